@@ -0,0 +1,349 @@
+/**
+ * Decoders for the alarm/set payload, one per wire format.
+ *
+ * JSON is the original format on TOPIC_ALARM_SET. CBOR (RFC 8949) is the compact format on
+ * TOPIC_ALARM_SET_CBOR. Both decode into an AlarmUpdate, so the rest of the firmware does not care
+ * which format a command arrived in.
+ *
+ * CBOR commands are a map from alarm key to boolean. A key is either the index of the alarm type
+ * in ALARM_TYPES plus one (0 is alarmOn, which is only published) or the same text key as in JSON.
+ * {"airflowAlarmOn": true} is A1 02 F5, three bytes instead of 23.
+ */
+
+#ifndef ALARM_CODEC_H
+#define ALARM_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <ArduinoJson.h>
+#include "Constants.h"
+#include "AlarmTypes.h"
+
+/**
+ * The alarm types a command sets or clears.
+ */
+struct AlarmUpdate {
+  /**
+   * The alarm types that the command mentions.
+   */
+  AlarmMask changed = 0;
+
+  /**
+   * Of the changed alarm types, the ones that should be on.
+   */
+  AlarmMask on = 0;
+
+  /**
+   * Whether the command carries a sequence number to trace, see CommandTrace.h, and the number.
+   */
+  bool traced = false;
+  uint32_t seq = 0;
+
+  /**
+   * The time the backend sent the command in milliseconds since the Unix epoch, 0 if not given.
+   */
+  uint64_t origin = 0;
+
+  /**
+   * The ID of the sender that numbered the command with seq, 0 if not given. A command with a source is
+   * applied only once, however often and over whichever path it arrives, see SequenceWindow.h.
+   */
+  uint32_t source = 0;
+
+  /**
+   * @param alarms The active alarm types before the command
+   * @return The active alarm types after the command
+   */
+  AlarmMask applyTo(AlarmMask alarms) const {
+    return (AlarmMask)((alarms & ~changed) | (on & changed));
+  }
+
+  void set(uint8_t index, bool value) {
+    changed |= (AlarmMask)(1U << index);
+    if (value) {
+      on |= (AlarmMask)(1U << index);
+    } else {
+      on &= (AlarmMask)~(1U << index);
+    }
+  }
+};
+
+/**
+ * Decoder for JSON alarm/set payloads.
+ */
+class JsonAlarmCodec {
+public:
+  /**
+   * Decode a JSON object with a boolean value for each alarm key that should change.
+   * Other keys and non-boolean values are ignored. The payload is parsed in place, so it is modified.
+   *
+   * @param payload The complete payload
+   * @param length The length of the payload
+   * @param update Receives the alarm types to set and clear
+   * @return nullptr on success, else a description of the error
+   */
+  const char *decode(char *payload, size_t length, AlarmUpdate &update) {
+    DeserializationError error = deserializeJson(document, payload, length, DeserializationOption::Filter(filter));
+    if (error) return error.c_str();
+
+    for (uint8_t i = 0; i < ALARM_TYPE_COUNT; i++) {
+      JsonVariant value = document[ALARM_TYPES[i].key];
+      if (value.is<bool>()) update.set(i, value.as<bool>());
+    }
+
+    JsonVariant seq = document[KEY_SEQ];
+    if (seq.is<uint32_t>()) {
+      update.traced = true;
+      update.seq = seq.as<uint32_t>();
+    }
+    JsonVariant origin = document[KEY_ORIGIN];
+    if (origin.is<uint64_t>()) update.origin = origin.as<uint64_t>();
+    JsonVariant source = document[KEY_SOURCE];
+    if (source.is<uint32_t>()) update.source = source.as<uint32_t>();
+    return nullptr;
+  }
+
+private:
+  /**
+   * Document a payload is parsed into. Only the alarm, trace and source keys are kept, see filter.
+   */
+  StaticJsonDocument<ALARM_JSON_DOCUMENT_SIZE> document;
+
+  /**
+   * Filter that makes the parser skip everything except the alarm, trace and source keys.
+   */
+  StaticJsonDocument<ALARM_JSON_FILTER_SIZE> filter = createFilter();
+
+  static StaticJsonDocument<ALARM_JSON_FILTER_SIZE> createFilter() {
+    StaticJsonDocument<ALARM_JSON_FILTER_SIZE> filter;
+    for (const AlarmType &alarmType : ALARM_TYPES) {
+      filter[alarmType.key] = true;
+    }
+    filter[KEY_SEQ] = true;
+    filter[KEY_ORIGIN] = true;
+    filter[KEY_SOURCE] = true;
+    return filter;
+  }
+};
+
+namespace cbor {
+  constexpr uint8_t MAJOR_UNSIGNED = 0;
+  constexpr uint8_t MAJOR_NEGATIVE = 1;
+  constexpr uint8_t MAJOR_BYTES = 2;
+  constexpr uint8_t MAJOR_TEXT = 3;
+  constexpr uint8_t MAJOR_ARRAY = 4;
+  constexpr uint8_t MAJOR_MAP = 5;
+  constexpr uint8_t MAJOR_TAG = 6;
+  constexpr uint8_t MAJOR_SIMPLE = 7;
+
+  constexpr uint8_t FALSE = 0xF4;
+  constexpr uint8_t TRUE = 0xF5;
+  constexpr uint8_t NULL_VALUE = 0xF6;
+
+  /**
+   * Reads CBOR items from a buffer without allocating. Indefinite lengths are not supported,
+   * nothing in an alarm command needs them. 64-bit arguments are only read as uint64_t.
+   */
+  class Reader {
+  public:
+    Reader(const uint8_t *data, size_t length) : data(data), length(length) {}
+
+    /**
+     * Read the head of the next item.
+     *
+     * @param major Receives the major type
+     * @param argument Receives the argument: the value, the length or the amount of entries
+     * @return false if the head is truncated or not supported
+     */
+    bool readHead(uint8_t &major, uint64_t &argument) {
+      if (position >= length) return false;
+      uint8_t initial = data[position++];
+      major = initial >> 5;
+      uint8_t info = initial & 0x1F;
+
+      if (info < 24) {
+        argument = info;
+        return true;
+      }
+      uint8_t size = info == 24 ? 1 : info == 25 ? 2 : info == 26 ? 4 : info == 27 ? 8 : 0;
+      if (size == 0 || length - position < size) return false;
+
+      argument = 0;
+      while (size-- > 0) argument = argument << 8 | data[position++];
+      return true;
+    }
+
+    /**
+     * Read the head of the next item, rejecting arguments that do not fit in 32 bits.
+     */
+    bool readHead(uint8_t &major, uint32_t &argument) {
+      uint64_t wide;
+      if (!readHead(major, wide) || wide > UINT32_MAX) return false;
+      argument = (uint32_t)wide;
+      return true;
+    }
+
+    /**
+     * Take the bytes of a text or byte string whose head has been read.
+     *
+     * @param size The length from the head
+     * @return The bytes, or nullptr if the string is truncated
+     */
+    const uint8_t *take(uint32_t size) {
+      if (length - position < size) return nullptr;
+      const uint8_t *bytes = data + position;
+      position += size;
+      return bytes;
+    }
+
+    /**
+     * Skip the next item, including everything nested in it.
+     *
+     * @param depth How deep containers may still be nested
+     * @return false if the item is malformed or nested too deep
+     */
+    bool skip(uint8_t depth = CBOR_MAX_DEPTH) {
+      // The argument of a number or a float can take all 64 bits, only sizes have to fit in the payload
+      uint8_t major;
+      uint64_t argument;
+      if (!readHead(major, argument)) return false;
+
+      switch (major) {
+        case MAJOR_BYTES:
+        case MAJOR_TEXT:
+          return argument <= length - position && take((uint32_t)argument) != nullptr;
+        case MAJOR_ARRAY:
+        case MAJOR_MAP: {
+          // Every item takes at least a byte
+          if (depth == 0 || argument > length - position) return false;
+          uint64_t items = major == MAJOR_MAP ? argument * 2 : argument;
+          while (items-- > 0) {
+            if (!skip(depth - 1)) return false;
+          }
+          return true;
+        }
+        case MAJOR_TAG:
+          return depth > 0 && skip(depth - 1);
+        default:
+          return true;
+      }
+    }
+
+    bool atEnd() const {
+      return position == length;
+    }
+
+  private:
+    const uint8_t *data;
+    size_t length;
+    size_t position = 0;
+  };
+}  // namespace cbor
+
+/**
+ * Decoder for CBOR alarm/set payloads.
+ */
+class CborAlarmCodec {
+public:
+  /**
+   * Decode a CBOR map with a boolean value for each alarm key that should change.
+   * The trace fields and the source are text keys with an unsigned value, like in the JSON format.
+   * Unknown keys and values of the wrong type are skipped, like in the JSON format.
+   *
+   * @param payload The complete payload
+   * @param length The length of the payload
+   * @param update Receives the alarm types to set and clear
+   * @return nullptr on success, else a description of the error
+   */
+  static const char *decode(const char *payload, size_t length, AlarmUpdate &update) {
+    cbor::Reader reader((const uint8_t *)payload, length);
+    uint8_t major;
+    uint32_t entries;
+    if (!reader.readHead(major, entries) || major != cbor::MAJOR_MAP) return "NotAMap";
+
+    AlarmUpdate decoded;
+    while (entries-- > 0) {
+      uint8_t index = ALARM_TYPE_COUNT;
+      uint32_t key;
+      if (!reader.readHead(major, key)) return "Truncated";
+      if (major == cbor::MAJOR_UNSIGNED) {
+        if (key >= 1 && key <= ALARM_TYPE_COUNT) index = (uint8_t)(key - 1);
+      } else if (major == cbor::MAJOR_TEXT) {
+        const uint8_t *text = reader.take(key);
+        if (text == nullptr) return "Truncated";
+        if (textEquals(text, key, KEY_SEQ)) {
+          index = INDEX_SEQ;
+        } else if (textEquals(text, key, KEY_ORIGIN)) {
+          index = INDEX_ORIGIN;
+        } else if (textEquals(text, key, KEY_SOURCE)) {
+          index = INDEX_SOURCE;
+        } else {
+          AlarmMask alarm = findAlarmType((const char *)text, key);
+          if (alarm != 0) index = alarm_types::lowestBit(alarm);
+        }
+      } else {
+        return "InvalidKey";
+      }
+
+      // Only decode the value if it belongs to a known key, else step over it
+      uint8_t value;
+      uint64_t number;
+      if (index < ALARM_TYPE_COUNT && readBoolean(reader, value)) {
+        decoded.set(index, value == cbor::TRUE);
+      } else if (index == INDEX_SEQ && readUnsigned(reader, number) && number <= UINT32_MAX) {
+        decoded.traced = true;
+        decoded.seq = (uint32_t)number;
+      } else if (index == INDEX_ORIGIN && readUnsigned(reader, number)) {
+        decoded.origin = number;
+      } else if (index == INDEX_SOURCE && readUnsigned(reader, number) && number <= UINT32_MAX) {
+        decoded.source = (uint32_t)number;
+      } else if (!reader.skip()) {
+        return "InvalidValue";
+      }
+    }
+    if (!reader.atEnd()) return "TrailingBytes";
+
+    update = decoded;
+    return nullptr;
+  }
+
+private:
+  /**
+   * Key indices of the trace fields and the source, after the alarm types.
+   */
+  static constexpr uint8_t INDEX_SEQ = ALARM_TYPE_COUNT + 1;
+  static constexpr uint8_t INDEX_ORIGIN = ALARM_TYPE_COUNT + 2;
+  static constexpr uint8_t INDEX_SOURCE = ALARM_TYPE_COUNT + 3;
+
+  static bool textEquals(const uint8_t *text, uint32_t length, const char *key) {
+    return strlen(key) == length && memcmp(text, key, length) == 0;
+  }
+
+  /**
+   * Read an unsigned integer, leaving the reader in place if the next item is something else.
+   */
+  static bool readUnsigned(cbor::Reader &reader, uint64_t &value) {
+    cbor::Reader probe = reader;
+    uint8_t major;
+    if (!probe.readHead(major, value) || major != cbor::MAJOR_UNSIGNED) return false;
+    reader = probe;
+    return true;
+  }
+
+  /**
+   * Read a boolean, leaving the reader in place if the next item is something else.
+   */
+  static bool readBoolean(cbor::Reader &reader, uint8_t &value) {
+    cbor::Reader probe = reader;
+    uint8_t major;
+    uint32_t argument;
+    if (!probe.readHead(major, argument) || major != cbor::MAJOR_SIMPLE) return false;
+    value = (uint8_t)(0xE0 | argument);
+    if (value != cbor::TRUE && value != cbor::FALSE) return false;
+    reader = probe;
+    return true;
+  }
+};
+
+#endif  // ALARM_CODEC_H
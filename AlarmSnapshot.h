@@ -0,0 +1,79 @@
+/**
+ * Snapshot of the alarm state that is kept in RTC memory, so an alarm survives a reset.
+ *
+ * RTC memory keeps its content across watchdog resets, exceptions and ESP.restart(), but not across power loss.
+ * The snapshot is protected by a magic number and a CRC-32, so stale or corrupted memory is ignored.
+ */
+
+#ifndef ALARM_SNAPSHOT_H
+#define ALARM_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hal/Hal.h"
+#include "Constants.h"
+#include "AlarmTypes.h"
+#include "Crc32.h"
+
+struct AlarmSnapshot {
+  /**
+   * Marks the memory as an alarm snapshot, changed whenever the layout changes.
+   */
+  uint32_t magic;
+
+  /**
+   * The active alarm types.
+   */
+  AlarmMask activeAlarms;
+
+  /**
+   * The escalation stage the alarm was in, see EscalationPolicy.h.
+   */
+  uint8_t stage;
+
+  /**
+   * Whether the claxon was silenced for the rest of the stage.
+   */
+  uint8_t muted;
+
+  /**
+   * The active alarm types that were raised by commands, the others were detected on the device.
+   */
+  AlarmMask remoteAlarms;
+
+  /**
+   * The time that had passed since the stage started when the snapshot was written.
+   */
+  uint32_t timeInStage;
+
+  /**
+   * CRC-32 of all fields above.
+   */
+  uint32_t crc;
+
+  static constexpr uint32_t MAGIC = 0x414C5203;
+
+  /**
+   * Write the snapshot to RTC memory.
+   */
+  void save() {
+    magic = MAGIC;
+    crc = crc32(this, offsetof(AlarmSnapshot, crc));
+    hal::rtcWrite(RTC_ALARM_SNAPSHOT_OFFSET, this, sizeof(AlarmSnapshot));
+  }
+
+  /**
+   * Read the snapshot from RTC memory.
+   *
+   * @return true if a valid snapshot was found
+   */
+  bool load() {
+    if (!hal::rtcRead(RTC_ALARM_SNAPSHOT_OFFSET, this, sizeof(AlarmSnapshot))) return false;
+    return magic == MAGIC && crc == crc32(this, offsetof(AlarmSnapshot, crc));
+  }
+};
+
+static_assert(sizeof(AlarmSnapshot) % 4 == 0, "RTC memory is written in blocks of 4 bytes");
+static_assert(sizeof(AlarmSnapshot) <= RTC_ALARM_SNAPSHOT_BLOCKS * 4, "The snapshot must fit in its RTC region");
+
+#endif  // ALARM_SNAPSHOT_H
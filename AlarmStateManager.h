@@ -1,14 +1,23 @@
 /**
  * The alarm state manager is responsible for checking if the alarm should be triggered.
  * It is also responsible for turning the alarm on and off.
+ *
+ * While an alarm is on, the claxon follows the escalation policy of the leading alarm type, see EscalationPolicy.h.
+ * The manager keeps the current stage and when it ends, so a check only compares the time with the end of the
+ * stage, however the policy looks.
  */
 
 #ifndef ALARM_STATE_MANAGER
 #define ALARM_STATE_MANAGER
 
-#include <Arduino.h>
+#include <functional>
+#include "hal/Hal.h"
 #include "Constants.h"
-#include <set>
+#include "AlarmTypes.h"
+#include "AlarmSnapshot.h"
+#include "BeepSequencer.h"
+#include "EscalationPolicy.h"
+#include "Log.h"
 
 class AlarmStateManager {
 public:
@@ -18,88 +27,84 @@ public:
   AlarmStateManager() = default;
 
   /**
-   * Initialize the necessary pins for the alarm.
+   * Initialize the necessary pins for the alarm and restore the alarm state from before a reset.
+   * Must run before networking starts, so an active alarm resumes without waiting for the broker.
    */
-  static void initialize() {
-    pinMode(ALARM_LIGHT_PIN, OUTPUT);
-    pinMode(ALARM_CLAXON_PIN, OUTPUT);
-    pinMode(ALARM_BUTTON_PIN, INPUT);
+  void initialize() {
+    hal::setPinMode(ALARM_LIGHT_PIN, OUTPUT);
+    hal::setPinMode(ALARM_CLAXON_PIN, OUTPUT);
+    hal::setPinMode(ALARM_BUTTON_PIN, INPUT);
+    hal::writePin(ALARM_LIGHT_PIN, LOW);
+    if (escalationStore.load(escalation)) {
+      LOG_INFO("Loaded escalation policies, version %lu.", (unsigned long)escalation.version);
+    }
+    restoreSnapshot();
   }
-  
+
   /**
    * Check if the alarm should be triggered and trigger it if it should.
    * Else, turn the light off.
+   *
+   * @return The time in milliseconds until the alarm state needs to be checked again
    */
-  void checkTriggerAlarm() {
-    if (testAlarmOn || airflowAlarmOn || airPressureAlarmOn) {
-      turnLightOn();
-      unsigned long currentTime = millis();
-      unsigned long timeSinceActivation = currentTime - alarmActivationTime;
+  uint32_t checkTriggerAlarm() {
+    if (activeAlarms == 0) {
+      turnLightOff();
+      return SCHEDULER_MAX_IDLE;
+    }
 
-      // Only trigger the alarm sound the first 30 seconds after the alarm is activated
-      if (!first30SecondsElapsed && timeSinceActivation <= DELAY_30_SECONDS) {
-        triggerCorrectAlarmSound();
-      }
+    turnLightOn();
+    uint32_t currentTime = hal::millis();
+    if (!stageEntered) enterStage(currentTime);
+
+    // Move on when the stage is over, through several stages if the loop was held up that long
+    while (currentTime - stageStartedAt >= stageLength) {
+      stageStartedAt += stageLength;
+      stage = policy().next(stage);
+      muted = false;
+      LOG_INFO("Escalation stage %u of alarm types 0x%02x.", stage, activeAlarms);
+      enterStage(currentTime);
+      saveSnapshot();
+    }
+    uint32_t nextCheck = stageLength - (currentTime - stageStartedAt);
 
-      // After 10 minutes, play the alarm sound 5 times
-      if (timeSinceActivation >= DELAY_10_MINUTES) {
-        // Check if the alarm sound has been played 5 times
-        if (alarmSoundCounter < PLAYBACK_COUNT) {
-          triggerCorrectAlarmSound(true);
-          Serial.println("Activating alarm after 10 minutes. Counter: " + String(alarmSoundCounter));
-        } else {
-          Serial.println("Alarm has been triggered 5 times. Resetting alarm.");
-          // Reset the alarm sound counter
-          alarmSoundCounter = 0;
-          // Reset the alarm activation time to play the alarm again after 10 minutes
-          alarmActivationTime = millis();
-          // Set the first 30 seconds elapsed flag to true, so the alarm can be triggered again after 10 minutes and not during the first 30 seconds
-          first30SecondsElapsed = true;
-        }
-      }
-    } else {
-      turnLightOff();
+    // Keep the time in the stage in the snapshot reasonably fresh
+    if (currentTime - lastSnapshotTime >= RTC_SNAPSHOT_INTERVAL) {
+      saveSnapshot();
     }
+    uint32_t untilSnapshot = RTC_SNAPSHOT_INTERVAL - (currentTime - lastSnapshotTime);
+    if (untilSnapshot < nextCheck) nextCheck = untilSnapshot;
+    return nextCheck;
   }
 
   /**
-   * Checks the active alarm types and updates corresponding flags and alarm count.
+   * Register a function that is called whenever the active alarm types change,
+   * so the alarm state is checked right away instead of at the next deadline.
    *
-   * @param activeAlarmTypes A set containing the names of active alarm types.
+   * @param callback The function to call
    */
-  void checkAlarmType(const std::set<std::string> &activeAlarmTypes) {
+  void onStateChange(std::function<void()> callback) {
+    stateChangeCallback = std::move(callback);
+  }
+
+  /**
+   * Checks the active alarm types and updates the alarm state.
+   *
+   * @param alarms A mask containing the active alarm types.
+   */
+  void checkAlarmType(AlarmMask alarms) {
     // Store the current alarm state
-    bool oldTestAlarmOn = testAlarmOn;
-    bool oldAirflowAlarmOn = airflowAlarmOn;
-    bool oldAirPressureAlarmOn = airPressureAlarmOn;
-
-    testAlarmOn = false;
-    airflowAlarmOn = false;
-    airPressureAlarmOn = false;
-    alarmAmount = 0;
-
-    // Iterate through each alarm type in the set
-    for (const auto &alarmType : activeAlarmTypes) {
-      if (alarmType == KEY_TEST_ALARM_ON) {
-        testAlarmOn = true;
-        alarmAmount++;
-      } else if (alarmType == KEY_AIRFLOW_ALARM_ON) {
-        airflowAlarmOn = true;
-        alarmAmount++;
-      } else if (alarmType == KEY_AIR_PRESSURE_ALARM_ON) {
-        airPressureAlarmOn = true;
-        alarmAmount++;
-      }
-    }
+    AlarmMask oldAlarms = activeAlarms;
+    activeAlarms = alarms & ALL_ALARMS;
 
-    if (!testAlarmOn && !airflowAlarmOn && !airPressureAlarmOn) {
+    if (activeAlarms == 0) {
       turnAlarmOff();
     } else {
-      // Reset the alarm activation time if the alarm state has changed
-      if (oldTestAlarmOn != testAlarmOn || oldAirflowAlarmOn != airflowAlarmOn || oldAirPressureAlarmOn != airPressureAlarmOn) {
-        resetAlarmClaxon();
-        alarmActivationTime = millis();
-        first30SecondsElapsed = false;
+      // Escalate from the start if the alarm state has changed
+      if (oldAlarms != activeAlarms) {
+        startEscalation();
+        saveSnapshot();
+        if (stateChangeCallback) stateChangeCallback();
       }
     }
   }
@@ -108,172 +113,302 @@ public:
    * Turn the alarm off.
    */
   void turnAlarmOff() {
-    testAlarmOn = false;
-    airflowAlarmOn = false;
-    airPressureAlarmOn = false;
-    alarmActivationTime = 0;
-    first30SecondsElapsed = false;
+    activeAlarms = 0;
+    remoteAlarms = 0;
+    stage = 0;
+    muted = false;
+    stageEntered = false;
     turnLightOff();
     resetAlarmClaxon();
+    saveSnapshot();
+    if (stateChangeCallback) stateChangeCallback();
+  }
+
+  /**
+   * Record which of the active alarm types were raised by commands rather than detected on the device, so a reset
+   * restores them apart. Written to RTC memory when it changes.
+   *
+   * @param alarms A mask containing the alarm types raised by commands
+   */
+  void setRemoteAlarms(AlarmMask alarms) {
+    alarms &= ALL_ALARMS;
+    if (alarms == remoteAlarms) return;
+    remoteAlarms = alarms;
+    saveSnapshot();
+  }
+
+  /**
+   * Stop or resume writing the alarm state to RTC memory, e.g. while an update restarts the device.
+   * The state is written right before the writes stop and when they resume.
+   */
+  void holdSnapshots(bool hold) {
+    if (hold == snapshotsHeld) return;
+    snapshotsHeld = false;
+    saveSnapshot();
+    snapshotsHeld = hold;
+  }
+
+  /**
+   * Silence the claxon for the rest of the escalation stage, keeping the alarm types and the light on.
+   * The next stage sounds the claxon again, like a change of the alarm types does.
+   */
+  void silenceClaxon() {
+    if (activeAlarms == 0) return;
+
+    muted = true;
+    resetAlarmClaxon();
+    saveSnapshot();
+    if (stateChangeCallback) stateChangeCallback();
   }
 
   /**
    * Check if the alarm is on.
    *
-   * @param key The key of the alarm to check. If no key is provided, check if any alarm is on.
-   * @return true if the alarm is on, false otherwise
-   */
-  bool isAlarmOn(const std::string &key = "") {
-    if (key == KEY_AIR_PRESSURE_ALARM_ON) {
-      return airPressureAlarmOn;
-    } else if (key == KEY_AIRFLOW_ALARM_ON) {
-      return airflowAlarmOn;
-    } else if (key == KEY_TEST_ALARM_ON) {
-      return testAlarmOn;
+   * @param alarms The alarm types to check. If no mask is provided, check if any alarm is on.
+   * @return true if one of the alarm types is on, false otherwise
+   */
+  bool isAlarmOn(AlarmMask alarms = ALL_ALARMS) const {
+    return (activeAlarms & alarms) != 0;
+  }
+
+  /**
+   * @return The mask of the active alarm types
+   */
+  AlarmMask getActiveAlarms() const {
+    return activeAlarms;
+  }
+
+  /**
+   * @return The mask of the active alarm types that were raised by commands, see setRemoteAlarms()
+   */
+  AlarmMask getRemoteAlarms() const {
+    return (AlarmMask)(activeAlarms & remoteAlarms);
+  }
+
+  /**
+   * Replace the escalation policies and store them in flash. The current stage plays out as it was scheduled,
+   * the new policies apply from the next stage on.
+   *
+   * @param table The new policies
+   * @return nullptr if the policies were taken over, else a description of the error
+   */
+  const char *updateEscalation(const EscalationTable &table) {
+    const char *error = table.validate();
+    if (error != nullptr) return error;
+    if (table == escalation) return nullptr;
+
+    escalation = table;
+    if (!escalationStore.save(escalation)) {
+      LOG_ERROR("Could not store the escalation policies, they only last until a reset.");
     }
+    return nullptr;
+  }
 
-    return testAlarmOn || airflowAlarmOn || airPressureAlarmOn;
+  /**
+   * @return The escalation policies in use
+   */
+  const EscalationTable &getEscalation() const {
+    return escalation;
+  }
+
+  /**
+   * @return The escalation stage of the active alarm types
+   */
+  uint8_t getStage() const {
+    return stage;
+  }
+
+  /**
+   * @return The amount of times the claxon started sounding in the first stage of an alarm state,
+   *         to notice the first actuation after a command
+   */
+  uint32_t getClaxonStarts() const {
+    return claxonStarts;
+  }
+
+  /**
+   * @return The time of the first claxon edge of the last start in microseconds, see hal::micros()
+   */
+  uint32_t getClaxonStartedAt() const {
+    return beepSequencer.getStartedAt();
   }
 
 private:
   /**
-   * Whether the first 30 seconds have elapsed since the alarm was triggered.
-   * This is used to prevent the alarm from being triggered again for 30 seconds once the 10 minutes have elapsed.
+   * The alarm types that are on.
    */
-  bool first30SecondsElapsed = false;
+  AlarmMask activeAlarms = 0;
 
   /**
-   * Whether the alarm types are on.
+   * The alarm types raised by commands, kept in the snapshot so a reset does not mix them up with detected ones.
    */
-  bool testAlarmOn = false;
-  bool airflowAlarmOn = false;
-  bool airPressureAlarmOn = false;
+  AlarmMask remoteAlarms = 0;
 
   /**
-   * The amount of alarms that are on.
+   * Sequencer that plays the claxon patterns.
    */
-  int alarmAmount = 0;
+  BeepSequencer beepSequencer;
 
   /**
-   * The last time the alarm sound was triggered.
+   * The escalation policies and the flash file they are kept in.
    */
-  unsigned long lastAlarmSoundTime = 0;
+  EscalationTable escalation = EscalationTable::defaults();
+  EscalationStore escalationStore;
 
   /**
-   * The amount of times the claxon has beeped.
+   * The alarm type whose policy applies, the leading one of the active alarm types.
    */
-  int alarmBeepCount = ONE_ALARM;
+  uint8_t leadingType = 0;
 
   /**
-   * The time of activation of the alarm.
+   * The current stage of the policy, when it started and how long it lasts.
    */
-  unsigned long alarmActivationTime = 0;
+  uint8_t stage = 0;
+  uint32_t stageStartedAt = 0;
+  uint32_t stageLength = 0;
 
   /**
-   * Helper counter for the alarm sound.
+   * Whether the pattern of the current stage has been started and its length worked out.
    */
-  int alarmSoundCounter = 0;
+  bool stageEntered = false;
 
   /**
-   * Turn the light on.
+   * Whether the claxon was silenced for the rest of the stage.
    */
-  static void turnLightOn() {
-    digitalWrite(ALARM_LIGHT_PIN, HIGH);
-  }
+  bool muted = false;
 
   /**
-   * Turn the light off.
+   * The amount of times the claxon started in the first stage of an alarm state.
    */
-  static void turnLightOff() {
-    digitalWrite(ALARM_LIGHT_PIN, LOW);
-  }
+  uint32_t claxonStarts = 0;
 
   /**
-   * Turn the claxon on.
+   * Called whenever the active alarm types change.
    */
-  static void turnClaxonOn() {
-    if (digitalRead(ALARM_CLAXON_PIN) == LOW) {
-      digitalWrite(ALARM_CLAXON_PIN, HIGH);
-    }
-  }
+  std::function<void()> stateChangeCallback;
 
   /**
-   * Turn the claxon off.
+   * The last time the snapshot was written to RTC memory.
    */
-  static void turnClaxonOff() {
-    if (digitalRead(ALARM_CLAXON_PIN) == HIGH) {
-      digitalWrite(ALARM_CLAXON_PIN, LOW);
-    }
-  }
+  uint32_t lastSnapshotTime = 0;
 
   /**
-   * Trigger the correct alarm sound based on the alarm type.
-   * If there are multiple alarms, trigger the multiple causes alarm sound.
-   *
-   * @param incrementCounter Whether it should increment the alarmSoundCounter or not. Defaults to false.
+   * Whether writes of the snapshot to RTC memory are held, see holdSnapshots().
    */
-  void triggerCorrectAlarmSound(bool incrementCounter = false) {
-    // Check if there's only one alarm type
-    if (alarmAmount == ONE_ALARM) {
-      if (airflowAlarmOn) {
-        triggerAlarmSound(AIRFLOW_BEEPS, incrementCounter);
+  bool snapshotsHeld = false;
 
-      } else if (airPressureAlarmOn) {
-        triggerAlarmSound(AIR_PRESSURE_BEEPS, incrementCounter);
+  /**
+   * Write the alarm state to RTC memory. Called on every state transition.
+   */
+  void saveSnapshot() {
+    lastSnapshotTime = hal::millis();
+    if (snapshotsHeld) return;
+    AlarmSnapshot snapshot = {};
+    snapshot.activeAlarms = activeAlarms;
+    snapshot.remoteAlarms = activeAlarms & remoteAlarms;
+    snapshot.stage = stage;
+    snapshot.muted = muted;
+    snapshot.timeInStage = activeAlarms != 0 ? hal::millis() - stageStartedAt : 0;
+    snapshot.save();
+  }
 
-      } else if (testAlarmOn) {
-        triggerAlarmSound(TEST_BEEPS, incrementCounter);
-      } else {
-        return;
-      }
-    } else if (alarmAmount > ONE_ALARM) {
-      triggerAlarmSound(MULTIPLE_CAUSES_BEEPS, incrementCounter);
+  /**
+   * Restore the alarm state from RTC memory, if a valid snapshot is there.
+   */
+  void restoreSnapshot() {
+    AlarmSnapshot snapshot;
+    if (!snapshot.load() || (snapshot.activeAlarms & ALL_ALARMS) == 0) return;
+
+    activeAlarms = snapshot.activeAlarms & ALL_ALARMS;
+    remoteAlarms = snapshot.remoteAlarms & activeAlarms;
+    leadingType = leadingAlarmType(activeAlarms);
+    stage = snapshot.stage;
+    muted = snapshot.muted != 0;
+    stageStartedAt = hal::millis() - snapshot.timeInStage;
+    stageEntered = false;
+    if (stage >= policy().stageCount) {
+      // The policy changed since, escalate from the start
+      stage = 0;
+      muted = false;
+      stageStartedAt = hal::millis();
     }
+    lastSnapshotTime = hal::millis();
+    LOG_INFO("Restored alarm state from RTC memory.");
   }
 
   /**
-   * Trigger the alarm sound based on the pattern.
-   * @param pattern The pattern to use for the alarm sound.
-   * @param incrementCounter Whether it should increment the alarmSoundCounter or not. Defaults to false.
+   * Whether the light is on, so it is only written when it changes.
    */
-  void triggerAlarmSound(int pattern, bool incrementCounter = false) {
-    unsigned long currentTime = millis();
-    // If the last alarm sound has not been played yet, set the last alarm sound time to the current time
-    if (lastAlarmSoundTime == 0) {
-      lastAlarmSoundTime = currentTime;
-    }
+  bool lightOn = false;
 
-    // For the first BEEP_LENGTH milliseconds, turn the claxon on and return
-    if (currentTime - BEEP_LENGTH <= lastAlarmSoundTime) {
-      return turnClaxonOn();
+  /**
+   * Turn the light on.
+   */
+  void turnLightOn() {
+    if (!lightOn) {
+      hal::writePin(ALARM_LIGHT_PIN, HIGH);
+      lightOn = true;
     }
+  }
 
-    // After the first BEEP_LENGTH milliseconds, turn the claxon off
-    turnClaxonOff();
-
-    // If the pattern has not been completed yet and the time between beeps has elapsed:
-    if (alarmBeepCount < pattern && (currentTime - (BEEP_LENGTH + TIME_BETWEEN_BEEPS_IN_PATTERN) >= lastAlarmSoundTime)) {
-      // increment the alarm beep count, set the last alarm sound time to the current time and return
-      lastAlarmSoundTime = currentTime;
-      alarmBeepCount++;
-      return;
+  /**
+   * Turn the light off.
+   */
+  void turnLightOff() {
+    if (lightOn) {
+      hal::writePin(ALARM_LIGHT_PIN, LOW);
+      lightOn = false;
     }
+  }
+
+  /**
+   * @return The escalation policy of the active alarm types
+   */
+  const EscalationPolicy &policy() const {
+    return escalation.policies[leadingType];
+  }
 
-    // If the pattern has been completed, reset the alarm claxon and increment the alarm sound counter if necessary
-    if (currentTime - (BEEP_LENGTH + DELAY_ALARM) >= lastAlarmSoundTime) {
-      if (incrementCounter) alarmSoundCounter++;
+  /**
+   * Start the escalation of the active alarm types at the first stage.
+   */
+  void startEscalation() {
+    resetAlarmClaxon();
+    leadingType = leadingAlarmType(activeAlarms);
+    stage = 0;
+    stageStartedAt = hal::millis();
+    stageEntered = false;
+    muted = false;
+  }
 
-      return resetAlarmClaxon();
+  /**
+   * Play the pattern of the current stage and work out when the stage ends.
+   *
+   * @param currentTime The current time, which may be past the start of the stage after a reset
+   */
+  void enterStage(uint32_t currentTime) {
+    const EscalationStage &current = policy().stages[stage];
+    BeepPattern pattern = current.pattern(activeAlarms);
+    stageLength = current.length(activeAlarms);
+    stageEntered = true;
+    if (beepSequencer.isRunning()) resetAlarmClaxon();
+    if (pattern.beeps == 0 || muted) return;
+
+    // Only the cycles that are left play when the stage is already under way
+    uint8_t cycles = current.cycles;
+    if (cycles != 0) {
+      uint32_t played = (currentTime - stageStartedAt) / pattern.cycleLength();
+      if (played >= cycles) return;
+      cycles = (uint8_t)(cycles - played);
     }
+    beepSequencer.start(pattern, cycles);
+    if (stage == 0) claxonStarts++;
   }
 
   /**
    * Reset alarm claxon state.
    */
   void resetAlarmClaxon() {
-    turnClaxonOff();
-    alarmBeepCount = ONE_ALARM;
-    lastAlarmSoundTime = 0;
+    beepSequencer.stop();
   }
 };
 
@@ -0,0 +1,159 @@
+/**
+ * Compile-time registry of the alarm types the device knows about.
+ *
+ * Every alarm type is one row in ALARM_TYPES. The state of all alarm types is kept as a bitmask
+ * where bit i belongs to row i, so setting, clearing and checking alarms never allocates.
+ * To add an alarm type, add its key to Constants.h and a row to the table.
+ */
+
+#ifndef ALARM_TYPES_H
+#define ALARM_TYPES_H
+
+#include <stdint.h>
+#include <string.h>
+#include "Constants.h"
+
+/**
+ * Bitmask of alarm types, bit i is set when ALARM_TYPES[i] is on.
+ */
+using AlarmMask = uint8_t;
+
+struct AlarmType {
+  /**
+   * The JSON key of the alarm type.
+   */
+  const char *key;
+
+  /**
+   * The amount of beeps in the claxon pattern when this is the only active alarm.
+   */
+  uint8_t beeps;
+
+  /**
+   * The priority of the alarm type, the highest active one is the leading cause when several alarms are on.
+   */
+  uint8_t priority;
+};
+
+constexpr AlarmType ALARM_TYPES[] = {
+  {KEY_TEST_ALARM_ON,         TEST_BEEPS,         0},
+  {KEY_AIRFLOW_ALARM_ON,      AIRFLOW_BEEPS,      2},
+  {KEY_AIR_PRESSURE_ALARM_ON, AIR_PRESSURE_BEEPS, 1},
+};
+
+constexpr uint8_t ALARM_TYPE_COUNT = sizeof(ALARM_TYPES) / sizeof(ALARM_TYPES[0]);
+
+static_assert(ALARM_TYPE_COUNT <= sizeof(AlarmMask) * 8, "AlarmMask is too small for the amount of alarm types");
+
+/**
+ * Mask with every alarm type set.
+ */
+constexpr AlarmMask ALL_ALARMS = (AlarmMask)((1U << ALARM_TYPE_COUNT) - 1);
+
+namespace alarm_types {
+  constexpr bool keysEqual(const char *a, const char *b) {
+    return *a == *b && (*a == '\0' || keysEqual(a + 1, b + 1));
+  }
+
+  constexpr uint8_t indexOf(const char *key, uint8_t index = 0) {
+    return index >= ALARM_TYPE_COUNT || keysEqual(ALARM_TYPES[index].key, key) ? index : indexOf(key, index + 1);
+  }
+
+  constexpr uint8_t countBits(AlarmMask mask) {
+    return mask == 0 ? 0 : (uint8_t)((mask & 1U) + countBits(mask >> 1));
+  }
+
+  constexpr uint8_t lowestBit(AlarmMask mask, uint8_t index = 0) {
+    return (mask >> index) & 1U ? index : lowestBit(mask, index + 1);
+  }
+
+  constexpr uint8_t beepsFor(AlarmMask mask) {
+    return countBits(mask) == 0 ? 0
+         : countBits(mask) == ONE_ALARM ? ALARM_TYPES[lowestBit(mask)].beeps
+         : MULTIPLE_CAUSES_BEEPS;
+  }
+
+  /**
+   * Claxon pattern for every possible combination of alarm types, indexed by mask.
+   */
+  struct BeepTable {
+    uint8_t beeps[ALL_ALARMS + 1];
+
+    constexpr BeepTable() : beeps() {
+      for (unsigned mask = 0; mask <= ALL_ALARMS; mask++) {
+        beeps[mask] = beepsFor((AlarmMask)mask);
+      }
+    }
+  };
+
+  constexpr BeepTable BEEP_TABLE{};
+}  // namespace alarm_types
+
+/**
+ * The mask of a single alarm type, looked up by key at compile time.
+ *
+ * @param key The JSON key of the alarm type
+ * @return The mask of the alarm type
+ */
+constexpr AlarmMask alarmMaskOf(const char *key) {
+  return (AlarmMask)(1U << alarm_types::indexOf(key));
+}
+
+constexpr AlarmMask TEST_ALARM = alarmMaskOf(KEY_TEST_ALARM_ON);
+constexpr AlarmMask AIRFLOW_ALARM = alarmMaskOf(KEY_AIRFLOW_ALARM_ON);
+constexpr AlarmMask AIR_PRESSURE_ALARM = alarmMaskOf(KEY_AIR_PRESSURE_ALARM_ON);
+
+static_assert((TEST_ALARM | AIRFLOW_ALARM | AIR_PRESSURE_ALARM) == ALL_ALARMS, "Every key needs a row in ALARM_TYPES");
+
+/**
+ * The claxon pattern for a combination of alarm types: the pattern of the alarm type if only one is on,
+ * MULTIPLE_CAUSES_BEEPS if several are on and 0 if none are on.
+ *
+ * @param mask The active alarm types
+ * @return The amount of beeps in the pattern
+ */
+constexpr uint8_t beepsForAlarms(AlarmMask mask) {
+  return alarm_types::BEEP_TABLE.beeps[mask & ALL_ALARMS];
+}
+
+/**
+ * The amount of alarm types in a mask.
+ */
+constexpr uint8_t alarmCount(AlarmMask mask) {
+  return alarm_types::countBits(mask);
+}
+
+/**
+ * Look up the mask of an alarm type by key at runtime.
+ *
+ * @param key The key to look up, does not need to be NUL-terminated
+ * @param length The length of the key
+ * @return The mask of the alarm type, 0 if the key is unknown
+ */
+inline AlarmMask findAlarmType(const char *key, size_t length) {
+  for (uint8_t i = 0; i < ALARM_TYPE_COUNT; i++) {
+    // The key may contain a NUL, so it is compared by length
+    if (strlen(ALARM_TYPES[i].key) == length && memcmp(ALARM_TYPES[i].key, key, length) == 0) {
+      return (AlarmMask)(1U << i);
+    }
+  }
+  return 0;
+}
+
+/**
+ * The leading alarm type of a combination: the active one with the highest priority.
+ *
+ * @param mask The active alarm types
+ * @return The index in ALARM_TYPES, ALARM_TYPE_COUNT if no alarm is on
+ */
+inline uint8_t leadingAlarmType(AlarmMask mask) {
+  uint8_t leading = ALARM_TYPE_COUNT;
+  for (uint8_t i = 0; i < ALARM_TYPE_COUNT; i++) {
+    if ((mask >> i) & 1U && (leading == ALARM_TYPE_COUNT || ALARM_TYPES[i].priority > ALARM_TYPES[leading].priority)) {
+      leading = i;
+    }
+  }
+  return leading;
+}
+
+#endif  // ALARM_TYPES_H
@@ -0,0 +1,206 @@
+/**
+ * The beep sequencer plays claxon patterns from the one-shot hardware timer.
+ *
+ * Every edge of the pattern is switched from the timer interrupt, which then arms the timer for the next edge.
+ * The audible pattern is therefore exact to the millisecond and does not depend on how long the main loop,
+ * the MQTT callbacks or Serial output take. The main loop only starts and stops patterns.
+ */
+
+#ifndef BEEP_SEQUENCER_H
+#define BEEP_SEQUENCER_H
+
+#include <stdint.h>
+#include "hal/Hal.h"
+#include "Constants.h"
+#include "Metrics.h"
+
+/**
+ * Descriptor of a claxon pattern: beeps of onMs separated by offMs, followed by a pause of pauseMs.
+ */
+struct BeepPattern {
+  /**
+   * The length of a beep in milliseconds.
+   */
+  uint16_t onMs;
+
+  /**
+   * The silence between two beeps in milliseconds.
+   */
+  uint16_t offMs;
+
+  /**
+   * The amount of beeps in the pattern.
+   */
+  uint8_t beeps;
+
+  /**
+   * The silence after the last beep in milliseconds.
+   */
+  uint16_t pauseMs;
+
+  /**
+   * @return The duration of one cycle of the pattern in milliseconds
+   */
+  constexpr uint32_t cycleLength() const {
+    return beeps == 0 ? 0 : (uint32_t)beeps * onMs + (uint32_t)(beeps - 1) * offMs + pauseMs;
+  }
+};
+
+/**
+ * The pattern for a beep count such as TEST_BEEPS or AIRFLOW_BEEPS, with the default timing.
+ *
+ * @param beeps The amount of beeps
+ * @return The pattern descriptor
+ */
+constexpr BeepPattern beepPattern(uint8_t beeps) {
+  return {BEEP_LENGTH, TIME_BETWEEN_BEEPS_IN_PATTERN, beeps, DELAY_ALARM};
+}
+
+class BeepSequencer {
+public:
+  /**
+   * Create the sequencer. There is only one hardware timer, so there must only be one sequencer.
+   */
+  BeepSequencer() {
+    instance = this;
+  }
+
+  /**
+   * Start playing a pattern, replacing the pattern that is playing.
+   *
+   * @param newPattern The pattern to play
+   * @param cycles The amount of times to play the pattern, 0 to repeat until stop() is called
+   */
+  void start(const BeepPattern &newPattern, uint8_t cycles = 0) {
+    stop();
+    if (newPattern.beeps == 0) return;
+
+    pattern = newPattern;
+    repeats = cycles;
+    completedCycles = 0;
+    step = 0;
+    running = true;
+    armed = false;
+    hal::attachTimer(onTimer);
+    edge();
+    startedAt = armedAt;
+  }
+
+  /**
+   * Stop playing and turn the claxon off.
+   */
+  void stop() {
+    running = false;
+    hal::disarmTimer();
+    hal::writePin(ALARM_CLAXON_PIN, LOW);
+  }
+
+  /**
+   * @return true while a pattern is playing
+   */
+  bool isRunning() const {
+    return running;
+  }
+
+  /**
+   * @return The amount of complete cycles of the pattern that have been played since start()
+   */
+  uint8_t getCompletedCycles() const {
+    return completedCycles;
+  }
+
+  /**
+   * @return The time the first edge of the last pattern was switched in microseconds, see hal::micros()
+   */
+  uint32_t getStartedAt() const {
+    return startedAt;
+  }
+
+private:
+  /**
+   * The sequencer the timer interrupt belongs to.
+   */
+  static inline BeepSequencer *instance = nullptr;
+
+  /**
+   * The pattern that is playing.
+   */
+  BeepPattern pattern = {};
+
+  /**
+   * The amount of cycles to play, 0 for endless.
+   */
+  uint8_t repeats = 0;
+
+  /**
+   * The current edge in the cycle: even steps turn the claxon on, odd steps turn it off.
+   */
+  volatile uint8_t step = 0;
+
+  /**
+   * The amount of cycles played since start(). Written from the interrupt.
+   */
+  volatile uint8_t completedCycles = 0;
+
+  /**
+   * Whether a pattern is playing. Cleared from the interrupt when the last cycle completes.
+   */
+  volatile bool running = false;
+
+  /**
+   * When the timer was last armed in microseconds and for how many milliseconds, to measure the edge jitter.
+   * armed is false until the first edge of a pattern has armed the timer.
+   */
+  uint32_t armedAt = 0;
+  uint16_t armedMs = 0;
+  bool armed = false;
+
+  /**
+   * The time the first edge of the last pattern was switched in microseconds.
+   */
+  uint32_t startedAt = 0;
+
+  /**
+   * Switch the claxon for the current step and arm the timer for the next one.
+   */
+  void IRAM_ATTR edge() {
+    uint32_t now = hal::micros();
+    if (armed) metrics.recordClaxonEdge((int32_t)(now - armedAt - (uint32_t)armedMs * 1000));
+
+    bool on = (step & 1U) == 0;
+    hal::writePin(ALARM_CLAXON_PIN, on ? HIGH : LOW);
+
+    uint16_t duration = pattern.onMs;
+    if (!on) {
+      duration = step + 1 == 2 * pattern.beeps ? pattern.pauseMs : pattern.offMs;
+    }
+    armedAt = now;
+    armedMs = duration;
+    armed = true;
+    hal::armTimer(duration);
+  }
+
+  /**
+   * Advance to the next step when the timer expires.
+   */
+  void IRAM_ATTR advance() {
+    if (!running) return;
+
+    step = step + 1;
+    if (step == 2 * pattern.beeps) {
+      step = 0;
+      completedCycles = completedCycles + 1;
+      if (repeats != 0 && completedCycles >= repeats) {
+        running = false;
+        return;
+      }
+    }
+    edge();
+  }
+
+  static void IRAM_ATTR onTimer() {
+    if (instance != nullptr) instance->advance();
+  }
+};
+
+#endif  // BEEP_SEQUENCER_H
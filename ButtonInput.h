@@ -0,0 +1,173 @@
+/**
+ * The button input captures the alarm button from an interrupt and decodes presses in the main loop.
+ *
+ * The interrupt timestamps every edge and pushes it into a lock-free ring, so no press is lost while the
+ * main loop is busy. The main loop debounces the edges and decodes them into gestures:
+ * - a short press is reported as soon as the button goes down, to silence the claxon without delay;
+ * - a long press is reported once when the button has been held for BUTTON_LONG_PRESS, to clear all alarms.
+ */
+
+#ifndef BUTTON_INPUT_H
+#define BUTTON_INPUT_H
+
+#include <stdint.h>
+#include <functional>
+#include "hal/Hal.h"
+#include "Constants.h"
+#include "SpscRing.h"
+
+class ButtonInput {
+public:
+  /**
+   * Create the button input. There must only be one, as it owns the interrupt of ALARM_BUTTON_PIN.
+   */
+  ButtonInput() {
+    instance = this;
+  }
+
+  /**
+   * Attach the interrupt of the button pin.
+   *
+   * @param edgeCallback IRAM_ATTR function called from the interrupt after every edge, e.g. to wake the
+   *                     scheduler. May be nullptr.
+   */
+  void initialize(void (*edgeCallback)() = nullptr) {
+    this->edgeCallback = edgeCallback;
+    stableLevel = hal::readPin(ALARM_BUTTON_PIN);
+    hal::attachPinInterrupt(ALARM_BUTTON_PIN, onEdge);
+  }
+
+  /**
+   * Register a function that is called when the button goes down.
+   */
+  void onPress(std::function<void()> callback) {
+    pressCallback = std::move(callback);
+  }
+
+  /**
+   * Register a function that is called once when the button is held for BUTTON_LONG_PRESS.
+   */
+  void onLongPress(std::function<void()> callback) {
+    longPressCallback = std::move(callback);
+  }
+
+  /**
+   * Decode the captured edges into presses. Must be called from the main loop.
+   *
+   * @param now The current time
+   * @return The time in milliseconds until this needs to run again, if no edge arrives before
+   */
+  uint32_t process(uint32_t now) {
+    ButtonEdge edge;
+    while (edges.pop(edge)) {
+      // Ignore bounces: an edge only counts if the level was stable for BUTTON_DEBOUNCE
+      if (edge.level == stableLevel || edge.time - lastAcceptedEdge < BUTTON_DEBOUNCE) continue;
+
+      stableLevel = edge.level;
+      lastAcceptedEdge = edge.time;
+
+      if (stableLevel == HIGH) {
+        pressedAt = edge.time;
+        longPressReported = false;
+        presses++;
+        if (pressCallback) pressCallback();
+      }
+    }
+
+    // The interrupt may have missed the release if it bounced within the debounce time
+    if (stableLevel == HIGH && now - lastAcceptedEdge >= BUTTON_DEBOUNCE && hal::readPin(ALARM_BUTTON_PIN) == LOW) {
+      stableLevel = LOW;
+      lastAcceptedEdge = now;
+    }
+
+    if (stableLevel == HIGH && !longPressReported) {
+      uint32_t heldFor = now - pressedAt;
+      if (heldFor < BUTTON_LONG_PRESS) return BUTTON_LONG_PRESS - heldFor;
+
+      longPressReported = true;
+      longPresses++;
+      if (longPressCallback) longPressCallback();
+    }
+
+    return stableLevel == HIGH ? BUTTON_DEBOUNCE : SCHEDULER_MAX_IDLE;
+  }
+
+  /**
+   * @return The amount of presses decoded
+   */
+  uint32_t getPresses() const {
+    return presses;
+  }
+
+  /**
+   * @return The amount of long presses decoded
+   */
+  uint32_t getLongPresses() const {
+    return longPresses;
+  }
+
+  /**
+   * @return The amount of edges lost because the ring was full
+   */
+  uint32_t getDroppedEdges() const {
+    return edges.dropped;
+  }
+
+private:
+  /**
+   * An edge of the button pin, captured in the interrupt.
+   */
+  struct ButtonEdge {
+    uint32_t time;
+    uint8_t level;
+  };
+
+  /**
+   * The button input the interrupt belongs to.
+   */
+  static inline ButtonInput *instance = nullptr;
+
+  /**
+   * Edges captured by the interrupt and not yet decoded.
+   */
+  SpscRing<ButtonEdge, BUTTON_EDGE_QUEUE_SIZE> edges;
+
+  /**
+   * Function called from the interrupt after every edge.
+   */
+  void (*edgeCallback)() = nullptr;
+
+  std::function<void()> pressCallback;
+  std::function<void()> longPressCallback;
+
+  /**
+   * The debounced level of the button.
+   */
+  uint8_t stableLevel = LOW;
+
+  /**
+   * The time of the last edge that changed the debounced level.
+   */
+  uint32_t lastAcceptedEdge = 0;
+
+  /**
+   * The time the button went down.
+   */
+  uint32_t pressedAt = 0;
+
+  /**
+   * Whether the long press of the current press has been reported.
+   */
+  bool longPressReported = false;
+
+  uint32_t presses = 0;
+  uint32_t longPresses = 0;
+
+  static void IRAM_ATTR onEdge() {
+    if (instance == nullptr) return;
+    instance->edges.push({hal::millis(), (uint8_t)hal::readPin(ALARM_BUTTON_PIN)});
+    if (instance->edgeCallback) instance->edgeCallback();
+  }
+};
+
+#endif  // BUTTON_INPUT_H
@@ -0,0 +1,172 @@
+/**
+ * Tracing of alarm/set commands and pings that carry a sequence number.
+ *
+ * A traced command is stamped when it arrives, when it is parsed, when it is applied and when the claxon
+ * switches its first edge. The status published for it echoes the sequence number, the origin timestamp
+ * of the backend, the wall clock time it arrived and the time between the stages, so the backend can split
+ * the latency into the network, the parsing, the state change and the actuation.
+ *
+ * Traced statuses are formatted when they are sent; statuses without a trace keep using the precomputed payloads.
+ */
+
+#ifndef COMMAND_TRACE_H
+#define COMMAND_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "Constants.h"
+#include "AlarmTypes.h"
+#include "AlarmCodec.h"
+#include "StatusPayloads.h"
+
+struct CommandTrace {
+  uint32_t seq = 0;
+
+  /**
+   * The time the backend sent the command and the time it arrived, in milliseconds since the Unix epoch.
+   * Either is 0 if unknown: the backend did not send it, or the wall clock is not synchronized yet.
+   */
+  uint64_t origin = 0;
+  uint64_t received = 0;
+
+  /**
+   * The stages in microseconds, see hal::micros(). actuatedAt is only meaningful if actuated is set.
+   */
+  uint32_t receivedAt = 0;
+  uint32_t parsedAt = 0;
+  uint32_t appliedAt = 0;
+  uint32_t actuatedAt = 0;
+  bool actuated = false;
+
+  /**
+   * Start a trace for a decoded command.
+   *
+   * @param update The decoded command, with traced set
+   * @param receivedAt The time the first chunk arrived in microseconds
+   * @param received The wall clock time the first chunk arrived, 0 if not synchronized
+   * @param parsedAt The time decoding finished in microseconds
+   */
+  static CommandTrace start(const AlarmUpdate &update, uint32_t receivedAt, uint64_t received, uint32_t parsedAt) {
+    CommandTrace trace;
+    trace.seq = update.seq;
+    trace.origin = update.origin;
+    trace.received = received;
+    trace.receivedAt = receivedAt;
+    trace.parsedAt = parsedAt;
+    return trace;
+  }
+
+  /**
+   * Format the JSON status with the trace: the members of the status payload, then
+   * "seq", "origin" and "received" (null if unknown) and "stages" with "parse", "apply" and "actuate"
+   * in microseconds, where "actuate" is null if the claxon did not start for the command.
+   *
+   * @return The length of the payload, 0 if it did not fit
+   */
+  size_t formatJson(char *buffer, size_t size, AlarmMask alarms) const {
+    char origin[21];
+    char receivedText[21];
+    char actuate[11];
+    formatOptional(origin, sizeof(origin), this->origin, this->origin != 0);
+    formatOptional(receivedText, sizeof(receivedText), received, received != 0);
+    formatOptional(actuate, sizeof(actuate), actuatedAt - appliedAt, actuated);
+
+    // The status payload without its closing brace, followed by the trace members
+    int length = snprintf(buffer, size,
+                          "%.*s,\"" KEY_SEQ "\":%lu,\"" KEY_ORIGIN "\":%s,\"received\":%s,"
+                          "\"stages\":{\"parse\":%lu,\"apply\":%lu,\"actuate\":%s}}",
+                          (int)statusPayloadLength(alarms) - 1, statusPayload(alarms), (unsigned long)seq, origin,
+                          receivedText, (unsigned long)(parsedAt - receivedAt), (unsigned long)(appliedAt - parsedAt),
+                          actuate);
+    return length < 0 || (size_t)length >= size ? 0 : (size_t)length;
+  }
+
+  /**
+   * Format the CBOR status with the trace: the entries of the CBOR status payload, then the text keys
+   * "seq", "origin", "received" and "stages", an array of the parse, apply and actuate times.
+   * Unknown values are null, like in the JSON status.
+   *
+   * @return The length of the payload, 0 if it did not fit
+   */
+  size_t formatCbor(uint8_t *buffer, size_t size, AlarmMask alarms) const {
+    // The largest trace: four keys of up to 8 characters, two 64-bit and four 32-bit values
+    if (size < CBOR_STATUS_PAYLOAD_LENGTH + 4 * 9 + 2 * 9 + 4 * 5 + 1) return 0;
+
+    const uint8_t *status = (const uint8_t *)cborStatusPayload(alarms);
+    size_t position = 0;
+    buffer[position++] = (uint8_t)(status[0] + TRACE_ENTRIES);
+    memcpy(buffer + position, status + 1, CBOR_STATUS_PAYLOAD_LENGTH - 1);
+    position += CBOR_STATUS_PAYLOAD_LENGTH - 1;
+
+    position = writeText(buffer, position, KEY_SEQ);
+    position = writeHead(buffer, position, cbor::MAJOR_UNSIGNED, seq);
+    position = writeText(buffer, position, KEY_ORIGIN);
+    position = writeOptional(buffer, position, origin, origin != 0);
+    position = writeText(buffer, position, "received");
+    position = writeOptional(buffer, position, received, received != 0);
+    position = writeText(buffer, position, "stages");
+    position = writeHead(buffer, position, cbor::MAJOR_ARRAY, 3);
+    position = writeHead(buffer, position, cbor::MAJOR_UNSIGNED, parsedAt - receivedAt);
+    position = writeHead(buffer, position, cbor::MAJOR_UNSIGNED, appliedAt - parsedAt);
+    return writeOptional(buffer, position, actuatedAt - appliedAt, actuated);
+  }
+
+  /**
+   * Format the answer to a traced ping: the pong payload with "seq", "origin" and "received" like
+   * in the status, and "turnaround", the time from receiving the ping to sending the pong in microseconds.
+   *
+   * @param sentAt The time the pong is sent in microseconds
+   * @return The length of the payload, 0 if it did not fit
+   */
+  size_t formatPong(char *buffer, size_t size, uint32_t sentAt) const {
+    char origin[21];
+    char receivedText[21];
+    formatOptional(origin, sizeof(origin), this->origin, this->origin != 0);
+    formatOptional(receivedText, sizeof(receivedText), received, received != 0);
+    int length = snprintf(buffer, size, "%.*s,\"" KEY_SEQ "\":%lu,\"" KEY_ORIGIN "\":%s,\"received\":%s,\"turnaround\":%lu}",
+                          (int)PONG_PAYLOAD_LENGTH - 1, PONG_PAYLOAD, (unsigned long)seq, origin, receivedText,
+                          (unsigned long)(sentAt - receivedAt));
+    return length < 0 || (size_t)length >= size ? 0 : (size_t)length;
+  }
+
+private:
+  /**
+   * The entries the trace adds to the CBOR status map.
+   */
+  static constexpr uint8_t TRACE_ENTRIES = 4;
+
+  static_assert(1 + ALARM_TYPE_COUNT + TRACE_ENTRIES < 24, "The traced CBOR status map size must fit in the initial byte");
+
+  static void formatOptional(char *buffer, size_t size, uint64_t value, bool known) {
+    if (known) {
+      snprintf(buffer, size, "%llu", (unsigned long long)value);
+    } else {
+      snprintf(buffer, size, "null");
+    }
+  }
+
+  static size_t writeHead(uint8_t *buffer, size_t position, uint8_t major, uint64_t argument) {
+    uint8_t initial = (uint8_t)(major << 5);
+    uint8_t size = argument < 24 ? 0 : argument <= 0xFF ? 1 : argument <= 0xFFFF ? 2 : argument <= 0xFFFFFFFF ? 4 : 8;
+    buffer[position++] = (uint8_t)(initial | (size == 0 ? argument : size == 1 ? 24 : size == 2 ? 25 : size == 4 ? 26 : 27));
+    while (size-- > 0) buffer[position++] = (uint8_t)(argument >> (8 * size));
+    return position;
+  }
+
+  static size_t writeText(uint8_t *buffer, size_t position, const char *text) {
+    size_t length = strlen(text);
+    position = writeHead(buffer, position, cbor::MAJOR_TEXT, length);
+    memcpy(buffer + position, text, length);
+    return position + length;
+  }
+
+  static size_t writeOptional(uint8_t *buffer, size_t position, uint64_t value, bool known) {
+    if (known) return writeHead(buffer, position, cbor::MAJOR_UNSIGNED, value);
+    buffer[position++] = cbor::NULL_VALUE;
+    return position;
+  }
+};
+
+#endif  // COMMAND_TRACE_H
@@ -0,0 +1,264 @@
+/**
+ * The connection supervisor keeps the device connected to the MQTT broker.
+ *
+ * It replaces fixed-interval retries and the restart on every Wi-Fi drop with a state machine:
+ * a lost link is reassociated without rebooting, broker connections are retried with jittered
+ * exponential backoff, and the device is only restarted when the link stays down for longer than
+ * WIFI_RESTART_BUDGET or WIFI_REASSOCIATE_ATTEMPTS reassociations fail.
+ */
+
+#ifndef CONNECTION_SUPERVISOR_H
+#define CONNECTION_SUPERVISOR_H
+
+#include "hal/Hal.h"
+#include "hal/MqttTransport.h"
+#include "hal/NetworkLink.h"
+#include "Constants.h"
+#include "Log.h"
+
+class ConnectionSupervisor {
+public:
+  /**
+   * Create a new connection supervisor.
+   *
+   * @param networkLink link to reassociate or restart when it is lost
+   * @param mqttClient transport to connect to the broker
+   */
+  ConnectionSupervisor(NetworkLink *networkLink, MqttTransport *mqttClient) {
+    this->networkLink = networkLink;
+    this->mqttClient = mqttClient;
+  }
+
+  /**
+   * Report that the network link is up. Connects to the broker right away.
+   */
+  void linkUp() {
+    linkAttempts = 0;
+    if (state == State::ONLINE || state == State::MQTT_CONNECTING) return;
+    state = State::MQTT_BACKOFF;
+    nextAttemptAt = hal::millis();
+  }
+
+  /**
+   * Report that the network link is down. Broker connections wait until it is back.
+   */
+  void linkDown() {
+    markOffline();
+    state = State::LINK_DOWN;
+    nextAttemptAt = hal::millis() + backoff(linkAttempts);
+  }
+
+  /**
+   * Report that the connection to the broker has been established.
+   */
+  void mqttConnected() {
+    state = State::ONLINE;
+    mqttAttempts = 0;
+    if (offlineSince != 0) {
+      lastReconnectTime = hal::millis() - offlineSince;
+      reconnects++;
+      offlineSince = 0;
+    }
+  }
+
+  /**
+   * Report that the connection to the broker has been lost or could not be established.
+   */
+  void mqttDisconnected() {
+    if (state == State::LINK_DOWN || state == State::STARTING) return;
+    markOffline();
+    scheduleMqttAttempt();
+  }
+
+  /**
+   * Run the state machine. Must be called from the main loop.
+   */
+  void process() {
+    uint32_t now = hal::millis();
+
+    switch (state) {
+      case State::STARTING:
+      case State::ONLINE:
+        break;
+
+      case State::LINK_DOWN:
+        // Leave the link alone while it is being provisioned
+        if (networkLink->isConnecting()) break;
+
+        if (now - offlineSince >= WIFI_RESTART_BUDGET || linkAttempts >= WIFI_REASSOCIATE_ATTEMPTS) {
+          LOG_ERROR("Wi-Fi could not be recovered, restarting.");
+          networkLink->restart();
+          break;
+        }
+
+        if ((int32_t)(now - nextAttemptAt) >= 0) {
+          LOG_WARN("Reassociating with Wi-Fi, attempt %u", (unsigned)(linkAttempts + 1));
+          linkAttempts++;
+          reconnectAttempts++;
+          nextAttemptAt = now + backoff(linkAttempts);
+          networkLink->reconnect();
+        }
+        break;
+
+      case State::MQTT_BACKOFF:
+        if ((int32_t)(now - nextAttemptAt) >= 0) {
+          LOG_INFO("Connecting to MQTT...");
+          state = State::MQTT_CONNECTING;
+          connectStartedAt = now;
+          reconnectAttempts++;
+          mqttClient->connect();
+        }
+        break;
+
+      case State::MQTT_CONNECTING:
+        if (now - connectStartedAt >= MQTT_CONNECT_TIMEOUT) {
+          LOG_WARN("Connecting to MQTT timed out.");
+          mqttClient->disconnect();
+          if (state == State::MQTT_CONNECTING) scheduleMqttAttempt();
+        }
+        break;
+    }
+  }
+
+  /**
+   * @return true if the device is connected to the broker
+   */
+  bool isOnline() const {
+    return state == State::ONLINE;
+  }
+
+  /**
+   * @return The total amount of Wi-Fi reassociation and broker connection attempts
+   */
+  uint32_t getReconnectAttempts() const {
+    return reconnectAttempts;
+  }
+
+  /**
+   * @return The amount of times the connection was recovered after it had been lost
+   */
+  uint32_t getReconnects() const {
+    return reconnects;
+  }
+
+  /**
+   * @return The time in milliseconds from losing the connection until being back online, for the last recovery
+   */
+  uint32_t getLastReconnectTime() const {
+    return lastReconnectTime;
+  }
+
+private:
+  enum class State {
+    /** Waiting for the link to come up for the first time. */
+    STARTING,
+    /** The link was lost and is being reassociated. */
+    LINK_DOWN,
+    /** The link is up, waiting for the next broker connection attempt. */
+    MQTT_BACKOFF,
+    /** Waiting for the broker to accept the connection. */
+    MQTT_CONNECTING,
+    /** Connected to the broker. */
+    ONLINE
+  };
+
+  /**
+   * Network link the MQTT connection runs over.
+   */
+  NetworkLink *networkLink;
+
+  /**
+   * Transport to connect to the broker.
+   */
+  MqttTransport *mqttClient;
+
+  /**
+   * The current connection state.
+   */
+  State state = State::STARTING;
+
+  /**
+   * The time of the next reassociation or connection attempt.
+   */
+  uint32_t nextAttemptAt = 0;
+
+  /**
+   * The time the current broker connection attempt was started.
+   */
+  uint32_t connectStartedAt = 0;
+
+  /**
+   * The time the connection was lost, 0 while online.
+   */
+  uint32_t offlineSince = 0;
+
+  /**
+   * Failed reassociation attempts since the link was lost.
+   */
+  uint8_t linkAttempts = 0;
+
+  /**
+   * Failed broker connection attempts since the last successful connection.
+   */
+  uint8_t mqttAttempts = 0;
+
+  /**
+   * Total amount of reassociation and connection attempts.
+   */
+  uint32_t reconnectAttempts = 0;
+
+  /**
+   * Amount of successful recoveries.
+   */
+  uint32_t reconnects = 0;
+
+  /**
+   * Duration of the last recovery in milliseconds.
+   */
+  uint32_t lastReconnectTime = 0;
+
+  /**
+   * Remember when the connection was lost, if it was not lost already.
+   */
+  void markOffline() {
+    if (offlineSince == 0) {
+      // 0 means online, so nudge a loss at exactly 0 ms
+      offlineSince = hal::millis() == 0 ? 1 : hal::millis();
+    }
+  }
+
+  /**
+   * Schedule the next broker connection attempt, or wait for the link if it is down.
+   */
+  void scheduleMqttAttempt() {
+    if (!networkLink->isConnected()) {
+      state = State::LINK_DOWN;
+      nextAttemptAt = hal::millis() + backoff(linkAttempts);
+      return;
+    }
+
+    uint32_t delay = backoff(mqttAttempts);
+    if (mqttAttempts < UINT8_MAX) mqttAttempts++;
+    state = State::MQTT_BACKOFF;
+    nextAttemptAt = hal::millis() + delay;
+
+    LOG_INFO("Retrying MQTT in %lu ms", (unsigned long)delay);
+  }
+
+  /**
+   * Exponential backoff with equal jitter: half of the delay is fixed and half is random,
+   * so devices that lost the connection at the same time do not retry in lockstep.
+   *
+   * @param attempt The amount of failed attempts so far
+   * @return The delay before the next attempt in milliseconds
+   */
+  static uint32_t backoff(uint8_t attempt) {
+    uint32_t delay = RECONNECT_BACKOFF_MAX;
+    if (attempt < 16 && ((uint32_t)RECONNECT_BACKOFF_MIN << attempt) < RECONNECT_BACKOFF_MAX) {
+      delay = (uint32_t)RECONNECT_BACKOFF_MIN << attempt;
+    }
+    return delay / 2 + hal::random(delay / 2 + 1);
+  }
+};
+
+#endif  // CONNECTION_SUPERVISOR_H
@@ -16,9 +16,42 @@
 #define DELAY_30_SECONDS              (1000 * 30)
 #define DELAY_10_MINUTES              (1000 * 60 * 10)
 
+// Button
+#define BUTTON_DEBOUNCE             30
+#define BUTTON_LONG_PRESS           1000
+#define BUTTON_EDGE_QUEUE_SIZE      16
+
+// RTC memory layout, offsets and sizes in 4-byte blocks. The first 32 of the 128 user blocks hold the command
+// of the boot loader, which Update.end() writes before the restart into a new image, so they stay unused.
+#define RTC_USER_BLOCKS             128
+#define RTC_BOOT_COMMAND_BLOCKS     32
+#define RTC_ALARM_SNAPSHOT_OFFSET   32
+#define RTC_ALARM_SNAPSHOT_BLOCKS   4
+#define RTC_SEQUENCE_WINDOW_OFFSET  36
+#define RTC_SEQUENCE_WINDOW_BLOCKS  50
+#define RTC_TLS_SESSION_OFFSET      88
+#define RTC_TLS_SESSION_BLOCKS      25
+#define RTC_SNAPSHOT_INTERVAL       (1000 * 5)
+
+static_assert(RTC_ALARM_SNAPSHOT_OFFSET >= RTC_BOOT_COMMAND_BLOCKS, "The boot command must not be overwritten");
+static_assert(RTC_SEQUENCE_WINDOW_OFFSET >= RTC_ALARM_SNAPSHOT_OFFSET + RTC_ALARM_SNAPSHOT_BLOCKS,
+              "The sequence windows must not overlap the alarm snapshot");
+static_assert(RTC_TLS_SESSION_OFFSET >= RTC_SEQUENCE_WINDOW_OFFSET + RTC_SEQUENCE_WINDOW_BLOCKS,
+              "The TLS session must not overlap the sequence windows");
+static_assert(RTC_TLS_SESSION_OFFSET + RTC_TLS_SESSION_BLOCKS <= RTC_USER_BLOCKS, "The layout must fit in RTC user memory");
+
+// Scheduling
+#define SCHEDULER_CAPACITY          8
+#define SCHEDULER_MAX_IDLE          1000
+#define NETWORK_BUSY_INTERVAL       10
+#define NETWORK_IDLE_INTERVAL       100
+#define WIFI_IDLE_LIGHT_SLEEP       true
+
 // Wi-Fi configuration
 #define WIFI_SSID                   "make-sense-alarm"
 #define WIFI_PASSWORD               "MakeSense2024"
+#define WIFI_JOIN_TIMEOUT           (1000 * 15)
+#define WIFI_PORTAL_TIMEOUT_SECONDS 180
 
 // MQTT credentials
 #define MQTT_HOST                   "data.cleanmobilityhva.nl"
@@ -27,18 +60,165 @@
 #define MQTT_PASSWORD               "MakeSense2024"
 #define MQTT_CLIENT_ID              "make-sense-alarm"
 
-// Topics
+// MQTT over TLS, build with -D MQTT_TLS_ENABLED=1 once the broker has a TLS listener. The broker certificate is
+// pinned by its SHA-1 fingerprint: openssl x509 -noout -fingerprint -sha1 -in broker.crt
+#ifndef MQTT_TLS_ENABLED
+#define MQTT_TLS_ENABLED            0
+#endif
+#define MQTT_TLS_PORT               8883
+#define MQTT_TLS_FINGERPRINT        ""
+#define MQTT_MAX_PACKET_SIZE        1024
+#define TLS_RECEIVE_BUFFER_SIZE     1024
+#define TLS_SEND_BUFFER_SIZE        512
+#define TLS_HANDSHAKE_TIMEOUT       (1000 * 5)
+#define TLS_POLL_INTERVAL           20
+
+// MQTT session: without a clean session the broker keeps the subscriptions and queues commands while offline
+#define MQTT_PERSISTENT_SESSION     true
+#define AVAILABILITY_ONLINE         "online"
+#define AVAILABILITY_OFFLINE        "offline"
+
+// Reconnection
+#define RECONNECT_BACKOFF_MIN       1000
+#define RECONNECT_BACKOFF_MAX       (1000 * 60)
+#define MQTT_CONNECT_TIMEOUT        (1000 * 10)
+#define WIFI_REASSOCIATE_ATTEMPTS   10
+#define WIFI_RESTART_BUDGET         (1000 * 60 * 10)
+
+// Outbound journal
+#define JOURNAL_PATH                "/journal.bin"
+#define JOURNAL_CAPACITY            64
+#define JOURNAL_WRITE_BEHIND        8
+#define JOURNAL_WRITE_DELAY         (1000 * 5)
+#define JOURNAL_BATCH_SIZE          4
+#define JOURNAL_PAYLOAD_SIZE        512
+
+// Escalation policies, see EscalationPolicy.h
+#define ESCALATION_PATH             "/escalation.bin"
+#define ESCALATION_MAX_STAGES       6
+#define ESCALATION_MAX_BEEPS        8
+#define ESCALATION_ALARM_PATTERN    0xFF
+#define ESCALATION_MAX_STAGE_DURATION (1000UL * 60 * 60 * 24)
+
+// Firmware updates over the air from a local HTTP server, see OtaUpdater.h and DeltaPatch.h
+#define OTA_HOST_SIZE               40
+#define OTA_PATH_SIZE               64
+#define OTA_JSON_DOCUMENT_SIZE      256
+#define OTA_READ_BUFFER_SIZE        256
+#define OTA_WRITE_BUFFER_SIZE       256
+#define OTA_RECEIVE_TIMEOUT         (1000 * 10)
+#define OTA_RETRY_BACKOFF_MIN       1000
+#define OTA_RETRY_BACKOFF_MAX       (1000 * 30)
+#define OTA_MAX_RETRIES             8
+#define OTA_PROGRESS_STEP           (32 * 1024)
+#define OTA_REBOOT_DELAY            1000
+#define OTA_STATUS_SIZE             160
+
+// Metrics, build with -D METRICS_ENABLED=0 to leave them out
+#ifndef METRICS_ENABLED
+#define METRICS_ENABLED             1
+#endif
+#define METRICS_INTERVAL            (1000 * 60)
+#define METRICS_HISTOGRAM_BUCKETS   16
+#define METRICS_PAYLOAD_SIZE        384
+
+// Local evaluation of raw sensor telemetry, build with -D TELEMETRY_RULES_ENABLED=0 to leave it out.
+// Airflow in m3/h, air pressure in Pa, rates per second. See TelemetryRules.h for the rule table.
+#ifndef TELEMETRY_RULES_ENABLED
+#define TELEMETRY_RULES_ENABLED     1
+#endif
+#define TELEMETRY_RULE_CAPACITY     8
+#define TELEMETRY_WINDOW_CAPACITY   8
+#define TELEMETRY_MAX_PAYLOAD_SIZE  16
+#define AIRFLOW_LOW_THRESHOLD       150.0f
+#define AIRFLOW_LOW_HYSTERESIS      20.0f
+#define AIRFLOW_LOW_WINDOW          4
+#define AIRFLOW_FALL_RATE           100.0f
+#define AIRFLOW_FALL_HYSTERESIS     50.0f
+#define AIRFLOW_FALL_HOLD           (1000 * 10)
+#define AIR_PRESSURE_LOW_THRESHOLD  10.0f
+#define AIR_PRESSURE_LOW_HYSTERESIS 2.0f
+#define AIR_PRESSURE_LOW_WINDOW     2
+#define AIR_PRESSURE_LOW_DURATION   3000
+
+// Logging, build with -D LOG_LEVEL=LOG_LEVEL_INFO or lower to compile the debug logging out
+#define LOG_LEVEL_NONE              0
+#define LOG_LEVEL_ERROR             1
+#define LOG_LEVEL_WARN              2
+#define LOG_LEVEL_INFO              3
+#define LOG_LEVEL_DEBUG             4
+#ifndef LOG_LEVEL
+#define LOG_LEVEL                   LOG_LEVEL_DEBUG
+#endif
+#define LOG_BUFFER_SIZE             1024
+#define LOG_LINE_SIZE               128
+#define LOG_SITE_BURST              5
+#define LOG_SITE_INTERVAL           1000
+#define LOG_DRAIN_INTERVAL          10
+
+// Command tracing
+#define TRACE_ACTUATION_TIMEOUT     100
+#define TRACE_POLL_INTERVAL         1
+#define TRACE_PAYLOAD_SIZE          256
+#define NTP_SYNC_INTERVAL           (60 * 60)
+
+// Command rate limiting
+#define COMMAND_BURST               2
+#define COMMAND_WINDOW              500
+
+// Device identity, the device ID is derived from the chip ID
+#define DEVICE_GROUP                "default"
+#define DEVICE_ID_SIZE              9
+#define CLIENT_ID_SIZE              32
+#define BROADCAST_ANSWER_JITTER     2000
+
+// Local commands over UDP, unicast to the device or to the multicast group, see LocalCommand.h
+#define LOCAL_COMMAND_PORT          47800
+#define LOCAL_COMMAND_GROUP         "239.255.47.80"
+#define LOCAL_COMMAND_KEY           "MakeSenseLAN2024"
+#define LOCAL_COMMAND_MAX_SIZE      128
+#define LOCAL_SENDER_CAPACITY       8
+
+// Topics, relative to the namespace of the device (alarm/<id>/), its group (alarm/group/<group>/) or all devices (alarm/all/)
 #define TOPIC_ALARM                 "alarm"
-#define TOPIC_PING                  TOPIC_ALARM "/ping"
-#define TOPIC_PONG                  TOPIC_ALARM "/pong"
-#define TOPIC_ALARM_SET             TOPIC_ALARM "/set"
-#define TOPIC_ALARM_STATUS          TOPIC_ALARM "/status"
+#define TOPIC_GROUP                 "group"
+#define TOPIC_ALL                   "all"
+#define TOPIC_MAX_LENGTH            64
+#define TOPIC_PING                  "ping"
+#define TOPIC_PONG                  "pong"
+#define TOPIC_ALARM_SET             "set"
+#define TOPIC_ALARM_STATUS          "status"
+#define TOPIC_SUFFIX_CBOR           "/cbor"
+#define TOPIC_ALARM_SET_CBOR        TOPIC_ALARM_SET TOPIC_SUFFIX_CBOR
+#define TOPIC_ALARM_STATUS_CBOR     TOPIC_ALARM_STATUS TOPIC_SUFFIX_CBOR
+#define TOPIC_ALARM_STATUS_GET      TOPIC_ALARM_STATUS "/get"
+#define TOPIC_ALARM_JOURNAL         TOPIC_ALARM_STATUS "/journal"
+#define TOPIC_ALARM_SET_FILTER      TOPIC_ALARM_SET "/#"
+#define TOPIC_METRICS               "metrics"
+#define TOPIC_AVAILABILITY          "availability"
+#define TOPIC_ALARM_DESIRED         "desired"
+#define TOPIC_TELEMETRY_AIRFLOW     "telemetry/airflow"
+#define TOPIC_TELEMETRY_AIR_PRESSURE "telemetry/pressure"
+#define TOPIC_TELEMETRY_FILTER      "telemetry/+"
+#define TOPIC_ESCALATION            "escalation"
+#define TOPIC_OTA                   "ota"
+#define TOPIC_OTA_STATUS            TOPIC_OTA "/status"
 
 // Keys
 #define KEY_AIR_PRESSURE_ALARM_ON   "airPressureAlarmOn"
 #define KEY_AIRFLOW_ALARM_ON        "airflowAlarmOn"
 #define KEY_TEST_ALARM_ON           "testAlarmOn"
 #define KEY_ALARM_ON                "alarmOn"
+#define KEY_SEQ                     "seq"
+#define KEY_ORIGIN                  "origin"
+#define KEY_SOURCE                  "src"
+#define KEY_VERSION                 "version"
+#define KEY_SERVER                  "server"
+#define KEY_DELTA                   "delta"
+#define KEY_DELTA_SIZE              "deltaSize"
+#define KEY_FULL                    "full"
+#define KEY_FULL_SIZE               "fullSize"
+#define KEY_SHA256                  "sha256"
 
 // Beep patterns
 #define TEST_BEEPS                  1
@@ -47,7 +227,12 @@
 #define MULTIPLE_CAUSES_BEEPS       4
 
 // Other
-#define JSON_BUFFER_SIZE            1024
+#define MQTT_MAX_PAYLOAD_SIZE       256
+#define ALARM_JSON_DOCUMENT_SIZE    192
+#define ALARM_JSON_FILTER_SIZE      192
+#define CBOR_MAX_DEPTH              4
+#define PUBLISH_JSON_STATUS         true
+#define PUBLISH_CBOR_STATUS         true
 #define ONE_ALARM                   1
 #define PLAYBACK_COUNT              5
 #define ONE_BEEP                    1
@@ -0,0 +1,31 @@
+/**
+ * CRC-32 (IEEE 802.3) checksum for data kept in RTC memory or flash.
+ */
+
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Calculate the CRC-32 of a block of memory. Bitwise, so it needs no lookup table in RAM.
+ *
+ * @param data The data to checksum
+ * @param size The size of the data in bytes
+ * @param crc The CRC of the preceding data, to checksum data in several parts
+ * @return The CRC-32 of the data
+ */
+inline uint32_t crc32(const void *data, size_t size, uint32_t crc = 0) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  crc = ~crc;
+  while (size--) {
+    crc ^= *bytes++;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320U & (0U - (crc & 1U)));
+    }
+  }
+  return ~crc;
+}
+
+#endif  // CRC32_H
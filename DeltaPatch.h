@@ -0,0 +1,467 @@
+/**
+ * Firmware deltas, and the patcher that turns a delta and the running image into a new image in the spare slot.
+ *
+ * A new firmware mostly consists of the code of the running one, moved around, with the addresses in it changed by
+ * small amounts. A delta describes the new image as instructions against the running image, which compress well,
+ * so an update transfers a fraction of the full image. The patch stream is:
+ *
+ *   offset  size  field
+ *   0       4     magic, "MSD1"
+ *   4       4     size of the base image the delta was made against, little-endian
+ *   8       4     size of the new image, little-endian
+ *   12      ...   instructions
+ *
+ * An instruction is three varints, an add length, a copy length and a seek, followed by the add bytes and the copy
+ * bytes. Add bytes are added to the base image from the base cursor on (new = base + add, modulo 256), so moved
+ * code with changed addresses gives runs of zeros with a few small numbers. Copy bytes are new bytes as they are.
+ * After the instruction the base cursor moves by the seek. Varints are unsigned LEB128, the seek is zigzag encoded.
+ *
+ * The delta is the patch stream compressed with LZSS: a flag byte for every 8 items, lowest bit first, where a set
+ * bit is a literal byte and a clear bit a reference of 2 bytes, big-endian: the distance minus 1 in the upper
+ * DELTA_WINDOW_BITS bits and the length minus DELTA_MIN_MATCH in the lower bits. Lower bits that are all set are
+ * followed by a third byte with the rest of the length, for the long runs of zeros of moved code. Decompressing
+ * needs only the window, and both layers are streamed, so the patcher can take the delta in chunks as it comes off
+ * the network.
+ *
+ * Deltas are made on the host by native/DeltaEncoder.h, see bench/ota_delta.cpp.
+ */
+
+#ifndef DELTA_PATCH_H
+#define DELTA_PATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "hal/Hal.h"
+#include "Constants.h"
+#include "Sha256.h"
+
+/**
+ * The LZSS window of a delta: 2 KB, so the distance and the length of a reference fit in 16 bits.
+ */
+constexpr uint8_t DELTA_WINDOW_BITS = 11;
+constexpr size_t DELTA_WINDOW_SIZE = (size_t)1 << DELTA_WINDOW_BITS;
+constexpr uint8_t DELTA_LENGTH_MASK = (1 << (16 - DELTA_WINDOW_BITS)) - 1;
+constexpr uint16_t DELTA_MIN_MATCH = 3;
+constexpr uint16_t DELTA_MAX_MATCH = DELTA_MIN_MATCH + DELTA_LENGTH_MASK + UINT8_MAX;
+
+constexpr uint8_t DELTA_MAGIC[4] = {'M', 'S', 'D', '1'};
+constexpr size_t DELTA_HEADER_SIZE = 12;
+
+/**
+ * Streaming LZSS decompressor for deltas.
+ */
+class LzssDecoder {
+public:
+  void reset() {
+    position = 0;
+    flags = 0;
+    items = 0;
+    referenceLength = 0;
+  }
+
+  /**
+   * Decompress the next part of the input. It may end anywhere, also in the middle of a reference.
+   *
+   * @param data The compressed bytes
+   * @param length The amount of compressed bytes
+   * @param sink Takes the decompressed bytes as (const uint8_t *bytes, size_t length) and returns false to stop
+   * @return false if the sink stopped
+   */
+  template<typename Sink>
+  bool decode(const uint8_t *data, size_t length, Sink &&sink) {
+    for (size_t i = 0; i < length; i++) {
+      uint8_t byte = data[i];
+      if (items == 0) {
+        flags = byte;
+        items = 8;
+      } else if (flags & 1) {
+        emit(byte);
+        next();
+      } else {
+        reference[referenceLength++] = byte;
+        if (referenceLength == 1) continue;
+        uint8_t lengthBits = reference[1] & DELTA_LENGTH_MASK;
+        if (referenceLength == 2 && lengthBits == DELTA_LENGTH_MASK) continue;
+
+        uint16_t distance = (uint16_t)(((reference[0] << 8 | reference[1]) >> (16 - DELTA_WINDOW_BITS)) + 1);
+        uint16_t count = (uint16_t)(DELTA_MIN_MATCH + lengthBits + (referenceLength == 3 ? reference[2] : 0));
+        referenceLength = 0;
+        // The reference may overlap the bytes it produces, so it is copied byte by byte
+        for (uint16_t j = 0; j < count; j++) {
+          emit(window[(position - distance) & (DELTA_WINDOW_SIZE - 1)]);
+          if (pending == sizeof(output) && !flush(sink)) return false;
+        }
+        next();
+      }
+      if (pending == sizeof(output) && !flush(sink)) return false;
+    }
+    return flush(sink);
+  }
+
+  /**
+   * @return true if the input ended on an item boundary
+   */
+  bool atItemBoundary() const {
+    return referenceLength == 0;
+  }
+
+private:
+  uint8_t window[DELTA_WINDOW_SIZE];
+  uint16_t position = 0;
+
+  /**
+   * The flags of the current group and the items left in it, 0 if a flag byte comes next.
+   */
+  uint8_t flags = 0;
+  uint8_t items = 0;
+
+  /**
+   * The bytes of the reference being read.
+   */
+  uint8_t reference[3];
+  uint8_t referenceLength = 0;
+
+  /**
+   * Decompressed bytes that have not been handed to the sink.
+   */
+  uint8_t output[64];
+  uint8_t pending = 0;
+
+  void emit(uint8_t byte) {
+    window[position] = byte;
+    position = (position + 1) & (DELTA_WINDOW_SIZE - 1);
+    output[pending++] = byte;
+  }
+
+  void next() {
+    flags >>= 1;
+    items--;
+  }
+
+  template<typename Sink>
+  bool flush(Sink &sink) {
+    if (pending == 0) return true;
+    uint8_t count = pending;
+    pending = 0;
+    return sink((const uint8_t *)output, (size_t)count);
+  }
+};
+
+/**
+ * Writes a new image to the spare slot, from a delta against the running image or from the full image, and
+ * verifies its SHA-256 before committing it.
+ *
+ * The last bytes of the image are held back until the hash has been checked, so the slot never holds a complete
+ * image that was not verified. The patcher can be fed in chunks of any size, and keeps its state between them,
+ * so a download that was interrupted continues where it stopped.
+ */
+class DeltaPatcher {
+public:
+  enum class Format : uint8_t {
+    DELTA,
+    FULL
+  };
+
+  /**
+   * Start writing a new image.
+   *
+   * @param format Whether the input is a delta or the full image
+   * @param size The size of the full image, the size of a delta image comes from its header
+   * @return nullptr on success, else a description of the error
+   */
+  const char *begin(Format format, uint32_t size = 0) {
+    this->format = format;
+    lzss.reset();
+    sha.reset();
+    field = Field::HEADER;
+    headerLength = 0;
+    varint = 0;
+    varintShift = 0;
+    baseCursor = 0;
+    baseBufferLength = 0;
+    imageSize = 0;
+    written = 0;
+    pending = 0;
+    error = nullptr;
+    if (format == Format::FULL) {
+      imageSize = size;
+      if (!slot.begin(size)) error = "NoSpace";
+    }
+    return error;
+  }
+
+  /**
+   * Patch the next part of the input.
+   *
+   * @param data The next bytes of the delta or the image
+   * @param length The amount of bytes
+   * @return nullptr on success, else a description of the error, after which the patcher takes no more input
+   */
+  const char *write(const uint8_t *data, size_t length) {
+    if (error != nullptr) return error;
+    if (format == Format::FULL) {
+      output(data, length);
+    } else {
+      lzss.decode(data, length, [this](const uint8_t *bytes, size_t count) {
+        patch(bytes, count);
+        return error == nullptr;
+      });
+    }
+    return error;
+  }
+
+  /**
+   * Check that the image is complete and that its hash matches, then commit it. It boots at the next restart.
+   *
+   * @param expected The SHA-256 the image must have, SHA256_SIZE bytes
+   * @return nullptr if the image was committed, else a description of the error
+   */
+  const char *finish(const uint8_t *expected) {
+    if (error != nullptr) return error;
+    bool complete = format == Format::FULL || (field == Field::ADD_LENGTH && varintShift == 0 && lzss.atItemBoundary());
+    if (!complete || imageSize == 0 || written != imageSize) return fail("Incomplete");
+
+    uint8_t digest[SHA256_SIZE];
+    sha.update(buffer, pending);
+    sha.finish(digest);
+    uint8_t difference = 0;
+    for (uint8_t i = 0; i < SHA256_SIZE; i++) difference |= (uint8_t)(digest[i] ^ expected[i]);
+    if (difference != 0) return fail("HashMismatch");
+    if (!slot.write(buffer, pending) || !slot.commit()) return fail("CommitFailed");
+    pending = 0;
+    return nullptr;
+  }
+
+  /**
+   * Drop the image, e.g. when the update is given up.
+   */
+  void abort() {
+    slot.abort();
+    if (error == nullptr) error = "Aborted";
+  }
+
+  /**
+   * @return The size of the new image, 0 until the header of a delta has been read
+   */
+  uint32_t getImageSize() const {
+    return imageSize;
+  }
+
+  /**
+   * @return The bytes of the new image produced so far
+   */
+  uint32_t getWritten() const {
+    return written;
+  }
+
+private:
+  enum class Field : uint8_t {
+    HEADER,
+    ADD_LENGTH,
+    COPY_LENGTH,
+    SEEK,
+    ADD,
+    COPY
+  };
+
+  Format format = Format::DELTA;
+  LzssDecoder lzss;
+  Sha256 sha;
+  hal::FirmwareSlot slot;
+  const char *error = nullptr;
+
+  /**
+   * Where the patch stream is, and the field or instruction being read.
+   */
+  Field field = Field::HEADER;
+  uint8_t header[DELTA_HEADER_SIZE];
+  uint8_t headerLength = 0;
+  uint32_t varint = 0;
+  uint8_t varintShift = 0;
+  uint32_t addLength = 0;
+  uint32_t copyLength = 0;
+  int32_t seek = 0;
+
+  /**
+   * The size of the base image and the position in it the next add byte applies to.
+   */
+  uint32_t baseSize = 0;
+  uint32_t baseCursor = 0;
+
+  /**
+   * The part of the base image that was read last.
+   */
+  uint8_t baseBuffer[OTA_READ_BUFFER_SIZE];
+  uint32_t baseBufferStart = 0;
+  size_t baseBufferLength = 0;
+
+  /**
+   * The size of the new image and the bytes produced, of which the last ones wait in the buffer.
+   */
+  uint32_t imageSize = 0;
+  uint32_t written = 0;
+  uint8_t buffer[OTA_WRITE_BUFFER_SIZE];
+  size_t pending = 0;
+
+  const char *fail(const char *reason) {
+    error = reason;
+    slot.abort();
+    return error;
+  }
+
+  /**
+   * Apply decompressed bytes of the patch stream.
+   */
+  void patch(const uint8_t *bytes, size_t count) {
+    while (count > 0 && error == nullptr) {
+      switch (field) {
+        case Field::HEADER: {
+          size_t take = count < DELTA_HEADER_SIZE - headerLength ? count : DELTA_HEADER_SIZE - headerLength;
+          memcpy(header + headerLength, bytes, take);
+          headerLength += take;
+          bytes += take;
+          count -= take;
+          if (headerLength == DELTA_HEADER_SIZE) readHeader();
+          break;
+        }
+
+        case Field::ADD_LENGTH:
+        case Field::COPY_LENGTH:
+        case Field::SEEK:
+          readVarint(*bytes++);
+          count--;
+          break;
+
+        case Field::ADD: {
+          size_t take = count < addLength ? count : addLength;
+          for (size_t i = 0; i < take && error == nullptr; i++) {
+            uint8_t base;
+            if (!readBase(baseCursor++, base)) {
+              fail("BaseOutOfRange");
+              return;
+            }
+            uint8_t byte = (uint8_t)(base + bytes[i]);
+            output(&byte, 1);
+          }
+          bytes += take;
+          count -= take;
+          addLength -= take;
+          if (addLength == 0) field = copyLength > 0 ? Field::COPY : endInstruction();
+          break;
+        }
+
+        case Field::COPY: {
+          size_t take = count < copyLength ? count : copyLength;
+          output(bytes, take);
+          bytes += take;
+          count -= take;
+          copyLength -= take;
+          if (copyLength == 0) field = endInstruction();
+          break;
+        }
+      }
+    }
+  }
+
+  void readHeader() {
+    if (memcmp(header, DELTA_MAGIC, sizeof(DELTA_MAGIC)) != 0) {
+      fail("NotADelta");
+      return;
+    }
+    baseSize = readLittleEndian(header + 4);
+    imageSize = readLittleEndian(header + 8);
+    // A delta against another build would produce garbage, which the hash would only catch at the end
+    if (baseSize != hal::firmwareSize()) {
+      fail("WrongBase");
+      return;
+    }
+    if (!slot.begin(imageSize)) {
+      fail("NoSpace");
+      return;
+    }
+    field = Field::ADD_LENGTH;
+  }
+
+  void readVarint(uint8_t byte) {
+    if (varintShift > 28) {
+      fail("InvalidVarint");
+      return;
+    }
+    varint |= (uint32_t)(byte & 0x7F) << varintShift;
+    varintShift += 7;
+    if (byte & 0x80) return;
+
+    uint32_t value = varint;
+    varint = 0;
+    varintShift = 0;
+    if (field == Field::ADD_LENGTH) {
+      addLength = value;
+      field = Field::COPY_LENGTH;
+    } else if (field == Field::COPY_LENGTH) {
+      copyLength = value;
+      field = Field::SEEK;
+    } else {
+      seek = (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+      field = addLength > 0 ? Field::ADD : copyLength > 0 ? Field::COPY : endInstruction();
+    }
+  }
+
+  /**
+   * Move the base cursor at the end of an instruction.
+   *
+   * @return The field that follows
+   */
+  Field endInstruction() {
+    baseCursor += (uint32_t)seek;
+    return Field::ADD_LENGTH;
+  }
+
+  bool readBase(uint32_t offset, uint8_t &byte) {
+    if (offset - baseBufferStart >= baseBufferLength) {
+      if (offset >= baseSize) return false;
+      // Flash is read in aligned words
+      baseBufferStart = offset & ~(uint32_t)3;
+      baseBufferLength = baseSize - baseBufferStart < sizeof(baseBuffer) ? baseSize - baseBufferStart : sizeof(baseBuffer);
+      if (!hal::readFirmware(baseBufferStart, baseBuffer, baseBufferLength)) {
+        baseBufferLength = 0;
+        return false;
+      }
+    }
+    byte = baseBuffer[offset - baseBufferStart];
+    return true;
+  }
+
+  /**
+   * Add bytes to the new image. A full buffer is written when the next byte arrives, so the buffer is never
+   * empty once the image is complete.
+   */
+  void output(const uint8_t *bytes, size_t count) {
+    if (count > imageSize - written) {
+      fail("TooLong");
+      return;
+    }
+    written += count;
+    while (count > 0) {
+      if (pending == sizeof(buffer)) {
+        sha.update(buffer, pending);
+        if (!slot.write(buffer, pending)) {
+          fail("WriteFailed");
+          return;
+        }
+        pending = 0;
+      }
+      size_t take = count < sizeof(buffer) - pending ? count : sizeof(buffer) - pending;
+      memcpy(buffer + pending, bytes, take);
+      pending += take;
+      bytes += take;
+      count -= take;
+    }
+  }
+
+  static uint32_t readLittleEndian(const uint8_t *bytes) {
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+  }
+};
+
+#endif  // DELTA_PATCH_H
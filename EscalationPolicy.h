@@ -0,0 +1,276 @@
+/**
+ * Escalation policies: how the claxon sounds while an alarm stays on, as a table of stages per alarm type.
+ *
+ * A stage plays a pattern for a while: a number of beeps with the default timing, the pattern of the active alarm
+ * types, or silence. The pattern repeats for the duration of the stage, or plays a number of cycles. After the last
+ * stage the policy continues at its loop stage, so the tail of the policy repeats as long as the alarm is on. The
+ * policy of the leading alarm type applies, see leadingAlarmType().
+ *
+ * The default policy is the escalation the device always had: the pattern of the alarm types for 30 seconds,
+ * silence until 10 minutes after the activation, then the pattern PLAYBACK_COUNT times every 10 minutes.
+ *
+ * The backend retains the table of a group as CBOR on TOPIC_ESCALATION. It is validated, stored in flash so it
+ * survives resets and power loss, and used from the next stage on:
+ *
+ *   {"version": 3, <alarm key>: [loop, [duration, beeps, cycles], ...], ...}
+ *
+ * Alarm keys are the text keys or the index in ALARM_TYPES plus one, like in alarm/set. Alarm types that are left
+ * out get the default policy. beeps is 0 for silence and ESCALATION_ALARM_PATTERN for the pattern of the active
+ * alarm types. A duration of 0 lasts as long as the cycles take, 0 cycles repeat the pattern for the duration.
+ */
+
+#ifndef ESCALATION_POLICY_H
+#define ESCALATION_POLICY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "hal/Hal.h"
+#include "Constants.h"
+#include "AlarmTypes.h"
+#include "AlarmCodec.h"
+#include "BeepSequencer.h"
+#include "Crc32.h"
+
+struct EscalationStage {
+  /**
+   * How long the stage lasts in milliseconds, 0 for as long as its cycles take.
+   */
+  uint32_t duration;
+
+  /**
+   * The amount of beeps of the pattern, 0 for silence, ESCALATION_ALARM_PATTERN for the pattern of the alarm types.
+   */
+  uint8_t beeps;
+
+  /**
+   * The amount of times the pattern plays, 0 to repeat it until the stage ends.
+   */
+  uint8_t cycles;
+
+  uint16_t reserved;
+
+  /**
+   * @param activeAlarms The active alarm types
+   * @return The pattern the stage plays
+   */
+  BeepPattern pattern(AlarmMask activeAlarms) const {
+    return beepPattern(beeps == ESCALATION_ALARM_PATTERN ? beepsForAlarms(activeAlarms) : beeps);
+  }
+
+  /**
+   * @param activeAlarms The active alarm types
+   * @return How long the stage lasts in milliseconds
+   */
+  uint32_t length(AlarmMask activeAlarms) const {
+    return duration != 0 ? duration : cycles * pattern(activeAlarms).cycleLength();
+  }
+};
+
+struct EscalationPolicy {
+  uint8_t stageCount;
+
+  /**
+   * The stage that follows the last one.
+   */
+  uint8_t loopFrom;
+
+  uint16_t reserved;
+
+  EscalationStage stages[ESCALATION_MAX_STAGES];
+
+  /**
+   * @return The stage that follows a stage
+   */
+  uint8_t next(uint8_t stage) const {
+    return stage + 1 < stageCount ? (uint8_t)(stage + 1) : loopFrom;
+  }
+
+  /**
+   * Check that the policy can be played: every stage has a length and a pattern the sequencer can play.
+   *
+   * @return nullptr if it is valid, else a description of the error
+   */
+  const char *validate() const {
+    if (stageCount == 0 || stageCount > ESCALATION_MAX_STAGES) return "InvalidStageCount";
+    if (loopFrom >= stageCount) return "InvalidLoop";
+    for (uint8_t i = 0; i < stageCount; i++) {
+      const EscalationStage &stage = stages[i];
+      if (stage.beeps > ESCALATION_MAX_BEEPS && stage.beeps != ESCALATION_ALARM_PATTERN) return "InvalidBeeps";
+      if (stage.duration > ESCALATION_MAX_STAGE_DURATION) return "StageTooLong";
+      if (stage.duration == 0 && (stage.beeps == 0 || stage.cycles == 0)) return "EmptyStage";
+    }
+    return nullptr;
+  }
+};
+
+/**
+ * The escalation of the device before the policies could be configured.
+ */
+constexpr EscalationPolicy DEFAULT_ESCALATION_POLICY = {4, 2, 0, {
+  {DELAY_30_SECONDS, ESCALATION_ALARM_PATTERN, 0, 0},
+  {DELAY_10_MINUTES - DELAY_30_SECONDS, 0, 0, 0},
+  {0, ESCALATION_ALARM_PATTERN, PLAYBACK_COUNT, 0},
+  {DELAY_10_MINUTES, 0, 0, 0},
+}};
+
+/**
+ * The policies of all alarm types, indexed like ALARM_TYPES.
+ */
+struct EscalationTable {
+  /**
+   * The version the backend gave the table, 0 for the defaults.
+   */
+  uint32_t version;
+
+  EscalationPolicy policies[ALARM_TYPE_COUNT];
+
+  /**
+   * @return The table with the default policy for every alarm type
+   */
+  static EscalationTable defaults() {
+    EscalationTable table = {};
+    for (EscalationPolicy &policy : table.policies) policy = DEFAULT_ESCALATION_POLICY;
+    return table;
+  }
+
+  const char *validate() const {
+    for (const EscalationPolicy &policy : policies) {
+      const char *error = policy.validate();
+      if (error != nullptr) return error;
+    }
+    return nullptr;
+  }
+
+  bool operator==(const EscalationTable &other) const {
+    return memcmp(this, &other, sizeof(EscalationTable)) == 0;
+  }
+
+  /**
+   * Decode and validate a table from its CBOR message, see the description at the top.
+   *
+   * @param payload The complete payload
+   * @param length The length of the payload
+   * @param table Receives the table
+   * @return nullptr on success, else a description of the error
+   */
+  static const char *decode(const uint8_t *payload, size_t length, EscalationTable &table) {
+    cbor::Reader reader(payload, length);
+    uint8_t major;
+    uint32_t entries;
+    if (!reader.readHead(major, entries) || major != cbor::MAJOR_MAP) return "NotAMap";
+
+    EscalationTable decoded = defaults();
+    while (entries-- > 0) {
+      uint32_t key;
+      if (!reader.readHead(major, key)) return "Truncated";
+      uint8_t index = ALARM_TYPE_COUNT;
+      bool version = false;
+      if (major == cbor::MAJOR_UNSIGNED) {
+        if (key >= 1 && key <= ALARM_TYPE_COUNT) index = (uint8_t)(key - 1);
+      } else if (major == cbor::MAJOR_TEXT) {
+        const uint8_t *text = reader.take(key);
+        if (text == nullptr) return "Truncated";
+        version = key == sizeof(KEY_VERSION) - 1 && memcmp(text, KEY_VERSION, key) == 0;
+        AlarmMask alarm = findAlarmType((const char *)text, key);
+        if (alarm != 0) index = alarm_types::lowestBit(alarm);
+      } else {
+        return "InvalidKey";
+      }
+
+      if (version) {
+        if (!reader.readHead(major, decoded.version) || major != cbor::MAJOR_UNSIGNED) return "InvalidVersion";
+      } else if (index < ALARM_TYPE_COUNT) {
+        const char *error = decodePolicy(reader, decoded.policies[index]);
+        if (error != nullptr) return error;
+      } else if (!reader.skip()) {
+        return "InvalidValue";
+      }
+    }
+    if (!reader.atEnd()) return "TrailingBytes";
+
+    const char *error = decoded.validate();
+    if (error != nullptr) return error;
+    table = decoded;
+    return nullptr;
+  }
+
+private:
+  static const char *decodePolicy(cbor::Reader &reader, EscalationPolicy &policy) {
+    uint8_t major;
+    uint32_t items;
+    uint32_t loopFrom;
+    if (!reader.readHead(major, items) || major != cbor::MAJOR_ARRAY || items < 2) return "InvalidPolicy";
+    if (items - 1 > ESCALATION_MAX_STAGES) return "InvalidStageCount";
+    if (!reader.readHead(major, loopFrom) || major != cbor::MAJOR_UNSIGNED) return "InvalidLoop";
+
+    policy = {};
+    policy.stageCount = (uint8_t)(items - 1);
+    policy.loopFrom = loopFrom < ESCALATION_MAX_STAGES ? (uint8_t)loopFrom : ESCALATION_MAX_STAGES;
+    for (uint8_t i = 0; i < policy.stageCount; i++) {
+      uint32_t fields[3];
+      if (!reader.readHead(major, items) || major != cbor::MAJOR_ARRAY || items != 3) return "InvalidStage";
+      for (uint32_t &field : fields) {
+        if (!reader.readHead(major, field) || major != cbor::MAJOR_UNSIGNED) return "InvalidStage";
+      }
+      if (fields[1] > UINT8_MAX || fields[2] > UINT8_MAX) return "InvalidStage";
+      policy.stages[i] = {fields[0], (uint8_t)fields[1], (uint8_t)fields[2], 0};
+    }
+    return nullptr;
+  }
+};
+
+/**
+ * The escalation table in flash, protected by a magic number and a CRC-32 like AlarmSnapshot.
+ */
+class EscalationStore {
+public:
+  /**
+   * Read the stored table.
+   *
+   * @param table Receives the table
+   * @return false if no valid table is stored
+   */
+  bool load(EscalationTable &table) {
+    Record record;
+    if (!open() || !file.read(0, &record, sizeof(record))) return false;
+    if (record.magic != MAGIC || record.crc != crc32(&record.table, sizeof(record.table))) return false;
+    if (record.table.validate() != nullptr) return false;
+    table = record.table;
+    return true;
+  }
+
+  /**
+   * Store a table, replacing the stored one.
+   *
+   * @return false if the file system is not available
+   */
+  bool save(const EscalationTable &table) {
+    Record record = {MAGIC, crc32(&table, sizeof(table)), table};
+    return open() && file.write(0, &record, sizeof(record));
+  }
+
+private:
+  struct Record {
+    uint32_t magic;
+
+    /**
+     * CRC-32 of the table.
+     */
+    uint32_t crc;
+
+    EscalationTable table;
+  };
+
+  static constexpr uint32_t MAGIC = 0x45534301;
+
+  hal::FlashFile file;
+  bool opened = false;
+
+  bool open() {
+    if (!opened) opened = file.open(ESCALATION_PATH, sizeof(Record));
+    return opened;
+  }
+};
+
+#endif  // ESCALATION_POLICY_H
@@ -1,115 +1,390 @@
 /**
  * The internet manager is responsible for setting up the Wi-Fi connection and handling the MQTT connection.
+ *
+ * The device keeps a persistent session with the broker (MQTT_PERSISTENT_SESSION), so commands sent while it is
+ * offline are queued by the broker and arrive right after reconnecting. Its status is retained, and its Last Will
+ * marks it offline on TOPIC_AVAILABILITY when the connection is lost. The backend can also retain the full state it
+ * wants on TOPIC_ALARM_DESIRED, which the device subscribes to on every connect and applies like a command, so it
+ * is back in sync one round trip after the CONNACK.
+ *
+ * The escalation policies of the group are retained on TOPIC_ESCALATION and arrive after every connect as well,
+ * see EscalationPolicy.h.
+ *
+ * With TELEMETRY_RULES_ENABLED the device also subscribes to the raw readings of the sensors in its group and
+ * raises and clears the airflow and air pressure alarms itself, see TelemetryRules.h. An alarm type is active while
+ * the backend or a local rule raised it, so neither clears what the other one still holds.
+ *
+ * Given an HTTP transport, the device takes firmware updates on TOPIC_OTA and reports their progress on
+ * TOPIC_OTA_STATUS, see OtaUpdater.h.
  */
 
 #ifndef INTERNET_MANAGER_H
 #define INTERNET_MANAGER_H
 
-#include <WiFiManager.h>
-#include <PubSubClient.h>
+#include <cstdio>
+#include <cstring>
 
-#include <AsyncMqtt_Generic.h>
-#include <Ticker.h>
-
-#include <ArduinoJson.h>
+#include "hal/Hal.h"
+#include "hal/MqttTransport.h"
+#include "hal/NetworkLink.h"
+#include "hal/DatagramTransport.h"
+#include "hal/HttpTransport.h"
 #include "Constants.h"
 #include "AlarmStateManager.h"
+#include "AlarmTypes.h"
+#include "AlarmCodec.h"
+#include "PayloadAssembler.h"
+#include "TokenBucket.h"
+#include "OutboundJournal.h"
+#include "TopicRouter.h"
+#include "StatusPayloads.h"
+#include "ConnectionSupervisor.h"
+#include "Metrics.h"
+#include "CommandTrace.h"
+#include "LocalCommand.h"
+#include "SequenceWindow.h"
+#include "TelemetryRules.h"
+#include "OtaUpdater.h"
+#include "Log.h"
 
 class InternetManager {
 public:
+  /**
+   * Counters of the alarm/set commands and the status messages, to see how much the limiter saves.
+   */
+  struct CommandStats {
+    /**
+     * The alarm/set commands that were decoded.
+     */
+    uint32_t commands = 0;
+
+    /**
+     * The commands that were merged into a command waiting for the limiter.
+     */
+    uint32_t coalesced = 0;
+
+    /**
+     * The state applications that did not change the alarm types.
+     */
+    uint32_t unchanged = 0;
+
+    /**
+     * The status messages that were published.
+     */
+    uint32_t statusPublished = 0;
+
+    /**
+     * The status messages that were not published, because the subscribers already have that status.
+     */
+    uint32_t statusSuppressed = 0;
+
+    /**
+     * The local commands that were authentic and meant for this device, and the datagrams that were refused
+     * as invalid or unauthentic.
+     */
+    uint32_t localCommands = 0;
+    uint32_t localRejected = 0;
+
+    /**
+     * The commands that were refused because their sequence number was seen before: replays, and copies of
+     * a command that arrived both locally and over MQTT.
+     */
+    uint32_t duplicates = 0;
+
+    /**
+     * The desired states received, the retained one after every connect and the changes while connected.
+     */
+    uint32_t desired = 0;
+
+    /**
+     * The escalation tables that replaced the policies in use, and the ones that were refused as invalid.
+     */
+    uint32_t escalations = 0;
+    uint32_t escalationsRejected = 0;
+
+    /**
+     * The firmware updates that were started, and the update commands that were refused.
+     */
+    uint32_t updates = 0;
+    uint32_t updatesRejected = 0;
+  };
+
   /**
    * Create a new instance of the InternetManager.
-   * Initialize the web server on the given port and set the state manager to use for turning the alarm on and off.
+   * Set the state manager to use for turning the alarm on and off and the network to talk over.
    *
    * @param alarmStateManager state manager to use for turning the alarm on and off
+   * @param networkLink link to bring up before connecting to the MQTT broker
+   * @param mqttClient transport to use for talking to the MQTT broker
+   * @param localTransport listener for local commands from the LAN, nullptr to only take commands over MQTT
+   * @param updateTransport HTTP client to download firmware updates with, nullptr to take no updates
    */
-  explicit InternetManager(AlarmStateManager *alarmStateManager) {
+  InternetManager(AlarmStateManager *alarmStateManager, NetworkLink *networkLink, MqttTransport *mqttClient,
+                  DatagramTransport *localTransport = nullptr, HttpTransport *updateTransport = nullptr)
+      : connectionSupervisor(networkLink, mqttClient) {
     this->alarmStateManager = alarmStateManager;
+    this->networkLink = networkLink;
+    this->mqttClient = mqttClient;
+    this->localTransport = localTransport;
+    this->updateTransport = updateTransport;
   }
 
   /**
-   * Initialize the Wi-Fi connection through the Wi-Fi manager and set up the MQTT connection.
+   * Start the Wi-Fi connection through the network link and set up the MQTT connection.
+   * Returns immediately; the connection is completed from process().
    */
   void initialize() {
     // Initialize the built-in LED pin as an output and turn it off
-    pinMode(LED_BUILTIN, OUTPUT);
-    digitalWrite(LED_BUILTIN, HIGH);
+    hal::setPinMode(LED_BUILTIN, OUTPUT);
+    hal::writePin(LED_BUILTIN, HIGH);
 
-    wifiConnectHandler = WiFi.onStationModeGotIP([this](const WiFiEventStationModeGotIP &event) {
-      onWifiConnect(event);
+    networkLink->onUp([this]() {
+      onWifiConnect();
     });
 
-    wifiDisconnectHandler = WiFi.onStationModeDisconnected([this](const WiFiEventStationModeDisconnected &event) {
-      onWifiDisconnect(event);
+    networkLink->onDown([this]() {
+      onWifiDisconnect();
     });
 
-    mqttClient.onConnect([this](bool sessionPresent) {
-      onMqttConnect();
+    mqttClient->onConnect([this](bool sessionPresent) {
+      onMqttConnect(sessionPresent);
     });
 
-    mqttClient.onDisconnect([this](AsyncMqttClientDisconnectReason reason) {
+    mqttClient->onDisconnect([this](int reason) {
       onMqttDisconnect(reason);
     });
 
-    mqttClient.onSubscribe([](const uint16_t &packetId, const uint8_t &qos) {
+    mqttClient->onSubscribe([](uint16_t packetId, uint8_t qos) {
       onMqttSubscribe(packetId, qos);
     });
 
-    mqttClient.onMessage([this](char *topic, char *payload, const AsyncMqttClientMessageProperties &properties,
-                                const size_t &len, const size_t &index, const size_t &total) {
-      onMqttMessage(topic, payload, properties, len, index, total);
+    mqttClient->onMessage([this](const char *topic, const char *payload, size_t len, size_t index, size_t total) {
+      onMqttMessage(topic, payload, len, index, total);
     });
 
-    mqttClient.setServer(MQTT_HOST, MQTT_PORT);
-    mqttClient.setCredentials(MQTT_USER, MQTT_PASSWORD);
-    mqttClient.setClientId(MQTT_CLIENT_ID);
+    mqttClient->onPublish([this](uint16_t packetId) {
+      onMqttPublish(packetId);
+    });
 
-    connectToWifi();
+    if (localTransport != nullptr) {
+      localTransport->onPacket([this](const uint8_t *data, size_t length) {
+        onLocalCommand(data, length);
+      });
+    }
+    if (updateTransport != nullptr) {
+      otaUpdater.begin(updateTransport);
+      otaUpdater.onChange([this]() {
+        holdRtcWrites();
+        publishOtaStatus();
+      });
+    }
+    commandWindow.load();
+#if TELEMETRY_RULES_ENABLED
+    size_t rules = telemetry.begin(TELEMETRY_RULES, TELEMETRY_RULE_COUNT);
+    if (rules != TELEMETRY_RULE_COUNT) {
+      LOG_ERROR("[Telemetry] Compiled %u of %u rules", (unsigned)rules, (unsigned)TELEMETRY_RULE_COUNT);
+    }
+#endif
+
+    // Pick up the transitions that were not delivered before a reset
+    journal.begin();
+
+    // Start from the alarm state restored after a reset, the rules take back the alarm types they had detected
+    activeAlarms = alarmStateManager->getActiveAlarms();
+#if TELEMETRY_RULES_ENABLED
+    remoteAlarms = alarmStateManager->getRemoteAlarms();
+    telemetry.restore((AlarmMask)(activeAlarms & ~remoteAlarms), hal::millis());
+#else
+    remoteAlarms = activeAlarms;
+#endif
+
+    // Every device has its own client ID and topic namespace, derived from the chip ID
+    snprintf(deviceId, sizeof(deviceId), "%06lx", (unsigned long)hal::chipId());
+    snprintf(clientId, sizeof(clientId), "%s-%s", MQTT_CLIENT_ID, deviceId);
+    topics.begin(deviceId, DEVICE_GROUP);
+    hal::beginWallClock(NTP_SYNC_INTERVAL);
+    LOG_INFO("Device topics: %s", topics.prefix(TopicRouter::SCOPE_DEVICE));
+
+    mqttClient->setServer(MQTT_HOST, BROKER_PORT);
+    mqttClient->setCredentials(MQTT_USER, MQTT_PASSWORD);
+    mqttClient->setClientId(clientId);
+    mqttClient->setCleanSession(!MQTT_PERSISTENT_SESSION);
+    mqttClient->setWill(topics.topic(TopicRouter::OUTBOUND_AVAILABILITY), 1, true, AVAILABILITY_OFFLINE,
+                        sizeof(AVAILABILITY_OFFLINE) - 1);
+
+    networkLink->begin();
   }
 
-  unsigned long lastDeactivationTime = 0;
+  /**
+   * Drive the network setup. Must be called from the main loop and never blocks.
+   *
+   * @return The time in milliseconds until this needs to run again
+   */
+  uint32_t process() {
+    networkLink->process();
+    connectionSupervisor.process();
+    uint32_t nextRun = networkLink->isConnecting() ? NETWORK_BUSY_INTERVAL : NETWORK_IDLE_INTERVAL;
+    if (connectionSupervisor.isOnline()) hal::updateWallClock();
+
+    uint32_t untilTransport = mqttClient->process(hal::millis());
+    if (untilTransport < nextRun) nextRun = untilTransport;
+
+    uint32_t untilJournalWrite = journal.process(hal::millis());
+    if (untilJournalWrite < nextRun) nextRun = untilJournalWrite;
+
+    // Answer a status request to the group or all devices once its jitter has passed
+    if (statusRequested) {
+      int32_t untilAnswer = (int32_t)(statusAnswerAt - hal::millis());
+      if (untilAnswer <= 0) {
+        statusRequested = false;
+        sendAlarmState(true);
+      } else if ((uint32_t)untilAnswer < nextRun) {
+        nextRun = (uint32_t)untilAnswer;
+      }
+    }
 
-  void listenToAlarmDeactivation() {
-    if (digitalRead(ALARM_BUTTON_PIN) == HIGH) {
-      if (millis() - lastDeactivationTime >= DELAY_ALARM) {
-        activeAlarmTypes.clear();
-        setAlarmState("");
-        lastDeactivationTime = millis();  // Update the last deactivation time
+    // Publish the status of a traced command once the claxon has started, or it is clear that it will not
+    if (traceState == TraceState::AWAITING_ACTUATION) {
+      if (alarmStateManager->getClaxonStarts() != traceClaxonStarts) {
+        trace.actuatedAt = alarmStateManager->getClaxonStartedAt();
+        trace.actuated = true;
+        traceState = TraceState::APPLIED;
+        sendAlarmState(true);
+      } else if ((int32_t)(hal::millis() - traceDeadline) >= 0) {
+        traceState = TraceState::APPLIED;
+        sendAlarmState(true);
+      } else if (TRACE_POLL_INTERVAL < nextRun) {
+        nextRun = TRACE_POLL_INTERVAL;
       }
     }
+
+    // Apply the commands that were held back by the limiter, as one state change
+    if (commandPending) {
+      uint32_t untilToken = commandLimiter.timeUntilToken(hal::millis());
+      if (untilToken == 0) {
+        commandLimiter.tryTake(hal::millis());
+        commandPending = false;
+        applyAlarmState();
+      } else if (untilToken < nextRun) {
+        nextRun = untilToken;
+      }
+    }
+
+    if (updateTransport != nullptr) {
+      uint32_t untilUpdate = otaUpdater.process(hal::millis());
+      if (untilUpdate < nextRun) nextRun = untilUpdate;
+      holdRtcWrites();
+    }
+
+#if METRICS_ENABLED
+    uint32_t untilMetrics = publishMetrics(hal::millis());
+    if (untilMetrics < nextRun) nextRun = untilMetrics;
+#endif
+    return nextRun;
+  }
+
+  /**
+   * @return The supervisor that keeps the broker connection up, for its reconnect statistics
+   */
+  const ConnectionSupervisor &getConnectionSupervisor() const {
+    return connectionSupervisor;
+  }
+
+  /**
+   * @return The counters of the alarm/set commands and the status messages
+   */
+  const CommandStats &getCommandStats() const {
+    return commandStats;
+  }
+
+  /**
+   * @return The journal of the transitions that could not be published, for its statistics
+   */
+  const OutboundJournal &getJournal() const {
+    return journal;
+  }
+
+#if TELEMETRY_RULES_ENABLED
+  /**
+   * @return The evaluator of the sensor readings, for its statistics
+   */
+  const TelemetryEvaluator &getTelemetry() const {
+    return telemetry;
+  }
+#endif
+
+  /**
+   * @return The updater of the firmware, for its state and statistics
+   */
+  const OtaUpdater &getOtaUpdater() const {
+    return otaUpdater;
+  }
+
+  /**
+   * @return The topic namespaces of the device
+   */
+  const TopicRouter &getTopics() const {
+    return topics;
+  }
+
+  /**
+   * Clear all alarms, e.g. after a long press of the button, and publish the new state.
+   */
+  void clearAlarms() {
+    // The button is newer than any command that is still held back
+    commandPending = false;
+    if (traceState == TraceState::DECODED) traceState = TraceState::NONE;
+    // A rule that still detects its alarm keeps it, the button silences its claxon
+    remoteAlarms = 0;
+    activeAlarms = detectedAlarms();
+    applyAlarmState();
   }
 
 private:
+  /**
+   * The port of the broker, its TLS listener with MQTT_TLS_ENABLED.
+   */
+  static constexpr uint16_t BROKER_PORT = MQTT_TLS_ENABLED ? MQTT_TLS_PORT : MQTT_PORT;
+
+  /**
+   * Network link the MQTT connection runs over.
+   */
+  NetworkLink *networkLink;
+
+  /**
+   * Publish/subscribe client to use for sending messages to the MQTT broker.
+   */
+  MqttTransport *mqttClient;
 
   /**
-   * Wi-Fi client to use for the MQTT client.
+   * Listener for local commands, nullptr if there is none.
    */
-  WiFiClient wiFiClient;
+  DatagramTransport *localTransport;
 
   /**
-   * Async publish/subscribe client to use for sending messages to the MQTT broker.
+   * HTTP client for firmware updates, nullptr if there is none.
    */
-  AsyncMqttClient mqttClient;
+  HttpTransport *updateTransport;
 
   /**
-   * Wi-Fi event handler to handle a successful connection.
+   * Downloads, verifies and installs firmware updates.
    */
-  WiFiEventHandler wifiConnectHandler;
+  OtaUpdater otaUpdater;
 
   /**
-   * Wi-Fi event handler to handle a disconnection.
+   * Buffer the status of a firmware update is formatted in.
    */
-  WiFiEventHandler wifiDisconnectHandler;
+  char otaPayload[OTA_STATUS_SIZE];
 
   /**
-   * Timer to use for reconnecting to the MQTT broker.
+   * The sequence numbers seen per sender, to apply every numbered command only once.
    */
-  Ticker mqttReconnectTimer;
+  SequenceWindow commandWindow;
 
   /**
-   * Timer to use for reconnecting to Wi-Fi.
+   * Supervisor that reconnects to Wi-Fi and the MQTT broker after a disconnection.
    */
-  Ticker wifiReconnectTimer;
+  ConnectionSupervisor connectionSupervisor;
 
   /**
    * State manager to use for turning the alarm on and off.
@@ -117,91 +392,191 @@ private:
   AlarmStateManager *alarmStateManager;
 
   /**
-   * Buffer to use for parsing and creating JSON messages.
+   * Buffer the chunks of an incoming alarm/set or escalation message are collected in.
+   */
+  PayloadAssembler<MQTT_MAX_PAYLOAD_SIZE> alarmPayload;
+
+  /**
+   * Decoder for JSON alarm/set payloads.
+   */
+  JsonAlarmCodec jsonCodec;
+
+#if TELEMETRY_RULES_ENABLED
+  /**
+   * The rules the sensor readings of the group are evaluated against.
+   */
+  TelemetryEvaluator telemetry;
+#endif
+
+  /**
+   * The ID of the device, the chip ID in hex, and the MQTT client ID built from it.
+   */
+  char deviceId[DEVICE_ID_SIZE] = {};
+  char clientId[CLIENT_ID_SIZE] = {};
+
+  /**
+   * The topic namespaces of the device.
+   */
+  TopicRouter topics;
+
+  /**
+   * Whether a status request to the group or all devices waits for its answer, and when to answer.
+   */
+  bool statusRequested = false;
+  uint32_t statusAnswerAt = 0;
+
+  /**
+   * Mask to store active alarm types: the remote ones and the ones the telemetry rules detect
+   */
+  AlarmMask activeAlarms = 0;
+
+  /**
+   * The alarm types raised by alarm/set and local commands.
+   */
+  AlarmMask remoteAlarms = 0;
+
+  /**
+   * Limits how often alarm/set commands are applied. Commands over the limit are coalesced.
+   */
+  TokenBucket commandLimiter{COMMAND_BURST, COMMAND_WINDOW};
+
+  /**
+   * Whether activeAlarms holds commands that are waiting for the limiter.
+   */
+  bool commandPending = false;
+
+  /**
+   * The alarm types in the last published status, only meaningful once statusKnown is set.
+   */
+  AlarmMask publishedAlarms = 0;
+
+  /**
+   * Whether a status has been published, so the subscribers know publishedAlarms.
+   */
+  bool statusKnown = false;
+
+  /**
+   * Counters of the alarm/set commands and the status messages.
+   */
+  CommandStats commandStats;
+
+  /**
+   * Transitions that could not be published, delivered after reconnecting.
+   */
+  OutboundJournal journal;
+
+  /**
+   * The packet ID of the journal batch the broker has not acknowledged yet, 0 if none.
+   */
+  uint16_t journalPacketId = 0;
+
+  /**
+   * The sequence number of the last transition in that batch.
+   */
+  uint32_t journalBatchThrough = 0;
+
+  /**
+   * Buffer a journal batch is formatted in.
    */
-  DynamicJsonDocument jsonBuffer = DynamicJsonDocument(JSON_BUFFER_SIZE);
+  char journalPayload[JOURNAL_PAYLOAD_SIZE];
 
   /**
-   * Set to store active alarm types
+   * When the first chunk of the current message arrived, in microseconds and on the wall clock.
    */
-  std::set<std::string> activeAlarmTypes;
+  uint32_t messageReceivedAt = 0;
+  uint64_t messageReceivedWall = 0;
 
   /**
-   * Define all alarm keys
+   * Where the trace of the last traced command is: decoded and waiting for the limiter, applied and
+   * waiting for the claxon, or applied and ready to be echoed by the next status.
    */
-  const std::vector<std::string> alarmKeys = {
-    KEY_TEST_ALARM_ON,
-    KEY_AIRFLOW_ALARM_ON,
-    KEY_AIR_PRESSURE_ALARM_ON
+  enum class TraceState : uint8_t {
+    NONE,
+    DECODED,
+    AWAITING_ACTUATION,
+    APPLIED
   };
 
+  TraceState traceState = TraceState::NONE;
+  CommandTrace trace;
+
   /**
-   * Whether the ESP is currently connecting to Wi-Fi.
+   * The claxon starts before the traced command was applied, and when to stop waiting for the claxon.
    */
-  bool isConnectingToWifi = false;
+  uint32_t traceClaxonStarts = 0;
+  uint32_t traceDeadline = 0;
 
   /**
-   * Connect to Wi-Fi. If the ESP was set up before it will use the saved credentials.
-   * If not it will create an access point with the name and password defined in the constants.
-   * This access point must be used to set up the connection with a Wi-Fi network.
-   * To set up this connection go to gateway IP (192.1769.4.1) while connected to this access point.
+   * Buffer traced statuses and pongs are formatted in.
    */
-  void connectToWifi() {
-    // Initialize the Wi-Fi connection
-    Serial.println("Initializing Wi-Fi connection");
-    WiFiManager wifiManager;
-    isConnectingToWifi = true;
-    wifiManager.autoConnect(WIFI_SSID, WIFI_PASSWORD);
-    isConnectingToWifi = false;
-    Serial.println("Connected to Wi-Fi.");
-  }
+  char tracePayload[TRACE_PAYLOAD_SIZE];
 
+#if METRICS_ENABLED
   /**
-   * Connect to the MQTT broker.
+   * The time the current metrics period started, and the buffer the metrics are formatted in.
    */
-  void connectToMqtt() {
-    Serial.println("Connecting to MQTT...");
-    mqttClient.connect();
-  }
+  uint32_t metricsPeriodStart = 0;
+  char metricsPayload[METRICS_PAYLOAD_SIZE];
+#endif
 
   /**
    * Connect to the MQTT broker after a successful Wi-Fi connection.
-   *
-   * @param event The event that triggered this callback
    */
-  void onWifiConnect(const WiFiEventStationModeGotIP &event) {
-    (void)event;
-    connectToMqtt();
+  void onWifiConnect() {
+    connectionSupervisor.linkUp();
+    if (localTransport != nullptr && !localTransport->listen(LOCAL_COMMAND_PORT, LOCAL_COMMAND_GROUP)) {
+      LOG_WARN("[Local] Could not listen on port %u", (unsigned)LOCAL_COMMAND_PORT);
+    }
   }
 
   /**
-   * Reconnect to the MQTT broker after a disconnection.
-   *
-   * @param event The event that triggered this callback
-   */
-  void onWifiDisconnect(const WiFiEventStationModeDisconnected &event) {
-    (void)event;
-    Serial.println("Disconnected from Wi-Fi.");
-    mqttReconnectTimer.detach();  // ensure we don't reconnect to MQTT while reconnecting to Wi-Fi
-    if (!isConnectingToWifi) {
-      wifiReconnectTimer.once(2, []() {
-        EspClass::restart();
-      });
-    }
+   * Let the supervisor reassociate with Wi-Fi after a disconnection.
+   */
+  void onWifiDisconnect() {
+    LOG_WARN("Disconnected from Wi-Fi.");
+    if (localTransport != nullptr) localTransport->close();
+    connectionSupervisor.linkDown();
   }
 
   /**
    * Execute the callback function when the client is connected to the MQTT broker.
+   *
+   * @param sessionPresent Whether the broker kept the session, with the subscriptions, from the last connection
    */
-  void onMqttConnect() {
-    Serial.print("Connected to MQTT broker: ");
-    Serial.print(MQTT_HOST);
-    Serial.print(", port: ");
-    Serial.println(MQTT_PORT);
+  void onMqttConnect(bool sessionPresent) {
+    LOG_INFO("Connected to MQTT broker: %s, port: %u, session present: %d", MQTT_HOST, (unsigned)BROKER_PORT,
+             sessionPresent);
+    connectionSupervisor.mqttConnected();
+    publish(TopicRouter::OUTBOUND_AVAILABILITY, 1, AVAILABILITY_ONLINE, sizeof(AVAILABILITY_ONLINE) - 1, true);
+
+    // Subscribe to the commands to this device, its group and all devices. The set filter covers every format.
+    // A session that was kept still has these subscriptions, and its queued commands are already on their way.
+    char filter[TOPIC_MAX_LENGTH];
+    if (!sessionPresent) {
+      for (uint8_t scope = 0; scope < TopicRouter::SCOPE_COUNT; scope++) {
+        mqttClient->subscribe(topics.topic((TopicRouter::Scope)scope, TOPIC_ALARM_SET_FILTER, filter), 2);
+        mqttClient->subscribe(topics.topic((TopicRouter::Scope)scope, TOPIC_PING, filter), 0);
+        mqttClient->subscribe(topics.topic((TopicRouter::Scope)scope, TOPIC_ALARM_STATUS_GET, filter), 1);
+      }
+      // Every device decides for itself whether an image fits, so updates are only addressed to the device
+      if (updateTransport != nullptr) mqttClient->subscribe(topics.topic(TopicRouter::SCOPE_DEVICE, TOPIC_OTA, filter), 1);
+#if TELEMETRY_RULES_ENABLED
+      // Readings are only worth something fresh, a lost one is replaced by the next
+      mqttClient->subscribe(topics.topic(TopicRouter::SCOPE_GROUP, TOPIC_TELEMETRY_FILTER, filter), 0);
+#endif
+    }
 
-    // Subscribe to topics
-    mqttClient.subscribe(TOPIC_PING, 0);
-    mqttClient.subscribe(TOPIC_ALARM_SET, 2);
+    // Subscribing again makes the broker send the retained desired state and escalation policies,
+    // also when the session was kept
+    mqttClient->subscribe(topics.desiredTopic(), 1);
+    mqttClient->subscribe(topics.topic(TopicRouter::SCOPE_GROUP, TOPIC_ESCALATION, filter), 1);
+
+    // Catch up on what happened while offline: the current state once, then every transition.
+    // After a reset the retained status may be older than the restored state, so it is always replaced.
+    if (!statusKnown || journal.hasPending()) {
+      sendAlarmState(false);
+      flushJournal();
+    }
   }
 
   /**
@@ -209,16 +584,62 @@ private:
    *
    * @param reason The reason for the disconnection
    */
-  void onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
-    (void)reason;
+  void onMqttDisconnect(int reason) {
+    LOG_WARN("Disconnected from MQTT. Reason: %d", reason);
+    connectionSupervisor.mqttDisconnected();
 
-    Serial.print("Disconnected from MQTT. Reason: ");
-    Serial.println((int)reason);
+    // The batch in flight is sent again after reconnecting
+    journalPacketId = 0;
+  }
 
-    if (WiFi.isConnected()) {
-      mqttReconnectTimer.once(2, [this]() {
-        connectToMqtt();
-      });
+  /**
+   * Execute the callback function when the broker acknowledged a message.
+   * Marks the journal batch in flight as delivered and sends the next one.
+   *
+   * @param packetId The packet ID of the acknowledged message
+   */
+  void onMqttPublish(uint16_t packetId) {
+    if (journalPacketId == 0 || packetId != journalPacketId) return;
+    journalPacketId = 0;
+    journal.acknowledge(journalBatchThrough, hal::millis());
+    flushJournal();
+  }
+
+  /**
+   * Publish the next batch of undelivered transitions to TOPIC_ALARM_JOURNAL, one batch at a time.
+   *
+   * The payload is a JSON array with an object per transition, oldest first:
+   * {"seq":12,"age":5300,"status":{...}}, where age is the time in milliseconds since the transition
+   * (null if it happened before a reset) and status is the status payload after the transition.
+   * The sequence numbers let the backend drop batches it receives twice.
+   */
+  void flushJournal() {
+    if (journalPacketId != 0 || !journal.hasPending() || !mqttClient->connected()) return;
+
+    OutboundJournal::Event events[JOURNAL_BATCH_SIZE];
+    size_t count = journal.peek(events, JOURNAL_BATCH_SIZE);
+    uint32_t now = hal::millis();
+    size_t length = 0;
+    size_t included = 0;
+    journalPayload[length++] = '[';
+    for (; included < count; included++) {
+      const OutboundJournal::Event &event = events[included];
+      char age[12] = "null";
+      if (!event.beforeReset) snprintf(age, sizeof(age), "%lu", (unsigned long)(now - event.time));
+      int written = snprintf(journalPayload + length, sizeof(journalPayload) - length, "%s{\"seq\":%lu,\"age\":%s,\"status\":%s}",
+                             included == 0 ? "" : ",", (unsigned long)event.sequence, age, statusPayload(event.alarms));
+      // Keep one byte for the closing bracket, the rest goes in the next batch
+      if (written < 0 || length + written + 1 >= sizeof(journalPayload)) break;
+      length += written;
+    }
+    if (included == 0) return;
+    journalPayload[length++] = ']';
+
+    uint16_t packetId = publish(TopicRouter::OUTBOUND_JOURNAL, 1, journalPayload, length);
+    if (packetId != 0) {
+      journalPacketId = packetId;
+      journalBatchThrough = events[included - 1].sequence;
+      LOG_DEBUG("[MQTT] Published journal batch up to sequence: %lu", (unsigned long)journalBatchThrough);
     }
   }
 
@@ -228,11 +649,8 @@ private:
    * @param packetId
    * @param qos
    */
-  static void onMqttSubscribe(const uint16_t &packetId, const uint8_t &qos) {
-    Serial.print("[MQTT] Subscribe acknowledged. PacketId: ");
-    Serial.print(packetId);
-    Serial.print(". QoS: ");
-    Serial.println(qos);
+  static void onMqttSubscribe(uint16_t packetId, uint8_t qos) {
+    LOG_DEBUG("[MQTT] Subscribe acknowledged. PacketId: %u. QoS: %u", packetId, qos);
   }
 
   /**
@@ -240,78 +658,324 @@ private:
    *
    * @param topic  The topic the message was received on
    * @param payload  The payload of the message
-   * @param properties  The properties of the message
    * @param len  The length of the payload
    * @param index  The index of the message in the payload
    * @param total  The total length of the message
    */
-  void onMqttMessage(char *topic, char *payload, const AsyncMqttClientMessageProperties &properties, const size_t &len,
-                     const size_t &index, const size_t &total) {
-    (void)payload;
-
-    Serial.print("[MQTT] Message arrived in topic: ");
-    Serial.println(topic);
-
-    // Convert the topic and payload to strings
-    String topicString = String(topic);
+  void onMqttMessage(const char *topic, const char *payload, size_t len, size_t index, size_t total) {
+    uint32_t start = hal::cycleCount();
+    if (index == 0) {
+      messageReceivedAt = hal::micros();
+      messageReceivedWall = hal::epochMillis();
+      LOG_DEBUG("[MQTT] Message arrived in topic: %s", topic);
+    }
 
-    // Check if the topic is a topic that should be handled by comparing the topic string with the constants strings
-    if (topicString == TOPIC_PING) {
-      handlePing();
-    } else if (topicString == TOPIC_ALARM_SET) {
-      setAlarmState(payload);
+    // Look the topic up in the namespaces of the device
+    TopicRouter::Match match = topics.match(topic);
+    if (match.route == TopicRouter::Route::PING) {
+      if (index == 0) handlePing(payload, len == total ? len : 0);
+    } else if (match.route == TopicRouter::Route::STATUS_GET) {
+      if (index == 0) requestAlarmState(match.scope);
+#if TELEMETRY_RULES_ENABLED
+    } else if (match.route == TopicRouter::Route::TELEMETRY_AIRFLOW ||
+               match.route == TopicRouter::Route::TELEMETRY_AIR_PRESSURE) {
+      if (index == 0 && len == total && total <= TELEMETRY_MAX_PAYLOAD_SIZE) {
+        onTelemetry(match.route == TopicRouter::Route::TELEMETRY_AIRFLOW ? TelemetryChannel::AIRFLOW
+                                                                          : TelemetryChannel::AIR_PRESSURE,
+                    payload, len);
+      }
+#endif
+    } else if ((match.route == TopicRouter::Route::ALARM_DESIRED || match.route == TopicRouter::Route::ESCALATION) &&
+               total == 0) {
+      // The backend removed its desired state or its policies, the device keeps what it has
+    } else if (match.route == TopicRouter::Route::ALARM_SET || match.route == TopicRouter::Route::ALARM_SET_CBOR ||
+               match.route == TopicRouter::Route::ALARM_DESIRED) {
+      if (index == 0 && match.route == TopicRouter::Route::ALARM_DESIRED) commandStats.desired++;
+      switch (alarmPayload.feed(payload, len, index, total)) {
+        case PayloadAssembler<MQTT_MAX_PAYLOAD_SIZE>::Result::COMPLETE: {
+          uint32_t setStart = hal::cycleCount();
+          setAlarmState(alarmPayload.data(), alarmPayload.length(), match.route == TopicRouter::Route::ALARM_SET_CBOR);
+          metrics.recordAlarmSet(hal::cycleCount() - setStart);
+          break;
+        }
+        case PayloadAssembler<MQTT_MAX_PAYLOAD_SIZE>::Result::REJECTED:
+          if (index == 0) {
+            LOG_WARN("[MQTT] Rejected alarm payload of %lu bytes", (unsigned long)total);
+          }
+          break;
+        case PayloadAssembler<MQTT_MAX_PAYLOAD_SIZE>::Result::INCOMPLETE:
+          break;
+      }
+    } else if (match.route == TopicRouter::Route::ESCALATION) {
+      PayloadAssembler<MQTT_MAX_PAYLOAD_SIZE>::Result result = alarmPayload.feed(payload, len, index, total);
+      if (result == PayloadAssembler<MQTT_MAX_PAYLOAD_SIZE>::Result::COMPLETE) {
+        updateEscalation((const uint8_t *)alarmPayload.data(), alarmPayload.length());
+      } else if (result == PayloadAssembler<MQTT_MAX_PAYLOAD_SIZE>::Result::REJECTED && index == 0) {
+        LOG_WARN("[MQTT] Rejected escalation payload of %lu bytes", (unsigned long)total);
+      }
+    } else if (match.route == TopicRouter::Route::OTA && updateTransport != nullptr) {
+      PayloadAssembler<MQTT_MAX_PAYLOAD_SIZE>::Result result = alarmPayload.feed(payload, len, index, total);
+      if (result == PayloadAssembler<MQTT_MAX_PAYLOAD_SIZE>::Result::COMPLETE) {
+        startUpdate(alarmPayload.data(), alarmPayload.length());
+      } else if (result == PayloadAssembler<MQTT_MAX_PAYLOAD_SIZE>::Result::REJECTED && index == 0) {
+        LOG_WARN("[MQTT] Rejected update payload of %lu bytes", (unsigned long)total);
+      }
     } else {
-      Serial.println("Unknown topic - ignoring message");
+      LOG_WARN("Unknown topic - ignoring message");
     }
+    metrics.recordMessage(hal::cycleCount() - start);
   }
 
   /**
    * Handle the message received on TOPIC_PING.
-   * Send a response.
+   * Send a response, which echoes the sequence number of a traced ping, see CommandTrace.h.
+   *
+   * @param payload The payload of the ping
+   * @param length The length of the payload, 0 if it is empty or does not arrive in one chunk
    */
-  void handlePing() {
-    jsonBuffer.clear();
-    JsonObject root = jsonBuffer.to<JsonObject>();
-    root["message"] = "Pong!";
-    String response;
-    serializeJson(root, response);
+  void handlePing(const char *payload, size_t length) {
+    AlarmUpdate update;
+    char buffer[MQTT_MAX_PAYLOAD_SIZE];
+    if (length > 0 && length <= sizeof(buffer)) {
+      memcpy(buffer, payload, length);
+      if (jsonCodec.decode(buffer, length, update) != nullptr) update.traced = false;
+    }
+
+    size_t pongLength = 0;
+    if (update.traced) {
+      CommandTrace pingTrace = CommandTrace::start(update, messageReceivedAt, messageReceivedWall, hal::micros());
+      pongLength = pingTrace.formatPong(tracePayload, sizeof(tracePayload), hal::micros());
+    }
+    if (pongLength != 0) {
+      publish(TopicRouter::OUTBOUND_PONG, 0, tracePayload, pongLength);
+    } else {
+      publish(TopicRouter::OUTBOUND_PONG, 0, PONG_PAYLOAD, PONG_PAYLOAD_LENGTH);
+    }
+    LOG_DEBUG("[MQTT] Published message to topic: %s", topics.topic(TopicRouter::OUTBOUND_PONG));
+  }
 
-    mqttClient.publish(TOPIC_PONG, 0, false, response.c_str());
-    Serial.println("[MQTT] Published message to topic: " + String(TOPIC_PONG));
+  /**
+   * Handle the message received on TOPIC_ALARM_STATUS_GET.
+   * A request to this device is answered right away. A request to the group or all devices is answered
+   * after a random delay of up to BROADCAST_ANSWER_JITTER, so the answers of the fleet are spread out.
+   *
+   * @param scope The namespace the request was sent to
+   */
+  void requestAlarmState(TopicRouter::Scope scope) {
+    if (scope == TopicRouter::SCOPE_DEVICE) {
+      sendAlarmState(true);
+    } else if (!statusRequested) {
+      statusRequested = true;
+      statusAnswerAt = hal::millis() + hal::random(BROADCAST_ANSWER_JITTER);
+    }
   }
 
   /**
-   * Handle the message received on TOPIC_ALARM_SET.
+   * Handle the message received on TOPIC_ALARM_SET, TOPIC_ALARM_SET_CBOR or TOPIC_ALARM_DESIRED.
    * Turn the alarm on or off based on the payload and send a response with the current alarm state.
    *
-   * The payload should be a JSON object with an "alarmOn" key with a boolean value.
+   * The payload should be a JSON object or a CBOR map with a boolean value for each alarm key that should change,
+   * see AlarmCodec.h. JSON is parsed in place, so the buffer is modified. A command with a sequence number is
+   * traced: the next status echoes the newest traced command it includes, see CommandTrace.h. A command that
+   * also names its source is applied only once, see applyUpdate().
    *
-   * @param payload The payload of the message
-   */
-  void setAlarmState(String payload) {
-    // Parse the payload
-    jsonBuffer.clear();
-    deserializeJson(jsonBuffer, payload);
-
-    // Loop through each alarm key and update alarm type
-    for (const auto &alarmKey : alarmKeys) {
-      if (jsonBuffer.containsKey(alarmKey) && jsonBuffer[alarmKey].is<bool>()) {
-        if (jsonBuffer[alarmKey]) {
-          activeAlarmTypes.insert(alarmKey);
-        } else {
-          activeAlarmTypes.erase(alarmKey);
-        }
-      }
+   * A desired state is a JSON object with every alarm key. It is retained and arrives after every connect, so it
+   * should carry the source and seq of the command it came from: then it is applied only once, and does not undo
+   * a later press of the button.
+   *
+   * @param payload The complete payload of the message
+   * @param length The length of the payload
+   * @param cbor Whether the payload is CBOR rather than JSON
+   */
+  void setAlarmState(char *payload, size_t length, bool cbor) {
+    AlarmUpdate update;
+    const char *error = cbor ? CborAlarmCodec::decode(payload, length, update)
+                             : jsonCodec.decode(payload, length, update);
+    if (error != nullptr) {
+      LOG_WARN("[MQTT] Invalid alarm payload: %s", error);
+      return;
+    }
+
+    applyUpdate(update);
+  }
+
+  /**
+   * Handle a datagram from the local listener: authenticate it and apply it like an alarm/set command,
+   * if it is meant for this device. See LocalCommand.h for the format.
+   *
+   * @param data The datagram
+   * @param length The length of the datagram
+   */
+  void onLocalCommand(const uint8_t *data, size_t length) {
+    uint32_t start = hal::cycleCount();
+    messageReceivedAt = hal::micros();
+    messageReceivedWall = hal::epochMillis();
+
+    AlarmUpdate update;
+    uint32_t target = 0;
+    const char *error = LocalCommand::decode(data, length, update, target);
+    if (error != nullptr) {
+      commandStats.localRejected++;
+      LOG_WARN("[Local] Rejected datagram of %lu bytes: %s", (unsigned long)length, error);
+    } else if (target == 0 || target == hal::chipId()) {
+      commandStats.localCommands++;
+      applyUpdate(update);
+    }
+    metrics.recordAlarmSet(hal::cycleCount() - start);
+  }
+
+  /**
+   * Decode the escalation policies of the group and hand them to the alarm state manager, which stores them.
+   * The retained table arrives after every connect, so a table that is already in use is left alone.
+   *
+   * @param payload The complete CBOR payload of the message
+   * @param length The length of the payload
+   */
+  void updateEscalation(const uint8_t *payload, size_t length) {
+    EscalationTable table;
+    const char *error = EscalationTable::decode(payload, length, table);
+    if (error == nullptr && table == alarmStateManager->getEscalation()) return;
+    if (error == nullptr) error = alarmStateManager->updateEscalation(table);
+    if (error != nullptr) {
+      commandStats.escalationsRejected++;
+      LOG_WARN("[MQTT] Refused escalation policies: %s", error);
+      return;
+    }
+    commandStats.escalations++;
+    LOG_INFO("[MQTT] Escalation policies version %lu in use.", (unsigned long)table.version);
+  }
+
+  /**
+   * Decode a firmware update command and start the update, unless one is running already.
+   *
+   * @param payload The complete JSON payload of the message, parsed in place
+   * @param length The length of the payload
+   */
+  void startUpdate(char *payload, size_t length) {
+    OtaRequest request;
+    const char *error = OtaRequest::decodeJson(payload, length, request);
+    if (error == nullptr) error = otaUpdater.start(request);
+    if (error != nullptr) {
+      commandStats.updatesRejected++;
+      LOG_WARN("[MQTT] Refused firmware update: %s", error);
+      return;
+    }
+    commandStats.updates++;
+    LOG_INFO("[MQTT] Firmware update from %s:%u started.", request.host, (unsigned)request.port);
+  }
+
+  /**
+   * Publish the state of the firmware update, retained, so the backend sees how the last update ended.
+   */
+  void publishOtaStatus() {
+    size_t length = otaUpdater.formatStatus(otaPayload, sizeof(otaPayload));
+    if (length != 0) publish(TopicRouter::OUTBOUND_OTA_STATUS, 1, otaPayload, length, true);
+  }
+
+  /**
+   * Leave RTC memory alone while the updater waits to restart into a committed image, so the state is restored
+   * from what it was when the image was committed.
+   */
+  void holdRtcWrites() {
+    bool restarting = otaUpdater.getState() == OtaUpdater::State::RESTARTING;
+    alarmStateManager->holdSnapshots(restarting);
+    commandWindow.hold(restarting);
+  }
+
+#if TELEMETRY_RULES_ENABLED
+  /**
+   * Evaluate a sensor reading and apply the alarm types the rules raised or cleared with it, right away:
+   * the rules debounce the readings, so they bypass the command limiter. While a command is held back by the
+   * limiter, activeAlarms already holds it, so the rules only join it and process() applies both with its token.
+   *
+   * @param channel The channel of the reading
+   * @param payload The reading as decimal number
+   * @param length The length of the reading
+   */
+  void onTelemetry(TelemetryChannel channel, const char *payload, size_t length) {
+    AlarmMask changed = telemetry.feed(channel, payload, length, hal::millis());
+    if (changed == 0) return;
+
+    AlarmMask detected = telemetry.getDetected();
+    LOG_INFO("[Telemetry] Detected alarms: 0x%02x, changed: 0x%02x", detected, changed);
+    activeAlarms = (AlarmMask)(remoteAlarms | detected);
+    if (!commandPending) applyAlarmState();
+  }
+#endif
+
+  /**
+   * @return The alarm types the telemetry rules detect, none without them
+   */
+  AlarmMask detectedAlarms() const {
+#if TELEMETRY_RULES_ENABLED
+    return telemetry.getDetected();
+#else
+    return 0;
+#endif
+  }
+
+  /**
+   * Apply a decoded command, from MQTT or from the local listener. A command with a source is refused
+   * if its sequence number was seen before, so a command that arrives over both paths is applied once.
+   *
+   * @param update The decoded command
+   */
+  void applyUpdate(const AlarmUpdate &update) {
+    if (update.source != 0 && !commandWindow.accept(update.source, update.seq)) {
+      commandStats.duplicates++;
+      return;
+    }
+
+    commandStats.commands++;
+    remoteAlarms = update.applyTo(remoteAlarms);
+    activeAlarms = (AlarmMask)(remoteAlarms | detectedAlarms());
+    if (update.traced) {
+      trace = CommandTrace::start(update, messageReceivedAt, messageReceivedWall, hal::micros());
+      traceState = TraceState::DECODED;
     }
 
-    // Activate or deactivate the alarm based on the values
-    if (!activeAlarmTypes.empty()) {
-      alarmStateManager->checkAlarmType(activeAlarmTypes);
+    // Over the limit the command waits for process(), later commands are merged into it
+    if (commandPending) {
+      commandStats.coalesced++;
+    } else if (commandLimiter.tryTake(hal::millis())) {
+      applyAlarmState();
+    } else {
+      commandPending = true;
+    }
+  }
+
+  /**
+   * Turn the alarm on or off based on activeAlarms and send a response if the alarm state changed.
+   */
+  void applyAlarmState() {
+    uint32_t claxonStarts = alarmStateManager->getClaxonStarts();
+    bool changed = activeAlarms != alarmStateManager->getActiveAlarms();
+
+    // Activate or deactivate the alarm based on the values, if they differ from the current state
+    if (!changed) {
+      commandStats.unchanged++;
+    } else if (activeAlarms != 0) {
+      alarmStateManager->checkAlarmType(activeAlarms);
     } else {
       alarmStateManager->turnAlarmOff();
     }
+    alarmStateManager->setRemoteAlarms(remoteAlarms);
+
+    if (traceState != TraceState::DECODED) {
+      sendAlarmState(false);
+      return;
+    }
 
-    sendAlarmState();
+    // A traced command is always answered. If it sounds the claxon, the answer waits for the first edge.
+    trace.appliedAt = hal::micros();
+    if (changed && activeAlarms != 0) {
+      traceState = TraceState::AWAITING_ACTUATION;
+      traceClaxonStarts = claxonStarts;
+      traceDeadline = hal::millis() + TRACE_ACTUATION_TIMEOUT;
+    } else {
+      traceState = TraceState::APPLIED;
+      sendAlarmState(true);
+    }
   }
 
   /**
@@ -319,23 +983,92 @@ private:
    *
    * The message will be sent to TOPIC_ALARM_STATUS and will be a JSON object with the following keys:
    * - alarmOn: boolean indicating if the alarm is on
+   * - testAlarmOn: boolean indicating if the test alarm is on
    * - airflowAlarmOn: boolean indicating if the airflow alarm is on
    * - airPressureAlarmOn: boolean indicating if the air pressure alarm is on
-   * - testAlarmOn: boolean indicating if the test alarm is on
+   *
+   * The same state is sent as CBOR to TOPIC_ALARM_STATUS_CBOR. Either format can be switched off
+   * with PUBLISH_JSON_STATUS and PUBLISH_CBOR_STATUS once no subscriber needs it anymore.
+   * Both are retained, so a new subscriber gets the current state right away.
+   * The payloads are precomputed for every alarm state, see StatusPayloads.h.
+   *
+   * Unless requested, nothing is sent when the subscribers already have this state from the last status.
+   * The status after a traced command is formatted with its trace, see CommandTrace.h.
+   *
+   * @param requested Whether the status was asked for on TOPIC_ALARM_STATUS_GET
+   */
+  void sendAlarmState(bool requested) {
+    AlarmMask alarms = alarmStateManager->getActiveAlarms();
+    if (!requested && statusKnown && alarms == publishedAlarms) {
+      commandStats.statusSuppressed++;
+      return;
+    }
+
+    bool traced = traceState == TraceState::APPLIED;
+    if (traced) traceState = TraceState::NONE;
+
+    bool sent = false;
+    if (PUBLISH_JSON_STATUS) {
+      size_t length = traced ? trace.formatJson(tracePayload, sizeof(tracePayload), alarms) : 0;
+      if (length != 0) {
+        sent |= publish(TopicRouter::OUTBOUND_STATUS, 2, tracePayload, length, true) != 0;
+      } else {
+        sent |= publish(TopicRouter::OUTBOUND_STATUS, 2, statusPayload(alarms), statusPayloadLength(alarms), true) != 0;
+      }
+      LOG_DEBUG("[MQTT] Published message to topic: %s", topics.topic(TopicRouter::OUTBOUND_STATUS));
+    }
+    if (PUBLISH_CBOR_STATUS) {
+      size_t length = traced ? trace.formatCbor((uint8_t *)tracePayload, sizeof(tracePayload), alarms) : 0;
+      if (length != 0) {
+        sent |= publish(TopicRouter::OUTBOUND_STATUS_CBOR, 2, tracePayload, length, true) != 0;
+      } else {
+        sent |= publish(TopicRouter::OUTBOUND_STATUS_CBOR, 2, cborStatusPayload(alarms), CBOR_STATUS_PAYLOAD_LENGTH,
+                        true) != 0;
+      }
+      LOG_DEBUG("[MQTT] Published message to topic: %s", topics.topic(TopicRouter::OUTBOUND_STATUS_CBOR));
+    }
+
+    // A status that could not be handed to the client is journaled and delivered after reconnecting
+    if (sent) {
+      publishedAlarms = alarms;
+      statusKnown = true;
+      commandStats.statusPublished++;
+    } else {
+      journal.append(alarms, hal::millis());
+    }
+  }
+
+  /**
+   * Publish a message to one of the topics of the device, counting the messages the client does not accept.
+   *
+   * @param retain Whether the broker keeps the message for later subscribers
+   * @return The packet ID of the message, 1 for QoS 0, or 0 if it was not accepted
+   */
+  uint16_t publish(TopicRouter::Outbound topic, uint8_t qos, const char *payload, size_t length, bool retain = false) {
+    uint16_t packetId = mqttClient->publish(topics.topic(topic), qos, retain, payload, length);
+    if (packetId == 0) metrics.recordPublishFailure();
+    return packetId;
+  }
+
+#if METRICS_ENABLED
+  /**
+   * Publish the metrics to TOPIC_METRICS once every METRICS_INTERVAL, see Metrics.h.
+   * A period in which the broker is unreachable is not published, its counters go into the next one.
+   *
+   * @param now The current time in milliseconds
+   * @return The time in milliseconds until the next publish
    */
-  void sendAlarmState() {
-    jsonBuffer.clear();
-    JsonObject root = jsonBuffer.to<JsonObject>();
-    root[KEY_ALARM_ON] = alarmStateManager->isAlarmOn();
-    root[KEY_AIRFLOW_ALARM_ON] = alarmStateManager->isAlarmOn(KEY_AIRFLOW_ALARM_ON);
-    root[KEY_AIR_PRESSURE_ALARM_ON] = alarmStateManager->isAlarmOn(KEY_AIR_PRESSURE_ALARM_ON);
-    root[KEY_TEST_ALARM_ON] = alarmStateManager->isAlarmOn(KEY_TEST_ALARM_ON);
-    String response;
-    serializeJsonPretty(root, response);
+  uint32_t publishMetrics(uint32_t now) {
+    uint32_t elapsed = now - metricsPeriodStart;
+    if (elapsed < METRICS_INTERVAL) return METRICS_INTERVAL - elapsed;
+    metricsPeriodStart = now;
+    if (!mqttClient->connected()) return METRICS_INTERVAL;
 
-    mqttClient.publish(TOPIC_ALARM_STATUS, 2, false, response.c_str());
-    Serial.println("[MQTT] Published message to topic: " + String(TOPIC_ALARM_STATUS));
+    size_t length = metrics.publish(metricsPayload, sizeof(metricsPayload), connectionSupervisor.getReconnects());
+    if (length != 0) publish(TopicRouter::OUTBOUND_METRICS, 0, metricsPayload, length);
+    return METRICS_INTERVAL;
   }
+#endif
 };
 
 #endif  // INTERNET_MANAGER_H
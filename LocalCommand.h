@@ -0,0 +1,121 @@
+/**
+ * Datagram format of local commands, which reach the device over UDP from sensors on the same LAN.
+ *
+ * A local command has the same meaning as a command on TOPIC_ALARM_SET_CBOR, but does not depend on the broker,
+ * so alarms from the same room keep working while the internet uplink is slow or down. It is authenticated with
+ * LOCAL_COMMAND_KEY, which the sensors and the devices share:
+ *
+ *   offset  size  field
+ *   0       1     version, LocalCommand::VERSION
+ *   1       4     sender ID, not 0
+ *   5       4     target: the chip ID of the device, or 0 for every device that receives the datagram
+ *   9       4     sequence number, increasing per sender
+ *   13      n     CBOR alarm/set map, see AlarmCodec.h
+ *   13 + n  8     SipHash-2-4 of all bytes before it
+ *
+ * Numbers are big-endian, like in CBOR. The sender and the sequence number become the source and seq of the
+ * command, so the sequence window refuses replays and copies that also arrive over MQTT, see SequenceWindow.h.
+ */
+
+#ifndef LOCAL_COMMAND_H
+#define LOCAL_COMMAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "Constants.h"
+#include "AlarmCodec.h"
+#include "SipHash.h"
+
+static_assert(sizeof(LOCAL_COMMAND_KEY) - 1 == SIP_HASH_KEY_SIZE, "LOCAL_COMMAND_KEY must be 16 characters");
+
+class LocalCommand {
+public:
+  static constexpr uint8_t VERSION = 1;
+  static constexpr size_t HEADER_SIZE = 13;
+  static constexpr size_t MAC_SIZE = 8;
+
+  /**
+   * @return The key local commands are authenticated with
+   */
+  static const uint8_t *key() {
+    return (const uint8_t *)LOCAL_COMMAND_KEY;
+  }
+
+  /**
+   * Encode a command, as a sensor does.
+   *
+   * @param buffer Receives the datagram
+   * @param size The size of the buffer
+   * @param sender The ID of the sender, not 0
+   * @param target The chip ID of the device, 0 for every device
+   * @param sequence The sequence number, higher than the last one of the sender
+   * @param command The CBOR alarm/set map
+   * @param commandLength The length of the map
+   * @return The length of the datagram, 0 if it does not fit
+   */
+  static size_t encode(uint8_t *buffer, size_t size, uint32_t sender, uint32_t target, uint32_t sequence,
+                       const uint8_t *command, size_t commandLength) {
+    size_t length = HEADER_SIZE + commandLength + MAC_SIZE;
+    if (length > size || length > LOCAL_COMMAND_MAX_SIZE) return 0;
+
+    buffer[0] = VERSION;
+    writeNumber(buffer + 1, sender);
+    writeNumber(buffer + 5, target);
+    writeNumber(buffer + 9, sequence);
+    memcpy(buffer + HEADER_SIZE, command, commandLength);
+
+    uint64_t mac = sipHash(key(), buffer, HEADER_SIZE + commandLength);
+    for (uint8_t i = 0; i < MAC_SIZE; i++) {
+      buffer[HEADER_SIZE + commandLength + i] = (uint8_t)(mac >> (8 * (MAC_SIZE - 1 - i)));
+    }
+    return length;
+  }
+
+  /**
+   * Authenticate and decode a datagram. Nothing in it is looked at before the MAC has been checked.
+   *
+   * @param datagram The datagram
+   * @param length The length of the datagram
+   * @param update Receives the command, with the sender as source and the sequence number as seq
+   * @param target Receives the chip ID the command is for, 0 for every device
+   * @return nullptr on success, else a description of the error
+   */
+  static const char *decode(const uint8_t *datagram, size_t length, AlarmUpdate &update, uint32_t &target) {
+    if (length < HEADER_SIZE + 1 + MAC_SIZE) return "TooShort";
+    if (length > LOCAL_COMMAND_MAX_SIZE) return "TooLong";
+
+    size_t signedLength = length - MAC_SIZE;
+    uint64_t mac = sipHash(key(), datagram, signedLength);
+    uint8_t difference = 0;
+    for (uint8_t i = 0; i < MAC_SIZE; i++) {
+      difference |= (uint8_t)(datagram[signedLength + i] ^ (uint8_t)(mac >> (8 * (MAC_SIZE - 1 - i))));
+    }
+    if (difference != 0) return "BadMac";
+    if (datagram[0] != VERSION) return "UnknownVersion";
+
+    uint32_t sender = readNumber(datagram + 1);
+    if (sender == 0) return "NoSender";
+
+    AlarmUpdate decoded;
+    const char *error = CborAlarmCodec::decode((const char *)datagram + HEADER_SIZE, signedLength - HEADER_SIZE, decoded);
+    if (error != nullptr) return error;
+
+    decoded.source = sender;
+    decoded.seq = readNumber(datagram + 9);
+    target = readNumber(datagram + 5);
+    update = decoded;
+    return nullptr;
+  }
+
+private:
+  static void writeNumber(uint8_t *bytes, uint32_t value) {
+    for (uint8_t i = 0; i < 4; i++) bytes[i] = (uint8_t)(value >> (24 - 8 * i));
+  }
+
+  static uint32_t readNumber(const uint8_t *bytes) {
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+  }
+};
+
+#endif  // LOCAL_COMMAND_H
@@ -0,0 +1,184 @@
+/**
+ * Levelled logging into a ring buffer that is drained to Serial while the main loop idles.
+ *
+ * LOG_ERROR, LOG_WARN, LOG_INFO and LOG_DEBUG format printf-style into a fixed line buffer and append the
+ * line to the ring, so logging never waits for the UART and never allocates. The level is fixed at compile
+ * time with LOG_LEVEL: calls below it compile to nothing, arguments included. Every call site is rate limited
+ * on its own, and its next line tells how many lines it suppressed. When the ring is full, whole lines are
+ * dropped and counted.
+ *
+ * Only log from the main loop and the network callbacks, never from an interrupt.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "hal/Hal.h"
+#include "Constants.h"
+#include "TokenBucket.h"
+
+class Logger {
+public:
+  /**
+   * The rate limit of one call site, see LOG_SITE_BURST and LOG_SITE_INTERVAL.
+   */
+  struct Site {
+    TokenBucket limiter{LOG_SITE_BURST, LOG_SITE_INTERVAL};
+
+    /**
+     * The lines suppressed since the last line of the site.
+     */
+    uint16_t suppressed = 0;
+  };
+
+  /**
+   * Format a line and append it to the ring. Use the LOG_ macros rather than calling this.
+   *
+   * @param site The call site
+   * @param level The letter of the level: E, W, I or D
+   * @param format The printf-style format, in flash on the device
+   */
+  void write(Site &site, char level, const char *format, ...) __attribute__((format(printf, 4, 5))) {
+    uint32_t now = hal::millis();
+    if (!site.limiter.tryTake(now)) {
+      if (site.suppressed < UINT16_MAX) site.suppressed++;
+      return;
+    }
+
+    if (dropped != 0) {
+      char note[40];
+      int length = snprintf(note, sizeof(note), "[%lu] W %lu log lines dropped\r\n", (unsigned long)now,
+                            (unsigned long)dropped);
+      if (append(note, (size_t)length)) dropped = 0;
+    }
+
+    // Leave room for the line ending
+    char line[LOG_LINE_SIZE];
+    constexpr size_t TEXT_SIZE = sizeof(line) - 2;
+    size_t length = clamp(snprintf(line, TEXT_SIZE, "[%lu] %c ", (unsigned long)now, level), TEXT_SIZE);
+
+    va_list args;
+    va_start(args, format);
+    length += clamp(vsnprintf_P(line + length, TEXT_SIZE - length, format, args), TEXT_SIZE - length);
+    va_end(args);
+
+    if (site.suppressed != 0) {
+      length += clamp(snprintf(line + length, TEXT_SIZE - length, " (%u suppressed)", site.suppressed),
+                      TEXT_SIZE - length);
+      site.suppressed = 0;
+    }
+    line[length++] = '\r';
+    line[length++] = '\n';
+
+    if (!append(line, length)) dropped++;
+  }
+
+  /**
+   * Write as much of the ring to Serial as the UART takes without waiting.
+   *
+   * @return true if lines are still waiting
+   */
+  bool drain() {
+    size_t writable = hal::serialWritable();
+    while (used > 0 && writable > 0) {
+      size_t chunk = LOG_BUFFER_SIZE - tail;
+      if (chunk > used) chunk = used;
+      if (chunk > writable) chunk = writable;
+      hal::serialWrite(buffer + tail, chunk);
+      tail = (tail + chunk) % LOG_BUFFER_SIZE;
+      used -= chunk;
+      writable -= chunk;
+    }
+    return used > 0;
+  }
+
+  /**
+   * @return The amount of lines dropped because the ring was full, since the last note about it
+   */
+  uint32_t getDropped() const {
+    return dropped;
+  }
+
+private:
+  char buffer[LOG_BUFFER_SIZE];
+
+  /**
+   * The index of the oldest byte and the amount of bytes waiting.
+   */
+  size_t tail = 0;
+  size_t used = 0;
+
+  uint32_t dropped = 0;
+
+  /**
+   * @return The length snprintf wrote, given the length it wanted to write and the space it had
+   */
+  static size_t clamp(int length, size_t size) {
+    if (length < 0 || size == 0) return 0;
+    return (size_t)length < size ? (size_t)length : size - 1;
+  }
+
+  /**
+   * Append a whole line, or nothing if it does not fit.
+   */
+  bool append(const char *line, size_t length) {
+    if (length > LOG_BUFFER_SIZE - used) return false;
+    size_t head = (tail + used) % LOG_BUFFER_SIZE;
+    for (size_t i = 0; i < length; i++) {
+      buffer[(head + i) % LOG_BUFFER_SIZE] = line[i];
+    }
+    used += length;
+    return true;
+  }
+};
+
+inline Logger logger;
+
+/**
+ * Takes the place of a call below LOG_LEVEL, so its format is still checked while no code is generated.
+ */
+inline void logDiscarded(const char *format, ...) __attribute__((format(printf, 1, 2)));
+inline void logDiscarded(const char *format, ...) {
+  (void)format;
+}
+
+#define LOG_OFF(format, ...)                                          \
+  do {                                                                \
+    if (false) logDiscarded(format, ##__VA_ARGS__);                   \
+  } while (0)
+
+#define LOG_AT(level, format, ...)                                    \
+  do {                                                                \
+    static Logger::Site logSite;                                      \
+    logger.write(logSite, level, PSTR(format), ##__VA_ARGS__);        \
+  } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(format, ...) LOG_AT('E', format, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(format, ...) LOG_OFF(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(format, ...) LOG_AT('W', format, ##__VA_ARGS__)
+#else
+#define LOG_WARN(format, ...) LOG_OFF(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...) LOG_AT('I', format, ##__VA_ARGS__)
+#else
+#define LOG_INFO(format, ...) LOG_OFF(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...) LOG_AT('D', format, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(format, ...) LOG_OFF(format, ##__VA_ARGS__)
+#endif
+
+#endif  // LOG_H
@@ -0,0 +1,182 @@
+/**
+ * Runtime metrics of the device, aggregated in fixed memory and published periodically by the internet manager.
+ *
+ * The loop time, the handler times and the claxon edge jitter are recorded where they happen, at the cost of
+ * a few counter updates each. The timings of a period are reset after every publish, the counters keep counting.
+ * Building with METRICS_ENABLED set to 0 replaces the class with an empty one, so nothing is recorded or stored.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "hal/Hal.h"
+#include "Constants.h"
+
+/**
+ * Histogram with power-of-two buckets: bucket 0 counts 0, bucket b counts [2^(b-1), 2^b).
+ * The last bucket also counts everything above it.
+ */
+template<uint8_t BUCKETS>
+class LogHistogram {
+public:
+  void record(uint32_t value) {
+    uint8_t bucket = value == 0 ? 0 : (uint8_t)(32 - __builtin_clz(value));
+    if (bucket >= BUCKETS) bucket = BUCKETS - 1;
+    counts[bucket]++;
+  }
+
+  void reset() {
+    for (uint32_t &count : counts) count = 0;
+  }
+
+  /**
+   * Format the counts as a JSON array, without the empty buckets at the end.
+   *
+   * @return The amount of characters written, or the amount needed if the buffer is too small
+   */
+  int format(char *buffer, size_t size) const {
+    uint8_t used = BUCKETS;
+    while (used > 1 && counts[used - 1] == 0) used--;
+
+    int length = snprintf(buffer, size, "[");
+    for (uint8_t bucket = 0; bucket < used; bucket++) {
+      size_t offset = (size_t)length < size ? (size_t)length : size;
+      length += snprintf(buffer + offset, size - offset, bucket == 0 ? "%lu" : ",%lu", (unsigned long)counts[bucket]);
+    }
+    size_t offset = (size_t)length < size ? (size_t)length : size;
+    return length + snprintf(buffer + offset, size - offset, "]");
+  }
+
+private:
+  uint32_t counts[BUCKETS] = {};
+};
+
+#if METRICS_ENABLED
+
+class Metrics {
+public:
+  /**
+   * Record the time one loop iteration spent running tasks, without the idle time.
+   *
+   * @param cycles The run time in CPU cycles
+   */
+  void recordLoop(uint32_t cycles) {
+    uint32_t start = hal::cycleCount();
+    loopMicros.record(cycles / hal::CYCLES_PER_MICROSECOND);
+    uint32_t cost = hal::cycleCount() - start;
+    if (cost > recordCycles) recordCycles = cost;
+  }
+
+  /**
+   * Record the time spent handling one chunk of an incoming message.
+   */
+  void recordMessage(uint32_t cycles) {
+    if (cycles > maxMessageCycles) maxMessageCycles = cycles;
+  }
+
+  /**
+   * Record the time spent decoding and applying an alarm/set command.
+   */
+  void recordAlarmSet(uint32_t cycles) {
+    if (cycles > maxAlarmSetCycles) maxAlarmSetCycles = cycles;
+  }
+
+  /**
+   * Count a message the MQTT client did not accept.
+   */
+  void recordPublishFailure() {
+    publishFailures++;
+  }
+
+  /**
+   * Record how far a claxon edge was from its intended time. Called from the timer interrupt.
+   *
+   * @param errorMicros The actual minus the intended time since the previous edge in microseconds
+   */
+  void IRAM_ATTR recordClaxonEdge(int32_t errorMicros) {
+    uint32_t jitter = (uint32_t)(errorMicros < 0 ? -errorMicros : errorMicros);
+    if (jitter > maxJitterMicros) maxJitterMicros = jitter;
+    totalJitterMicros = totalJitterMicros + jitter;
+    claxonEdges = claxonEdges + 1;
+  }
+
+  /**
+   * Format the metrics of the period as one compact JSON object and start a new period.
+   *
+   * Keys: up (uptime in s), loop (loop time histogram in us, see LogHistogram), msgMax and setMax (longest
+   * message and alarm/set handling in us), heap, block (largest free block) and frag (heap fragmentation in %),
+   * reconnects, pubFail, edges, jitterMax and jitterMean (claxon edge jitter in us), cost (cycles per loop record).
+   *
+   * @param buffer Receives the payload
+   * @param size The size of the buffer
+   * @param reconnects The amount of times the broker connection was recovered
+   * @return The length of the payload, 0 if it did not fit
+   */
+  size_t publish(char *buffer, size_t size, uint32_t reconnects) {
+    hal::disableInterrupts();
+    uint32_t edges = claxonEdges;
+    uint32_t jitterMax = maxJitterMicros;
+    uint32_t jitterTotal = totalJitterMicros;
+    claxonEdges = 0;
+    maxJitterMicros = 0;
+    totalJitterMicros = 0;
+    hal::enableInterrupts();
+
+    char histogram[METRICS_HISTOGRAM_BUCKETS * 11 + 3];
+    loopMicros.format(histogram, sizeof(histogram));
+    int length = snprintf(buffer, size,
+                          "{\"up\":%lu,\"loop\":%s,\"msgMax\":%lu,\"setMax\":%lu,\"heap\":%lu,\"block\":%lu,"
+                          "\"frag\":%u,\"reconnects\":%lu,\"pubFail\":%lu,\"edges\":%lu,\"jitterMax\":%lu,"
+                          "\"jitterMean\":%lu,\"cost\":%lu}",
+                          (unsigned long)(hal::millis() / 1000), histogram,
+                          (unsigned long)(maxMessageCycles / hal::CYCLES_PER_MICROSECOND),
+                          (unsigned long)(maxAlarmSetCycles / hal::CYCLES_PER_MICROSECOND),
+                          (unsigned long)hal::freeHeap(), (unsigned long)hal::largestFreeBlock(),
+                          (unsigned)hal::heapFragmentation(), (unsigned long)reconnects,
+                          (unsigned long)publishFailures, (unsigned long)edges, (unsigned long)jitterMax,
+                          (unsigned long)(edges == 0 ? 0 : jitterTotal / edges), (unsigned long)recordCycles);
+
+    loopMicros.reset();
+    maxMessageCycles = 0;
+    maxAlarmSetCycles = 0;
+    return length < 0 || (size_t)length >= size ? 0 : (size_t)length;
+  }
+
+private:
+  LogHistogram<METRICS_HISTOGRAM_BUCKETS> loopMicros;
+  uint32_t maxMessageCycles = 0;
+  uint32_t maxAlarmSetCycles = 0;
+  uint32_t publishFailures = 0;
+
+  /**
+   * The longest time recordLoop() took, the fixed cost of the metrics per loop iteration.
+   */
+  uint32_t recordCycles = 0;
+
+  volatile uint32_t claxonEdges = 0;
+  volatile uint32_t maxJitterMicros = 0;
+  volatile uint32_t totalJitterMicros = 0;
+};
+
+#else
+
+class Metrics {
+public:
+  void recordLoop(uint32_t) {}
+  void recordMessage(uint32_t) {}
+  void recordAlarmSet(uint32_t) {}
+  void recordPublishFailure() {}
+  void IRAM_ATTR recordClaxonEdge(int32_t) {}
+};
+
+#endif
+
+/**
+ * The metrics of the device.
+ */
+inline Metrics metrics;
+
+#endif  // METRICS_H
@@ -0,0 +1,459 @@
+/**
+ * Firmware updates over the air, from an HTTP server on the LAN, started by a command on TOPIC_OTA:
+ *
+ *   {"server": "http://192.168.1.10:8080", "delta": "/alarm-1.3.0-from-1.2.0.msd", "deltaSize": 31234,
+ *    "full": "/alarm-1.3.0.bin", "fullSize": 412345, "sha256": "<hash of the new image in hex>"}
+ *
+ * The delta against the running image is downloaded and patched into the spare flash slot as it arrives, see
+ * DeltaPatch.h. The full image is the fallback: it is used when the delta is left out, was made against another
+ * image, or does not give an image with the expected hash. Either can be left out, not both.
+ *
+ * A download that is interrupted continues with a ranged request from the byte it stopped at, after a backoff like
+ * the broker connection. The image is only committed when its SHA-256 matches, then the device restarts into it.
+ * The alarm state survives the restart in RTC memory, see AlarmSnapshot.h. It is kept clear of the first 32 blocks,
+ * where the image is committed as a command to the boot loader, and is not written while waiting for the restart.
+ *
+ * The progress is reported as retained JSON on TOPIC_OTA_STATUS, see formatStatus().
+ */
+
+#ifndef OTA_UPDATER_H
+#define OTA_UPDATER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <ArduinoJson.h>
+
+#include "hal/Hal.h"
+#include "hal/HttpTransport.h"
+#include "Constants.h"
+#include "DeltaPatch.h"
+#include "Log.h"
+
+/**
+ * A decoded update command.
+ */
+struct OtaRequest {
+  char host[OTA_HOST_SIZE];
+  uint16_t port;
+
+  /**
+   * The paths of the delta and the full image on the server, empty if left out, and their sizes.
+   */
+  char deltaPath[OTA_PATH_SIZE];
+  uint32_t deltaSize;
+  char fullPath[OTA_PATH_SIZE];
+  uint32_t fullSize;
+
+  /**
+   * The SHA-256 of the new image.
+   */
+  uint8_t sha256[SHA256_SIZE];
+
+  /**
+   * Decode a JSON command, see the description at the top. The payload is parsed in place.
+   *
+   * @param payload The complete payload
+   * @param length The length of the payload
+   * @param request Receives the command
+   * @return nullptr on success, else a description of the error
+   */
+  static const char *decodeJson(char *payload, size_t length, OtaRequest &request) {
+    StaticJsonDocument<OTA_JSON_DOCUMENT_SIZE> document;
+    DeserializationError error = deserializeJson(document, payload, length);
+    if (error) return error.c_str();
+
+    OtaRequest decoded = {};
+    const char *server = document[KEY_SERVER].as<const char *>();
+    if (server == nullptr || !parseServer(server, decoded)) return "InvalidServer";
+
+    const char *delta = document[KEY_DELTA].as<const char *>();
+    const char *full = document[KEY_FULL].as<const char *>();
+    if (delta == nullptr && full == nullptr) return "NoImage";
+    if (delta != nullptr && !copyPath(delta, document[KEY_DELTA_SIZE].as<uint32_t>(), decoded.deltaPath,
+                                      decoded.deltaSize)) {
+      return "InvalidDelta";
+    }
+    if (full != nullptr && !copyPath(full, document[KEY_FULL_SIZE].as<uint32_t>(), decoded.fullPath,
+                                     decoded.fullSize)) {
+      return "InvalidFull";
+    }
+
+    const char *hash = document[KEY_SHA256].as<const char *>();
+    if (hash == nullptr || strlen(hash) != 2 * SHA256_SIZE) return "InvalidHash";
+    for (uint8_t i = 0; i < SHA256_SIZE; i++) {
+      int high = hexDigit(hash[2 * i]);
+      int low = hexDigit(hash[2 * i + 1]);
+      if (high < 0 || low < 0) return "InvalidHash";
+      decoded.sha256[i] = (uint8_t)(high << 4 | low);
+    }
+    request = decoded;
+    return nullptr;
+  }
+
+private:
+  /**
+   * Split http://host[:port] into the host and the port.
+   */
+  static bool parseServer(const char *server, OtaRequest &request) {
+    static constexpr char SCHEME[] = "http://";
+    if (strncmp(server, SCHEME, sizeof(SCHEME) - 1) != 0) return false;
+    const char *host = server + sizeof(SCHEME) - 1;
+    const char *colon = strchr(host, ':');
+    size_t hostLength = colon != nullptr ? (size_t)(colon - host) : strlen(host);
+    if (hostLength == 0 || hostLength >= sizeof(request.host) || memchr(host, '/', hostLength) != nullptr) return false;
+    memcpy(request.host, host, hostLength);
+    request.host[hostLength] = '\0';
+
+    request.port = 80;
+    if (colon != nullptr) {
+      char *end;
+      unsigned long port = strtoul(colon + 1, &end, 10);
+      if (*end != '\0' || port == 0 || port > UINT16_MAX) return false;
+      request.port = (uint16_t)port;
+    }
+    return true;
+  }
+
+  static bool copyPath(const char *path, uint32_t size, char (&buffer)[OTA_PATH_SIZE], uint32_t &bufferSize) {
+    size_t length = strlen(path);
+    if (path[0] != '/' || length >= OTA_PATH_SIZE || size == 0) return false;
+    memcpy(buffer, path, length + 1);
+    bufferSize = size;
+    return true;
+  }
+
+  static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+};
+
+class OtaUpdater {
+public:
+  enum class State : uint8_t {
+    /** No update running. */
+    IDLE,
+    /** Downloading and patching. */
+    DOWNLOADING,
+    /** The download was interrupted, waiting for the next attempt. */
+    WAITING,
+    /** The image was verified and committed, waiting to restart into it. */
+    RESTARTING,
+    /** The update was given up, see getError(). */
+    FAILED
+  };
+
+  /**
+   * Counters of all updates since boot.
+   */
+  struct Stats {
+    /**
+     * The updates started and the ones that ended with a verified image.
+     */
+    uint32_t started = 0;
+    uint32_t verified = 0;
+
+    /**
+     * The requests made, the ones that continued an interrupted download, and the updates that fell back to the
+     * full image.
+     */
+    uint32_t requests = 0;
+    uint32_t resumes = 0;
+    uint32_t fallbacks = 0;
+
+    /**
+     * The bytes of deltas and images received, including the ones of downloads that were given up.
+     */
+    uint32_t bytesReceived = 0;
+
+    /**
+     * The time from the command to the verified image of the last update in milliseconds, and the CPU time
+     * its patching took in cycles, see hal::cycleCount().
+     */
+    uint32_t lastDuration = 0;
+    uint64_t lastPatchCycles = 0;
+  };
+
+  /**
+   * Register with the transport the updates are downloaded with.
+   */
+  void begin(HttpTransport *transport) {
+    this->transport = transport;
+    transport->onBody([this](const uint8_t *data, size_t length) {
+      onBody(data, length);
+    });
+    transport->onEnd([this](HttpTransport::End end) {
+      onEnd(end);
+    });
+  }
+
+  /**
+   * Set the function to call when the state changes or the download made progress, e.g. to publish the status.
+   */
+  void onChange(std::function<void()> callback) {
+    changeCallback = std::move(callback);
+  }
+
+  /**
+   * Start an update. The download starts at the next process().
+   *
+   * @return nullptr if the update was started, else a description of the error
+   */
+  const char *start(const OtaRequest &request) {
+    if (transport == nullptr) return "NoTransport";
+    if (state == State::DOWNLOADING || state == State::WAITING || state == State::RESTARTING) return "Busy";
+
+    this->request = request;
+    stats.started++;
+    startedAt = hal::millis();
+    patchCycles = 0;
+    error = nullptr;
+    startImage(request.deltaPath[0] != '\0' ? DeltaPatcher::Format::DELTA : DeltaPatcher::Format::FULL);
+    return nullptr;
+  }
+
+  /**
+   * Drive the update: start and continue downloads, detect stalled ones and restart into a verified image.
+   *
+   * @param now The current time in milliseconds
+   * @return The time in milliseconds until this needs to run again
+   */
+  uint32_t process(uint32_t now) {
+    switch (state) {
+      case State::IDLE:
+      case State::FAILED:
+        return UINT32_MAX;
+
+      case State::DOWNLOADING:
+        // A connection that stays silent is given up, and continued like one that was lost
+        if (now - lastDataAt >= OTA_RECEIVE_TIMEOUT) {
+          LOG_WARN("[OTA] No data for %lu ms", (unsigned long)(now - lastDataAt));
+          transport->abort();
+          return 0;
+        }
+        return OTA_RECEIVE_TIMEOUT - (now - lastDataAt);
+
+      case State::WAITING:
+        if ((int32_t)(now - nextAttemptAt) < 0) return nextAttemptAt - now;
+        requestDownload();
+        return 0;
+
+      case State::RESTARTING:
+        if ((int32_t)(now - nextAttemptAt) < 0) return nextAttemptAt - now;
+        LOG_INFO("[OTA] Restarting into the new image.");
+        state = State::IDLE;
+        hal::restart();
+        return UINT32_MAX;
+    }
+    return UINT32_MAX;
+  }
+
+  State getState() const {
+    return state;
+  }
+
+  /**
+   * @return Why the last update failed, nullptr if it did not
+   */
+  const char *getError() const {
+    return error;
+  }
+
+  const Stats &getStats() const {
+    return stats;
+  }
+
+  /**
+   * Format the status of the update as JSON, e.g.
+   * {"state":"downloading","format":"delta","received":12040,"size":31234,"requests":2,"error":null}
+   *
+   * @return The length of the status, 0 if it does not fit
+   */
+  size_t formatStatus(char *buffer, size_t size) const {
+    static constexpr const char *STATES[] = {"idle", "downloading", "waiting", "restarting", "failed"};
+    char reason[40] = "null";
+    if (error != nullptr) snprintf(reason, sizeof(reason), "\"%s\"", error);
+    int length = snprintf(buffer, size,
+                          "{\"state\":\"%s\",\"format\":\"%s\",\"received\":%lu,\"size\":%lu,\"requests\":%lu,\"error\":%s}",
+                          STATES[(uint8_t)state], format == DeltaPatcher::Format::DELTA ? KEY_DELTA : KEY_FULL,
+                          (unsigned long)received, (unsigned long)downloadSize(), (unsigned long)requests, reason);
+    return length < 0 || (size_t)length >= size ? 0 : (size_t)length;
+  }
+
+private:
+  HttpTransport *transport = nullptr;
+  DeltaPatcher patcher;
+  OtaRequest request = {};
+  std::function<void()> changeCallback;
+  State state = State::IDLE;
+  const char *error = nullptr;
+  Stats stats;
+
+  /**
+   * What is being downloaded, the bytes of it received and the requests made for it.
+   */
+  DeltaPatcher::Format format = DeltaPatcher::Format::DELTA;
+  uint32_t received = 0;
+  uint32_t requests = 0;
+
+  /**
+   * Failed requests in a row, for the backoff.
+   */
+  uint8_t attempts = 0;
+
+  /**
+   * When the update started, when the last data arrived, and when to make the next request or to restart.
+   */
+  uint32_t startedAt = 0;
+  uint32_t lastDataAt = 0;
+  uint32_t nextAttemptAt = 0;
+
+  uint64_t patchCycles = 0;
+
+  uint32_t downloadSize() const {
+    return format == DeltaPatcher::Format::DELTA ? request.deltaSize : request.fullSize;
+  }
+
+  const char *downloadPath() const {
+    return format == DeltaPatcher::Format::DELTA ? request.deltaPath : request.fullPath;
+  }
+
+  void changed() {
+    if (changeCallback) changeCallback();
+  }
+
+  /**
+   * Start writing the image from the delta or the full image. The first request goes out from process().
+   */
+  void startImage(DeltaPatcher::Format format) {
+    this->format = format;
+    received = 0;
+    requests = 0;
+    attempts = 0;
+    error = patcher.begin(format, request.fullSize);
+    if (error != nullptr) {
+      fallBack();
+      return;
+    }
+    state = State::WAITING;
+    nextAttemptAt = hal::millis();
+    changed();
+  }
+
+  /**
+   * Request the rest of the download.
+   */
+  void requestDownload() {
+    requests++;
+    stats.requests++;
+    if (received > 0) stats.resumes++;
+    lastDataAt = hal::millis();
+    state = State::DOWNLOADING;
+    LOG_INFO("[OTA] Requesting %s from byte %lu", downloadPath(), (unsigned long)received);
+    if (!transport->get(request.host, request.port, downloadPath(), received)) retry();
+  }
+
+  void onBody(const uint8_t *data, size_t length) {
+    if (state != State::DOWNLOADING) return;
+    if (length > downloadSize() - received) length = downloadSize() - received;
+    uint32_t before = received;
+    received += length;
+    stats.bytesReceived += length;
+    lastDataAt = hal::millis();
+    attempts = 0;
+
+    uint32_t start = hal::cycleCount();
+    const char *patchError = patcher.write(data, length);
+    patchCycles += hal::cycleCount() - start;
+    if (patchError != nullptr) {
+      LOG_WARN("[OTA] Could not patch the %s: %s", downloadPath(), patchError);
+      error = patchError;
+      // Leave the state first, so the end of the aborted download is not taken for an interruption
+      state = State::FAILED;
+      transport->abort();
+      fallBack();
+      return;
+    }
+    if (before / OTA_PROGRESS_STEP != received / OTA_PROGRESS_STEP) changed();
+  }
+
+  void onEnd(HttpTransport::End end) {
+    if (state != State::DOWNLOADING) return;
+    if (received == downloadSize()) {
+      finishImage();
+    } else if (end == HttpTransport::End::INTERRUPTED) {
+      retry();
+    } else {
+      error = end == HttpTransport::End::REFUSED ? "Refused" : "SizeMismatch";
+      patcher.abort();
+      fallBack();
+    }
+  }
+
+  /**
+   * Verify and commit the image, or fall back to the full image if it is not the expected one.
+   */
+  void finishImage() {
+    uint32_t start = hal::cycleCount();
+    const char *finishError = patcher.finish(request.sha256);
+    patchCycles += hal::cycleCount() - start;
+    if (finishError != nullptr) {
+      LOG_WARN("[OTA] The image from the %s is not valid: %s", downloadPath(), finishError);
+      error = finishError;
+      fallBack();
+      return;
+    }
+
+    stats.verified++;
+    stats.lastDuration = hal::millis() - startedAt;
+    stats.lastPatchCycles = patchCycles;
+    LOG_INFO("[OTA] Image of %lu bytes verified in %lu ms", (unsigned long)patcher.getImageSize(),
+             (unsigned long)stats.lastDuration);
+    state = State::RESTARTING;
+    nextAttemptAt = hal::millis() + OTA_REBOOT_DELAY;
+    changed();
+  }
+
+  /**
+   * Continue with the full image after the delta failed, or give the update up.
+   */
+  void fallBack() {
+    if (format == DeltaPatcher::Format::DELTA && request.fullPath[0] != '\0') {
+      stats.fallbacks++;
+      startImage(DeltaPatcher::Format::FULL);
+      return;
+    }
+    LOG_ERROR("[OTA] Update failed: %s", error);
+    state = State::FAILED;
+    changed();
+  }
+
+  /**
+   * Continue the download after a backoff, or give the update up after OTA_MAX_RETRIES failed requests in a row.
+   */
+  void retry() {
+    if (++attempts > OTA_MAX_RETRIES) {
+      error = "TooManyRetries";
+      patcher.abort();
+      LOG_ERROR("[OTA] Update failed: %s", error);
+      state = State::FAILED;
+      changed();
+      return;
+    }
+    uint32_t delay = OTA_RETRY_BACKOFF_MAX;
+    if (((uint32_t)OTA_RETRY_BACKOFF_MIN << (attempts - 1)) < OTA_RETRY_BACKOFF_MAX) {
+      delay = (uint32_t)OTA_RETRY_BACKOFF_MIN << (attempts - 1);
+    }
+    LOG_WARN("[OTA] Download interrupted at byte %lu, continuing in %lu ms", (unsigned long)received,
+             (unsigned long)delay);
+    state = State::WAITING;
+    nextAttemptAt = hal::millis() + delay;
+    changed();
+  }
+};
+
+#endif  // OTA_UPDATER_H
@@ -0,0 +1,350 @@
+/**
+ * Journal of the status transitions that could not be published, kept in a ring of records on flash.
+ *
+ * While the broker is unreachable every transition is appended with a sequence number. After reconnecting
+ * the internet manager publishes the journal in batches and acknowledges each batch once the broker has it,
+ * so no transition is lost, not even across a reset.
+ *
+ * To keep flash writes down, records are first collected in a small RAM buffer and written together.
+ * Records that are delivered before the buffer is written never reach flash. Delivery is recorded by
+ * appending an acknowledgement record instead of rewriting old records, so every write goes to the next
+ * slot of the ring and the writes are spread evenly over the file.
+ */
+
+#ifndef OUTBOUND_JOURNAL_H
+#define OUTBOUND_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hal/Hal.h"
+#include "Constants.h"
+#include "AlarmTypes.h"
+#include "Crc32.h"
+#include "Log.h"
+
+/**
+ * One slot of the journal file.
+ */
+struct JournalRecord {
+  /**
+   * The position the record was written at. The slot of the record is index % JOURNAL_CAPACITY.
+   */
+  uint32_t index;
+
+  /**
+   * For a status record the sequence number of the transition,
+   * for an acknowledgement the sequence number up to which everything has been delivered.
+   */
+  uint32_t sequence;
+
+  /**
+   * The time of the transition in milliseconds since boot.
+   */
+  uint32_t time;
+
+  /**
+   * RECORD_STATUS or RECORD_ACK.
+   */
+  uint8_t type;
+
+  /**
+   * The alarm types that were active after the transition.
+   */
+  AlarmMask alarms;
+
+  /**
+   * The lower half of the CRC-32 of all fields above.
+   */
+  uint16_t check;
+
+  static constexpr uint8_t RECORD_STATUS = 1;
+  static constexpr uint8_t RECORD_ACK = 2;
+
+  uint16_t checksum() const {
+    return (uint16_t)crc32(this, offsetof(JournalRecord, check));
+  }
+};
+
+static_assert(sizeof(JournalRecord) == 16, "Journal records must stay compact and fixed-size");
+
+class OutboundJournal {
+public:
+  /**
+   * A transition that still has to be delivered.
+   */
+  struct Event {
+    uint32_t sequence;
+    uint32_t time;
+    AlarmMask alarms;
+
+    /**
+     * Whether the event happened before the last reset, so its time is from another boot.
+     */
+    bool beforeReset;
+  };
+
+  /**
+   * Open the journal file and find the undelivered transitions in it.
+   *
+   * @return false if the file system is not available, the journal then does nothing
+   */
+  bool begin() {
+    ready = file.open(JOURNAL_PATH, JOURNAL_CAPACITY * sizeof(JournalRecord));
+    if (!ready) {
+      LOG_ERROR("[Journal] File system not available.");
+      return false;
+    }
+
+    bool found = false;
+    for (uint32_t slot = 0; slot < JOURNAL_CAPACITY; slot++) {
+      JournalRecord record;
+      if (!readSlot(slot, record)) continue;
+      if (!found || record.index >= nextIndex) nextIndex = record.index + 1;
+      found = true;
+
+      if (record.type == JournalRecord::RECORD_STATUS && record.sequence > lastSequence) {
+        lastSequence = record.sequence;
+        lastAlarms = record.alarms;
+      } else if (record.type == JournalRecord::RECORD_ACK && record.sequence > deliveredThrough) {
+        deliveredThrough = record.sequence;
+      }
+    }
+    writtenThrough = lastSequence;
+    ackWrittenThrough = deliveredThrough;
+    restoredThrough = lastSequence;
+
+    if (hasPending()) {
+      LOG_INFO("[Journal] Undelivered transitions after reset: %lu", (unsigned long)(lastSequence - deliveredThrough));
+    }
+    return true;
+  }
+
+  /**
+   * Record a transition that could not be published.
+   * A transition to the state of the previous undelivered transition changes nothing and is collapsed into it.
+   *
+   * @param alarms The alarm types that are active after the transition
+   * @param now The current time in milliseconds
+   */
+  void append(AlarmMask alarms, uint32_t now) {
+    if (!ready) return;
+    if (hasPending() && alarms == lastAlarms) {
+      stats.collapsed++;
+      return;
+    }
+
+    JournalRecord record = {};
+    record.sequence = ++lastSequence;
+    record.time = now;
+    record.type = JournalRecord::RECORD_STATUS;
+    record.alarms = alarms;
+    lastAlarms = alarms;
+    stats.appended++;
+    buffer(record, now);
+  }
+
+  /**
+   * @return true if there are transitions that have not been delivered
+   */
+  bool hasPending() const {
+    return lastSequence != deliveredThrough;
+  }
+
+  /**
+   * Copy the oldest undelivered transitions, from flash and from the RAM buffer.
+   *
+   * @param events Receives the transitions, oldest first
+   * @param capacity The size of events
+   * @return The amount of transitions copied
+   */
+  size_t peek(Event *events, size_t capacity) {
+    size_t count = 0;
+
+    // Only look at flash if it holds records that are not delivered yet
+    if (writtenThrough > deliveredThrough) {
+      uint32_t first = nextIndex > JOURNAL_CAPACITY ? nextIndex - JOURNAL_CAPACITY : 0;
+      for (uint32_t index = first; index < nextIndex && count < capacity; index++) {
+        JournalRecord record;
+        if (readSlot(index % JOURNAL_CAPACITY, record) && record.index == index) {
+          count += copyIfPending(record, events[count]);
+        }
+      }
+    }
+
+    for (uint8_t i = 0; i < buffered && count < capacity; i++) {
+      count += copyIfPending(writeBehind[i], events[count]);
+    }
+    return count;
+  }
+
+  /**
+   * Mark the transitions up to a sequence number as delivered.
+   *
+   * @param sequence The sequence number of the last delivered transition
+   * @param now The current time in milliseconds
+   */
+  void acknowledge(uint32_t sequence, uint32_t now) {
+    if (!ready || sequence <= deliveredThrough) return;
+    stats.delivered += sequence - deliveredThrough;
+    deliveredThrough = sequence;
+
+    // Delivered records in the RAM buffer never have to be written, an unwritten acknowledgement is moved up
+    uint8_t kept = 0;
+    bool ackBuffered = false;
+    for (uint8_t i = 0; i < buffered; i++) {
+      JournalRecord &record = writeBehind[i];
+      if (record.type == JournalRecord::RECORD_ACK) {
+        record.sequence = deliveredThrough;
+        ackWrittenThrough = deliveredThrough;
+        ackBuffered = true;
+      } else if (record.sequence <= deliveredThrough) {
+        continue;
+      }
+      writeBehind[kept++] = record;
+    }
+    buffered = kept;
+
+    // Flash only needs to learn about the delivery if it holds delivered records
+    if (!ackBuffered && writtenThrough > ackWrittenThrough) {
+      JournalRecord record = {};
+      record.sequence = deliveredThrough;
+      record.time = now;
+      record.type = JournalRecord::RECORD_ACK;
+      ackWrittenThrough = deliveredThrough;
+      buffer(record, now);
+    }
+  }
+
+  /**
+   * Write the RAM buffer to flash once it has waited for JOURNAL_WRITE_DELAY.
+   *
+   * @param now The current time in milliseconds
+   * @return The time in milliseconds until this needs to run again
+   */
+  uint32_t process(uint32_t now) {
+    if (buffered == 0) return SCHEDULER_MAX_IDLE;
+    uint32_t waited = now - bufferedSince;
+    if (waited < JOURNAL_WRITE_DELAY) return JOURNAL_WRITE_DELAY - waited;
+    flush();
+    return SCHEDULER_MAX_IDLE;
+  }
+
+  /**
+   * Statistics of the journal.
+   */
+  struct Stats {
+    uint32_t appended = 0;
+    uint32_t collapsed = 0;
+    uint32_t delivered = 0;
+
+    /**
+     * Undelivered transitions that were overwritten because the ring was full.
+     */
+    uint32_t overwritten = 0;
+
+    uint32_t recordsWritten = 0;
+  };
+
+  const Stats &getStats() const {
+    return stats;
+  }
+
+private:
+  hal::FlashFile file;
+  bool ready = false;
+
+  /**
+   * The index the next record is written at.
+   */
+  uint32_t nextIndex = 0;
+
+  /**
+   * The sequence number of the last transition and the state after it.
+   */
+  uint32_t lastSequence = 0;
+  AlarmMask lastAlarms = 0;
+
+  /**
+   * The sequence number up to which everything has been delivered.
+   */
+  uint32_t deliveredThrough = 0;
+
+  /**
+   * The sequence number of the last transition on flash.
+   */
+  uint32_t writtenThrough = 0;
+
+  /**
+   * The sequence number of the last acknowledgement on flash or in the RAM buffer.
+   */
+  uint32_t ackWrittenThrough = 0;
+
+  /**
+   * Transitions up to this sequence number were restored from flash at boot.
+   */
+  uint32_t restoredThrough = 0;
+
+  /**
+   * Records waiting to be written, and the time the oldest of them was buffered.
+   */
+  JournalRecord writeBehind[JOURNAL_WRITE_BEHIND];
+  uint8_t buffered = 0;
+  uint32_t bufferedSince = 0;
+
+  Stats stats;
+
+  void buffer(const JournalRecord &record, uint32_t now) {
+    if (buffered == 0) bufferedSince = now;
+    writeBehind[buffered++] = record;
+    if (buffered == JOURNAL_WRITE_BEHIND) flush();
+  }
+
+  bool copyIfPending(const JournalRecord &record, Event &event) const {
+    if (record.type != JournalRecord::RECORD_STATUS || record.sequence <= deliveredThrough) return false;
+    event.sequence = record.sequence;
+    event.time = record.time;
+    event.alarms = record.alarms;
+    event.beforeReset = record.sequence <= restoredThrough;
+    return true;
+  }
+
+  /**
+   * Write the RAM buffer to the next slots of the ring, in at most two writes.
+   */
+  void flush() {
+    uint8_t written = 0;
+    while (written < buffered) {
+      uint32_t slot = nextIndex % JOURNAL_CAPACITY;
+      uint8_t run = buffered - written;
+      if (slot + run > JOURNAL_CAPACITY) run = (uint8_t)(JOURNAL_CAPACITY - slot);
+
+      for (uint8_t i = 0; i < run; i++) {
+        JournalRecord &record = writeBehind[written + i];
+        countOverwritten(slot + i);
+        record.index = nextIndex++;
+        record.check = record.checksum();
+        if (record.type == JournalRecord::RECORD_STATUS) writtenThrough = record.sequence;
+      }
+      file.write(slot * sizeof(JournalRecord), &writeBehind[written], run * sizeof(JournalRecord));
+      stats.recordsWritten += run;
+      written += run;
+    }
+    buffered = 0;
+  }
+
+  void countOverwritten(uint32_t slot) {
+    if (nextIndex < JOURNAL_CAPACITY) return;
+    JournalRecord old;
+    if (readSlot(slot, old) && old.type == JournalRecord::RECORD_STATUS && old.sequence > deliveredThrough) {
+      stats.overwritten++;
+    }
+  }
+
+  bool readSlot(uint32_t slot, JournalRecord &record) {
+    if (!file.read(slot * sizeof(JournalRecord), &record, sizeof(JournalRecord))) return false;
+    bool known = record.type == JournalRecord::RECORD_STATUS || record.type == JournalRecord::RECORD_ACK;
+    return known && record.index % JOURNAL_CAPACITY == slot && record.check == record.checksum();
+  }
+};
+
+#endif  // OUTBOUND_JOURNAL_H
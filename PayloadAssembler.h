@@ -0,0 +1,101 @@
+/**
+ * The payload assembler collects the chunks of an MQTT message into a fixed, preallocated buffer.
+ *
+ * AsyncMqttClient hands large messages over in several chunks, each with the index of the chunk in the message
+ * and the total length. The chunks are copied into the buffer in place, so a complete message can be parsed
+ * without any heap allocation. Messages larger than the buffer are rejected as soon as their first chunk arrives.
+ */
+
+#ifndef PAYLOAD_ASSEMBLER_H
+#define PAYLOAD_ASSEMBLER_H
+
+#include <stddef.h>
+#include <string.h>
+
+template<size_t CAPACITY>
+class PayloadAssembler {
+public:
+  /**
+   * Result of feeding a chunk to the assembler.
+   */
+  enum class Result {
+    /** More chunks are needed before the message is complete. */
+    INCOMPLETE,
+    /** The message is complete and can be read from data() and length(). */
+    COMPLETE,
+    /** The message does not fit in the buffer or a chunk arrived out of order; the message is dropped. */
+    REJECTED
+  };
+
+  /**
+   * Add a chunk of a message to the buffer.
+   *
+   * @param payload The chunk, not NUL-terminated
+   * @param len The length of the chunk
+   * @param index The position of the chunk in the message
+   * @param total The total length of the message
+   * @return Whether the message is complete, incomplete or rejected
+   */
+  Result feed(const char *payload, size_t len, size_t index, size_t total) {
+    if (index == 0) {
+      // A new message starts, decide once whether it fits
+      received = 0;
+      dropping = total > CAPACITY;
+      if (dropping) rejected++;
+    }
+
+    if (dropping) return Result::REJECTED;
+
+    if (index != received || index + len > total || total > CAPACITY) {
+      // The chunk does not continue the message we are assembling
+      dropping = true;
+      rejected++;
+      return Result::REJECTED;
+    }
+
+    memcpy(buffer + index, payload, len);
+    received += len;
+    if (received < total) return Result::INCOMPLETE;
+
+    // NUL-terminate so the buffer can also be used as a C string
+    buffer[received] = '\0';
+    return Result::COMPLETE;
+  }
+
+  /**
+   * @return The assembled message. Only valid after feed() returned COMPLETE.
+   */
+  char *data() {
+    return buffer;
+  }
+
+  /**
+   * @return The length of the assembled message
+   */
+  size_t length() const {
+    return received;
+  }
+
+  /**
+   * The amount of messages that have been rejected.
+   */
+  unsigned long rejected = 0;
+
+private:
+  /**
+   * The buffer the message is assembled in, with room for a terminating NUL.
+   */
+  char buffer[CAPACITY + 1] = {};
+
+  /**
+   * The amount of bytes of the current message that have been received.
+   */
+  size_t received = 0;
+
+  /**
+   * Whether the rest of the current message should be dropped.
+   */
+  bool dropping = false;
+};
+
+#endif  // PAYLOAD_ASSEMBLER_H
@@ -0,0 +1,197 @@
+/**
+ * Deadline-based cooperative scheduler for the main loop.
+ *
+ * Every component registers a task that returns how long it can wait before it has to run again.
+ * Each loop iteration runs the tasks that are due and then idles until the earliest deadline,
+ * or until wake() is called from a network callback or an interrupt. The run time of every task and
+ * of every iteration is measured. The log is drained to Serial while idle, see Log.h.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <functional>
+#include "hal/Hal.h"
+#include "Constants.h"
+#include "Metrics.h"
+#include "Log.h"
+
+template<uint8_t CAPACITY>
+class Scheduler {
+public:
+  /**
+   * A task runs at the current time and returns the delay in milliseconds until it needs to run again.
+   */
+  using TaskFunction = std::function<uint32_t(uint32_t now)>;
+
+  /**
+   * Run-time statistics of a task.
+   */
+  struct TaskStats {
+    /**
+     * The name of the task.
+     */
+    const char *name;
+
+    /**
+     * The amount of times the task has run.
+     */
+    uint32_t runs;
+
+    /**
+     * The total run time in CPU cycles, see hal::CYCLES_PER_MICROSECOND.
+     */
+    uint64_t totalCycles;
+
+    /**
+     * The longest run time in CPU cycles.
+     */
+    uint32_t maxCycles;
+  };
+
+  /**
+   * Register a task. It runs for the first time in the next iteration.
+   *
+   * @param name The name of the task, for the statistics
+   * @param function The function to run
+   * @return The ID of the task, to wake it with wake()
+   */
+  uint8_t add(const char *name, TaskFunction function) {
+    if (taskCount >= CAPACITY) return CAPACITY;
+
+    Task &task = tasks[taskCount];
+    task.function = std::move(function);
+    task.nextRun = hal::millis();
+    task.stats = {name, 0, 0, 0};
+    return taskCount++;
+  }
+
+  /**
+   * Make a task run in the next iteration and end the current idle period.
+   * Call from the main loop and network callbacks, use wakeFromInterrupt() in interrupts.
+   *
+   * @param id The ID of the task
+   */
+  void wake(uint8_t id) {
+    // With interrupts off, so a wake-up from an interrupt between the load and the store is not lost
+    hal::disableInterrupts();
+    wakeMask = wakeMask | (1UL << id);
+    hal::enableInterrupts();
+    hal::wake();
+  }
+
+  /**
+   * Make a task run in the next iteration and end the current idle period, from an interrupt.
+   * Interrupts do not preempt each other, so the update of the woken tasks needs no lock here.
+   *
+   * @param id The ID of the task
+   */
+  void IRAM_ATTR wakeFromInterrupt(uint8_t id) {
+    wakeMask = wakeMask | (1UL << id);
+    hal::wake();
+  }
+
+  /**
+   * Run the due tasks and idle until the next deadline. Call this from loop().
+   */
+  void runOnce() {
+    uint32_t now = hal::millis();
+    uint32_t woken = takeWakeMask();
+    uint32_t busyCycles = 0;
+
+    for (uint8_t id = 0; id < taskCount; id++) {
+      Task &task = tasks[id];
+      if ((woken & (1UL << id)) == 0 && (int32_t)(now - task.nextRun) < 0) continue;
+
+      uint32_t start = hal::cycleCount();
+      uint32_t delay = task.function(now);
+      uint32_t cycles = hal::cycleCount() - start;
+
+      task.nextRun = now + (delay == 0 ? 1 : delay);
+      task.stats.runs++;
+      task.stats.totalCycles += cycles;
+      if (cycles > task.stats.maxCycles) task.stats.maxCycles = cycles;
+      busyCycles += cycles;
+    }
+    iterations++;
+    metrics.recordLoop(busyCycles);
+
+    // Idle until the earliest deadline, but never longer than SCHEDULER_MAX_IDLE
+    now = hal::millis();
+    uint32_t sleep = SCHEDULER_MAX_IDLE;
+    for (uint8_t id = 0; id < taskCount; id++) {
+      int32_t untilDue = (int32_t)(tasks[id].nextRun - now);
+      if (untilDue <= 0) return;
+      if ((uint32_t)untilDue < sleep) sleep = (uint32_t)untilDue;
+    }
+
+    // Hand the log to the UART while idle, and come back for the rest once the UART has sent this part
+    if (logger.drain() && sleep > LOG_DRAIN_INTERVAL) sleep = LOG_DRAIN_INTERVAL;
+    if (wakeMask == 0) hal::idle(sleep);
+  }
+
+  /**
+   * @param id The ID of the task
+   * @return The run-time statistics of the task
+   */
+  const TaskStats &getStats(uint8_t id) const {
+    return tasks[id].stats;
+  }
+
+  /**
+   * @return The amount of registered tasks
+   */
+  uint8_t getTaskCount() const {
+    return taskCount;
+  }
+
+  /**
+   * @return The amount of loop iterations
+   */
+  uint32_t getIterations() const {
+    return iterations;
+  }
+
+private:
+  struct Task {
+    TaskFunction function;
+    uint32_t nextRun;
+    TaskStats stats;
+  };
+
+  /**
+   * The registered tasks.
+   */
+  Task tasks[CAPACITY];
+
+  /**
+   * The amount of registered tasks.
+   */
+  uint8_t taskCount = 0;
+
+  /**
+   * Tasks that have been woken since the last iteration, one bit per task ID.
+   */
+  volatile uint32_t wakeMask = 0;
+
+  /**
+   * The amount of loop iterations.
+   */
+  uint32_t iterations = 0;
+
+  static_assert(CAPACITY <= 32, "wakeMask has one bit per task");
+
+  /**
+   * Take and clear the woken tasks, with interrupts off so no wake-up from an interrupt is lost.
+   */
+  uint32_t takeWakeMask() {
+    hal::disableInterrupts();
+    uint32_t woken = wakeMask;
+    wakeMask = 0;
+    hal::enableInterrupts();
+    return woken;
+  }
+};
+
+#endif  // SCHEDULER_H
@@ -0,0 +1,163 @@
+/**
+ * Sliding windows of the sequence numbers seen per sender, so a command is applied only once.
+ *
+ * Senders number their commands with increasing sequence numbers. The window keeps the highest number of each
+ * sender and a bitmap of the SEQUENCE_WINDOW_BITS numbers below it. A number that was seen before, or that is
+ * too old for the bitmap, is refused. This rejects replayed local datagrams, and a command that arrives over
+ * both the local listener and MQTT is applied only for the first copy.
+ *
+ * The windows are kept in RTC memory, so a reset does not open the door for replays. After a power loss the
+ * first command of every sender is accepted again.
+ */
+
+#ifndef SEQUENCE_WINDOW_H
+#define SEQUENCE_WINDOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hal/Hal.h"
+#include "Constants.h"
+#include "Crc32.h"
+
+/**
+ * The amount of sequence numbers below the highest one that are remembered per sender.
+ */
+constexpr uint8_t SEQUENCE_WINDOW_BITS = 64;
+
+class SequenceWindow {
+public:
+  /**
+   * Check a sequence number and remember it if it is new.
+   *
+   * @param sender The ID of the sender, not 0
+   * @param sequence The sequence number of the command
+   * @return true if the command is new and should be applied
+   */
+  bool accept(uint32_t sender, uint32_t sequence) {
+    Entry *entry = find(sender);
+    if (entry == nullptr) {
+      entry = evict();
+      entry->sender = sender;
+      entry->highest = sequence;
+      entry->seen = 1;
+    } else if (sequence > entry->highest) {
+      uint32_t shift = sequence - entry->highest;
+      entry->seen = shift >= SEQUENCE_WINDOW_BITS ? 1 : entry->seen << shift | 1;
+      entry->highest = sequence;
+    } else {
+      uint32_t age = entry->highest - sequence;
+      if (age >= SEQUENCE_WINDOW_BITS || (entry->seen >> age & 1) != 0) return false;
+      entry->seen |= 1ULL << age;
+    }
+
+    entry->lastUsed = ++useCounter;
+    save();
+    return true;
+  }
+
+  /**
+   * Stop or resume writing the windows to RTC memory, e.g. while an update restarts the device.
+   * The windows keep working in memory, and are written when resumed.
+   */
+  void hold(bool hold) {
+    if (hold == held) return;
+    held = hold;
+    if (!held) save();
+  }
+
+  /**
+   * Restore the windows from RTC memory, if valid ones are there.
+   */
+  void load() {
+    Snapshot snapshot;
+    if (!hal::rtcRead(RTC_SEQUENCE_WINDOW_OFFSET, &snapshot, sizeof(snapshot))) return;
+    if (snapshot.magic != MAGIC || snapshot.crc != crc32(snapshot.entries, sizeof(snapshot.entries))) return;
+
+    for (uint8_t i = 0; i < LOCAL_SENDER_CAPACITY; i++) {
+      entries[i] = snapshot.entries[i];
+      if (entries[i].lastUsed > useCounter) useCounter = entries[i].lastUsed;
+    }
+  }
+
+private:
+  struct Entry {
+    /**
+     * The ID of the sender, 0 if the entry is free.
+     */
+    uint32_t sender;
+
+    /**
+     * The highest sequence number seen.
+     */
+    uint32_t highest;
+
+    /**
+     * Bit n is set if highest - n was seen.
+     */
+    uint64_t seen;
+
+    /**
+     * When the entry was last used, to evict the least recently used one when a new sender shows up.
+     */
+    uint32_t lastUsed;
+
+    uint32_t reserved;
+  };
+
+  /**
+   * The windows as kept in RTC memory, protected by a magic number and a CRC-32 like AlarmSnapshot.
+   */
+  struct Snapshot {
+    uint32_t magic;
+
+    /**
+     * CRC-32 of the entries.
+     */
+    uint32_t crc;
+
+    Entry entries[LOCAL_SENDER_CAPACITY];
+  };
+
+  static_assert(sizeof(Snapshot) % 4 == 0, "RTC memory is written in blocks of 4 bytes");
+  static_assert(sizeof(Snapshot) <= RTC_SEQUENCE_WINDOW_BLOCKS * 4, "The windows must fit in their RTC region");
+
+  static constexpr uint32_t MAGIC = 0x53455101;
+
+  Entry entries[LOCAL_SENDER_CAPACITY] = {};
+  uint32_t useCounter = 0;
+
+  /**
+   * Whether writes to RTC memory are held, see hold().
+   */
+  bool held = false;
+
+  Entry *find(uint32_t sender) {
+    for (Entry &entry : entries) {
+      if (entry.sender == sender) return &entry;
+    }
+    return nullptr;
+  }
+
+  /**
+   * @return A free entry, or else the least recently used one
+   */
+  Entry *evict() {
+    Entry *oldest = &entries[0];
+    for (Entry &entry : entries) {
+      if (entry.sender == 0) return &entry;
+      if (entry.lastUsed < oldest->lastUsed) oldest = &entry;
+    }
+    return oldest;
+  }
+
+  void save() {
+    if (held) return;
+    Snapshot snapshot;
+    snapshot.magic = MAGIC;
+    for (uint8_t i = 0; i < LOCAL_SENDER_CAPACITY; i++) snapshot.entries[i] = entries[i];
+    snapshot.crc = crc32(snapshot.entries, sizeof(snapshot.entries));
+    hal::rtcWrite(RTC_SEQUENCE_WINDOW_OFFSET, &snapshot, sizeof(snapshot));
+  }
+};
+
+#endif  // SEQUENCE_WINDOW_H
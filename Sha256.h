@@ -0,0 +1,136 @@
+/**
+ * SHA-256, to verify a firmware image before the device boots it, see OtaUpdater.h.
+ *
+ * Streaming, so the image is hashed while it is written to flash, in about 100 bytes of RAM.
+ * Reference: FIPS 180-4, "Secure Hash Standard", 2015.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * The length of a SHA-256 digest in bytes.
+ */
+constexpr size_t SHA256_SIZE = 32;
+
+class Sha256 {
+public:
+  Sha256() {
+    reset();
+  }
+
+  /**
+   * Start a new hash.
+   */
+  void reset() {
+    static constexpr uint32_t INITIAL[8] = {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(state, INITIAL, sizeof(state));
+    length = 0;
+    buffered = 0;
+  }
+
+  /**
+   * Hash the next part of the message.
+   */
+  void update(const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    length += size;
+    if (buffered > 0) {
+      size_t take = size < BLOCK_SIZE - buffered ? size : BLOCK_SIZE - buffered;
+      memcpy(block + buffered, bytes, take);
+      buffered += take;
+      bytes += take;
+      size -= take;
+      if (buffered < BLOCK_SIZE) return;
+      compress(block);
+      buffered = 0;
+    }
+    for (; size >= BLOCK_SIZE; bytes += BLOCK_SIZE, size -= BLOCK_SIZE) compress(bytes);
+    memcpy(block, bytes, size);
+    buffered = size;
+  }
+
+  /**
+   * Finish the hash. Call reset() before hashing another message.
+   *
+   * @param digest Receives the hash, SHA256_SIZE bytes
+   */
+  void finish(uint8_t *digest) {
+    uint64_t bits = length * 8;
+    uint8_t padding[BLOCK_SIZE + 8] = {0x80};
+    size_t padLength = (buffered < BLOCK_SIZE - 8 ? BLOCK_SIZE - 8 : 2 * BLOCK_SIZE - 8) - buffered;
+    for (uint8_t i = 0; i < 8; i++) padding[padLength + i] = (uint8_t)(bits >> (56 - 8 * i));
+    update(padding, padLength + 8);
+    for (uint8_t i = 0; i < SHA256_SIZE; i++) digest[i] = (uint8_t)(state[i / 4] >> (24 - 8 * (i % 4)));
+  }
+
+private:
+  static constexpr size_t BLOCK_SIZE = 64;
+
+  static constexpr uint32_t ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t block[BLOCK_SIZE];
+  size_t buffered;
+
+  static uint32_t rotate(uint32_t value, uint8_t bits) {
+    return (value >> bits) | (value << (32 - bits));
+  }
+
+  void compress(const uint8_t *data) {
+    // The message schedule is kept as a ring of 16 words instead of all 64
+    uint32_t w[16];
+    for (uint8_t i = 0; i < 16; i++) {
+      w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 | (uint32_t)data[4 * i + 2] << 8 |
+             data[4 * i + 3];
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (uint8_t i = 0; i < 64; i++) {
+      if (i >= 16) {
+        uint32_t w15 = w[(i - 15) & 15];
+        uint32_t w2 = w[(i - 2) & 15];
+        w[i & 15] += (rotate(w15, 7) ^ rotate(w15, 18) ^ (w15 >> 3)) + w[(i - 7) & 15] +
+                     (rotate(w2, 17) ^ rotate(w2, 19) ^ (w2 >> 10));
+      }
+      uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + ROUND_CONSTANTS[i] +
+                    w[i & 15];
+      uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+};
+
+#endif  // SHA256_H
@@ -0,0 +1,79 @@
+/**
+ * Lock-free single-producer/single-consumer ring buffer.
+ *
+ * Meant for handing data from an interrupt (the producer) to the main loop (the consumer) without disabling
+ * interrupts. Each index is only written by one side, so no lock is needed on the single-core ESP8266.
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdint.h>
+#include "hal/Hal.h"
+
+template<typename T, uint8_t CAPACITY>
+class SpscRing {
+  static_assert(CAPACITY >= 2 && (CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+public:
+  /**
+   * Add an item. Called by the producer only.
+   *
+   * @param item The item to add
+   * @return false if the ring is full and the item was dropped
+   */
+  bool IRAM_ATTR push(const T &item) {
+    uint8_t currentHead = head;
+    if ((uint8_t)(currentHead - tail) >= CAPACITY) {
+      dropped = dropped + 1;
+      return false;
+    }
+    items[currentHead & (CAPACITY - 1)] = item;
+    // Make sure the item is written before it is published
+    __asm__ __volatile__("" ::: "memory");
+    head = currentHead + 1;
+    return true;
+  }
+
+  /**
+   * Take the oldest item. Called by the consumer only.
+   *
+   * @param item Receives the item
+   * @return false if the ring is empty
+   */
+  bool pop(T &item) {
+    uint8_t currentTail = tail;
+    if (currentTail == head) return false;
+    item = items[currentTail & (CAPACITY - 1)];
+    __asm__ __volatile__("" ::: "memory");
+    tail = currentTail + 1;
+    return true;
+  }
+
+  /**
+   * @return true if there is nothing to take
+   */
+  bool isEmpty() const {
+    return tail == head;
+  }
+
+  /**
+   * The amount of items dropped because the ring was full.
+   */
+  volatile uint32_t dropped = 0;
+
+private:
+  T items[CAPACITY];
+
+  /**
+   * Index of the next item to write, only written by the producer.
+   */
+  volatile uint8_t head = 0;
+
+  /**
+   * Index of the next item to read, only written by the consumer.
+   */
+  volatile uint8_t tail = 0;
+};
+
+#endif  // SPSC_RING_H
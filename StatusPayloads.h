@@ -0,0 +1,146 @@
+/**
+ * Precomputed payloads for the messages the device publishes.
+ *
+ * The alarm status only depends on the active alarm types, so the JSON and the CBOR for every
+ * possible mask are generated at compile time. Publishing a status is then a pointer and length handoff.
+ */
+
+#ifndef STATUS_PAYLOADS_H
+#define STATUS_PAYLOADS_H
+
+#include <stddef.h>
+#include "Constants.h"
+#include "AlarmTypes.h"
+
+/**
+ * Payload of the answer to a ping.
+ */
+constexpr char PONG_PAYLOAD[] = "{\"message\":\"Pong!\"}";
+
+constexpr size_t PONG_PAYLOAD_LENGTH = sizeof(PONG_PAYLOAD) - 1;
+
+namespace status_payloads {
+  constexpr size_t length(const char *text) {
+    return *text == '\0' ? 0 : 1 + length(text + 1);
+  }
+
+  /**
+   * Length of `"key":false`, the longest form of a boolean member.
+   */
+  constexpr size_t memberLength(const char *key) {
+    return length(key) + 2 + 1 + 5;
+  }
+
+  constexpr size_t maxLength() {
+    size_t total = 2 + memberLength(KEY_ALARM_ON);
+    for (const AlarmType &alarmType : ALARM_TYPES) {
+      total += 1 + memberLength(alarmType.key);
+    }
+    return total;
+  }
+
+  constexpr size_t MAX_LENGTH = maxLength();
+
+  /**
+   * The compact JSON status for every combination of alarm types, indexed by mask.
+   */
+  struct StatusTable {
+    char text[ALL_ALARMS + 1][MAX_LENGTH + 1];
+    size_t lengths[ALL_ALARMS + 1];
+
+    constexpr StatusTable() : text(), lengths() {
+      for (unsigned mask = 0; mask <= ALL_ALARMS; mask++) {
+        size_t position = 0;
+        text[mask][position++] = '{';
+        position = appendMember(text[mask], position, KEY_ALARM_ON, mask != 0);
+        for (uint8_t i = 0; i < ALARM_TYPE_COUNT; i++) {
+          text[mask][position++] = ',';
+          position = appendMember(text[mask], position, ALARM_TYPES[i].key, (mask >> i) & 1U);
+        }
+        text[mask][position++] = '}';
+        text[mask][position] = '\0';
+        lengths[mask] = position;
+      }
+    }
+
+  private:
+    static constexpr size_t append(char *target, size_t position, const char *value) {
+      while (*value != '\0') target[position++] = *value++;
+      return position;
+    }
+
+    static constexpr size_t appendMember(char *target, size_t position, const char *key, bool value) {
+      target[position++] = '"';
+      position = append(target, position, key);
+      target[position++] = '"';
+      target[position++] = ':';
+      return append(target, position, value ? "true" : "false");
+    }
+  };
+
+  constexpr StatusTable STATUS_TABLE{};
+
+  /**
+   * Length of the CBOR status: a map head and a one byte key and value per member.
+   */
+  constexpr size_t CBOR_LENGTH = 1 + 2 * (1 + ALARM_TYPE_COUNT);
+
+  static_assert(ALARM_TYPE_COUNT < 23, "CBOR status keys and map size must fit in the initial byte");
+
+  /**
+   * The CBOR status for every combination of alarm types, indexed by mask.
+   * Key 0 is alarmOn and key i + 1 is ALARM_TYPES[i], like in CBOR alarm/set commands.
+   */
+  struct CborStatusTable {
+    uint8_t bytes[ALL_ALARMS + 1][CBOR_LENGTH];
+
+    constexpr CborStatusTable() : bytes() {
+      for (unsigned mask = 0; mask <= ALL_ALARMS; mask++) {
+        size_t position = 0;
+        bytes[mask][position++] = (uint8_t)(0xA0 | (1 + ALARM_TYPE_COUNT));
+        bytes[mask][position++] = 0;
+        bytes[mask][position++] = mask != 0 ? 0xF5 : 0xF4;
+        for (uint8_t i = 0; i < ALARM_TYPE_COUNT; i++) {
+          bytes[mask][position++] = (uint8_t)(i + 1);
+          bytes[mask][position++] = (mask >> i) & 1U ? 0xF5 : 0xF4;
+        }
+      }
+    }
+  };
+
+  constexpr CborStatusTable CBOR_STATUS_TABLE{};
+}  // namespace status_payloads
+
+/**
+ * The status payload for a combination of alarm types.
+ * It is a JSON object with alarmOn and one boolean per alarm type, without whitespace.
+ *
+ * @param mask The active alarm types
+ * @return The NUL-terminated payload
+ */
+constexpr const char *statusPayload(AlarmMask mask) {
+  return status_payloads::STATUS_TABLE.text[mask & ALL_ALARMS];
+}
+
+/**
+ * @param mask The active alarm types
+ * @return The length of the status payload for the mask
+ */
+constexpr size_t statusPayloadLength(AlarmMask mask) {
+  return status_payloads::STATUS_TABLE.lengths[mask & ALL_ALARMS];
+}
+
+/**
+ * The CBOR status payload for a combination of alarm types, published on TOPIC_ALARM_STATUS_CBOR.
+ * It is a map with alarmOn under key 0 and one boolean per alarm type under its index plus one.
+ *
+ * @param mask The active alarm types
+ * @return The payload, CBOR_STATUS_PAYLOAD_LENGTH bytes long
+ */
+inline const char *cborStatusPayload(AlarmMask mask) {
+  return (const char *)status_payloads::CBOR_STATUS_TABLE.bytes[mask & ALL_ALARMS];
+}
+
+constexpr size_t CBOR_STATUS_PAYLOAD_LENGTH = status_payloads::CBOR_LENGTH;
+
+#endif  // STATUS_PAYLOADS_H
@@ -0,0 +1,402 @@
+/**
+ * Streaming evaluation of raw airflow and air pressure telemetry against threshold rules.
+ *
+ * Sensors publish their readings as plain decimal numbers on TOPIC_TELEMETRY_AIRFLOW and
+ * TOPIC_TELEMETRY_AIR_PRESSURE in the namespace of their group. Every reading is checked against the rules of its
+ * channel when it arrives, so an alarm detected on the device actuates at the reading that crosses the rule, without
+ * the detour through the backend.
+ *
+ * A rule compares the mean of the last `window` readings with a threshold (BELOW, ABOVE), or the change per second
+ * across the last `window` readings (FALLING, RISING). It raises its alarm type once its condition held for
+ * minDuration, and clears it when the value is back past the threshold by the hysteresis and the rule was raised for
+ * at least `hold`. An alarm type is detected while any of its rules is raised.
+ *
+ * The rule table is compiled once at startup into fixed point: readings are kept in thousandths, the thresholds of
+ * the mean rules are multiplied by the window length so a mean is a comparison of running sums, and the rules are
+ * sorted by channel. A reading then costs a few integer operations per rule of its channel and never allocates.
+ * Every channel keeps its last TELEMETRY_WINDOW_CAPACITY readings in a ring.
+ */
+
+#ifndef TELEMETRY_RULES_H
+#define TELEMETRY_RULES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Constants.h"
+#include "AlarmTypes.h"
+
+/**
+ * The quantities the sensors report.
+ */
+enum class TelemetryChannel : uint8_t {
+  AIRFLOW,
+  AIR_PRESSURE,
+  COUNT
+};
+
+struct TelemetryRule {
+  enum Kind : uint8_t {
+    BELOW,    // The mean of the window is below the threshold
+    ABOVE,    // The mean of the window is above the threshold
+    FALLING,  // The value falls faster than the threshold per second across the window
+    RISING,   // The value rises faster than the threshold per second across the window
+  };
+
+  TelemetryChannel channel;
+  Kind kind;
+
+  /**
+   * The threshold in the unit of the channel, per second for a rate, and how far the value has to be back
+   * before the rule clears.
+   */
+  float threshold;
+  float hysteresis;
+
+  /**
+   * The amount of readings the mean or the rate is taken over, up to TELEMETRY_WINDOW_CAPACITY.
+   * A rate needs at least 2.
+   */
+  uint8_t window;
+
+  /**
+   * How long in milliseconds the condition has to hold before the rule raises, and how long the rule stays
+   * raised at least.
+   */
+  uint32_t minDuration;
+  uint32_t hold;
+
+  /**
+   * The alarm type the rule raises.
+   */
+  AlarmMask alarm;
+};
+
+/**
+ * The rules of the device. A stalling fan is caught by the fall of the airflow before the mean drops below the
+ * threshold, which takes over once the fall rule clears.
+ */
+constexpr TelemetryRule TELEMETRY_RULES[] = {
+  {TelemetryChannel::AIRFLOW, TelemetryRule::BELOW, AIRFLOW_LOW_THRESHOLD, AIRFLOW_LOW_HYSTERESIS,
+   AIRFLOW_LOW_WINDOW, 0, 0, AIRFLOW_ALARM},
+  {TelemetryChannel::AIRFLOW, TelemetryRule::FALLING, AIRFLOW_FALL_RATE, AIRFLOW_FALL_HYSTERESIS,
+   2, 0, AIRFLOW_FALL_HOLD, AIRFLOW_ALARM},
+  {TelemetryChannel::AIR_PRESSURE, TelemetryRule::BELOW, AIR_PRESSURE_LOW_THRESHOLD, AIR_PRESSURE_LOW_HYSTERESIS,
+   AIR_PRESSURE_LOW_WINDOW, AIR_PRESSURE_LOW_DURATION, 0, AIR_PRESSURE_ALARM},
+};
+
+constexpr size_t TELEMETRY_RULE_COUNT = sizeof(TELEMETRY_RULES) / sizeof(TELEMETRY_RULES[0]);
+
+static_assert(TELEMETRY_RULE_COUNT <= TELEMETRY_RULE_CAPACITY, "TELEMETRY_RULE_CAPACITY is too small for the rules");
+
+class TelemetryEvaluator {
+public:
+  /**
+   * Counters of the readings and the detections.
+   */
+  struct Stats {
+    uint32_t samples = 0;
+
+    /**
+     * The readings that were not a number.
+     */
+    uint32_t rejected = 0;
+
+    /**
+     * The times a rule raised.
+     */
+    uint32_t raised = 0;
+  };
+
+  /**
+   * Compile a rule table and forget all readings. Rules that are not valid are left out.
+   *
+   * @param rules The rules
+   * @param count The amount of rules
+   * @return The amount of rules that were compiled
+   */
+  size_t begin(const TelemetryRule *rules, size_t count) {
+    *this = TelemetryEvaluator();
+    for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++) {
+      firstRule[channel] = ruleCount;
+      for (size_t i = 0; i < count && ruleCount < TELEMETRY_RULE_CAPACITY; i++) {
+        const TelemetryRule &rule = rules[i];
+        if ((uint8_t)rule.channel != channel || !isValid(rule)) continue;
+        compiled[ruleCount++] = compile(rule);
+      }
+    }
+    firstRule[CHANNEL_COUNT] = ruleCount;
+    return ruleCount;
+  }
+
+  /**
+   * Evaluate a reading as it arrived on a telemetry topic.
+   *
+   * @param channel The channel of the reading
+   * @param text The reading as decimal number, not NUL-terminated
+   * @param length The length of the text
+   * @param now The current time in milliseconds
+   * @return The alarm types whose detection changed, see getDetected()
+   */
+  AlarmMask feed(TelemetryChannel channel, const char *text, size_t length, uint32_t now) {
+    int32_t value;
+    if (!parse(text, length, value)) {
+      stats.rejected++;
+      return 0;
+    }
+    return feed(channel, value, now);
+  }
+
+  /**
+   * Evaluate a reading.
+   *
+   * @param channel The channel of the reading
+   * @param value The reading in thousandths of the unit of the channel
+   * @param now The current time in milliseconds
+   * @return The alarm types whose detection changed, see getDetected()
+   */
+  AlarmMask feed(TelemetryChannel channel, int32_t value, uint32_t now) {
+    if (channel >= TelemetryChannel::COUNT) return 0;
+    stats.samples++;
+    Ring &ring = rings[(uint8_t)channel];
+    uint8_t first = firstRule[(uint8_t)channel];
+    uint8_t last = firstRule[(uint8_t)channel + 1];
+
+    // Slide the window of every mean rule before the oldest reading may be overwritten
+    for (uint8_t i = first; i < last; i++) {
+      const Compiled &rule = compiled[i];
+      if (isRate(rule.kind)) continue;
+      if (ring.count >= rule.window) states[i].sum -= ring.values[index(ring, rule.window)];
+      states[i].sum += value;
+    }
+    ring.values[ring.head] = value;
+    ring.times[ring.head] = now;
+    ring.head = (uint8_t)((ring.head + 1) % TELEMETRY_WINDOW_CAPACITY);
+    if (ring.count < TELEMETRY_WINDOW_CAPACITY) ring.count++;
+
+    for (uint8_t i = first; i < last; i++) {
+      evaluate(i, ring, value, now);
+    }
+
+    AlarmMask previous = detected;
+    detected = 0;
+    for (uint8_t i = 0; i < ruleCount; i++) {
+      if (states[i].raised) detected |= compiled[i].alarm;
+    }
+    return (AlarmMask)(detected ^ previous);
+  }
+
+  /**
+   * Raise the rules of alarm types that were detected before a reset, so they clear like any raised rule once
+   * their window is full again and the value is back, instead of never reporting a change.
+   *
+   * @param alarms The alarm types to raise the rules of
+   * @param now The current time in milliseconds
+   */
+  void restore(AlarmMask alarms, uint32_t now) {
+    for (uint8_t i = 0; i < ruleCount; i++) {
+      if ((compiled[i].alarm & alarms) == 0) continue;
+      states[i].raised = true;
+      states[i].pending = false;
+      states[i].raisedAt = now;
+      detected |= compiled[i].alarm;
+    }
+  }
+
+  /**
+   * @return The alarm types that at least one rule raised
+   */
+  AlarmMask getDetected() const {
+    return detected;
+  }
+
+  const Stats &getStats() const {
+    return stats;
+  }
+
+  /**
+   * Parse a decimal number such as "-12.5" into thousandths. Digits after the third decimal are ignored.
+   *
+   * @param text The number, not NUL-terminated
+   * @param length The length of the text
+   * @param value Receives the number in thousandths
+   * @return false if the text is not a number or its magnitude is VALUE_LIMIT or more
+   */
+  static bool parse(const char *text, size_t length, int32_t &value) {
+    bool negative = length > 0 && text[0] == '-';
+    size_t position = length > 0 && (text[0] == '-' || text[0] == '+') ? 1 : 0;
+
+    int64_t thousandths = 0;
+    bool digits = false;
+    uint8_t decimals = 0;
+    bool point = false;
+    for (; position < length; position++) {
+      char c = text[position];
+      if (c == '.' && !point) {
+        point = true;
+      } else if (c >= '0' && c <= '9') {
+        digits = true;
+        if (point && decimals == 3) continue;
+        if (point) decimals++;
+        thousandths = thousandths * 10 + (c - '0');
+        if (thousandths >= (int64_t)VALUE_LIMIT * 1000) return false;
+      } else {
+        return false;
+      }
+    }
+    if (!digits) return false;
+
+    for (; decimals < 3; decimals++) thousandths *= 10;
+    if (thousandths >= (int64_t)VALUE_LIMIT * 1000) return false;
+    value = (int32_t)(negative ? -thousandths : thousandths);
+    return true;
+  }
+
+private:
+  static constexpr uint8_t CHANNEL_COUNT = (uint8_t)TelemetryChannel::COUNT;
+
+  /**
+   * Readings with a magnitude of this or more are refused, so a window sum of thousandths fits 64 bits with room.
+   */
+  static constexpr int32_t VALUE_LIMIT = 1000000;
+
+  /**
+   * A rule in fixed point. For a mean rule the bounds are sums of thousandths over the window, for a rate rule
+   * they are thousandths per second.
+   */
+  struct Compiled {
+    int64_t raiseBound;
+    int64_t clearBound;
+    uint32_t minDuration;
+    uint32_t hold;
+    TelemetryRule::Kind kind;
+    uint8_t window;
+    AlarmMask alarm;
+  };
+
+  struct State {
+    /**
+     * The sum of the readings in the window of a mean rule.
+     */
+    int64_t sum;
+
+    /**
+     * Since when the condition holds, while pending, and since when the rule is raised.
+     */
+    uint32_t since;
+    uint32_t raisedAt;
+    bool pending;
+    bool raised;
+  };
+
+  /**
+   * The last readings of a channel and when they arrived. head is where the next one goes.
+   */
+  struct Ring {
+    int32_t values[TELEMETRY_WINDOW_CAPACITY];
+    uint32_t times[TELEMETRY_WINDOW_CAPACITY];
+    uint8_t head;
+    uint8_t count;
+  };
+
+  Compiled compiled[TELEMETRY_RULE_CAPACITY] = {};
+  State states[TELEMETRY_RULE_CAPACITY] = {};
+  uint8_t ruleCount = 0;
+
+  /**
+   * The rules of channel c are compiled[firstRule[c]] up to compiled[firstRule[c + 1]].
+   */
+  uint8_t firstRule[CHANNEL_COUNT + 1] = {};
+
+  Ring rings[CHANNEL_COUNT] = {};
+  AlarmMask detected = 0;
+  Stats stats;
+
+  static bool isRate(TelemetryRule::Kind kind) {
+    return kind == TelemetryRule::FALLING || kind == TelemetryRule::RISING;
+  }
+
+  static bool isValid(const TelemetryRule &rule) {
+    uint8_t minimumWindow = isRate(rule.kind) ? 2 : 1;
+    return rule.window >= minimumWindow && rule.window <= TELEMETRY_WINDOW_CAPACITY && rule.alarm != 0 &&
+           (rule.alarm & ~ALL_ALARMS) == 0 && rule.hysteresis >= 0;
+  }
+
+  static int64_t toThousandths(float value) {
+    return (int64_t)(value * 1000.0f + (value < 0 ? -0.5f : 0.5f));
+  }
+
+  static Compiled compile(const TelemetryRule &rule) {
+    // FALLING is compared like BELOW, against negative rates
+    int64_t threshold = toThousandths(rule.threshold);
+    int64_t hysteresis = toThousandths(rule.hysteresis);
+    Compiled result = {0, 0, rule.minDuration, rule.hold, rule.kind, rule.window, rule.alarm};
+    switch (rule.kind) {
+      case TelemetryRule::BELOW:
+        result.raiseBound = threshold * rule.window;
+        result.clearBound = (threshold + hysteresis) * rule.window;
+        break;
+      case TelemetryRule::ABOVE:
+        result.raiseBound = threshold * rule.window;
+        result.clearBound = (threshold - hysteresis) * rule.window;
+        break;
+      case TelemetryRule::FALLING:
+        result.raiseBound = -threshold;
+        result.clearBound = -(threshold - hysteresis);
+        break;
+      case TelemetryRule::RISING:
+        result.raiseBound = threshold;
+        result.clearBound = threshold - hysteresis;
+        break;
+    }
+    return result;
+  }
+
+  /**
+   * @return The index of the reading `back` places before the head
+   */
+  static uint8_t index(const Ring &ring, uint8_t back) {
+    return (uint8_t)((ring.head + TELEMETRY_WINDOW_CAPACITY - back) % TELEMETRY_WINDOW_CAPACITY);
+  }
+
+  void evaluate(uint8_t i, const Ring &ring, int32_t value, uint32_t now) {
+    const Compiled &rule = compiled[i];
+    State &state = states[i];
+    if (ring.count < rule.window) return;
+
+    // Compare `measured` against `bound * scale`: sums for a mean, thousandths times milliseconds for a rate
+    int64_t measured = state.sum;
+    int64_t scale = 1;
+    if (isRate(rule.kind)) {
+      uint8_t oldest = index(ring, rule.window);
+      uint32_t elapsed = now - ring.times[oldest];
+      if (elapsed == 0) return;
+      measured = ((int64_t)value - ring.values[oldest]) * 1000;
+      scale = elapsed;
+    }
+
+    bool low = rule.kind == TelemetryRule::BELOW || rule.kind == TelemetryRule::FALLING;
+    bool raise = low ? measured < rule.raiseBound * scale : measured > rule.raiseBound * scale;
+    bool clear = low ? measured >= rule.clearBound * scale : measured <= rule.clearBound * scale;
+
+    if (!state.raised) {
+      if (!raise) {
+        state.pending = false;
+        return;
+      }
+      if (!state.pending) {
+        state.pending = true;
+        state.since = now;
+      }
+      if (now - state.since >= rule.minDuration) {
+        state.raised = true;
+        state.raisedAt = now;
+        stats.raised++;
+      }
+    } else if (clear && now - state.raisedAt >= rule.hold) {
+      state.raised = false;
+      state.pending = false;
+    }
+  }
+};
+
+#endif  // TELEMETRY_RULES_H
@@ -0,0 +1,165 @@
+/**
+ * Cache of the TLS session with the broker, so a reconnect resumes the session instead of a full handshake.
+ *
+ * A resumed handshake skips the key exchange and the certificate, which are what make a full handshake cost
+ * seconds of CPU on the ESP8266, and takes one round trip less. The session is kept in memory across reconnects
+ * and in RTC memory across resets, protected by a magic number and a CRC-32 like AlarmSnapshot. It holds the
+ * master secret, so it is never written to flash and is gone after a power loss.
+ *
+ * The session is bound to the host and port it was made with. A session the broker no longer knows costs
+ * nothing extra: the broker answers with a full handshake, whose session replaces the cached one.
+ *
+ * Whether the broker ignores the maximum fragment length extension is kept with the session, so a device learns
+ * it once per server and not on every connect.
+ */
+
+#ifndef TLS_SESSION_CACHE_H
+#define TLS_SESSION_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "hal/Hal.h"
+#include "Constants.h"
+#include "Crc32.h"
+
+/**
+ * The parameters of a TLS 1.2 session, laid out like br_ssl_session_parameters of BearSSL.
+ */
+struct TlsSession {
+  uint8_t sessionId[32];
+  uint8_t sessionIdLength;
+
+  /**
+   * Padding, where the compiler puts it in the BearSSL struct.
+   */
+  uint8_t reserved;
+
+  uint16_t version;
+  uint16_t cipherSuite;
+  uint8_t masterSecret[48];
+
+  /**
+   * @return true if the session has the same ID as the other one, so a handshake with it was resumed
+   */
+  bool sameId(const TlsSession &other) const {
+    return sessionIdLength != 0 && sessionIdLength == other.sessionIdLength &&
+           memcmp(sessionId, other.sessionId, sessionIdLength) == 0;
+  }
+};
+
+class TlsSessionCache {
+public:
+  /**
+   * Bind the cache to a server and restore its session from RTC memory, if a valid one is there.
+   */
+  void begin(const char *host, uint16_t port) {
+    server = crc32(host, strlen(host), port);
+    valid = false;
+    unboundedRecords = false;
+    Record record;
+    if (!hal::rtcRead(RTC_TLS_SESSION_OFFSET, &record, sizeof(record))) return;
+    if (record.magic != MAGIC || record.crc != crc32(&record, offsetof(Record, crc))) return;
+    if (record.server != server) return;
+    unboundedRecords = (record.flags & FLAG_UNBOUNDED_RECORDS) != 0;
+    if (record.session.sessionIdLength == 0) return;
+    session = record.session;
+    valid = true;
+  }
+
+  /**
+   * @return true if the broker was seen to send records larger than the maximum fragment length asked for
+   */
+  bool hasUnboundedRecords() const {
+    return unboundedRecords;
+  }
+
+  void setUnboundedRecords(bool unbounded) {
+    if (unbounded == unboundedRecords) return;
+    unboundedRecords = unbounded;
+    save();
+  }
+
+  /**
+   * @param session Receives the cached session
+   * @return true if there is a session to resume
+   */
+  bool get(TlsSession &session) const {
+    if (!valid) return false;
+    session = this->session;
+    return true;
+  }
+
+  /**
+   * Cache the session of a handshake, unless the broker gave it no ID to resume it by.
+   */
+  void put(const TlsSession &session) {
+    if (session.sessionIdLength == 0 || session.sessionIdLength > sizeof(session.sessionId)) {
+      clear();
+      return;
+    }
+    // A resumed session is the one that is cached already
+    if (valid && memcmp(&this->session, &session, sizeof(session)) == 0) return;
+    this->session = session;
+    valid = true;
+    save();
+  }
+
+  /**
+   * Forget the session, e.g. after a failed handshake. What is known about the records of the broker stays.
+   */
+  void clear() {
+    if (!valid) return;
+    valid = false;
+    memset(&session, 0, sizeof(session));
+    save();
+  }
+
+private:
+  /**
+   * The session as kept in RTC memory.
+   */
+  struct Record {
+    uint32_t magic;
+
+    /**
+     * The server the session is with, see begin().
+     */
+    uint32_t server;
+
+    TlsSession session;
+
+    /**
+     * FLAG_UNBOUNDED_RECORDS, and padding to keep the size a multiple of 4 bytes.
+     */
+    uint16_t flags;
+
+    /**
+     * CRC-32 of all fields above.
+     */
+    uint32_t crc;
+  };
+
+  static_assert(sizeof(Record) % 4 == 0, "RTC memory is written in blocks of 4 bytes");
+  static_assert(sizeof(Record) <= RTC_TLS_SESSION_BLOCKS * 4, "The session must fit in its RTC region");
+
+  static constexpr uint32_t MAGIC = 0x544C5302;
+  static constexpr uint16_t FLAG_UNBOUNDED_RECORDS = 0x0001;
+
+  TlsSession session = {};
+  uint32_t server = 0;
+  bool valid = false;
+  bool unboundedRecords = false;
+
+  void save() {
+    Record record = {};
+    record.magic = MAGIC;
+    record.server = server;
+    record.session = session;
+    record.flags = unboundedRecords ? FLAG_UNBOUNDED_RECORDS : 0;
+    record.crc = crc32(&record, offsetof(Record, crc));
+    hal::rtcWrite(RTC_TLS_SESSION_OFFSET, &record, sizeof(record));
+  }
+};
+
+#endif  // TLS_SESSION_CACHE_H
@@ -0,0 +1,72 @@
+/**
+ * Token bucket rate limiter.
+ *
+ * The bucket holds up to a fixed amount of tokens and gains one token per refill interval.
+ * Every limited action takes a token, so short bursts pass right away and a sustained stream
+ * is held to one action per interval. Time is passed in, so it works with hal::millis() and
+ * keeps working across its rollover.
+ */
+
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#include <stdint.h>
+
+class TokenBucket {
+public:
+  /**
+   * Create a full bucket.
+   *
+   * @param capacity The maximum amount of tokens, which is the longest burst that passes
+   * @param refillInterval The time in milliseconds it takes to gain one token
+   */
+  TokenBucket(uint8_t capacity, uint32_t refillInterval)
+      : capacity(capacity), refillInterval(refillInterval), tokens(capacity) {}
+
+  /**
+   * Take a token if one is available.
+   *
+   * @param now The current time in milliseconds
+   * @return true if a token was taken
+   */
+  bool tryTake(uint32_t now) {
+    refill(now);
+    if (tokens == 0) return false;
+    if (tokens == capacity) lastRefill = now;
+    tokens--;
+    return true;
+  }
+
+  /**
+   * @param now The current time in milliseconds
+   * @return The time in milliseconds until a token is available, 0 if one is available now
+   */
+  uint32_t timeUntilToken(uint32_t now) {
+    refill(now);
+    return tokens > 0 ? 0 : refillInterval - (now - lastRefill);
+  }
+
+private:
+  uint8_t capacity;
+  uint32_t refillInterval;
+  uint8_t tokens;
+
+  /**
+   * The time the last token was added. Only meaningful while the bucket is not full.
+   */
+  uint32_t lastRefill = 0;
+
+  void refill(uint32_t now) {
+    if (tokens == capacity) return;
+    uint32_t gained = (now - lastRefill) / refillInterval;
+    if (gained == 0) return;
+    if (gained >= (uint32_t)(capacity - tokens)) {
+      tokens = capacity;
+    } else {
+      tokens += (uint8_t)gained;
+      lastRefill += gained * refillInterval;
+    }
+  }
+};
+
+#endif  // TOKEN_BUCKET_H
@@ -0,0 +1,188 @@
+/**
+ * Topic namespaces of a device and the matching of incoming topics.
+ *
+ * Every device publishes under alarm/<device id>/ and accepts commands from three namespaces:
+ * its own, its group (alarm/group/<group>/) and all devices (alarm/all/). The prefixes of these
+ * namespaces are formatted once at startup. Matching a topic is then a few length checks and
+ * memcmp calls against the prefix table and the suffix table, without allocating.
+ */
+
+#ifndef TOPIC_ROUTER_H
+#define TOPIC_ROUTER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "Constants.h"
+
+class TopicRouter {
+public:
+  /**
+   * The namespace a topic is in.
+   */
+  enum Scope : uint8_t {
+    SCOPE_DEVICE,
+    SCOPE_GROUP,
+    SCOPE_ALL,
+    SCOPE_COUNT
+  };
+
+  /**
+   * What an incoming message is.
+   */
+  enum class Route : uint8_t {
+    NONE,
+    PING,
+    ALARM_SET,
+    ALARM_SET_CBOR,
+    ALARM_DESIRED,
+    STATUS_GET,
+    TELEMETRY_AIRFLOW,
+    TELEMETRY_AIR_PRESSURE,
+    ESCALATION,
+    OTA
+  };
+
+  /**
+   * The topics the device publishes to, in its own namespace.
+   */
+  enum Outbound : uint8_t {
+    OUTBOUND_PONG,
+    OUTBOUND_STATUS,
+    OUTBOUND_STATUS_CBOR,
+    OUTBOUND_JOURNAL,
+    OUTBOUND_METRICS,
+    OUTBOUND_AVAILABILITY,
+    OUTBOUND_OTA_STATUS,
+    OUTBOUND_COUNT
+  };
+
+  struct Match {
+    Route route;
+    Scope scope;
+  };
+
+  /**
+   * Format the prefixes and the outbound topics.
+   *
+   * @param deviceId The ID of the device, a single topic level
+   * @param group The group of the device, a single topic level
+   */
+  void begin(const char *deviceId, const char *group) {
+    prefixLengths[SCOPE_DEVICE] = format(prefixes[SCOPE_DEVICE], "%s/%s/", TOPIC_ALARM, deviceId);
+    prefixLengths[SCOPE_GROUP] = format(prefixes[SCOPE_GROUP], "%s/%s/%s/", TOPIC_ALARM, TOPIC_GROUP, group);
+    prefixLengths[SCOPE_ALL] = format(prefixes[SCOPE_ALL], "%s/%s/", TOPIC_ALARM, TOPIC_ALL);
+
+    for (uint8_t i = 0; i < OUTBOUND_COUNT; i++) {
+      format(outbound[i], "%s%s", prefixes[SCOPE_DEVICE], OUTBOUND_SUFFIXES[i]);
+    }
+    format(desired, "%s%s", prefixes[SCOPE_DEVICE], TOPIC_ALARM_DESIRED);
+  }
+
+  /**
+   * Find out what an incoming topic is. Topics delivered through a wildcard subscription that
+   * match none of the known suffixes give Route::NONE.
+   *
+   * @param topic The topic of the message
+   * @return The route and the namespace of the topic
+   */
+  Match match(const char *topic) const {
+    size_t length = strlen(topic);
+    for (uint8_t scope = 0; scope < SCOPE_COUNT; scope++) {
+      size_t prefixLength = prefixLengths[scope];
+      if (length <= prefixLength || memcmp(topic, prefixes[scope], prefixLength) != 0) continue;
+
+      const char *suffix = topic + prefixLength;
+      size_t suffixLength = length - prefixLength;
+      for (const InboundSuffix &inbound : INBOUND_SUFFIXES) {
+        if (suffixLength == inbound.length && memcmp(suffix, inbound.suffix, suffixLength) == 0) {
+          return {inbound.route, (Scope)scope};
+        }
+      }
+      return {Route::NONE, (Scope)scope};
+    }
+    return {Route::NONE, SCOPE_COUNT};
+  }
+
+  /**
+   * @return The prefix of a namespace, ending in a slash
+   */
+  const char *prefix(Scope scope) const {
+    return prefixes[scope];
+  }
+
+  /**
+   * @return A topic the device publishes to
+   */
+  const char *topic(Outbound topic) const {
+    return outbound[topic];
+  }
+
+  /**
+   * @return The topic the backend retains the desired state of the device on
+   */
+  const char *desiredTopic() const {
+    return desired;
+  }
+
+  /**
+   * Format a topic in a namespace, e.g. a subscription filter.
+   *
+   * @param scope The namespace
+   * @param suffix The topic relative to the namespace
+   * @param buffer Receives the topic, TOPIC_MAX_LENGTH bytes
+   * @return The buffer
+   */
+  const char *topic(Scope scope, const char *suffix, char (&buffer)[TOPIC_MAX_LENGTH]) const {
+    // The prefix lengths are known, so this is two copies, truncated like format() would
+    size_t prefixLength = prefixLengths[scope];
+    size_t suffixLength = strlen(suffix);
+    if (prefixLength + suffixLength >= TOPIC_MAX_LENGTH) suffixLength = TOPIC_MAX_LENGTH - 1 - prefixLength;
+    memcpy(buffer, prefixes[scope], prefixLength);
+    memcpy(buffer + prefixLength, suffix, suffixLength);
+    buffer[prefixLength + suffixLength] = '\0';
+    return buffer;
+  }
+
+private:
+  struct InboundSuffix {
+    const char *suffix;
+    size_t length;
+    Route route;
+  };
+
+  static constexpr InboundSuffix INBOUND_SUFFIXES[] = {
+    {TOPIC_ALARM_SET,        sizeof(TOPIC_ALARM_SET) - 1,        Route::ALARM_SET},
+    {TOPIC_ALARM_SET_CBOR,   sizeof(TOPIC_ALARM_SET_CBOR) - 1,   Route::ALARM_SET_CBOR},
+    {TOPIC_ALARM_DESIRED,    sizeof(TOPIC_ALARM_DESIRED) - 1,    Route::ALARM_DESIRED},
+    {TOPIC_PING,             sizeof(TOPIC_PING) - 1,             Route::PING},
+    {TOPIC_ALARM_STATUS_GET, sizeof(TOPIC_ALARM_STATUS_GET) - 1, Route::STATUS_GET},
+    {TOPIC_TELEMETRY_AIRFLOW, sizeof(TOPIC_TELEMETRY_AIRFLOW) - 1, Route::TELEMETRY_AIRFLOW},
+    {TOPIC_TELEMETRY_AIR_PRESSURE, sizeof(TOPIC_TELEMETRY_AIR_PRESSURE) - 1, Route::TELEMETRY_AIR_PRESSURE},
+    {TOPIC_ESCALATION,       sizeof(TOPIC_ESCALATION) - 1,       Route::ESCALATION},
+    {TOPIC_OTA,              sizeof(TOPIC_OTA) - 1,              Route::OTA},
+  };
+
+  static constexpr const char *OUTBOUND_SUFFIXES[OUTBOUND_COUNT] = {
+    TOPIC_PONG,
+    TOPIC_ALARM_STATUS,
+    TOPIC_ALARM_STATUS_CBOR,
+    TOPIC_ALARM_JOURNAL,
+    TOPIC_METRICS,
+    TOPIC_AVAILABILITY,
+    TOPIC_OTA_STATUS,
+  };
+
+  char prefixes[SCOPE_COUNT][TOPIC_MAX_LENGTH] = {};
+  uint8_t prefixLengths[SCOPE_COUNT] = {};
+  char outbound[OUTBOUND_COUNT][TOPIC_MAX_LENGTH] = {};
+  char desired[TOPIC_MAX_LENGTH] = {};
+
+  template<typename... Arguments>
+  static uint8_t format(char (&buffer)[TOPIC_MAX_LENGTH], const char *pattern, Arguments... arguments) {
+    int length = snprintf(buffer, TOPIC_MAX_LENGTH, pattern, arguments...);
+    return length < 0 ? 0 : length >= TOPIC_MAX_LENGTH ? TOPIC_MAX_LENGTH - 1 : (uint8_t)length;
+  }
+};
+
+#endif  // TOPIC_ROUTER_H
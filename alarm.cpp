@@ -8,17 +8,81 @@
 #include "InternetManager.h"
 #include "AlarmStateManager.h"
 #include "Constants.h"
+#include "Scheduler.h"
+#include "ButtonInput.h"
+#if MQTT_TLS_ENABLED
+#include "hal/TlsMqttTransport.h"
+#else
+#include "hal/AsyncMqttTransport.h"
+#endif
+#include "hal/WifiLink.h"
+#include "hal/AsyncUdpTransport.h"
+#include "hal/AsyncHttpTransport.h"
 
 AlarmStateManager *alarmStateManager = new AlarmStateManager();
-InternetManager *internetManager = new InternetManager(alarmStateManager);
+WifiLink *wifiLink = new WifiLink();
+#if MQTT_TLS_ENABLED
+TlsMqttTransport *mqttTransport = new TlsMqttTransport();
+#else
+AsyncMqttTransport *mqttTransport = new AsyncMqttTransport();
+#endif
+AsyncUdpTransport *localTransport = new AsyncUdpTransport();
+AsyncHttpTransport *updateTransport = new AsyncHttpTransport();
+InternetManager *internetManager = new InternetManager(alarmStateManager, wifiLink, mqttTransport, localTransport,
+                                                       updateTransport);
+Scheduler<SCHEDULER_CAPACITY> scheduler;
+ButtonInput buttonInput;
+
+/**
+ * The task that checks the alarm state, woken whenever the alarm state changes.
+ */
+uint8_t alarmTask;
+
+/**
+ * The task that decodes button presses, woken by the button interrupt.
+ */
+uint8_t buttonTask;
+
+/**
+ * Wake the button task from the button interrupt.
+ */
+void IRAM_ATTR onButtonEdge() {
+  scheduler.wakeFromInterrupt(buttonTask);
+}
 
 void setup() {
   Serial.begin(SERIAL_BAUD_RATE);
-  AlarmStateManager::initialize();
+  alarmStateManager->initialize();
   internetManager->initialize();
+
+  scheduler.add("network", [](uint32_t now) {
+    (void)now;
+    return internetManager->process();
+  });
+
+  buttonTask = scheduler.add("button", [](uint32_t now) {
+    return buttonInput.process(now);
+  });
+
+  alarmTask = scheduler.add("alarm", [](uint32_t now) {
+    (void)now;
+    return alarmStateManager->checkTriggerAlarm();
+  });
+
+  alarmStateManager->onStateChange([]() {
+    scheduler.wake(alarmTask);
+  });
+
+  // A short press silences the claxon, a long press clears all alarms
+  buttonInput.onPress([]() {
+    alarmStateManager->silenceClaxon();
+  });
+  buttonInput.onLongPress([]() {
+    internetManager->clearAlarms();
+  });
+  buttonInput.initialize(onButtonEdge);
 }
 
 void loop() {
-  internetManager->listenToAlarmDeactivation();
-  alarmStateManager->checkTriggerAlarm();
+  scheduler.runOnce();
 }
\ No newline at end of file
@@ -0,0 +1,135 @@
+/**
+ * Host benchmark of the alarm/set and alarm/status wire formats.
+ *
+ * Decodes the same commands as JSON and as CBOR and compares the status payloads, printing the
+ * size on the wire and the time per operation. Build and run with `pio run -e codec_bench -t exec`.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "../AlarmCodec.h"
+#include "../StatusPayloads.h"
+
+namespace {
+  constexpr uint32_t ITERATIONS = 200000;
+
+  /**
+   * Keeps the compiler from optimizing the measured work away.
+   */
+  volatile uint32_t sink = 0;
+
+  struct Command {
+    const char *name;
+    const char *json;
+    const char *cbor;
+    size_t cborLength;
+  };
+
+  const Command COMMANDS[] = {
+    {"one key", "{\"" KEY_AIRFLOW_ALARM_ON "\":true}", "\xA1\x02\xF5", 3},
+    {"all keys",
+     "{\"" KEY_TEST_ALARM_ON "\":false,\"" KEY_AIRFLOW_ALARM_ON "\":true,\"" KEY_AIR_PRESSURE_ALARM_ON "\":true}",
+     "\xA3\x01\xF4\x02\xF5\x03\xF5", 7},
+    {"text keys", "{\"" KEY_AIRFLOW_ALARM_ON "\":true}", "\xA1\x6E" KEY_AIRFLOW_ALARM_ON "\xF5", 17},
+    {"extra key", "{\"" KEY_AIRFLOW_ALARM_ON "\":true,\"source\":\"backend\"}",
+     "\xA2\x02\xF5\x66source\x67" "backend", 18},
+    {"float key", "{\"" KEY_TEST_ALARM_ON "\":true,\"x\":1.5}", "\xA2\x01\xF5\x61x\xFB\x3F\xF8\0\0\0\0\0\0", 14},
+  };
+
+  /**
+   * Time a function over ITERATIONS calls.
+   *
+   * @return The mean time per call in nanoseconds
+   */
+  template<typename Function>
+  double measure(Function function) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+      function(i);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / ITERATIONS;
+  }
+
+  void report(const char *operation, const char *name, size_t jsonBytes, double jsonNs, size_t cborBytes, double cborNs) {
+    std::printf("%-8s %-10s  json: %3zu B %8.1f ns   cbor: %3zu B %8.1f ns\n", operation, name,
+                jsonBytes, jsonNs, cborBytes, cborNs);
+  }
+
+  void benchmarkDecode() {
+    JsonAlarmCodec jsonCodec;
+    char buffer[MQTT_MAX_PAYLOAD_SIZE + 1];
+
+    for (const Command &command : COMMANDS) {
+      size_t jsonLength = strlen(command.json);
+
+      // Both decoders get a fresh copy, as the JSON parser works in place
+      AlarmUpdate jsonUpdate;
+      const char *jsonError = nullptr;
+      double jsonNs = measure([&](uint32_t) {
+        memcpy(buffer, command.json, jsonLength);
+        AlarmUpdate update;
+        jsonError = jsonCodec.decode(buffer, jsonLength, update);
+        if (jsonError == nullptr) sink += update.on;
+        jsonUpdate = update;
+      });
+
+      AlarmUpdate cborUpdate;
+      const char *cborError = nullptr;
+      double cborNs = measure([&](uint32_t) {
+        memcpy(buffer, command.cbor, command.cborLength);
+        AlarmUpdate update;
+        cborError = CborAlarmCodec::decode(buffer, command.cborLength, update);
+        if (cborError == nullptr) sink += update.on;
+        cborUpdate = update;
+      });
+
+      if (jsonError != nullptr || cborError != nullptr) {
+        std::printf("decode   %-10s  failed, json: %s  cbor: %s\n", command.name, jsonError ? jsonError : "ok",
+                    cborError ? cborError : "ok");
+      } else if (jsonUpdate.changed != cborUpdate.changed || jsonUpdate.on != cborUpdate.on) {
+        std::printf("decode   %-10s  formats disagree\n", command.name);
+      }
+      report("decode", command.name, jsonLength, jsonNs, command.cborLength, cborNs);
+    }
+  }
+
+  void benchmarkStatus() {
+    // What sendAlarmState did before the payloads were precomputed
+    char buffer[MQTT_MAX_PAYLOAD_SIZE];
+    double serializeNs = measure([&](uint32_t i) {
+      AlarmMask mask = (AlarmMask)(i & ALL_ALARMS);
+      StaticJsonDocument<ALARM_JSON_DOCUMENT_SIZE> document;
+      document[KEY_ALARM_ON] = mask != 0;
+      for (uint8_t type = 0; type < ALARM_TYPE_COUNT; type++) {
+        document[ALARM_TYPES[type].key] = ((mask >> type) & 1U) != 0;
+      }
+      sink += serializeJson(document, buffer, sizeof(buffer));
+    });
+
+    double jsonNs = measure([&](uint32_t i) {
+      AlarmMask mask = (AlarmMask)(i & ALL_ALARMS);
+      sink += statusPayloadLength(mask) + (uint8_t)statusPayload(mask)[1];
+    });
+
+    double cborNs = measure([&](uint32_t i) {
+      AlarmMask mask = (AlarmMask)(i & ALL_ALARMS);
+      sink += CBOR_STATUS_PAYLOAD_LENGTH + (uint8_t)cborStatusPayload(mask)[1];
+    });
+
+    size_t longest = 0;
+    for (unsigned mask = 0; mask <= ALL_ALARMS; mask++) {
+      if (statusPayloadLength((AlarmMask)mask) > longest) longest = statusPayloadLength((AlarmMask)mask);
+    }
+    report("status", "serialize", longest, serializeNs, CBOR_STATUS_PAYLOAD_LENGTH, cborNs);
+    report("status", "table", longest, jsonNs, CBOR_STATUS_PAYLOAD_LENGTH, cborNs);
+  }
+}  // namespace
+
+int main() {
+  std::printf("%u iterations per measurement\n", ITERATIONS);
+  benchmarkDecode();
+  benchmarkStatus();
+  return 0;
+}
@@ -0,0 +1,708 @@
+/**
+ * Fleet simulator and load generator, to size the broker and check the fleet behaviour before a rollout.
+ *
+ * Runs many simulated alarms in one event loop against a real broker, by default a local mosquitto.
+ * Every simulated alarm has its own client ID and topic namespace and handles alarm/set, ping and
+ * status/get like InternetManager does, built from the same parts: TopicRouter, the alarm codecs,
+ * the command limiter and the precomputed status payloads. The alarm output is reduced to the mask
+ * of active alarm types. A backend client drives the traffic pattern and checks every status it gets.
+ *
+ * The run reports the command-to-status and ping-to-pong latency percentiles, the message rates seen
+ * by the clients and by the broker ($SYS topics, if the broker publishes them) and the devices whose
+ * state diverges from what the backend commanded.
+ *
+ * Build with `pio run -e fleet_sim` and run `.pio/build/fleet_sim/program --help` for the options.
+ * Beyond about 1000 devices, raise the open file limit (ulimit -n) and max_connections of the broker.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <sys/resource.h>
+
+#include "../Constants.h"
+#include "../AlarmTypes.h"
+#include "../AlarmCodec.h"
+#include "../StatusPayloads.h"
+#include "../TokenBucket.h"
+#include "../TopicRouter.h"
+#include "../native/PosixMqttTransport.h"
+
+namespace {
+  /**
+   * Chip IDs of the simulated devices start here, so their namespaces stay apart from real devices.
+   */
+  constexpr uint32_t FLEET_CHIP_ID_BASE = 0xF00000;
+
+  /**
+   * The group of the simulated devices, so group commands never reach real devices.
+   */
+  constexpr char FLEET_GROUP[] = "fleet";
+
+  /**
+   * Subscriptions every device makes after connecting, see InternetManager::onMqttConnect().
+   */
+  constexpr uint8_t SUBSCRIPTIONS_PER_DEVICE = 3 * TopicRouter::SCOPE_COUNT;
+
+  /**
+   * Time to wait for reconnecting after a lost connection, and for the fleet to settle after the traffic.
+   */
+  constexpr uint32_t RECONNECT_DELAY = 1000;
+  constexpr uint32_t DRAIN_TIME = 3000;
+
+  /**
+   * A command without a matching status after this long is counted as unanswered.
+   */
+  constexpr uint32_t ANSWER_TIMEOUT = 10000;
+
+  const std::chrono::steady_clock::time_point START = std::chrono::steady_clock::now();
+
+  uint64_t micros() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - START)
+        .count();
+  }
+
+  uint32_t millis() {
+    return (uint32_t)(micros() / 1000);
+  }
+
+  enum class Pattern {
+    /** Every command goes to a random device. */
+    UNIFORM,
+    /** Commands come in bursts of --burst to one random device, to exercise the limiter. */
+    BURST,
+    /** Every command goes to the group of all simulated devices. */
+    GROUP,
+    /** Every command goes to alarm/all, which also reaches real devices on a shared broker. */
+    ALL
+  };
+
+  struct Options {
+    const char *host = "127.0.0.1";
+    uint16_t port = 1883;
+    const char *user = nullptr;
+    const char *password = nullptr;
+    uint32_t devices = 500;
+    uint32_t duration = 60;
+    double commandRate = 50;
+    double pingRate = 10;
+    Pattern pattern = Pattern::UNIFORM;
+    uint32_t burst = 5;
+    double cborShare = 0;
+    double connectRate = 200;
+    uint32_t seed = 1;
+  };
+
+  Options options;
+  std::mt19937 randomEngine;
+
+  /**
+   * Shared by all devices, the event loop handles one message at a time.
+   */
+  JsonAlarmCodec jsonCodec;
+
+  /**
+   * Message counters of all clients together.
+   */
+  struct Traffic {
+    uint64_t commandsSent = 0;
+    uint64_t pingsSent = 0;
+    uint64_t deviceReceived = 0;
+    uint64_t devicePublished = 0;
+    uint64_t backendReceived = 0;
+  } traffic;
+
+  /**
+   * One simulated alarm.
+   */
+  class FleetDevice {
+  public:
+    PosixMqttTransport client;
+
+    /**
+     * The alarm types that are switched on, what AlarmStateManager would hold.
+     */
+    AlarmMask outputAlarms = 0;
+
+    uint32_t disconnects = 0;
+    uint32_t coalesced = 0;
+    uint8_t subscriptions = 0;
+
+    void begin(uint32_t chipId) {
+      snprintf(deviceId, sizeof(deviceId), "%06lx", (unsigned long)chipId);
+      snprintf(clientId, sizeof(clientId), "%s-%s", MQTT_CLIENT_ID, deviceId);
+      topics.begin(deviceId, FLEET_GROUP);
+
+      client.setServer(options.host, options.port);
+      client.setCredentials(options.user, options.password);
+      client.setClientId(clientId);
+      client.onConnect([this](bool) {
+        onConnect();
+      });
+      client.onDisconnect([this](int) {
+        disconnects++;
+        subscriptions = 0;
+        reconnectAt = millis() + RECONNECT_DELAY;
+      });
+      client.onSubscribe([this](uint16_t, uint8_t) {
+        subscriptions++;
+      });
+      client.onMessage([this](const char *topic, const char *payload, size_t len, size_t, size_t) {
+        onMessage(topic, payload, len);
+      });
+    }
+
+    const char *id() const {
+      return deviceId;
+    }
+
+    /**
+     * Connect for the first time. After that the device reconnects by itself.
+     */
+    void start() {
+      started = true;
+      client.connect();
+    }
+
+    void process(uint32_t now) {
+      if (!started) return;
+      if (client.fd() < 0 && (int32_t)(now - reconnectAt) >= 0) client.connect();
+      client.process(now);
+
+      if (statusRequested && (int32_t)(now - statusAnswerAt) >= 0) {
+        statusRequested = false;
+        sendAlarmState(true);
+      }
+      if (commandPending && limiter.timeUntilToken(now) == 0) {
+        limiter.tryTake(now);
+        commandPending = false;
+        applyAlarmState();
+      }
+    }
+
+  private:
+    char deviceId[DEVICE_ID_SIZE] = {};
+    char clientId[CLIENT_ID_SIZE] = {};
+    TopicRouter topics;
+    bool started = false;
+    uint32_t reconnectAt = 0;
+
+    AlarmMask activeAlarms = 0;
+    TokenBucket limiter{COMMAND_BURST, COMMAND_WINDOW};
+    bool commandPending = false;
+    AlarmMask publishedAlarms = 0;
+    bool statusKnown = false;
+    bool statusRequested = false;
+    uint32_t statusAnswerAt = 0;
+    char payloadBuffer[MQTT_MAX_PAYLOAD_SIZE];
+
+    void onConnect() {
+      char filter[TOPIC_MAX_LENGTH];
+      for (uint8_t scope = 0; scope < TopicRouter::SCOPE_COUNT; scope++) {
+        client.subscribe(topics.topic((TopicRouter::Scope)scope, TOPIC_ALARM_SET_FILTER, filter), 2);
+        client.subscribe(topics.topic((TopicRouter::Scope)scope, TOPIC_PING, filter), 0);
+        client.subscribe(topics.topic((TopicRouter::Scope)scope, TOPIC_ALARM_STATUS_GET, filter), 1);
+      }
+    }
+
+    void onMessage(const char *topic, const char *payload, size_t length) {
+      traffic.deviceReceived++;
+      TopicRouter::Match match = topics.match(topic);
+      if (match.route == TopicRouter::Route::PING) {
+        publish(TopicRouter::OUTBOUND_PONG, 0, PONG_PAYLOAD, PONG_PAYLOAD_LENGTH);
+      } else if (match.route == TopicRouter::Route::STATUS_GET) {
+        if (match.scope == TopicRouter::SCOPE_DEVICE) {
+          sendAlarmState(true);
+        } else if (!statusRequested) {
+          statusRequested = true;
+          statusAnswerAt = millis() + randomEngine() % BROADCAST_ANSWER_JITTER;
+        }
+      } else if (match.route == TopicRouter::Route::ALARM_SET || match.route == TopicRouter::Route::ALARM_SET_CBOR) {
+        if (length > sizeof(payloadBuffer)) return;
+        memcpy(payloadBuffer, payload, length);
+        setAlarmState(length, match.route == TopicRouter::Route::ALARM_SET_CBOR);
+      }
+    }
+
+    /**
+     * See InternetManager::setAlarmState().
+     */
+    void setAlarmState(size_t length, bool cbor) {
+      AlarmUpdate update;
+      const char *error = cbor ? CborAlarmCodec::decode(payloadBuffer, length, update)
+                               : jsonCodec.decode(payloadBuffer, length, update);
+      if (error != nullptr) return;
+
+      activeAlarms = update.applyTo(activeAlarms);
+      if (commandPending) {
+        coalesced++;
+      } else if (limiter.tryTake(millis())) {
+        applyAlarmState();
+      } else {
+        commandPending = true;
+      }
+    }
+
+    void applyAlarmState() {
+      outputAlarms = activeAlarms;
+      sendAlarmState(false);
+    }
+
+    /**
+     * See InternetManager::sendAlarmState(). A status that cannot be sent is not journaled,
+     * the backend counts the missing answer instead.
+     */
+    void sendAlarmState(bool requested) {
+      if (!requested && statusKnown && outputAlarms == publishedAlarms) return;
+
+      bool sent = false;
+      if (PUBLISH_JSON_STATUS) {
+        sent |= publish(TopicRouter::OUTBOUND_STATUS, 2, statusPayload(outputAlarms),
+                        statusPayloadLength(outputAlarms));
+      }
+      if (PUBLISH_CBOR_STATUS) {
+        sent |= publish(TopicRouter::OUTBOUND_STATUS_CBOR, 2, cborStatusPayload(outputAlarms),
+                        CBOR_STATUS_PAYLOAD_LENGTH);
+      }
+      if (sent) {
+        publishedAlarms = outputAlarms;
+        statusKnown = true;
+      }
+    }
+
+    bool publish(TopicRouter::Outbound topic, uint8_t qos, const char *payload, size_t length) {
+      if (client.publish(topics.topic(topic), qos, false, payload, length) == 0) return false;
+      traffic.devicePublished++;
+      return true;
+    }
+  };
+
+  /**
+   * The backend: sends the commands and pings and follows the status of every device.
+   */
+  class Backend {
+  public:
+    PosixMqttTransport client;
+
+    /**
+     * What the backend knows about a device.
+     */
+    struct DeviceView {
+      /**
+       * The state the commands so far should have led to.
+       */
+      AlarmMask commanded = 0;
+
+      /**
+       * The state in the last status of the device. Devices start with every alarm off.
+       */
+      AlarmMask reported = 0;
+
+      /**
+       * When the oldest command without a matching status and the last unanswered ping were sent, 0 if none.
+       */
+      uint64_t commandSentAt = 0;
+      uint64_t pingSentAt = 0;
+    };
+
+    std::vector<DeviceView> views;
+    std::vector<uint32_t> commandLatencies;
+    std::vector<uint32_t> pingLatencies;
+
+    /**
+     * Commands that needed no status because the state ended where the device had last reported,
+     * e.g. a burst that switched an alarm type on and off again.
+     */
+    uint32_t absorbed = 0;
+
+    uint32_t unanswered = 0;
+
+    /**
+     * The last message load the broker reported on its $SYS topics.
+     */
+    std::string brokerReceived = "-";
+    std::string brokerSent = "-";
+
+    void begin(const std::vector<std::unique_ptr<FleetDevice>> &devices) {
+      views.resize(devices.size());
+      for (size_t i = 0; i < devices.size(); i++) {
+        deviceIds.push_back(devices[i]->id());
+        deviceIndex[deviceIds.back()] = i;
+      }
+
+      client.setServer(options.host, options.port);
+      client.setCredentials(options.user, options.password);
+      client.setClientId(MQTT_CLIENT_ID "-fleet-backend");
+      client.onConnect([this](bool) {
+        client.subscribe(TOPIC_ALARM "/+/" TOPIC_ALARM_STATUS, 1);
+        client.subscribe(TOPIC_ALARM "/+/" TOPIC_PONG, 0);
+        client.subscribe("$SYS/broker/load/messages/+/1min", 0);
+      });
+      client.onDisconnect([this](int) {
+        reconnectAt = millis() + RECONNECT_DELAY;
+      });
+      client.onMessage([this](const char *topic, const char *payload, size_t len, size_t, size_t) {
+        onMessage(topic, payload, len);
+      });
+      client.connect();
+    }
+
+    void process(uint32_t now) {
+      if (client.fd() < 0 && (int32_t)(now - reconnectAt) >= 0) client.connect();
+      client.process(now);
+    }
+
+    /**
+     * Switch a random alarm type of a device, or of every device for the group and all patterns.
+     * Every command changes the commanded state, so every command expects a status.
+     *
+     * @param device The device, ignored for the group and all patterns
+     */
+    void sendCommand(size_t device) {
+      uint8_t type = (uint8_t)(randomEngine() % ALARM_TYPE_COUNT);
+      bool broadcast = options.pattern == Pattern::GROUP || options.pattern == Pattern::ALL;
+
+      // A broadcast switches the type to the opposite of what the first device has
+      bool value = ((views[broadcast ? 0 : device].commanded >> type) & 1U) == 0;
+      bool cbor = std::uniform_real_distribution<double>(0, 1)(randomEngine) < options.cborShare;
+
+      char payload[MQTT_MAX_PAYLOAD_SIZE];
+      size_t length;
+      if (cbor) {
+        payload[0] = (char)0xA1;
+        payload[1] = (char)(type + 1);
+        payload[2] = (char)(value ? cbor::TRUE : cbor::FALSE);
+        length = 3;
+      } else {
+        length = (size_t)snprintf(payload, sizeof(payload), "{\"%s\":%s}", ALARM_TYPES[type].key,
+                                  value ? "true" : "false");
+      }
+
+      std::string topic;
+      if (options.pattern == Pattern::GROUP) {
+        topic = std::string(TOPIC_ALARM "/" TOPIC_GROUP "/") + FLEET_GROUP + "/";
+      } else if (options.pattern == Pattern::ALL) {
+        topic = TOPIC_ALARM "/" TOPIC_ALL "/";
+      } else {
+        topic = std::string(TOPIC_ALARM "/") + deviceId(device) + "/";
+      }
+      topic += cbor ? TOPIC_ALARM_SET_CBOR : TOPIC_ALARM_SET;
+      if (client.publish(topic.c_str(), 1, false, payload, length) == 0) return;
+      traffic.commandsSent++;
+
+      uint64_t now = micros();
+      for (size_t i = broadcast ? 0 : device; i < (broadcast ? views.size() : device + 1); i++) {
+        DeviceView &view = views[i];
+        AlarmMask bit = (AlarmMask)(1U << type);
+        view.commanded = (AlarmMask)(value ? view.commanded | bit : view.commanded & ~bit);
+        if (view.commandSentAt == 0) view.commandSentAt = now;
+      }
+    }
+
+    void sendPing(size_t device) {
+      std::string topic = std::string(TOPIC_ALARM "/") + deviceId(device) + "/" TOPIC_PING;
+      if (client.publish(topic.c_str(), 0, false, "", 0) == 0) return;
+      traffic.pingsSent++;
+      if (views[device].pingSentAt == 0) views[device].pingSentAt = micros();
+    }
+
+    /**
+     * Settle the commands that will not get a status, see absorbed and unanswered.
+     */
+    void checkAnswers() {
+      uint64_t now = micros();
+      for (DeviceView &view : views) {
+        if (view.commandSentAt == 0 || now - view.commandSentAt < 1000 * (uint64_t)DRAIN_TIME / 2) continue;
+        if (view.reported == view.commanded) {
+          absorbed++;
+          view.commandSentAt = 0;
+        } else if (now - view.commandSentAt >= 1000 * (uint64_t)ANSWER_TIMEOUT) {
+          unanswered++;
+          view.commandSentAt = 0;
+        }
+      }
+    }
+
+  private:
+    std::unordered_map<std::string, size_t> deviceIndex;
+    std::vector<std::string> deviceIds;
+    uint32_t reconnectAt = 0;
+
+    const std::string &deviceId(size_t device) const {
+      return deviceIds[device];
+    }
+
+    void onMessage(const char *topic, const char *payload, size_t length) {
+      traffic.backendReceived++;
+      if (strncmp(topic, "$SYS/", 5) == 0) {
+        (strstr(topic, "/received/") != nullptr ? brokerReceived : brokerSent).assign(payload, length);
+        return;
+      }
+
+      // alarm/<device id>/status or alarm/<device id>/pong
+      const char *id = strchr(topic, '/');
+      const char *suffix = id == nullptr ? nullptr : strchr(id + 1, '/');
+      if (suffix == nullptr) return;
+      auto found = deviceIndex.find(std::string(id + 1, suffix - id - 1));
+      if (found == deviceIndex.end()) return;
+      DeviceView &view = views[found->second];
+      uint64_t now = micros();
+
+      if (strcmp(suffix + 1, TOPIC_PONG) == 0) {
+        if (view.pingSentAt != 0) pingLatencies.push_back((uint32_t)(now - view.pingSentAt));
+        view.pingSentAt = 0;
+        return;
+      }
+
+      for (unsigned mask = 0; mask <= ALL_ALARMS; mask++) {
+        if (statusPayloadLength((AlarmMask)mask) == length && memcmp(statusPayload((AlarmMask)mask), payload, length) == 0) {
+          view.reported = (AlarmMask)mask;
+          break;
+        }
+      }
+      if (view.commandSentAt != 0 && view.reported == view.commanded) {
+        commandLatencies.push_back((uint32_t)(now - view.commandSentAt));
+        view.commandSentAt = 0;
+      }
+    }
+  };
+
+  std::vector<std::unique_ptr<FleetDevice>> devices;
+  Backend backend;
+
+  /**
+   * Wait for socket activity for up to timeoutMs, then let every client handle it.
+   */
+  void pump(int timeoutMs) {
+    static std::vector<pollfd> fds;
+    fds.clear();
+    auto add = [](const PosixMqttTransport &client) {
+      if (client.fd() >= 0) fds.push_back({client.fd(), (short)(POLLIN | (client.wantsWrite() ? POLLOUT : 0)), 0});
+    };
+    add(backend.client);
+    for (const auto &device : devices) add(device->client);
+    poll(fds.data(), fds.size(), timeoutMs);
+
+    uint32_t now = millis();
+    backend.process(now);
+    for (const auto &device : devices) device->process(now);
+  }
+
+  /**
+   * Run the event loop for a while, calling tick with the elapsed time in microseconds after every pass.
+   */
+  template<typename Tick>
+  void runFor(uint32_t milliseconds, Tick tick) {
+    uint64_t start = micros();
+    while (micros() - start < 1000 * (uint64_t)milliseconds) {
+      pump(1);
+      tick(micros() - start);
+    }
+  }
+
+  /**
+   * Connect the devices at options.connectRate and wait until all of them have subscribed.
+   *
+   * @return The time it took in milliseconds
+   */
+  uint32_t connectFleet() {
+    uint64_t start = micros();
+    size_t started = 0;
+    auto subscribed = []() {
+      size_t count = 0;
+      for (const auto &device : devices) count += device->subscriptions == SUBSCRIPTIONS_PER_DEVICE;
+      return count;
+    };
+    while (micros() - start < 60 * 1000000ULL) {
+      size_t due = std::min(devices.size(), (size_t)((micros() - start) * options.connectRate / 1e6) + 1);
+      for (; started < due; started++) devices[started]->start();
+      pump(1);
+      if (started == devices.size() && backend.client.connected() && subscribed() == devices.size()) break;
+    }
+    std::printf("connect    devices: %zu/%zu subscribed  backend: %s  time: %lu ms\n", subscribed(), devices.size(),
+                backend.client.connected() ? "yes" : "no", (unsigned long)((micros() - start) / 1000));
+    return (uint32_t)((micros() - start) / 1000);
+  }
+
+  void reportPercentiles(const char *name, std::vector<uint32_t> &latencies) {
+    std::printf("latency    %-16s n: %6zu", name, latencies.size());
+    if (latencies.empty()) {
+      std::printf("\n");
+      return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    for (double quantile : {0.5, 0.9, 0.99, 0.999}) {
+      size_t index = std::min(latencies.size() - 1, (size_t)(quantile * latencies.size()));
+      std::printf("  p%g: %7.2f ms", quantile * 100, latencies[index] / 1000.0);
+    }
+    std::printf("  max: %7.2f ms\n", latencies.back() / 1000.0);
+  }
+
+  void reportDivergence() {
+    uint32_t stateDiverged = 0;
+    uint32_t statusDiverged = 0;
+    uint32_t shown = 0;
+    for (size_t i = 0; i < devices.size(); i++) {
+      const Backend::DeviceView &view = backend.views[i];
+      AlarmMask state = devices[i]->outputAlarms;
+      bool diverged = state != view.commanded || view.reported != state;
+      stateDiverged += state != view.commanded;
+      statusDiverged += view.reported != state;
+      if (diverged && shown++ < 5) {
+        std::printf("  %s  commanded: 0x%02x  state: 0x%02x  reported: 0x%02x  connected: %s\n", devices[i]->id(),
+                    view.commanded, state, view.reported, devices[i]->client.connected() ? "yes" : "no");
+      }
+    }
+    std::printf("divergence state != commanded: %u  status != state: %u  of %zu devices\n", stateDiverged,
+                statusDiverged, devices.size());
+  }
+
+  void usage(const char *program) {
+    std::printf("Usage: %s [options]\n"
+                "  --host HOST          broker host (127.0.0.1)\n"
+                "  --port PORT          broker port (1883)\n"
+                "  --user USER          broker user\n"
+                "  --password PASSWORD  broker password\n"
+                "  --devices N          simulated devices (500)\n"
+                "  --duration S         traffic time in seconds (60)\n"
+                "  --rate R             alarm/set commands per second over the fleet (50)\n"
+                "  --ping-rate R        pings per second over the fleet (10)\n"
+                "  --pattern P          uniform, burst, group or all (uniform)\n"
+                "  --burst N            commands per burst for the burst pattern (5)\n"
+                "  --cbor F             share of the commands sent as CBOR, 0 to 1 (0)\n"
+                "  --connect-rate R     device connections per second (200)\n"
+                "  --seed N             seed of the traffic pattern (1)\n",
+                program);
+  }
+
+  bool parseOptions(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+      std::string name = argv[i];
+      if (name == "--help" || i + 1 >= argc) return false;
+      const char *value = argv[++i];
+      if (name == "--host") options.host = value;
+      else if (name == "--port") options.port = (uint16_t)std::strtoul(value, nullptr, 10);
+      else if (name == "--user") options.user = value;
+      else if (name == "--password") options.password = value;
+      else if (name == "--devices") options.devices = (uint32_t)std::strtoul(value, nullptr, 10);
+      else if (name == "--duration") options.duration = (uint32_t)std::strtoul(value, nullptr, 10);
+      else if (name == "--rate") options.commandRate = std::strtod(value, nullptr);
+      else if (name == "--ping-rate") options.pingRate = std::strtod(value, nullptr);
+      else if (name == "--burst") options.burst = std::max(1UL, std::strtoul(value, nullptr, 10));
+      else if (name == "--cbor") options.cborShare = std::strtod(value, nullptr);
+      else if (name == "--connect-rate") options.connectRate = std::max(1.0, std::strtod(value, nullptr));
+      else if (name == "--seed") options.seed = (uint32_t)std::strtoul(value, nullptr, 10);
+      else if (name == "--pattern") {
+        std::string pattern = value;
+        if (pattern == "uniform") options.pattern = Pattern::UNIFORM;
+        else if (pattern == "burst") options.pattern = Pattern::BURST;
+        else if (pattern == "group") options.pattern = Pattern::GROUP;
+        else if (pattern == "all") options.pattern = Pattern::ALL;
+        else return false;
+      } else {
+        return false;
+      }
+    }
+    return options.devices > 0;
+  }
+
+  /**
+   * Every device holds a socket, so allow as many open files as the system does.
+   */
+  void raiseFileLimit() {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < options.devices + 16) {
+      std::printf("warning    open file limit %lu is too low for %u devices\n", (unsigned long)limit.rlim_cur,
+                  options.devices);
+    }
+  }
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (!parseOptions(argc, argv)) {
+    usage(argv[0]);
+    return 1;
+  }
+  raiseFileLimit();
+  randomEngine.seed(options.seed);
+
+  for (uint32_t i = 0; i < options.devices; i++) {
+    devices.push_back(std::make_unique<FleetDevice>());
+    devices.back()->begin(FLEET_CHIP_ID_BASE + i);
+  }
+  backend.begin(devices);
+  connectFleet();
+
+  // Traffic: commands and pings spread evenly over the run
+  uint64_t trafficStart = micros();
+  uint64_t commandsDue = 0;
+  uint64_t pingsDue = 0;
+  size_t burstDevice = 0;
+  uint32_t burstLeft = 0;
+  uint64_t nextCheck = 0;
+  runFor(options.duration * 1000, [&](uint64_t elapsed) {
+    uint64_t commands = (uint64_t)(elapsed * options.commandRate / 1e6);
+    for (; commandsDue < commands; commandsDue++) {
+      if (burstLeft == 0) {
+        burstDevice = randomEngine() % devices.size();
+        burstLeft = options.pattern == Pattern::BURST ? options.burst : 1;
+      }
+      burstLeft--;
+      backend.sendCommand(burstDevice);
+    }
+    uint64_t pings = (uint64_t)(elapsed * options.pingRate / 1e6);
+    for (; pingsDue < pings; pingsDue++) backend.sendPing(randomEngine() % devices.size());
+    if (elapsed >= nextCheck) {
+      backend.checkAnswers();
+      nextCheck = elapsed + 1000000;
+    }
+  });
+  double seconds = (micros() - trafficStart) / 1e6;
+
+  // Let the limiters release the held-back commands and the last statuses arrive
+  runFor(DRAIN_TIME, [](uint64_t) {});
+  backend.checkAnswers();
+  seconds = std::max(seconds, 1e-3);
+
+  uint32_t disconnects = 0;
+  uint32_t coalesced = 0;
+  uint64_t bytes = 0;
+  for (const auto &device : devices) {
+    disconnects += device->disconnects;
+    coalesced += device->coalesced;
+    bytes += device->client.bytesSent + device->client.bytesReceived;
+  }
+
+  std::printf("traffic    %.1f s  commands: %llu (%.1f/s)  pings: %llu (%.1f/s)  pattern: %s\n", seconds,
+              (unsigned long long)traffic.commandsSent, traffic.commandsSent / seconds,
+              (unsigned long long)traffic.pingsSent, traffic.pingsSent / seconds,
+              options.pattern == Pattern::UNIFORM ? "uniform" : options.pattern == Pattern::BURST ? "burst"
+              : options.pattern == Pattern::GROUP ? "group" : "all");
+  std::printf("clients    device in: %.1f/s  device out: %.1f/s  backend in: %.1f/s  device bytes: %.1f kB/s\n",
+              traffic.deviceReceived / seconds, traffic.devicePublished / seconds, traffic.backendReceived / seconds,
+              bytes / seconds / 1000);
+  std::printf("broker     $SYS messages/1min  received: %s  sent: %s\n", backend.brokerReceived.c_str(),
+              backend.brokerSent.c_str());
+  reportPercentiles("command->status", backend.commandLatencies);
+  reportPercentiles("ping->pong", backend.pingLatencies);
+  std::printf("commands   absorbed: %u  unanswered: %u  coalesced on devices: %u  disconnects: %u\n",
+              backend.absorbed, backend.unanswered, coalesced, disconnects);
+  reportDivergence();
+
+  for (const auto &device : devices) device->client.disconnect();
+  backend.client.disconnect();
+  return 0;
+}
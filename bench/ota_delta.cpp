@@ -0,0 +1,138 @@
+/**
+ * Host tool that makes the delta between two firmware images for an update over the air, see OtaUpdater.h.
+ *
+ * Writes the delta, patches it back onto the base with the patcher of the device to check that it gives the new
+ * image, and prints the sizes, the time a full and a delta update take to download at a given bandwidth, and the
+ * command to publish on TOPIC_OTA. Build with `pio run -e ota_delta`, then run the program it builds:
+ *
+ *   ota_delta BASE.bin NEW.bin OUT.msd [--server URL] [--bandwidth BYTES_PER_S]
+ *
+ * BASE.bin is the firmware.bin the devices run, NEW.bin the one to update to. The delta and NEW.bin are served
+ * from the root of the server, which must answer range requests, like `python3 -m RangeHTTPServer` or nginx.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../hal/Hal.h"
+#include "../DeltaPatch.h"
+#include "../Sha256.h"
+#include "../native/DeltaEncoder.h"
+
+namespace {
+  /**
+   * The size of the parts the delta is patched in, like the TCP segments it arrives in on the device.
+   */
+  constexpr size_t SEGMENT_SIZE = 1460;
+
+  bool readFile(const char *path, std::vector<uint8_t> &contents) {
+    FILE *file = std::fopen(path, "rb");
+    if (file == nullptr) return false;
+    uint8_t buffer[4096];
+    size_t read;
+    while ((read = std::fread(buffer, 1, sizeof(buffer), file)) > 0) contents.insert(contents.end(), buffer, buffer + read);
+    bool ok = std::ferror(file) == 0;
+    std::fclose(file);
+    return ok;
+  }
+
+  bool writeFile(const char *path, const std::vector<uint8_t> &contents) {
+    FILE *file = std::fopen(path, "wb");
+    if (file == nullptr) return false;
+    bool ok = std::fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+    return std::fclose(file) == 0 && ok;
+  }
+
+  const char *baseName(const char *path) {
+    const char *slash = std::strrchr(path, '/');
+    return slash != nullptr ? slash + 1 : path;
+  }
+
+  double millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  /**
+   * Patch the delta onto the base image like the device does.
+   *
+   * @return nullptr if it gives the new image, else a description of the error
+   */
+  const char *verify(const std::vector<uint8_t> &base, const std::vector<uint8_t> &delta, const uint8_t *hash) {
+    hal::sim::firmware = base;
+    DeltaPatcher patcher;
+    const char *error = patcher.begin(DeltaPatcher::Format::DELTA);
+    for (size_t offset = 0; offset < delta.size() && error == nullptr; offset += SEGMENT_SIZE) {
+      error = patcher.write(delta.data() + offset, std::min(SEGMENT_SIZE, delta.size() - offset));
+    }
+    if (error == nullptr) error = patcher.finish(hash);
+    return error;
+  }
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *server = "http://192.168.1.10:8080";
+  double bandwidth = 16 * 1024;
+  std::vector<const char *> paths;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+      server = argv[++i];
+    } else if (std::strcmp(argv[i], "--bandwidth") == 0 && i + 1 < argc) {
+      bandwidth = std::strtod(argv[++i], nullptr);
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (paths.size() != 3 || bandwidth <= 0) {
+    std::fprintf(stderr, "usage: %s BASE.bin NEW.bin OUT.msd [--server URL] [--bandwidth BYTES_PER_S]\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<uint8_t> base;
+  std::vector<uint8_t> image;
+  if (!readFile(paths[0], base) || !readFile(paths[1], image)) {
+    std::fprintf(stderr, "could not read %s or %s\n", paths[0], paths[1]);
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  DeltaEncoder encoder;
+  std::vector<uint8_t> delta = encoder.encode(base, image);
+  double encodeMs = millisecondsSince(start);
+  if (!writeFile(paths[2], delta)) {
+    std::fprintf(stderr, "could not write %s\n", paths[2]);
+    return 1;
+  }
+
+  uint8_t hash[SHA256_SIZE];
+  Sha256 sha;
+  sha.update(image.data(), image.size());
+  sha.finish(hash);
+  char hex[2 * SHA256_SIZE + 1];
+  for (size_t i = 0; i < SHA256_SIZE; i++) std::snprintf(hex + 2 * i, 3, "%02x", hash[i]);
+
+  start = std::chrono::steady_clock::now();
+  const char *error = verify(base, delta, hash);
+  double patchMs = millisecondsSince(start);
+  if (error != nullptr) {
+    std::fprintf(stderr, "the delta does not give the new image: %s\n", error);
+    return 1;
+  }
+
+  const DeltaEncoder::Stats &stats = encoder.getStats();
+  std::printf("base       %8zu B\n", base.size());
+  std::printf("new        %8zu B  sha256: %s\n", image.size(), hex);
+  std::printf("delta      %8zu B  %.1f%% of the image  patch stream: %zu B  instructions: %zu  add: %zu B  copy: %zu B\n",
+              delta.size(), delta.size() * 100.0 / image.size(), stats.patchSize, stats.instructions, stats.addBytes,
+              stats.copyBytes);
+  std::printf("host time  encode: %.1f ms  patch and verify: %.1f ms\n", encodeMs, patchMs);
+  std::printf("download   full: %.1f s  delta: %.1f s  at %.0f B/s\n", image.size() / bandwidth, delta.size() / bandwidth,
+              bandwidth);
+  std::printf("command    {\"" KEY_SERVER "\":\"%s\",\"" KEY_DELTA "\":\"/%s\",\"" KEY_DELTA_SIZE "\":%zu,\"" KEY_FULL
+              "\":\"/%s\",\"" KEY_FULL_SIZE "\":%zu,\"" KEY_SHA256 "\":\"%s\"}\n", server, baseName(paths[2]),
+              delta.size(), baseName(paths[1]), image.size(), hex);
+  return 0;
+}
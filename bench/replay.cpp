@@ -0,0 +1,977 @@
+/**
+ * Accelerated-time replay of command and button traces against the alarm state machine.
+ *
+ * The alarm state manager, the button input and the scheduler run unchanged on the simulated clock of
+ * native/HostHal.h, which jumps from one deadline to the next, so the 30 second window, the 10 minute
+ * re-alarm and the playback repeats replay at thousands of times real speed. Every built-in scenario
+ * asserts the exact light and claxon edge timeline, some of them across the millis() rollover.
+ * The telemetry scenarios feed generated sensor readings through the rules of TelemetryRules.h and assert that the
+ * light follows a straightforward reference evaluation of the same rules at the very reading that crosses them.
+ * Microbenchmarks of checkTriggerAlarm(), the alarm/set path, the status formatting and the evaluation of a reading
+ * follow, to catch per-tick cost regressions.
+ *
+ * Build and run with `pio run -e replay -t exec`. Options:
+ *   --trace FILE       replay a recorded trace and print its timeline instead of running the scenarios
+ *   --start MS         the millis() value the trace starts at, e.g. 4294960000 to cross the rollover
+ *   --duration MS      how long to replay the trace, by default until 1 s after its last event
+ *   --max-tick-ns NS   fail if a checkTriggerAlarm() tick takes longer than this on average
+ *
+ * A trace has one event per line: the time in milliseconds since the start, then "set" followed by an
+ * alarm/set JSON payload, "press", "release", or "airflow" or "pressure" followed by a sensor reading.
+ * Empty lines and lines starting with '#' are skipped. The alarm types the rules detect in the readings of a
+ * recorded trace are printed, and checked against the reference evaluation.
+ */
+
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "../hal/Hal.h"
+#include "../Constants.h"
+#include "../AlarmStateManager.h"
+#include "../AlarmCodec.h"
+#include "../ButtonInput.h"
+#include "../CommandTrace.h"
+#include "../Scheduler.h"
+#include "../StatusPayloads.h"
+#include "../TelemetryRules.h"
+
+namespace {
+  constexpr uint32_t ITERATIONS = 200000;
+
+  /**
+   * Keeps the compiler from optimizing the measured work away.
+   */
+  volatile uint32_t sink = 0;
+
+  /**
+   * An event of a trace, at a time in milliseconds since the start of the replay.
+   */
+  struct Event {
+    enum Kind : uint8_t {
+      SET,
+      PRESS,
+      RELEASE,
+      AIRFLOW,
+      AIR_PRESSURE,
+      ESCALATION,
+    };
+
+    uint32_t at;
+    Kind kind;
+    std::string payload;
+  };
+
+  /**
+   * A level change of the light or the claxon, at a time in milliseconds since the start of the replay.
+   */
+  struct Edge {
+    uint8_t pin;
+    uint8_t level;
+    uint32_t at;
+
+    bool operator==(const Edge &other) const {
+      return pin == other.pin && level == other.level && at == other.at;
+    }
+  };
+
+  /**
+   * A part of the expected timeline, expanded into edges by expand().
+   */
+  struct Expectation {
+    enum Kind : uint8_t {
+      LIGHT,     // The light switches to level at `at`
+      PATTERN,   // The pattern of `beeps` repeats from `at` until it is stopped at `until`
+      PLAYBACK,  // The pattern of `beeps` plays `cycles` times from `at`
+    };
+
+    Kind kind;
+    uint32_t at;
+    uint8_t level;
+    uint8_t beeps;
+    uint32_t until;
+    uint8_t cycles;
+  };
+
+  Expectation light(uint32_t at, uint8_t level) {
+    return {Expectation::LIGHT, at, level, 0, 0, 0};
+  }
+
+  Expectation pattern(uint32_t at, uint8_t beeps, uint32_t until) {
+    return {Expectation::PATTERN, at, 0, beeps, until, 0};
+  }
+
+  Expectation playback(uint32_t at, uint8_t beeps, uint8_t cycles = PLAYBACK_COUNT) {
+    return {Expectation::PLAYBACK, at, 0, beeps, 0, cycles};
+  }
+
+  /**
+   * Expand the expectations into the edges of one pin, in the order they must happen.
+   * A pattern that is stopped switches the claxon off at the stop time, after the edges that are due then.
+   */
+  std::vector<Edge> expand(const std::vector<Expectation> &expectations, uint8_t pin) {
+    std::vector<Edge> edges;
+    for (const Expectation &expectation : expectations) {
+      if (expectation.kind == Expectation::LIGHT) {
+        if (pin == ALARM_LIGHT_PIN) edges.push_back({pin, expectation.level, expectation.at});
+        continue;
+      }
+      if (pin != ALARM_CLAXON_PIN) continue;
+
+      BeepPattern beeps = beepPattern(expectation.beeps);
+      uint32_t time = expectation.at;
+      bool on = false;
+      bool stopped = false;
+      for (uint32_t cycle = 0; !stopped && (expectation.cycles == 0 || cycle < expectation.cycles); cycle++) {
+        for (uint8_t step = 0; step < 2 * beeps.beeps; step++) {
+          if (expectation.kind == Expectation::PATTERN && time > expectation.until) {
+            if (on) edges.push_back({pin, LOW, expectation.until});
+            stopped = true;
+            break;
+          }
+          on = step % 2 == 0;
+          edges.push_back({pin, (uint8_t)(on ? HIGH : LOW), time});
+          time += on ? beeps.onMs : step + 1 == 2 * beeps.beeps ? beeps.pauseMs : beeps.offMs;
+        }
+      }
+    }
+    std::stable_sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) { return a.at < b.at; });
+    return edges;
+  }
+
+  /**
+   * Reset the simulated board: the clock starts at the given millis() value, the pins are low and
+   * RTC memory holds no alarm snapshot.
+   */
+  void resetBoard(uint32_t start) {
+    hal::sim::clockMs = start;
+    hal::sim::idleMs = 0;
+    hal::sim::onIdle = nullptr;
+    memset(hal::sim::pinLevels, 0, sizeof(hal::sim::pinLevels));
+    memset(hal::sim::rtcMemory, 0, sizeof(hal::sim::rtcMemory));
+    hal::sim::flashFiles.clear();
+  }
+
+  /**
+   * Runs the alarm state manager and the button input from a trace, scheduled the same way as on the device.
+   * Only one replay can exist at a time, as the button interrupt and the hardware timer are global.
+   */
+  class Replay {
+  public:
+    /**
+     * Reset the simulated board and start the components at the given millis() value.
+     */
+    Replay(uint32_t start, std::vector<Event> events) : start(start), events(std::move(events)) {
+      active = this;
+      resetBoard(start);
+      hal::sim::onPinChange = [this](uint8_t pin, uint8_t level, uint32_t timeMs) {
+        if (pin == ALARM_LIGHT_PIN || pin == ALARM_CLAXON_PIN) edges.push_back({pin, level, timeMs - this->start});
+      };
+
+      alarmStateManager.initialize();
+      telemetry.begin(TELEMETRY_RULES, TELEMETRY_RULE_COUNT);
+      scheduler.add("replay", [this](uint32_t now) {
+        return process(now);
+      });
+      buttonTask = scheduler.add("button", [this](uint32_t now) {
+        return buttonInput.process(now);
+      });
+      alarmTask = scheduler.add("alarm", [this](uint32_t now) {
+        (void)now;
+        return alarmStateManager.checkTriggerAlarm();
+      });
+      alarmStateManager.onStateChange([this]() {
+        scheduler.wake(alarmTask);
+      });
+
+      // Like on the device: a short press silences the claxon, a long press clears all alarms
+      buttonInput.onPress([this]() {
+        alarmStateManager.silenceClaxon();
+      });
+      buttonInput.onLongPress([this]() {
+        apply(0);
+      });
+      buttonInput.initialize(onButtonEdge);
+    }
+
+    ~Replay() {
+      hal::sim::onPinChange = nullptr;
+      hal::attachPinInterrupt(ALARM_BUTTON_PIN, nullptr);
+      hal::disarmTimer();
+      active = nullptr;
+    }
+
+    /**
+     * Run the main loop until the given time since the start.
+     */
+    void run(uint32_t duration) {
+      uint32_t end = start + duration;
+      while ((int32_t)(end - hal::millis()) > 0) {
+        scheduler.runOnce();
+      }
+    }
+
+    /**
+     * @return The edges of one pin before the given time since the start
+     */
+    std::vector<Edge> getEdges(uint8_t pin, uint32_t before) const {
+      std::vector<Edge> result;
+      for (const Edge &edge : edges) {
+        if (edge.pin == pin && edge.at < before) result.push_back(edge);
+      }
+      return result;
+    }
+
+    /**
+     * @return All edges in the order they happened
+     */
+    const std::vector<Edge> &getEdges() const {
+      return edges;
+    }
+
+    /**
+     * @return The alarm types the rules detected after every reading, at the time since the start
+     */
+    const std::vector<std::pair<uint32_t, AlarmMask>> &getDetections() const {
+      return detections;
+    }
+
+  private:
+    static inline Replay *active = nullptr;
+
+    uint32_t start;
+    std::vector<Event> events;
+    size_t nextEvent = 0;
+    std::vector<Edge> edges;
+    std::vector<std::pair<uint32_t, AlarmMask>> detections;
+
+    AlarmStateManager alarmStateManager;
+    TelemetryEvaluator telemetry;
+    ButtonInput buttonInput;
+    Scheduler<SCHEDULER_CAPACITY> scheduler;
+    JsonAlarmCodec jsonCodec;
+    uint8_t buttonTask = 0;
+    uint8_t alarmTask = 0;
+
+    static void IRAM_ATTR onButtonEdge() {
+      if (active != nullptr) active->scheduler.wakeFromInterrupt(active->buttonTask);
+    }
+
+    /**
+     * Inject the events that are due, like the network task delivers commands on the device.
+     *
+     * @return The time in milliseconds until the next event
+     */
+    uint32_t process(uint32_t now) {
+      while (nextEvent < events.size() && (int32_t)(now - (start + events[nextEvent].at)) >= 0) {
+        const Event &event = events[nextEvent++];
+        if (event.kind == Event::SET) {
+          set(event.payload);
+        } else if (event.kind == Event::ESCALATION) {
+          escalate(event.payload);
+        } else if (event.kind == Event::AIRFLOW || event.kind == Event::AIR_PRESSURE) {
+          sample(event.kind == Event::AIRFLOW ? TelemetryChannel::AIRFLOW : TelemetryChannel::AIR_PRESSURE,
+                 event.payload, now);
+        } else {
+          hal::sim::drivePin(ALARM_BUTTON_PIN, event.kind == Event::PRESS ? HIGH : LOW);
+        }
+      }
+      if (nextEvent == events.size()) return SCHEDULER_MAX_IDLE;
+      return start + events[nextEvent].at - now;
+    }
+
+    /**
+     * Decode an alarm/set payload and apply it, like InternetManager::setAlarmState() without the rate limit.
+     */
+    void set(const std::string &payload) {
+      char buffer[MQTT_MAX_PAYLOAD_SIZE + 1];
+      AlarmUpdate update;
+      size_t length = std::min(payload.size(), (size_t)MQTT_MAX_PAYLOAD_SIZE);
+      memcpy(buffer, payload.data(), length);
+      const char *error = jsonCodec.decode(buffer, length, update);
+      if (error != nullptr) {
+        std::fprintf(stderr, "invalid payload %s: %s\n", payload.c_str(), error);
+        return;
+      }
+      apply(update.applyTo(alarmStateManager.getActiveAlarms()));
+    }
+
+    /**
+     * Decode escalation policies and hand them over, like InternetManager::updateEscalation().
+     */
+    void escalate(const std::string &payload) {
+      EscalationTable table;
+      const char *error = EscalationTable::decode((const uint8_t *)payload.data(), payload.size(), table);
+      if (error == nullptr) error = alarmStateManager.updateEscalation(table);
+      if (error != nullptr) std::fprintf(stderr, "invalid escalation policies: %s\n", error);
+    }
+
+    /**
+     * Evaluate a sensor reading and apply what the rules detect, like InternetManager::onTelemetry().
+     */
+    void sample(TelemetryChannel channel, const std::string &reading, uint32_t now) {
+      AlarmMask changed = telemetry.feed(channel, reading.data(), reading.size(), now);
+      detections.push_back({now - start, telemetry.getDetected()});
+      if (changed == 0) return;
+      AlarmMask detected = telemetry.getDetected();
+      apply((AlarmMask)((alarmStateManager.getActiveAlarms() & ~changed) | (detected & changed)));
+    }
+
+    void apply(AlarmMask alarms) {
+      if (alarms == alarmStateManager.getActiveAlarms()) return;
+      if (alarms != 0) {
+        alarmStateManager.checkAlarmType(alarms);
+      } else {
+        alarmStateManager.turnAlarmOff();
+      }
+    }
+  };
+
+  const char *const SET_TEST = "{\"" KEY_TEST_ALARM_ON "\":true}";
+  const char *const SET_AIRFLOW = "{\"" KEY_AIRFLOW_ALARM_ON "\":true}";
+  const char *const CLEAR_AIRFLOW = "{\"" KEY_AIRFLOW_ALARM_ON "\":false}";
+  const char *const SET_AIR_PRESSURE = "{\"" KEY_AIR_PRESSURE_ALARM_ON "\":true}";
+
+  /**
+   * Escalation policies in CBOR for the airflow alarm, key 2: its own pattern for 5 s, then one beep twice and
+   * 20 s of silence, repeated from the second stage. The other alarm types keep the default policy.
+   * {"version": 3, 2: [1, [5000, 255, 0], [0, 1, 2], [20000, 0, 0]]}
+   */
+  const std::string AIRFLOW_ESCALATION("\xA2\x67version\x03\x02\x84\x01\x83\x19\x13\x88\x18\xFF\x00"
+                                       "\x83\x00\x01\x02\x83\x19\x4E\x20\x00\x00", 30);
+
+  /**
+   * The end of the first stage of the default escalation, which stops the claxon.
+   */
+  constexpr uint32_t WINDOW_END = DELAY_30_SECONDS;
+
+  /**
+   * The duration of the playback after 10 minutes.
+   */
+  constexpr uint32_t playbackLength(uint8_t beeps) {
+    return PLAYBACK_COUNT * beepPattern(beeps).cycleLength();
+  }
+
+  struct Scenario {
+    const char *name;
+    uint32_t start;
+    uint32_t duration;
+    std::vector<Event> events;
+    std::vector<Expectation> expected;
+  };
+
+  std::vector<Scenario> scenarios() {
+    // The second playback starts 10 minutes after the first one completed
+    constexpr uint32_t SECOND_PLAYBACK = DELAY_10_MINUTES + playbackLength(AIRFLOW_BEEPS) + DELAY_10_MINUTES;
+    const std::vector<Event> airflow = {{0, Event::SET, SET_AIRFLOW}};
+    const std::vector<Expectation> firstWindow = {
+      light(0, HIGH),
+      pattern(0, AIRFLOW_BEEPS, WINDOW_END),
+    };
+    const std::vector<Expectation> reAlarm = {
+      light(0, HIGH),
+      pattern(0, AIRFLOW_BEEPS, WINDOW_END),
+      playback(DELAY_10_MINUTES, AIRFLOW_BEEPS),
+      playback(SECOND_PLAYBACK, AIRFLOW_BEEPS),
+    };
+
+    return {
+      {"first 30 s", 0, 2 * DELAY_30_SECONDS, airflow, firstWindow},
+      {"re-alarm", 0, SECOND_PLAYBACK + playbackLength(AIRFLOW_BEEPS) + 1000, airflow, reAlarm},
+      {"silence", 0, DELAY_10_MINUTES + playbackLength(TEST_BEEPS) + 1000,
+       {{0, Event::SET, SET_TEST}, {10200, Event::PRESS, ""}, {10300, Event::RELEASE, ""}},
+       {light(0, HIGH), pattern(0, TEST_BEEPS, 10200), playback(DELAY_10_MINUTES, TEST_BEEPS)}},
+      {"add type", 0, 2 * DELAY_30_SECONDS,
+       {{0, Event::SET, SET_AIR_PRESSURE}, {12200, Event::SET, SET_AIRFLOW}},
+       {light(0, HIGH), pattern(0, AIR_PRESSURE_BEEPS, 12200), pattern(12200, MULTIPLE_CAUSES_BEEPS, 12200 + WINDOW_END)}},
+      {"clear", 0, 20000,
+       {{0, Event::SET, SET_AIRFLOW}, {5000, Event::SET, CLEAR_AIRFLOW}},
+       {light(0, HIGH), pattern(0, AIRFLOW_BEEPS, 5000), light(5000, LOW)}},
+      {"long press", 0, 10000,
+       {{0, Event::SET, SET_AIRFLOW}, {2000, Event::PRESS, ""}, {3500, Event::RELEASE, ""}},
+       {light(0, HIGH), pattern(0, AIRFLOW_BEEPS, 2000), light(2000 + BUTTON_LONG_PRESS, LOW)}},
+      // A policy from the backend, stored in flash; the test alarm keeps the default
+      {"custom policy", 0, 60000,
+       {{0, Event::ESCALATION, AIRFLOW_ESCALATION}, {1000, Event::SET, SET_AIRFLOW}},
+       {light(1000, HIGH), pattern(1000, AIRFLOW_BEEPS, 6000), playback(6000, TEST_BEEPS, 2),
+        playback(30000, TEST_BEEPS, 2), playback(54000, TEST_BEEPS, 2)}},
+      // millis() wraps in the first 30 seconds and while waiting for the re-alarm
+      {"rollover window", 0U - 15000U, 2 * DELAY_30_SECONDS, airflow, firstWindow},
+      {"rollover re-alarm", 0U - DELAY_10_MINUTES / 2, SECOND_PLAYBACK + playbackLength(AIRFLOW_BEEPS) + 1000,
+       airflow, reAlarm},
+    };
+  }
+
+  const char *pinName(uint8_t pin) {
+    return pin == ALARM_LIGHT_PIN ? "light" : "claxon";
+  }
+
+  /**
+   * Compare the timeline of one pin with the expectation and print the first difference.
+   *
+   * @return true if they are the same
+   */
+  bool compare(const char *scenario, uint8_t pin, const std::vector<Edge> &expected, const std::vector<Edge> &actual) {
+    size_t index = 0;
+    while (index < expected.size() && index < actual.size() && expected[index] == actual[index]) index++;
+    if (index == expected.size() && index == actual.size()) return true;
+
+    std::printf("  %s: %s edge %zu of %zu differs: expected ", scenario, pinName(pin), index, expected.size());
+    if (index < expected.size()) {
+      std::printf("%s at %u ms", expected[index].level == HIGH ? "on" : "off", expected[index].at);
+    } else {
+      std::printf("no edge");
+    }
+    std::printf(", got ");
+    if (index < actual.size()) {
+      std::printf("%s at %u ms (%zu edges)\n", actual[index].level == HIGH ? "on" : "off", actual[index].at, actual.size());
+    } else {
+      std::printf("no edge\n");
+    }
+    return false;
+  }
+
+  /**
+   * Replay all scenarios and assert their timelines.
+   *
+   * @return true if all timelines are as expected
+   */
+  bool runScenarios() {
+    bool passed = true;
+    for (const Scenario &scenario : scenarios()) {
+      auto wallStart = std::chrono::steady_clock::now();
+      Replay replay(scenario.start, scenario.events);
+      replay.run(scenario.duration);
+      double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+
+      bool ok = true;
+      size_t edgeCount = 0;
+      for (uint8_t pin : {(uint8_t)ALARM_LIGHT_PIN, (uint8_t)ALARM_CLAXON_PIN}) {
+        std::vector<Edge> actual = replay.getEdges(pin, scenario.duration);
+        std::vector<Edge> expected = expand(scenario.expected, pin);
+        expected.erase(std::remove_if(expected.begin(), expected.end(),
+                                      [&](const Edge &edge) { return edge.at >= scenario.duration; }),
+                       expected.end());
+        ok &= compare(scenario.name, pin, expected, actual);
+        edgeCount += actual.size();
+      }
+      passed &= ok;
+      std::printf("%-18s edges: %4zu  simulated: %7.1f s  speed: %9.0fx  %s\n", scenario.name, edgeCount,
+                  scenario.duration / 1000.0, scenario.duration / std::max(wallMs, 0.001), ok ? "ok" : "FAILED");
+    }
+    return passed;
+  }
+
+  /**
+   * The rules of TelemetryRules.h evaluated the obvious way, from the whole history of readings, to check the
+   * compiled evaluation with its rings and running sums against. Readings are parsed with strtod.
+   */
+  class ReferenceRules {
+  public:
+    /**
+     * @return The alarm types detected after the reading
+     */
+    AlarmMask feed(TelemetryChannel channel, const std::string &reading, uint32_t now) {
+      // A reading that is not a number is dropped, like the device does
+      char *end;
+      double value = std::strtod(reading.c_str(), &end);
+      bool valid = !reading.empty() && *end == '\0';
+      std::vector<Reading> &readings = history[(size_t)channel];
+      if (valid) readings.push_back({now, (int64_t)std::llround(value * 1000)});
+      AlarmMask detected = 0;
+      for (size_t i = 0; i < TELEMETRY_RULE_COUNT; i++) {
+        const TelemetryRule &rule = TELEMETRY_RULES[i];
+        if (valid && rule.channel == channel && readings.size() >= rule.window) update(rule, states[i], readings, now);
+        if (states[i].raised) detected |= rule.alarm;
+      }
+      return detected;
+    }
+
+  private:
+    struct Reading {
+      uint32_t at;
+      int64_t thousandths;
+    };
+
+    struct RuleState {
+      bool raised = false;
+      bool pending = false;
+      uint32_t since = 0;
+      uint32_t raisedAt = 0;
+    };
+
+    std::vector<Reading> history[(size_t)TelemetryChannel::COUNT];
+    RuleState states[TELEMETRY_RULE_COUNT];
+
+    static void update(const TelemetryRule &rule, RuleState &state, const std::vector<Reading> &readings, uint32_t now) {
+      // mean < threshold is sum < threshold * window, rate < threshold is change * 1000 < threshold * elapsed
+      const Reading &oldest = readings[readings.size() - rule.window];
+      const Reading &newest = readings.back();
+      int64_t measured = 0;
+      int64_t scale = rule.window;
+      if (rule.kind == TelemetryRule::BELOW || rule.kind == TelemetryRule::ABOVE) {
+        for (size_t i = readings.size() - rule.window; i < readings.size(); i++) measured += readings[i].thousandths;
+      } else {
+        if (newest.at == oldest.at) return;
+        measured = (newest.thousandths - oldest.thousandths) * 1000;
+        scale = newest.at - oldest.at;
+      }
+
+      int64_t threshold = std::llround(rule.threshold * 1000.0) * scale;
+      int64_t back = std::llround(rule.hysteresis * 1000.0) * scale;
+      bool raise = false;
+      bool clear = false;
+      switch (rule.kind) {
+        case TelemetryRule::BELOW:
+          raise = measured < threshold;
+          clear = measured >= threshold + back;
+          break;
+        case TelemetryRule::ABOVE:
+          raise = measured > threshold;
+          clear = measured <= threshold - back;
+          break;
+        case TelemetryRule::FALLING:
+          raise = measured < -threshold;
+          clear = measured >= -(threshold - back);
+          break;
+        case TelemetryRule::RISING:
+          raise = measured > threshold;
+          clear = measured <= threshold - back;
+          break;
+      }
+
+      if (state.raised) {
+        if (clear && now - state.raisedAt >= rule.hold) state.raised = state.pending = false;
+      } else if (!raise) {
+        state.pending = false;
+      } else {
+        if (!state.pending) state.since = now;
+        state.pending = true;
+        if (now - state.since >= rule.minDuration) {
+          state.raised = true;
+          state.raisedAt = now;
+        }
+      }
+    }
+  };
+
+  /**
+   * Deterministic noise, so every run replays the same readings.
+   */
+  class Noise {
+  public:
+    explicit Noise(uint32_t seed) : state(seed) {}
+
+    /**
+     * @return A value between -amplitude and amplitude
+     */
+    double next(double amplitude) {
+      state = state * 1664525U + 1013904223U;
+      return ((state >> 8) / 16777216.0 * 2 - 1) * amplitude;
+    }
+
+  private:
+    uint32_t state;
+  };
+
+  /**
+   * Generate the readings of a sensor, formatted with one decimal like the sensors publish them.
+   *
+   * @param kind Event::AIRFLOW or Event::AIR_PRESSURE
+   * @param period The time between two readings in milliseconds
+   * @param duration The time to generate readings for
+   * @param level The value without noise at a time since the start
+   * @param noise The amplitude of the noise
+   * @param events Receives the readings, merged by time with the events already in it
+   */
+  template<typename Level>
+  void generate(Event::Kind kind, uint32_t period, uint32_t duration, Level level, double noise,
+                std::vector<Event> &events) {
+    Noise random(kind * 7919U + period);
+    for (uint32_t at = 0; at < duration; at += period) {
+      char text[TELEMETRY_MAX_PAYLOAD_SIZE];
+      snprintf(text, sizeof(text), "%.1f", level(at) + random.next(noise));
+      events.push_back({at, kind, text});
+    }
+    std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b) { return a.at < b.at; });
+  }
+
+  struct TelemetryScenario {
+    const char *name;
+    uint32_t duration;
+    std::vector<Event> events;
+  };
+
+  std::vector<TelemetryScenario> telemetryScenarios() {
+    std::vector<TelemetryScenario> result;
+
+    // The fan stalls in two readings and runs again after a minute
+    TelemetryScenario stall = {"fan stall", 180000, {}};
+    generate(Event::AIRFLOW, 1000, stall.duration, [](uint32_t at) {
+      return at < 61000 ? 300.0 : at < 62000 ? 170.0 : at < 120000 ? 40.0 : 300.0;
+    }, 8, stall.events);
+    result.push_back(stall);
+
+    // A filter clogs slowly, too slow for the fall rule, and is replaced
+    TelemetryScenario clog = {"slow clog", 400000, {}};
+    generate(Event::AIRFLOW, 1000, clog.duration, [](uint32_t at) {
+      return at < 50000 ? 300.0 : at < 300000 ? std::max(100.0, 300.0 - (at - 50000) * 0.0012) : 300.0;
+    }, 8, clog.events);
+    result.push_back(clog);
+
+    // Noisy readings around the threshold, the hysteresis keeps the light from flickering
+    TelemetryScenario noisy = {"noisy threshold", 300000, {}};
+    generate(Event::AIRFLOW, 1000, noisy.duration, [](uint32_t) { return 158.0; }, 15, noisy.events);
+    result.push_back(noisy);
+
+    // A pressure dip shorter than the minimum duration, then a long one
+    TelemetryScenario dip = {"pressure dip", 120000, {}};
+    generate(Event::AIR_PRESSURE, 500, dip.duration, [](uint32_t at) {
+      return (at >= 30000 && at < 32000) || (at >= 60000 && at < 72000) ? 6.0 : 25.0;
+    }, 0.5, dip.events);
+    result.push_back(dip);
+
+    // A stall and a pressure dip at once
+    TelemetryScenario both = {"stall and dip", 90000, {}};
+    generate(Event::AIRFLOW, 1000, both.duration, [](uint32_t at) {
+      return at >= 20000 && at < 60000 ? 30.0 : 300.0;
+    }, 8, both.events);
+    generate(Event::AIR_PRESSURE, 500, both.duration, [](uint32_t at) {
+      return at >= 25000 && at < 50000 ? 4.0 : 25.0;
+    }, 0.5, both.events);
+    result.push_back(both);
+
+    return result;
+  }
+
+  /**
+   * Compare the detections of a replay with the reference evaluation of its readings.
+   *
+   * @param expectedLight Receives the light edges the reference detections give, if only readings drive the alarm
+   * @return The amount of readings after which the detections differ
+   */
+  size_t checkDetections(const std::vector<Event> &events, const Replay &replay, std::vector<Edge> &expectedLight) {
+    ReferenceRules reference;
+    const std::vector<std::pair<uint32_t, AlarmMask>> &detections = replay.getDetections();
+    size_t index = 0;
+    size_t mismatches = 0;
+    bool lit = false;
+    for (const Event &event : events) {
+      if (event.kind != Event::AIRFLOW && event.kind != Event::AIR_PRESSURE) continue;
+      TelemetryChannel channel = event.kind == Event::AIRFLOW ? TelemetryChannel::AIRFLOW : TelemetryChannel::AIR_PRESSURE;
+      AlarmMask expected = reference.feed(channel, event.payload, event.at);
+      if (index >= detections.size() || detections[index].first != event.at || detections[index].second != expected) {
+        if (mismatches++ == 0) {
+          std::printf("  reading at %u ms: expected alarms 0x%02x, got 0x%02x\n", event.at, expected,
+                      index < detections.size() ? detections[index].second : 0);
+        }
+      }
+      index++;
+      if ((expected != 0) != lit) {
+        lit = expected != 0;
+        expectedLight.push_back({ALARM_LIGHT_PIN, (uint8_t)(lit ? HIGH : LOW), event.at});
+      }
+    }
+    return mismatches;
+  }
+
+  /**
+   * Replay the telemetry scenarios and assert that the rules detect what the reference detects, and that the
+   * light switches at the reading that crosses a rule, well within one sample period.
+   *
+   * @return true if all detections and light timelines are as expected
+   */
+  bool runTelemetryScenarios() {
+    bool passed = true;
+    for (const TelemetryScenario &scenario : telemetryScenarios()) {
+      Replay replay(0, scenario.events);
+      replay.run(scenario.duration);
+
+      std::vector<Edge> expectedLight;
+      size_t mismatches = checkDetections(scenario.events, replay, expectedLight);
+      std::vector<Edge> light = replay.getEdges(ALARM_LIGHT_PIN, scenario.duration);
+      bool ok = mismatches == 0 && compare(scenario.name, ALARM_LIGHT_PIN, expectedLight, light);
+      passed &= ok;
+      std::printf("%-18s readings: %4zu  mismatches: %zu  light edges: %2zu  first detection: ", scenario.name,
+                  replay.getDetections().size(), mismatches, light.size());
+      if (light.empty()) {
+        std::printf("    -     %s\n", ok ? "ok" : "FAILED");
+      } else {
+        std::printf("%6u ms  %s\n", light.front().at, ok ? "ok" : "FAILED");
+      }
+    }
+    return passed;
+  }
+
+  /**
+   * Read a trace file, see the description at the top.
+   *
+   * @return false if the file could not be read or has an invalid line
+   */
+  bool readTrace(const char *path, std::vector<Event> &events) {
+    FILE *file = std::fopen(path, "r");
+    if (file == nullptr) {
+      std::fprintf(stderr, "cannot open %s\n", path);
+      return false;
+    }
+
+    char line[MQTT_MAX_PAYLOAD_SIZE + 64];
+    uint32_t lineNumber = 0;
+    bool valid = true;
+    while (valid && std::fgets(line, sizeof(line), file) != nullptr) {
+      lineNumber++;
+      line[strcspn(line, "\r\n")] = '\0';
+      char *text = line + strspn(line, " \t");
+      if (*text == '\0' || *text == '#') continue;
+
+      char *end;
+      unsigned long at = strtoul(text, &end, 10);
+      char *command = end + strspn(end, " \t");
+      Event event = {(uint32_t)at, Event::SET, ""};
+      if (end == text) {
+        valid = false;
+      } else if (strncmp(command, "set ", 4) == 0) {
+        event.payload = command + 4;
+      } else if (strcmp(command, "press") == 0) {
+        event.kind = Event::PRESS;
+      } else if (strcmp(command, "release") == 0) {
+        event.kind = Event::RELEASE;
+      } else if (strncmp(command, "airflow ", 8) == 0) {
+        event.kind = Event::AIRFLOW;
+        event.payload = command + 8;
+      } else if (strncmp(command, "pressure ", 9) == 0) {
+        event.kind = Event::AIR_PRESSURE;
+        event.payload = command + 9;
+      } else {
+        valid = false;
+      }
+
+      if (!valid || (!events.empty() && event.at < events.back().at)) {
+        std::fprintf(stderr, "%s:%u: invalid or out of order event\n", path, lineNumber);
+        valid = false;
+      }
+      events.push_back(event);
+    }
+    std::fclose(file);
+    return valid;
+  }
+
+  /**
+   * Replay a trace file and print its timeline.
+   */
+  bool replayTrace(const char *path, uint32_t start, uint32_t duration) {
+    std::vector<Event> events;
+    if (!readTrace(path, events)) return false;
+    if (duration == 0) duration = (events.empty() ? 0 : events.back().at) + 1000;
+
+    Replay replay(start, events);
+    replay.run(duration);
+    for (const Edge &edge : replay.getEdges()) {
+      if (edge.at < duration) std::printf("%10u ms  %-6s %s\n", edge.at, pinName(edge.pin), edge.level == HIGH ? "on" : "off");
+    }
+
+    // The readings of a recorded trace: what the rules detected, checked against the reference
+    if (replay.getDetections().empty()) return true;
+    AlarmMask detected = 0;
+    for (const auto &detection : replay.getDetections()) {
+      if (detection.second == detected) continue;
+      detected = detection.second;
+      std::printf("%10u ms  %-6s 0x%02x\n", detection.first, "rules", detected);
+    }
+    std::vector<Edge> expectedLight;
+    size_t mismatches = checkDetections(events, replay, expectedLight);
+    std::printf("%zu readings, %zu differ from the reference\n", replay.getDetections().size(), mismatches);
+    return mismatches == 0;
+  }
+
+  /**
+   * Time a function over ITERATIONS calls.
+   *
+   * @return The mean time per call in nanoseconds
+   */
+  template<typename Function>
+  double measure(Function function) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+      function(i);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / ITERATIONS;
+  }
+
+  /**
+   * Measure checkTriggerAlarm() in every phase of an alarm.
+   *
+   * @return The mean time of the slowest phase in nanoseconds
+   */
+  double benchmarkTick() {
+    struct Phase {
+      const char *name;
+      AlarmMask alarms;
+      uint32_t after;
+    };
+    const Phase phases[] = {
+      {"off", 0, 0},
+      {"window", AIRFLOW_ALARM, 1000},
+      {"waiting", AIRFLOW_ALARM, DELAY_30_SECONDS + 1000},
+      {"playback", AIRFLOW_ALARM, DELAY_10_MINUTES + 1000},
+    };
+
+    double slowest = 0;
+    for (const Phase &phase : phases) {
+      resetBoard(0);
+      AlarmStateManager alarmStateManager;
+      alarmStateManager.initialize();
+      if (phase.alarms != 0) alarmStateManager.checkAlarmType(phase.alarms);
+      // Get there the way the scheduler does, from one deadline to the next
+      for (uint32_t elapsed = 0; elapsed < phase.after;) {
+        uint32_t step = std::min(std::max(alarmStateManager.checkTriggerAlarm(), 1U), phase.after - elapsed);
+        hal::sim::advance(step);
+        elapsed += step;
+      }
+
+      double ns = measure([&](uint32_t) {
+        sink += alarmStateManager.checkTriggerAlarm();
+      });
+      slowest = std::max(slowest, ns);
+      std::printf("tick     %-10s %8.1f ns\n", phase.name, ns);
+    }
+    return slowest;
+  }
+
+  /**
+   * Measure the alarm/set path: decoding only, and decoding and applying to the alarm state manager,
+   * alternating between on and off so every command changes the state.
+   */
+  void benchmarkCommand() {
+    resetBoard(0);
+    AlarmStateManager alarmStateManager;
+    alarmStateManager.initialize();
+    JsonAlarmCodec jsonCodec;
+    const char *payloads[] = {SET_AIRFLOW, CLEAR_AIRFLOW};
+    char buffer[MQTT_MAX_PAYLOAD_SIZE + 1];
+
+    double decodeNs = measure([&](uint32_t i) {
+      const char *payload = payloads[i & 1];
+      size_t length = strlen(payload);
+      memcpy(buffer, payload, length);
+      AlarmUpdate update;
+      if (jsonCodec.decode(buffer, length, update) == nullptr) sink += update.on;
+    });
+
+    double applyNs = measure([&](uint32_t i) {
+      const char *payload = payloads[i & 1];
+      size_t length = strlen(payload);
+      memcpy(buffer, payload, length);
+      AlarmUpdate update;
+      if (jsonCodec.decode(buffer, length, update) != nullptr) return;
+      AlarmMask alarms = update.applyTo(alarmStateManager.getActiveAlarms());
+      if (alarms != 0) {
+        alarmStateManager.checkAlarmType(alarms);
+      } else {
+        alarmStateManager.turnAlarmOff();
+      }
+    });
+
+    std::printf("command  %-10s %8.1f ns\n", "decode", decodeNs);
+    std::printf("command  %-10s %8.1f ns\n", "apply", applyNs);
+  }
+
+  /**
+   * Measure the status formatting of sendAlarmState(): the precomputed payloads and the traced payloads.
+   */
+  void benchmarkStatus() {
+    char buffer[TRACE_PAYLOAD_SIZE];
+    CommandTrace trace;
+    trace.seq = 42;
+    trace.origin = 1760000000000ULL;
+    trace.received = 1760000000005ULL;
+    trace.parsedAt = 120;
+    trace.appliedAt = 150;
+    trace.actuatedAt = 900;
+    trace.actuated = true;
+
+    double tableNs = measure([&](uint32_t i) {
+      AlarmMask mask = (AlarmMask)(i & ALL_ALARMS);
+      sink += statusPayloadLength(mask) + (uint8_t)statusPayload(mask)[1];
+    });
+    double jsonNs = measure([&](uint32_t i) {
+      sink += trace.formatJson(buffer, sizeof(buffer), (AlarmMask)(i & ALL_ALARMS));
+    });
+    double cborNs = measure([&](uint32_t i) {
+      sink += trace.formatCbor((uint8_t *)buffer, sizeof(buffer), (AlarmMask)(i & ALL_ALARMS));
+    });
+
+    std::printf("status   %-10s %8.1f ns\n", "table", tableNs);
+    std::printf("status   %-10s %8.1f ns\n", "traced", jsonNs);
+    std::printf("status   %-10s %8.1f ns\n", "cbor", cborNs);
+  }
+
+  /**
+   * Measure the evaluation of a reading: parsing only, and parsing and evaluating the airflow rules, with
+   * readings around the threshold so the rules raise and clear.
+   */
+  void benchmarkTelemetry() {
+    const char *readings[] = {"300.0", "152.5", "148.0", "40.2", "171.9", "299.9"};
+    TelemetryEvaluator telemetry;
+    telemetry.begin(TELEMETRY_RULES, TELEMETRY_RULE_COUNT);
+
+    double parseNs = measure([&](uint32_t i) {
+      const char *reading = readings[i % 6];
+      int32_t value;
+      if (TelemetryEvaluator::parse(reading, strlen(reading), value)) sink += (uint32_t)value;
+    });
+    double feedNs = measure([&](uint32_t i) {
+      const char *reading = readings[i % 6];
+      sink += telemetry.feed(TelemetryChannel::AIRFLOW, reading, strlen(reading), i * 1000);
+    });
+
+    std::printf("reading  %-10s %8.1f ns\n", "parse", parseNs);
+    std::printf("reading  %-10s %8.1f ns\n", "evaluate", feedNs);
+  }
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *tracePath = nullptr;
+  uint32_t start = 0;
+  uint32_t duration = 0;
+  double maxTickNs = 0;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--trace") == 0) {
+      tracePath = argv[i + 1];
+    } else if (strcmp(argv[i], "--start") == 0) {
+      start = (uint32_t)strtoul(argv[i + 1], nullptr, 10);
+    } else if (strcmp(argv[i], "--duration") == 0) {
+      duration = (uint32_t)strtoul(argv[i + 1], nullptr, 10);
+    } else if (strcmp(argv[i], "--max-tick-ns") == 0) {
+      maxTickNs = strtod(argv[i + 1], nullptr);
+    } else {
+      std::fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  // The alarm state manager reports the playback on Serial, which would slow down the replay
+  Serial.muted = true;
+  if (tracePath != nullptr) return replayTrace(tracePath, start, duration) ? 0 : 1;
+
+  bool passed = runScenarios();
+  passed &= runTelemetryScenarios();
+  std::printf("%u iterations per measurement\n", ITERATIONS);
+  double slowestTick = benchmarkTick();
+  benchmarkCommand();
+  benchmarkStatus();
+  benchmarkTelemetry();
+
+  if (maxTickNs > 0 && slowestTick > maxTickNs) {
+    std::printf("checkTriggerAlarm() takes %.1f ns, more than the budget of %.1f ns\n", slowestTick, maxTickNs);
+    passed = false;
+  }
+  return passed ? 0 : 1;
+}
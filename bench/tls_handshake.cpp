@@ -0,0 +1,221 @@
+/**
+ * Measures the cost of full and resumed TLS handshakes of the MQTT connection against a broker with TLS,
+ * by default a local mosquitto with a listener on port 8883.
+ *
+ * Connects the way the device does (see hal/TlsMqttTransport.h and native/OpenSslMqttTransport.h): TLS 1.2,
+ * the certificate pinned by its fingerprint, bounded records, and the session resumed by its ID. Every connection
+ * waits for the CONNACK and disconnects. Three phases:
+ *
+ *   full     every connection without resumption, like a device without a session cache
+ *   resumed  every connection resumes the session of the first one, like reconnects of a device
+ *   reset    a new transport resumes the session from the simulated RTC memory, like a device after a reset
+ *
+ * Reports the wall and CPU time of the handshakes, the CPU time of their longest step, which is how long the
+ * device keeps its main loop busy at once, the bytes on the wire and the time to the CONNACK. The host
+ * CPU is orders of magnitude faster than the ESP8266, so compare the ratios: the CPU time of a full handshake is
+ * the key exchange and the certificate, which a resumed one skips.
+ *
+ * Build with `pio run -e tls_handshake` and run `.pio/build/tls_handshake/program --help` for the options.
+ * A mosquitto listener for it:
+ *
+ *   listener 8883
+ *   certfile /etc/mosquitto/certs/broker.crt
+ *   keyfile /etc/mosquitto/certs/broker.key
+ *   allow_anonymous true
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+#include "../Constants.h"
+#include "../native/OpenSslMqttTransport.h"
+
+namespace {
+  /**
+   * Time to wait for the CONNACK of one connection.
+   */
+  constexpr uint32_t CONNECT_TIMEOUT = 10000;
+
+  struct Options {
+    const char *host = "127.0.0.1";
+    uint16_t port = 8883;
+    const char *fingerprint = nullptr;
+    const char *user = nullptr;
+    const char *password = nullptr;
+    uint32_t rounds = 20;
+    uint16_t recordSize = TLS_RECEIVE_BUFFER_SIZE;
+  };
+
+  Options options;
+
+  /**
+   * One connection: its handshake and the time from the start of the TCP connection to the CONNACK.
+   */
+  struct Sample {
+    OpenSslMqttTransport::Handshake handshake;
+    uint64_t connackMicros = 0;
+  };
+
+  uint64_t micros() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  std::unique_ptr<OpenSslMqttTransport> makeClient(bool resumption) {
+    auto client = std::make_unique<OpenSslMqttTransport>(options.fingerprint, options.recordSize);
+    client->setServer(options.host, options.port);
+    client->setCredentials(options.user, options.password);
+    client->setClientId("tls-handshake-bench");
+    client->setResumption(resumption);
+    return client;
+  }
+
+  /**
+   * Connect, wait for the CONNACK and disconnect.
+   *
+   * @return false if the connection failed or timed out
+   */
+  bool connectOnce(OpenSslMqttTransport &client, Sample &sample) {
+    bool connected = false;
+    bool failed = false;
+    client.onConnect([&connected](bool) {
+      connected = true;
+    });
+    client.onDisconnect([&failed](int reason) {
+      std::fprintf(stderr, "disconnected, reason %d\n", reason);
+      failed = true;
+    });
+
+    uint64_t start = micros();
+    client.connect();
+    while (!connected && !failed && micros() - start < 1000 * (uint64_t)CONNECT_TIMEOUT) {
+      if (client.fd() >= 0) {
+        pollfd descriptor = {client.fd(), (short)(POLLIN | (client.wantsWrite() ? POLLOUT : 0)), 0};
+        poll(&descriptor, 1, 10);
+      }
+      client.process((uint32_t)(micros() / 1000));
+    }
+    sample.connackMicros = micros() - start;
+    sample.handshake = client.getLastHandshake();
+    client.onDisconnect(nullptr);
+    client.disconnect();
+    return connected;
+  }
+
+  /**
+   * Run connections and report their means.
+   *
+   * @return false if a connection failed
+   */
+  bool runPhase(const char *name, OpenSslMqttTransport &client, uint32_t rounds, std::vector<Sample> &samples) {
+    samples.clear();
+    for (uint32_t i = 0; i < rounds; i++) {
+      Sample sample;
+      if (!connectOnce(client, sample)) {
+        std::printf("%-9s connection %u failed\n", name, i + 1);
+        return false;
+      }
+      samples.push_back(sample);
+    }
+
+    double wall = 0, cpu = 0, sent = 0, received = 0, connack = 0;
+    uint64_t maxWall = 0, maxStep = 0;
+    uint32_t resumed = 0;
+    for (const Sample &sample : samples) {
+      wall += sample.handshake.wallMicros;
+      cpu += sample.handshake.cpuMicros;
+      sent += sample.handshake.bytesSent;
+      received += sample.handshake.bytesReceived;
+      connack += sample.connackMicros;
+      maxWall = std::max(maxWall, sample.handshake.wallMicros);
+      maxStep = std::max(maxStep, sample.handshake.longestStepMicros);
+      resumed += sample.handshake.resumed ? 1 : 0;
+    }
+    double n = (double)samples.size();
+    std::printf("%-9s n: %3zu  resumed: %3u  handshake: %7.2f ms (max %7.2f)  cpu: %6.2f ms (step max %6.2f)"
+                "  bytes out/in: %5.0f/%5.0f  connack: %7.2f ms\n", name, samples.size(), resumed, wall / n / 1000,
+                maxWall / 1000.0, cpu / n / 1000, maxStep / 1000.0, sent / n, received / n, connack / n / 1000);
+    return true;
+  }
+
+  double mean(const std::vector<Sample> &samples, uint64_t OpenSslMqttTransport::Handshake::*field) {
+    double total = 0;
+    for (const Sample &sample : samples) total += (double)(sample.handshake.*field);
+    return samples.empty() ? 0 : total / samples.size();
+  }
+
+  void usage(const char *program) {
+    std::printf("Usage: %s --fingerprint SHA1 [options]\n"
+                "  --host HOST          broker host (127.0.0.1)\n"
+                "  --port PORT          broker TLS port (8883)\n"
+                "  --fingerprint SHA1   SHA-1 fingerprint of the broker certificate, required\n"
+                "  --user USER          broker user\n"
+                "  --password PASSWORD  broker password\n"
+                "  --rounds N           connections per phase (20)\n"
+                "  --record-size N      record size to negotiate: 512, 1024, 2048, 4096 or 0 for 16 kB (%u)\n",
+                program, (unsigned)TLS_RECEIVE_BUFFER_SIZE);
+  }
+
+  bool parseOptions(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+      std::string name = argv[i];
+      if (name == "--help" || i + 1 >= argc) return false;
+      const char *value = argv[++i];
+      if (name == "--host") options.host = value;
+      else if (name == "--port") options.port = (uint16_t)std::strtoul(value, nullptr, 10);
+      else if (name == "--fingerprint") options.fingerprint = value;
+      else if (name == "--user") options.user = value;
+      else if (name == "--password") options.password = value;
+      else if (name == "--rounds") options.rounds = std::max(1UL, std::strtoul(value, nullptr, 10));
+      else if (name == "--record-size") options.recordSize = (uint16_t)std::strtoul(value, nullptr, 10);
+      else return false;
+    }
+    return options.fingerprint != nullptr;
+  }
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (!parseOptions(argc, argv)) {
+    usage(argv[0]);
+    return 1;
+  }
+  // Start without a session in the simulated RTC memory
+  std::memset(hal::sim::rtcMemory, 0, sizeof(hal::sim::rtcMemory));
+
+  std::vector<Sample> full;
+  std::unique_ptr<OpenSslMqttTransport> client = makeClient(false);
+  if (!client->isFingerprintValid()) {
+    std::printf("the fingerprint must be 20 bytes in hex\n");
+    return 1;
+  }
+  if (!runPhase("full", *client, options.rounds, full)) return 1;
+  std::string certificate = client->getPeerFingerprint();
+
+  // The first connection makes the session, the others resume it
+  std::vector<Sample> resumed;
+  client = makeClient(true);
+  Sample first;
+  if (!connectOnce(*client, first)) return 1;
+  if (!runPhase("resumed", *client, options.rounds, resumed)) return 1;
+
+  std::vector<Sample> reset;
+  client = makeClient(true);
+  if (!runPhase("reset", *client, 1, reset)) return 1;
+
+  std::printf("records   limit: %u B  certificate: %s\n", (unsigned)first.handshake.recordLimit, certificate.c_str());
+  using Handshake = OpenSslMqttTransport::Handshake;
+  std::printf("resuming  handshake: %.0f%%  cpu: %.0f%%  bytes: %.0f%% of a full handshake\n",
+              100 * mean(resumed, &Handshake::wallMicros) / std::max(1.0, mean(full, &Handshake::wallMicros)),
+              100 * mean(resumed, &Handshake::cpuMicros) / std::max(1.0, mean(full, &Handshake::cpuMicros)),
+              100 * (mean(resumed, &Handshake::bytesSent) + mean(resumed, &Handshake::bytesReceived)) /
+                  std::max(1.0, mean(full, &Handshake::bytesSent) + mean(full, &Handshake::bytesReceived)));
+  return 0;
+}
@@ -0,0 +1,69 @@
+/**
+ * HTTP client on top of ESPAsyncTCP, used on the device to download firmware updates.
+ */
+
+#ifndef ASYNC_HTTP_TRANSPORT_H
+#define ASYNC_HTTP_TRANSPORT_H
+
+#include <ESPAsyncTCP.h>
+#include "HttpTransport.h"
+
+class AsyncHttpTransport : public HttpTransport {
+public:
+  /**
+   * Create a new transport and feed the connection events to the response parser.
+   */
+  AsyncHttpTransport() {
+    client.onConnect([this](void *argument, AsyncClient *connection) {
+      (void)argument;
+      if (connection->write(request, requestLength) != requestLength) connection->close();
+    });
+
+    client.onData([this](void *argument, AsyncClient *connection, void *data, size_t length) {
+      (void)argument;
+      // Closing right away is not allowed from the receive callback, the client closes at its next poll
+      if (!receive(static_cast<const uint8_t *>(data), length)) connection->close();
+    });
+
+    client.onDisconnect([this](void *argument, AsyncClient *connection) {
+      (void)argument;
+      (void)connection;
+      closed();
+    });
+
+    client.onError([this](void *argument, AsyncClient *connection, int8_t error) {
+      (void)argument;
+      (void)connection;
+      (void)error;
+      closed();
+    });
+  }
+
+  bool get(const char *host, uint16_t port, const char *path, uint32_t offset) override {
+    if (isRunning() || client.connected()) return false;
+    requestLength = startRequest(request, sizeof(request), host, path, offset);
+    if (requestLength == 0) return false;
+    if (client.connect(host, port)) return true;
+    discard();
+    return false;
+  }
+
+  void abort() override {
+    client.close(true);
+    closed();
+  }
+
+private:
+  /**
+   * Asynchronous TCP connection, whose callbacks run in the network stack.
+   */
+  AsyncClient client;
+
+  /**
+   * The request, sent once the connection is up.
+   */
+  char request[192];
+  size_t requestLength = 0;
+};
+
+#endif  // ASYNC_HTTP_TRANSPORT_H
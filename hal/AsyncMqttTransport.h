@@ -0,0 +1,87 @@
+/**
+ * MQTT transport on top of AsyncMqttClient, used on the device.
+ */
+
+#ifndef ASYNC_MQTT_TRANSPORT_H
+#define ASYNC_MQTT_TRANSPORT_H
+
+#include <AsyncMqtt_Generic.h>
+#include "MqttTransport.h"
+
+class AsyncMqttTransport : public MqttTransport {
+public:
+  /**
+   * Create a new transport and forward the client events to the registered callbacks.
+   */
+  AsyncMqttTransport() {
+    mqttClient.onConnect([this](bool sessionPresent) {
+      if (connectCallback) connectCallback(sessionPresent);
+    });
+
+    mqttClient.onDisconnect([this](AsyncMqttClientDisconnectReason reason) {
+      if (disconnectCallback) disconnectCallback((int)reason);
+    });
+
+    mqttClient.onSubscribe([this](const uint16_t &packetId, const uint8_t &qos) {
+      if (subscribeCallback) subscribeCallback(packetId, qos);
+    });
+
+    mqttClient.onMessage([this](char *topic, char *payload, const AsyncMqttClientMessageProperties &properties,
+                                const size_t &len, const size_t &index, const size_t &total) {
+      (void)properties;
+      if (messageCallback) messageCallback(topic, payload, len, index, total);
+    });
+
+    mqttClient.onPublish([this](const uint16_t &packetId) {
+      if (publishCallback) publishCallback(packetId);
+    });
+  }
+
+  void setServer(const char *host, uint16_t port) override {
+    mqttClient.setServer(host, port);
+  }
+
+  void setCredentials(const char *user, const char *password) override {
+    mqttClient.setCredentials(user, password);
+  }
+
+  void setClientId(const char *clientId) override {
+    mqttClient.setClientId(clientId);
+  }
+
+  void setCleanSession(bool cleanSession) override {
+    mqttClient.setCleanSession(cleanSession);
+  }
+
+  void setWill(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length) override {
+    mqttClient.setWill(topic, qos, retain, payload, length);
+  }
+
+  void connect() override {
+    mqttClient.connect();
+  }
+
+  void disconnect() override {
+    mqttClient.disconnect();
+  }
+
+  bool connected() const override {
+    return mqttClient.connected();
+  }
+
+  uint16_t subscribe(const char *topic, uint8_t qos) override {
+    return mqttClient.subscribe(topic, qos);
+  }
+
+  uint16_t publish(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length) override {
+    return mqttClient.publish(topic, qos, retain, payload, length);
+  }
+
+private:
+  /**
+   * Async publish/subscribe client to use for sending messages to the MQTT broker.
+   */
+  AsyncMqttClient mqttClient;
+};
+
+#endif  // ASYNC_MQTT_TRANSPORT_H
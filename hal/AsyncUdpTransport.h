@@ -0,0 +1,40 @@
+/**
+ * UDP listener on top of ESPAsyncUDP, used on the device.
+ */
+
+#ifndef ASYNC_UDP_TRANSPORT_H
+#define ASYNC_UDP_TRANSPORT_H
+
+#include <ESPAsyncUDP.h>
+#include "DatagramTransport.h"
+
+class AsyncUdpTransport : public DatagramTransport {
+public:
+  /**
+   * Create a new transport and forward the received datagrams to the registered callback.
+   */
+  AsyncUdpTransport() {
+    udp.onPacket([this](AsyncUDPPacket &packet) {
+      if (packetCallback) packetCallback(packet.data(), packet.length());
+    });
+  }
+
+  bool listen(uint16_t port, const char *group) override {
+    IPAddress address;
+    if (!address.fromString(group)) return false;
+    // Binds to every address of the device, so unicast datagrams to the port arrive as well
+    return udp.listenMulticast(address, port);
+  }
+
+  void close() override {
+    udp.close();
+  }
+
+private:
+  /**
+   * Asynchronous UDP socket, whose callback runs in the network stack.
+   */
+  AsyncUDP udp;
+};
+
+#endif  // ASYNC_UDP_TRANSPORT_H
@@ -0,0 +1,47 @@
+/**
+ * Interface of the UDP listener for local commands, see LocalCommand.h.
+ *
+ * On the device this is implemented on top of ESPAsyncUDP (hal/AsyncUdpTransport.h),
+ * on the native build by a listener the simulation delivers datagrams to (native/InMemoryDatagram.h).
+ */
+
+#ifndef DATAGRAM_TRANSPORT_H
+#define DATAGRAM_TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+class DatagramTransport {
+public:
+  /**
+   * Called for every datagram that arrives, from the network stack like the MQTT callbacks.
+   */
+  using PacketCallback = std::function<void(const uint8_t *data, size_t length)>;
+
+  virtual ~DatagramTransport() = default;
+
+  /**
+   * Start listening on a port for unicast datagrams and for datagrams to a multicast group.
+   * Call once the network link is up.
+   *
+   * @param port The UDP port
+   * @param group The multicast group, e.g. "239.255.47.80"
+   * @return false if the listener could not be started
+   */
+  virtual bool listen(uint16_t port, const char *group) = 0;
+
+  /**
+   * Stop listening, e.g. when the network link goes down.
+   */
+  virtual void close() = 0;
+
+  void onPacket(PacketCallback callback) {
+    packetCallback = std::move(callback);
+  }
+
+protected:
+  PacketCallback packetCallback;
+};
+
+#endif  // DATAGRAM_TRANSPORT_H
@@ -0,0 +1,390 @@
+/**
+ * Thin hardware abstraction layer for the pins, the clock, the flash file system and the firmware image.
+ *
+ * On the device these forward straight to the Arduino core, so they cost nothing.
+ * On the native build they are backed by the simulated pins and clock in native/HostHal.h.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <Ticker.h>
+#include <coredecls.h>
+#include <LittleFS.h>
+#include <Updater.h>
+#include <ezTime.h>
+#else
+#include "../native/HostHal.h"
+#endif
+
+namespace hal {
+
+#ifdef ARDUINO
+  /**
+   * Configure the mode of a pin.
+   *
+   * @param pin The pin to configure
+   * @param mode INPUT, OUTPUT or INPUT_PULLUP
+   */
+  inline void setPinMode(uint8_t pin, uint8_t mode) {
+    ::pinMode(pin, mode);
+  }
+
+  /**
+   * Write a level to an output pin. IRAM-safe, called from the timer interrupt of BeepSequencer.
+   *
+   * @param pin The pin to write to
+   * @param level HIGH or LOW
+   */
+  inline void IRAM_ATTR writePin(uint8_t pin, uint8_t level) {
+    ::digitalWrite(pin, level);
+  }
+
+  /**
+   * Read the level of a pin. IRAM-safe, called from the interrupt of ButtonInput.
+   *
+   * @param pin The pin to read
+   * @return HIGH or LOW
+   */
+  inline int IRAM_ATTR readPin(uint8_t pin) {
+    return ::digitalRead(pin);
+  }
+
+  /**
+   * Call a function from an interrupt when the level of a pin changes.
+   * The function must be IRAM_ATTR and only touch IRAM-safe functions.
+   *
+   * @param pin The pin to watch
+   * @param callback The function to call
+   */
+  inline void attachPinInterrupt(uint8_t pin, void (*callback)()) {
+    ::attachInterrupt(digitalPinToInterrupt(pin), callback, CHANGE);
+  }
+
+  /**
+   * IRAM-safe, called from the interrupt of ButtonInput.
+   *
+   * @return The milliseconds since boot. Wraps around after about 49.7 days.
+   */
+  inline uint32_t IRAM_ATTR millis() {
+    return ::millis();
+  }
+
+  /**
+   * IRAM-safe, called from the timer interrupt of BeepSequencer.
+   *
+   * @return The microseconds since boot. Wraps around after about 71.6 minutes.
+   */
+  inline uint32_t IRAM_ATTR micros() {
+    return ::micros();
+  }
+
+  /**
+   * A random number from the hardware random number generator.
+   *
+   * @param max The exclusive upper bound
+   * @return A random number in [0, max)
+   */
+  inline uint32_t random(uint32_t max) {
+    return max == 0 ? 0 : RANDOM_REG32 % max;
+  }
+
+  /**
+   * @return The amount of bytes Serial takes without waiting for the UART
+   */
+  inline size_t serialWritable() {
+    return (size_t)Serial.availableForWrite();
+  }
+
+  /**
+   * Write bytes to Serial. Only waits for the UART if more than serialWritable() bytes are written.
+   */
+  inline void serialWrite(const char *data, size_t length) {
+    Serial.write((const uint8_t *)data, length);
+  }
+
+  /**
+   * @return The ID of the chip, unique per device
+   */
+  inline uint32_t chipId() {
+    return ESP.getChipId();
+  }
+
+  /**
+   * Start keeping the wall clock in sync over NTP with ezTime, see epochMillis().
+   *
+   * @param intervalSeconds The time between two synchronizations
+   */
+  inline void beginWallClock(uint16_t intervalSeconds) {
+    setDebug(NONE);
+    setInterval(intervalSeconds);
+  }
+
+  /**
+   * Synchronize the wall clock when it is due. Only call while online: a synchronization waits for
+   * the NTP answer, which takes one round trip to the NTP server.
+   */
+  inline void updateWallClock() {
+    events();
+  }
+
+  /**
+   * @return The wall clock time in milliseconds since the Unix epoch, 0 until it has been synchronized
+   */
+  inline uint64_t epochMillis() {
+    if (timeStatus() == timeNotSet) return 0;
+    return (uint64_t)UTC.now() * 1000 + UTC.ms();
+  }
+
+  /**
+   * Read from the RTC user memory, which survives resets but not power loss.
+   *
+   * @param offset The offset in 4-byte blocks
+   * @param data The buffer to read into
+   * @param size The amount of bytes to read, a multiple of 4
+   * @return true if the range is valid
+   */
+  inline bool rtcRead(uint32_t offset, void *data, size_t size) {
+    return ESP.rtcUserMemoryRead(offset, static_cast<uint32_t *>(data), size);
+  }
+
+  /**
+   * Write to the RTC user memory, which survives resets but not power loss.
+   *
+   * @param offset The offset in 4-byte blocks
+   * @param data The data to write
+   * @param size The amount of bytes to write, a multiple of 4
+   * @return true if the range is valid
+   */
+  inline bool rtcWrite(uint32_t offset, const void *data, size_t size) {
+    return ESP.rtcUserMemoryWrite(offset, const_cast<uint32_t *>(static_cast<const uint32_t *>(data)), size);
+  }
+
+  /**
+   * Attach the callback of the one-shot hardware timer (timer1). It runs in interrupt context,
+   * so it must be IRAM_ATTR and may only touch IRAM-safe functions such as digitalWrite.
+   *
+   * @param callback The function to call when the timer expires
+   */
+  inline void attachTimer(void (*callback)()) {
+    timer1_isr_init();
+    timer1_attachInterrupt(callback);
+  }
+
+  /**
+   * Arm the one-shot hardware timer. timer1 runs at 80 MHz / 256, so 312.5 ticks per millisecond.
+   * Can be called from the timer callback to schedule the next edge.
+   *
+   * @param milliseconds The time until the timer expires, at most 26 seconds
+   */
+  inline void IRAM_ATTR armTimer(uint32_t milliseconds) {
+    timer1_enable(TIM_DIV256, TIM_EDGE, TIM_SINGLE);
+    timer1_write(milliseconds * 312 + milliseconds / 2);
+  }
+
+  /**
+   * Stop the one-shot hardware timer.
+   */
+  inline void disarmTimer() {
+    timer1_disable();
+  }
+
+  /**
+   * Disable interrupts, to read data shared with an interrupt consistently. Keep the section short.
+   */
+  inline void disableInterrupts() {
+    noInterrupts();
+  }
+
+  /**
+   * Enable interrupts again after disableInterrupts().
+   */
+  inline void enableInterrupts() {
+    interrupts();
+  }
+
+  /**
+   * CPU cycles per microsecond of cycleCount().
+   */
+  constexpr uint32_t CYCLES_PER_MICROSECOND = F_CPU / 1000000L;
+
+  /**
+   * @return The CPU cycle counter, for measuring short durations. Wraps around after about 53 seconds.
+   */
+  inline uint32_t cycleCount() {
+    return ESP.getCycleCount();
+  }
+
+  /**
+   * @return The free heap in bytes
+   */
+  inline uint32_t freeHeap() {
+    return ESP.getFreeHeap();
+  }
+
+  /**
+   * @return The largest block that can be allocated from the heap in bytes
+   */
+  inline uint32_t largestFreeBlock() {
+    return ESP.getMaxFreeBlockSize();
+  }
+
+  /**
+   * @return The fragmentation of the heap in percent, 0 if all free memory is one block
+   */
+  inline uint8_t heapFragmentation() {
+    return ESP.getHeapFragmentation();
+  }
+
+  /**
+   * Set by wake() to end idle() early.
+   */
+  inline volatile bool wakeRequested = false;
+
+  /**
+   * End the current idle() early. Safe to call from interrupts and network callbacks.
+   */
+  inline void IRAM_ATTR wake() {
+    wakeRequested = true;
+    esp_schedule();
+  }
+
+  /**
+   * Let the CPU idle until the timeout passes or wake() is called. The network stack keeps running,
+   * and with automatic light sleep enabled the modem sleeps between beacons.
+   *
+   * @param milliseconds The maximum time to idle
+   */
+  inline void idle(uint32_t milliseconds) {
+    esp_delay(milliseconds, []() { return !wakeRequested; }, milliseconds);
+    wakeRequested = false;
+  }
+
+  /**
+   * A fixed-size file on LittleFS that is read and written in place.
+   * LittleFS spreads the writes over the flash blocks and never leaves a half-written block behind.
+   */
+  class FlashFile {
+  public:
+    /**
+     * Mount the file system and open the file, creating it zero-filled if it is missing or has another size.
+     *
+     * @param path The path of the file
+     * @param size The size of the file in bytes
+     * @return true if the file can be used
+     */
+    bool open(const char *path, size_t size) {
+      if (!LittleFS.begin()) return false;
+      file = LittleFS.open(path, "r+");
+      if (file && file.size() == size) return true;
+
+      file.close();
+      file = LittleFS.open(path, "w+");
+      if (!file) return false;
+      uint8_t zeros[64] = {};
+      for (size_t written = 0; written < size; written += sizeof(zeros)) {
+        size_t chunk = size - written < sizeof(zeros) ? size - written : sizeof(zeros);
+        if (file.write(zeros, chunk) != chunk) return false;
+      }
+      file.flush();
+      return true;
+    }
+
+    /**
+     * @return true if the range was read completely
+     */
+    bool read(size_t offset, void *data, size_t size) {
+      return file && file.seek(offset) && file.read(static_cast<uint8_t *>(data), size) == size;
+    }
+
+    /**
+     * Write a range and flush it to flash.
+     *
+     * @return true if the range was written completely
+     */
+    bool write(size_t offset, const void *data, size_t size) {
+      if (!file || !file.seek(offset) || file.write(static_cast<const uint8_t *>(data), size) != size) return false;
+      file.flush();
+      return true;
+    }
+
+  private:
+    File file;
+  };
+
+  /**
+   * @return The size of the running firmware image in bytes
+   */
+  inline uint32_t firmwareSize() {
+    return ESP.getSketchSize();
+  }
+
+  /**
+   * Read from the running firmware image, e.g. to patch a delta against it. The image is the one the
+   * build produced as firmware.bin, from flash offset 0.
+   *
+   * @param offset The offset in the image
+   * @param data The buffer to read into
+   * @param size The amount of bytes to read
+   * @return true if the range was read
+   */
+  inline bool readFirmware(uint32_t offset, void *data, size_t size) {
+    return offset + size <= firmwareSize() && ESP.flashRead(offset, static_cast<uint8_t *>(data), size);
+  }
+
+  /**
+   * The spare flash slot a new firmware image is written to with the Updater of the Arduino core.
+   * The boot loader copies a committed image over the running one at the next restart.
+   */
+  class FirmwareSlot {
+  public:
+    /**
+     * Start writing an image, erasing the slot as the writes reach it.
+     *
+     * @param size The size of the image in bytes
+     * @return false if the image does not fit in the free flash
+     */
+    bool begin(uint32_t size) {
+      if (Update.isRunning()) Update.end();
+      return Update.begin(size);
+    }
+
+    /**
+     * @return true if all bytes were written
+     */
+    bool write(const uint8_t *data, size_t size) {
+      return Update.write(const_cast<uint8_t *>(data), size) == size;
+    }
+
+    /**
+     * Commit the image, once all its bytes have been written. It boots at the next restart.
+     * Writes the command of the boot loader into the first 32 blocks of RTC user memory.
+     *
+     * @return false if the image is incomplete or not a valid image
+     */
+    bool commit() {
+      return Update.isFinished() && Update.end();
+    }
+
+    /**
+     * Drop an image that has not been committed.
+     */
+    void abort() {
+      // Ending an unfinished update resets the Updater without committing anything
+      if (Update.isRunning() && !Update.isFinished()) Update.end();
+    }
+  };
+
+  /**
+   * Restart the device, e.g. to boot a committed firmware image.
+   */
+  inline void restart() {
+    ESP.restart();
+  }
+#endif
+
+}  // namespace hal
+
+#endif  // HAL_H
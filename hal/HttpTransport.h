@@ -0,0 +1,212 @@
+/**
+ * Interface of the HTTP client firmware updates are downloaded with, see OtaUpdater.h.
+ *
+ * A download is a GET with a Range header, so an interrupted download continues at the byte it stopped at.
+ * The response is parsed here, the implementations only move bytes: on the device on top of ESPAsyncTCP
+ * (hal/AsyncHttpTransport.h), on the native build from an in-memory server (native/InMemoryHttp.h).
+ */
+
+#ifndef HTTP_TRANSPORT_H
+#define HTTP_TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <functional>
+
+class HttpTransport {
+public:
+  /**
+   * How a download ended.
+   */
+  enum class End : uint8_t {
+    /** The whole body arrived. */
+    COMPLETE,
+    /** The connection failed or was lost, the download can be continued. */
+    INTERRUPTED,
+    /** The server answered with an error or ignored the range, trying again does not help. */
+    REFUSED
+  };
+
+  /**
+   * Called for every part of the body that arrives, from the network stack like the MQTT callbacks.
+   */
+  using BodyCallback = std::function<void(const uint8_t *data, size_t length)>;
+
+  /**
+   * Called once per download when it ends.
+   */
+  using EndCallback = std::function<void(End end)>;
+
+  virtual ~HttpTransport() = default;
+
+  /**
+   * Start downloading a file, from an offset on. Returns immediately, the body arrives through the callbacks.
+   *
+   * @param host The host name or address of the server
+   * @param port The TCP port of the server
+   * @param path The path of the file, starting with a slash
+   * @param offset The first byte to download
+   * @return false if the download could not be started
+   */
+  virtual bool get(const char *host, uint16_t port, const char *path, uint32_t offset) = 0;
+
+  /**
+   * Stop the download. The end callback is called with End::INTERRUPTED if the download was running.
+   */
+  virtual void abort() = 0;
+
+  void onBody(BodyCallback callback) {
+    bodyCallback = std::move(callback);
+  }
+
+  void onEnd(EndCallback callback) {
+    endCallback = std::move(callback);
+  }
+
+protected:
+  BodyCallback bodyCallback;
+  EndCallback endCallback;
+
+  /**
+   * Prepare for the response to a new request and format the request.
+   *
+   * @param buffer Receives the request
+   * @param size The size of the buffer
+   * @return The length of the request, 0 if it does not fit
+   */
+  size_t startRequest(char *buffer, size_t size, const char *host, const char *path, uint32_t offset) {
+    state = State::STATUS_LINE;
+    lineLength = 0;
+    status = 0;
+    remaining = 0;
+    lengthKnown = false;
+    rangeStart = 0;
+    requestedOffset = offset;
+    int length = snprintf(buffer, size, "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%lu-\r\nConnection: close\r\n\r\n",
+                          path, host, (unsigned long)offset);
+    if (length < 0 || (size_t)length >= size) {
+      state = State::DONE;
+      return 0;
+    }
+    return (size_t)length;
+  }
+
+  /**
+   * Parse received bytes of the response and forward the body.
+   *
+   * @return false once the response is complete or refused, then the connection should be closed
+   */
+  bool receive(const uint8_t *data, size_t length) {
+    while (length > 0 && state != State::DONE) {
+      if (state == State::BODY) {
+        size_t take = lengthKnown && remaining < length ? remaining : length;
+        if (bodyCallback) bodyCallback(data, take);
+        // The callback may have aborted the download
+        if (state != State::BODY) break;
+        data += take;
+        length -= take;
+        if (lengthKnown) {
+          remaining -= take;
+          if (remaining == 0) end(End::COMPLETE);
+        }
+        continue;
+      }
+
+      char c = (char)*data++;
+      length--;
+      if (c != '\n') {
+        // Only the status line and the headers that are looked at matter, longer lines are cut off
+        if (c != '\r' && lineLength < sizeof(line) - 1) line[lineLength++] = c;
+        continue;
+      }
+      line[lineLength] = '\0';
+      if (state == State::STATUS_LINE) {
+        readStatusLine();
+      } else if (lineLength == 0) {
+        startBody();
+      } else {
+        readHeader();
+      }
+      lineLength = 0;
+    }
+    return state != State::DONE;
+  }
+
+  /**
+   * The connection was closed or failed.
+   */
+  void closed() {
+    if (state == State::DONE) return;
+    // Without a content length the body lasts until the server closes the connection
+    end(state == State::BODY && !lengthKnown ? End::COMPLETE : End::INTERRUPTED);
+  }
+
+  /**
+   * Forget the request without calling the end callback, when it could not be sent.
+   */
+  void discard() {
+    state = State::DONE;
+  }
+
+  bool isRunning() const {
+    return state != State::DONE;
+  }
+
+private:
+  enum class State : uint8_t {
+    STATUS_LINE,
+    HEADERS,
+    BODY,
+    DONE
+  };
+
+  State state = State::DONE;
+  char line[96];
+  size_t lineLength = 0;
+  uint16_t status = 0;
+  uint32_t remaining = 0;
+  bool lengthKnown = false;
+  uint32_t rangeStart = 0;
+  uint32_t requestedOffset = 0;
+
+  void end(End result) {
+    state = State::DONE;
+    if (endCallback) endCallback(result);
+  }
+
+  void readStatusLine() {
+    // HTTP/1.1 206 Partial Content
+    const char *space = strchr(line, ' ');
+    status = space == nullptr ? 0 : (uint16_t)strtoul(space + 1, nullptr, 10);
+    state = State::HEADERS;
+  }
+
+  void readHeader() {
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      remaining = (uint32_t)strtoul(line + 15, nullptr, 10);
+      lengthKnown = true;
+    } else if (strncasecmp(line, "Content-Range:", 14) == 0) {
+      // Content-Range: bytes 1000-4999/5000
+      const char *start = strstr(line + 14, "bytes ");
+      if (start != nullptr) rangeStart = (uint32_t)strtoul(start + 6, nullptr, 10);
+    }
+  }
+
+  void startBody() {
+    // A server that ignores the range sends the file from the start, which only helps for a new download
+    bool ranged = status == 206 && rangeStart == requestedOffset;
+    bool whole = status == 200 && requestedOffset == 0;
+    if (!ranged && !whole) {
+      end(End::REFUSED);
+      return;
+    }
+    state = State::BODY;
+    if (lengthKnown && remaining == 0) end(End::COMPLETE);
+  }
+};
+
+#endif  // HTTP_TRANSPORT_H
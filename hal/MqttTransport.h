@@ -0,0 +1,141 @@
+/**
+ * Interface of the MQTT transport used by the internet manager.
+ *
+ * On the device this is implemented on top of AsyncMqttClient (hal/AsyncMqttTransport.h), or over TLS
+ * (hal/TlsMqttTransport.h), on the native build by an in-memory broker (native/InMemoryBroker.h).
+ */
+
+#ifndef MQTT_TRANSPORT_H
+#define MQTT_TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+class MqttTransport {
+public:
+  /**
+   * Called when the connection to the broker has been established.
+   */
+  using ConnectCallback = std::function<void(bool sessionPresent)>;
+
+  /**
+   * Called when the connection to the broker has been lost. The reason is transport specific.
+   */
+  using DisconnectCallback = std::function<void(int reason)>;
+
+  /**
+   * Called when a subscription has been acknowledged.
+   */
+  using SubscribeCallback = std::function<void(uint16_t packetId, uint8_t qos)>;
+
+  /**
+   * Called when the broker acknowledged a message published with QoS 1 or 2.
+   */
+  using PublishCallback = std::function<void(uint16_t packetId)>;
+
+  /**
+   * Called for every chunk of a received message.
+   * The payload is not NUL-terminated; index and total describe where the chunk sits in the whole message.
+   */
+  using MessageCallback = std::function<void(const char *topic, const char *payload, size_t len, size_t index,
+                                             size_t total)>;
+
+  virtual ~MqttTransport() = default;
+
+  /**
+   * Configure the broker to connect to.
+   */
+  virtual void setServer(const char *host, uint16_t port) = 0;
+
+  /**
+   * Configure the credentials to log in with.
+   */
+  virtual void setCredentials(const char *user, const char *password) = 0;
+
+  /**
+   * Configure the client ID to connect with.
+   */
+  virtual void setClientId(const char *clientId) = 0;
+
+  /**
+   * Configure whether the broker starts a new session on every connect. Without a clean session the broker
+   * keeps the subscriptions of the client ID and queues the QoS 1 and 2 messages for it while it is offline.
+   */
+  virtual void setCleanSession(bool cleanSession) = 0;
+
+  /**
+   * Configure the Last Will, which the broker publishes when the connection is lost without a disconnect.
+   * The topic and the payload are not copied and must stay valid while the transport is used.
+   */
+  virtual void setWill(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length) = 0;
+
+  /**
+   * Start connecting to the broker. The connect callback is called once connected.
+   */
+  virtual void connect() = 0;
+
+  /**
+   * Disconnect from the broker.
+   */
+  virtual void disconnect() = 0;
+
+  /**
+   * @return true if the client is connected to the broker
+   */
+  virtual bool connected() const = 0;
+
+  /**
+   * Subscribe to a topic.
+   *
+   * @return The packet ID of the subscription, 0 on failure
+   */
+  virtual uint16_t subscribe(const char *topic, uint8_t qos) = 0;
+
+  /**
+   * Publish a message. The payload is handed over as pointer and length, no copy is made by the caller.
+   *
+   * @return The packet ID of the message (1 for QoS 0), 0 on failure
+   */
+  virtual uint16_t publish(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length) = 0;
+
+  /**
+   * Read and write the connection, for transports that are not driven by the callbacks of the network stack.
+   *
+   * @param now The current time in milliseconds
+   * @return The time in milliseconds until this needs to run again
+   */
+  virtual uint32_t process(uint32_t now) {
+    (void)now;
+    return UINT32_MAX;
+  }
+
+  void onConnect(ConnectCallback callback) {
+    connectCallback = std::move(callback);
+  }
+
+  void onDisconnect(DisconnectCallback callback) {
+    disconnectCallback = std::move(callback);
+  }
+
+  void onSubscribe(SubscribeCallback callback) {
+    subscribeCallback = std::move(callback);
+  }
+
+  void onMessage(MessageCallback callback) {
+    messageCallback = std::move(callback);
+  }
+
+  void onPublish(PublishCallback callback) {
+    publishCallback = std::move(callback);
+  }
+
+protected:
+  ConnectCallback connectCallback;
+  DisconnectCallback disconnectCallback;
+  SubscribeCallback subscribeCallback;
+  MessageCallback messageCallback;
+  PublishCallback publishCallback;
+};
+
+#endif  // MQTT_TRANSPORT_H
@@ -0,0 +1,69 @@
+/**
+ * Interface of the network link (Wi-Fi on the device) the MQTT transport runs over.
+ */
+
+#ifndef NETWORK_LINK_H
+#define NETWORK_LINK_H
+
+#include <functional>
+
+class NetworkLink {
+public:
+  /**
+   * Called when the link is up and has an IP address.
+   */
+  using UpCallback = std::function<void()>;
+
+  /**
+   * Called when the link has been lost.
+   */
+  using DownCallback = std::function<void()>;
+
+  virtual ~NetworkLink() = default;
+
+  /**
+   * Start bringing the link up. If no credentials are known this may start provisioning.
+   * Must return immediately; the rest of the setup is driven by process().
+   */
+  virtual void begin() = 0;
+
+  /**
+   * Drive the link setup. Called from the main loop, must never block.
+   */
+  virtual void process() {}
+
+  /**
+   * @return true if the link is up
+   */
+  virtual bool isConnected() const = 0;
+
+  /**
+   * @return true while the link is being provisioned, e.g. while the config portal is open
+   */
+  virtual bool isConnecting() const = 0;
+
+  /**
+   * Try to reassociate with the network after the link was lost, without restarting.
+   * The up callback is called once the link is back.
+   */
+  virtual void reconnect() = 0;
+
+  /**
+   * Restart the device. Used as the last resort when the link cannot be recovered.
+   */
+  virtual void restart() = 0;
+
+  void onUp(UpCallback callback) {
+    upCallback = std::move(callback);
+  }
+
+  void onDown(DownCallback callback) {
+    downCallback = std::move(callback);
+  }
+
+protected:
+  UpCallback upCallback;
+  DownCallback downCallback;
+};
+
+#endif  // NETWORK_LINK_H
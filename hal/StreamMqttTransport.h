@@ -0,0 +1,559 @@
+/**
+ * MQTT 3.1.1 over a byte stream, for network stacks without an MQTT client of their own.
+ *
+ * Implements the subset the internet manager uses: CONNECT with credentials, a Last Will and a clean or
+ * persistent session, SUBSCRIBE, PUBLISH with QoS 0, 1 and 2 in both directions, and the keep-alive ping. A server
+ * that sends nothing for one and a half times the keep-alive after a ping is taken as gone, like the broker does
+ * with a client, so a half-open connection does not wait for the network stack to give up.
+ * A subclass opens, reads and writes the stream: a TLS client on the device (hal/TlsMqttTransport.h), a POSIX
+ * socket on the host (native/PosixMqttTransport.h). Nothing blocks here: the owner calls process(), which
+ * reads, runs the callbacks and writes what was queued. Messages are handed to the message callback in one chunk.
+ *
+ * Packets are serialized straight into an outbox and parsed in an inbox, both allocated once when the transport
+ * is made, so publishing and receiving never touch the heap.
+ */
+
+#ifndef STREAM_MQTT_TRANSPORT_H
+#define STREAM_MQTT_TRANSPORT_H
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "MqttTransport.h"
+
+class StreamMqttTransport : public MqttTransport {
+public:
+  /**
+   * Reason passed to the disconnect callback when the broker closed the connection or sent garbage.
+   * A refused CONNECT passes the CONNACK return code (1 to 5), the subclasses add their own reasons.
+   */
+  static constexpr int REASON_CLOSED = 0;
+  static constexpr int REASON_PROTOCOL = 100;
+
+  /**
+   * @param maxPacketSize The largest remaining length of a packet in either direction. Larger received packets
+   *                      are treated as a protocol error, larger messages are not published.
+   * @param pollInterval The time in milliseconds process() asks to be called again after while connected
+   */
+  StreamMqttTransport(size_t maxPacketSize, uint32_t pollInterval)
+      : maxPacketSize(maxPacketSize), pollInterval(pollInterval),
+        bufferSize(maxPacketSize + FIXED_HEADER_SIZE + ACK_RESERVE), inbox(new char[bufferSize]),
+        outbox(new char[bufferSize]) {}
+
+  void setServer(const char *host, uint16_t port) override {
+    this->host = host;
+    this->port = port;
+  }
+
+  void setCredentials(const char *user, const char *password) override {
+    this->user = user == nullptr ? "" : user;
+    this->password = password == nullptr ? "" : password;
+  }
+
+  void setClientId(const char *clientId) override {
+    this->clientId = clientId;
+  }
+
+  void setCleanSession(bool cleanSession) override {
+    this->cleanSession = cleanSession;
+  }
+
+  void setWill(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length) override {
+    willTopic = topic == nullptr ? "" : topic;
+    willPayload.assign(payload == nullptr ? "" : payload, payload == nullptr ? 0 : length);
+    willQos = qos;
+    willRetain = retain;
+  }
+
+  /**
+   * @param seconds The keep-alive interval sent in CONNECT, 0 to switch the keep-alive off
+   */
+  void setKeepAlive(uint16_t seconds) {
+    keepAlive = seconds;
+  }
+
+  void connect() override {
+    if (state != State::DISCONNECTED) return;
+    state = State::OPENING;
+    openStream();
+  }
+
+  void disconnect() override {
+    if (state == State::DISCONNECTED) return;
+    if (state == State::CONNECTED && beginPacket(0xE0, 0, 0)) flush();
+    fail(REASON_CLOSED);
+  }
+
+  bool connected() const override {
+    return state == State::CONNECTED;
+  }
+
+  uint16_t subscribe(const char *topic, uint8_t qos) override {
+    if (state != State::CONNECTED) return 0;
+    size_t topicLength = strlen(topic);
+    if (!beginPacket(0x82, 2 + 2 + topicLength + 1, ACK_RESERVE)) return 0;
+    uint16_t packetId = nextPacketId();
+    putUint16(packetId);
+    putString(topic, topicLength);
+    put(reinterpret_cast<const char *>(&qos), 1);
+    return packetId;
+  }
+
+  uint16_t publish(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length) override {
+    if (state != State::CONNECTED) return 0;
+    size_t topicLength = strlen(topic);
+    if (!beginPacket((uint8_t)(0x30 | (qos << 1) | (retain ? 1 : 0)), 2 + topicLength + (qos > 0 ? 2 : 0) + length,
+                     ACK_RESERVE)) {
+      return 0;
+    }
+    uint16_t packetId = qos == 0 ? 1 : nextPacketId();
+    putString(topic, topicLength);
+    if (qos > 0) putUint16(packetId);
+    put(payload, length);
+    return packetId;
+  }
+
+  /**
+   * Finish opening the stream, read what arrived, run the callbacks and send what was queued.
+   *
+   * @param now The current time in milliseconds, for the keep-alive
+   * @return The time in milliseconds until this needs to run again
+   */
+  uint32_t process(uint32_t now) override {
+    if (state == State::OPENING) {
+      int opened = pollStream();
+      if (opened < 0) return UINT32_MAX;
+      if (opened == 0) return pollInterval;
+      state = State::MQTT_CONNECTING;
+      lastSentAt = now;
+      lastReceivedAt = now;
+      pingPending = false;
+      sendConnect();
+    }
+    if (state == State::DISCONNECTED) return UINT32_MAX;
+
+    if (!receive(now)) return UINT32_MAX;
+    if (state == State::CONNECTED && keepAlive != 0) {
+      if (pingPending && now - lastReceivedAt >= keepAlive * 1500U) {
+        fail(REASON_CLOSED);
+        return UINT32_MAX;
+      }
+      if (now - lastSentAt >= keepAlive * 1000U / 2 && beginPacket(0xC0, 0, 0)) pingPending = true;
+    }
+    if (outboxLength != 0) {
+      lastSentAt = now;
+      flush();
+    }
+    return state == State::DISCONNECTED ? UINT32_MAX : pollInterval;
+  }
+
+  /**
+   * MQTT bytes sent and received since the transport was created, without the framing of the stream.
+   */
+  uint64_t bytesSent = 0;
+  uint64_t bytesReceived = 0;
+
+protected:
+  /**
+   * Start opening the stream to the server. On failure the subclass calls fail().
+   */
+  virtual void openStream() = 0;
+
+  /**
+   * Continue opening the stream.
+   *
+   * @return 1 once it is open, 0 while it is being opened, -1 if it failed and fail() was called
+   */
+  virtual int pollStream() = 0;
+
+  /**
+   * Read what arrived, without waiting.
+   *
+   * @return The amount of bytes read, 0 if nothing arrived, -1 if the stream ended and fail() was called
+   */
+  virtual long readStream(char *buffer, size_t size) = 0;
+
+  /**
+   * Write what the stream takes, without waiting.
+   *
+   * @return The amount of bytes written, 0 if the stream takes nothing now, -1 if it failed and fail() was called
+   */
+  virtual long writeStream(const char *data, size_t size) = 0;
+
+  /**
+   * Close the stream. Called for every stream that was opened or started to, and may be called again after.
+   */
+  virtual void closeStream() = 0;
+
+  const char *getHost() const {
+    return host.c_str();
+  }
+
+  uint16_t getPort() const {
+    return port;
+  }
+
+  /**
+   * @return true while the stream is being opened
+   */
+  bool isOpening() const {
+    return state == State::OPENING;
+  }
+
+  /**
+   * @return true while queued data waits to be written
+   */
+  bool hasOutput() const {
+    return outboxLength != 0;
+  }
+
+  /**
+   * Close the connection and report the reason to the disconnect callback, unless it was closed already.
+   */
+  void fail(int reason) {
+    bool wasConnected = state != State::DISCONNECTED;
+    state = State::DISCONNECTED;
+    closeStream();
+    generation++;
+    inboxLength = 0;
+    outboxLength = 0;
+    receivedQos2Count = 0;
+    if (disconnectCallback && (wasConnected || reason != REASON_CLOSED)) disconnectCallback(reason);
+  }
+
+private:
+  enum class State {
+    DISCONNECTED,
+    OPENING,
+    MQTT_CONNECTING,
+    CONNECTED
+  };
+
+  /**
+   * The largest fixed header: the type and four digits of remaining length.
+   */
+  static constexpr size_t FIXED_HEADER_SIZE = 5;
+
+  /**
+   * Outbox space kept free by PUBLISH and SUBSCRIBE, for the acknowledgements of received packets.
+   */
+  static constexpr size_t ACK_RESERVE = 64;
+
+  /**
+   * The amount of QoS 2 messages remembered until their PUBREL.
+   */
+  static constexpr uint8_t QOS2_CAPACITY = 8;
+
+  const size_t maxPacketSize;
+  const uint32_t pollInterval;
+  State state = State::DISCONNECTED;
+
+  /**
+   * The received bytes not handled yet and the packets waiting to be written, each of bufferSize bytes.
+   */
+  const size_t bufferSize;
+  std::unique_ptr<char[]> inbox;
+  std::unique_ptr<char[]> outbox;
+  size_t inboxLength = 0;
+  size_t outboxLength = 0;
+
+  std::string host;
+  uint16_t port = 1883;
+  std::string user;
+  std::string password;
+  std::string clientId;
+  uint16_t keepAlive = 15;
+  bool cleanSession = true;
+
+  /**
+   * The Last Will, none while the topic is empty.
+   */
+  std::string willTopic;
+  std::string willPayload;
+  uint8_t willQos = 0;
+  bool willRetain = false;
+
+  uint32_t lastSentAt = 0;
+
+  /**
+   * When the server last sent anything, and whether a ping went out since.
+   */
+  uint32_t lastReceivedAt = 0;
+  bool pingPending = false;
+
+  uint16_t packetId = 0;
+
+  /**
+   * QoS 2 messages that were delivered and wait for their PUBREL, so a resent PUBLISH is not delivered twice.
+   * When full, the oldest one is forgotten.
+   */
+  uint16_t receivedQos2[QOS2_CAPACITY] = {};
+  uint8_t receivedQos2Count = 0;
+
+  /**
+   * Counts the closed streams, to notice a callback closing the connection while packets are handled.
+   */
+  uint32_t generation = 0;
+
+  uint16_t nextPacketId() {
+    packetId = packetId == 0xFFFF ? 1 : packetId + 1;
+    return packetId;
+  }
+
+  /**
+   * Start a packet in the outbox, writing what the stream takes first if it does not fit.
+   *
+   * @param header The type and flags of the packet
+   * @param remaining The length of the packet after the fixed header
+   * @param reserve The space to leave free in the outbox
+   * @return false if the packet does not fit
+   */
+  bool beginPacket(uint8_t header, size_t remaining, size_t reserve) {
+    if (remaining > maxPacketSize) return false;
+    size_t needed = FIXED_HEADER_SIZE + remaining + reserve;
+    if (outboxLength + needed > bufferSize) flush();
+    if (outboxLength + needed > bufferSize) return false;
+
+    outbox[outboxLength++] = (char)header;
+    do {
+      uint8_t digit = remaining % 128;
+      remaining /= 128;
+      outbox[outboxLength++] = (char)(remaining > 0 ? digit | 0x80 : digit);
+    } while (remaining > 0);
+    return true;
+  }
+
+  void put(const char *data, size_t length) {
+    memcpy(outbox.get() + outboxLength, data, length);
+    outboxLength += length;
+  }
+
+  void putUint16(uint16_t value) {
+    char bytes[2] = {(char)(value >> 8), (char)(value & 0xFF)};
+    put(bytes, sizeof(bytes));
+  }
+
+  void putString(const char *text, size_t length) {
+    putUint16((uint16_t)length);
+    put(text, length);
+  }
+
+  void putString(const std::string &text) {
+    putString(text.data(), text.size());
+  }
+
+  /**
+   * Queue an acknowledgement. Fails the connection if the outbox is full even with its reserve.
+   */
+  void sendAck(uint8_t header, uint16_t id) {
+    if (!beginPacket(header, 2, 0)) {
+      fail(REASON_PROTOCOL);
+      return;
+    }
+    putUint16(id);
+  }
+
+  void sendConnect() {
+    uint8_t flags = cleanSession ? 0x02 : 0x00;
+    size_t remaining = 2 + 4 + 1 + 1 + 2 + 2 + clientId.size();
+    if (!willTopic.empty()) {
+      flags |= (uint8_t)(0x04 | (willQos << 3) | (willRetain ? 0x20 : 0));
+      remaining += 2 + willTopic.size() + 2 + willPayload.size();
+    }
+    if (!user.empty()) {
+      flags |= 0x80;
+      remaining += 2 + user.size();
+    }
+    if (!password.empty()) {
+      flags |= 0x40;
+      remaining += 2 + password.size();
+    }
+    if (!beginPacket(0x10, remaining, 0)) {
+      fail(REASON_PROTOCOL);
+      return;
+    }
+    putString("MQTT", 4);
+    char level[2] = {4, (char)flags};
+    put(level, sizeof(level));
+    putUint16(keepAlive);
+    putString(clientId);
+    if (!willTopic.empty()) {
+      putString(willTopic);
+      putString(willPayload);
+    }
+    if (!user.empty()) putString(user);
+    if (!password.empty()) putString(password);
+    flush();
+  }
+
+  /**
+   * Write as much of the outbox as the stream takes.
+   */
+  void flush() {
+    size_t written = 0;
+    while (written < outboxLength) {
+      long sent = writeStream(outbox.get() + written, outboxLength - written);
+      if (sent <= 0) break;
+      bytesSent += (uint64_t)sent;
+      written += (size_t)sent;
+    }
+    // The stream may have failed and cleared the outbox
+    if (written == 0 || outboxLength == 0) return;
+    outboxLength -= written;
+    memmove(outbox.get(), outbox.get() + written, outboxLength);
+  }
+
+  /**
+   * Read what the stream has and handle every complete packet.
+   *
+   * @param now The current time in milliseconds, for the keep-alive
+   * @return false if the connection was closed
+   */
+  bool receive(uint32_t now) {
+    uint32_t connection = generation;
+    while (inboxLength < bufferSize) {
+      long received = readStream(inbox.get() + inboxLength, bufferSize - inboxLength);
+      if (received < 0) return false;
+      if (received == 0) break;
+      bytesReceived += (uint64_t)received;
+      inboxLength += (size_t)received;
+      lastReceivedAt = now;
+      pingPending = false;
+    }
+
+    size_t offset = 0;
+    while (connection == generation) {
+      // Fixed header: type and flags, then the remaining length in up to four 7-bit digits
+      size_t position = offset + 1;
+      size_t remaining = 0;
+      uint32_t multiplier = 1;
+      bool complete = false;
+      while (position < inboxLength && position - offset <= 4) {
+        uint8_t digit = (uint8_t)inbox[position++];
+        remaining += (digit & 0x7F) * multiplier;
+        multiplier *= 128;
+        if ((digit & 0x80) == 0) {
+          complete = true;
+          break;
+        }
+      }
+      if (!complete) {
+        if (position - offset > 4) fail(REASON_PROTOCOL);
+        break;
+      }
+      if (remaining > maxPacketSize) {
+        fail(REASON_PROTOCOL);
+        break;
+      }
+      if (inboxLength - position < remaining) break;
+
+      handlePacket((uint8_t)inbox[offset], inbox.get() + position, remaining);
+      offset = position + remaining;
+    }
+    // A callback may have closed the connection, or even opened a new one
+    if (connection != generation) return false;
+    inboxLength -= offset;
+    memmove(inbox.get(), inbox.get() + offset, inboxLength);
+    return true;
+  }
+
+  static uint16_t readUint16(const char *data) {
+    return (uint16_t)(((uint8_t)data[0] << 8) | (uint8_t)data[1]);
+  }
+
+  void handlePacket(uint8_t header, char *body, size_t length) {
+    uint8_t type = header >> 4;
+    if (type != 3 && type != 13 && length < 2) {
+      fail(REASON_PROTOCOL);
+      return;
+    }
+
+    switch (type) {
+      case 2:  // CONNACK
+        if (body[1] != 0) {
+          fail(body[1]);
+          return;
+        }
+        state = State::CONNECTED;
+        receivedQos2Count = 0;
+        if (connectCallback) connectCallback((body[0] & 1) != 0);
+        break;
+      case 3:  // PUBLISH
+        handlePublish(header, body, length);
+        break;
+      case 4:  // PUBACK
+      case 7:  // PUBCOMP
+        if (publishCallback) publishCallback(readUint16(body));
+        break;
+      case 5:  // PUBREC
+        sendAck(0x62, readUint16(body));
+        break;
+      case 6: {  // PUBREL
+        uint16_t id = readUint16(body);
+        forgetQos2(id);
+        sendAck(0x70, id);
+        break;
+      }
+      case 9:  // SUBACK
+        if (length < 3) {
+          fail(REASON_PROTOCOL);
+          return;
+        }
+        if (subscribeCallback) subscribeCallback(readUint16(body), (uint8_t)body[2]);
+        break;
+      case 13:  // PINGRESP
+        break;
+      default:
+        fail(REASON_PROTOCOL);
+        break;
+    }
+  }
+
+  void handlePublish(uint8_t header, char *body, size_t length) {
+    uint8_t qos = (header >> 1) & 0x03;
+    if (length < 2) {
+      fail(REASON_PROTOCOL);
+      return;
+    }
+    size_t topicLength = readUint16(body);
+    size_t position = 2 + topicLength + (qos > 0 ? 2 : 0);
+    if (qos == 3 || position > length) {
+      fail(REASON_PROTOCOL);
+      return;
+    }
+    uint16_t id = qos > 0 ? readUint16(body + 2 + topicLength) : 0;
+
+    if (qos == 2) {
+      for (uint8_t i = 0; i < receivedQos2Count; i++) {
+        if (receivedQos2[i] == id) {
+          sendAck(0x50, id);
+          return;
+        }
+      }
+      if (receivedQos2Count == QOS2_CAPACITY) forgetQos2(receivedQos2[0]);
+      receivedQos2[receivedQos2Count++] = id;
+      sendAck(0x50, id);
+    } else if (qos == 1) {
+      sendAck(0x40, id);
+    }
+
+    // Terminate the topic in place: move it over its length, which is not needed anymore
+    memmove(body, body + 2, topicLength);
+    body[topicLength] = '\0';
+
+    size_t payloadLength = length - position;
+    if (messageCallback) messageCallback(body, body + position, payloadLength, 0, payloadLength);
+  }
+
+  void forgetQos2(uint16_t id) {
+    for (uint8_t i = 0; i < receivedQos2Count; i++) {
+      if (receivedQos2[i] != id) continue;
+      memmove(&receivedQos2[i], &receivedQos2[i + 1], (receivedQos2Count - i - 1) * sizeof(receivedQos2[0]));
+      receivedQos2Count--;
+      return;
+    }
+  }
+};
+
+#endif  // STREAM_MQTT_TRANSPORT_H
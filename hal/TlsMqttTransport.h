@@ -0,0 +1,427 @@
+/**
+ * MQTT transport over TLS on the ESP8266, with the BearSSL engine on top of ESPAsyncTCP, used on the device
+ * when MQTT_TLS_ENABLED is set.
+ *
+ * The broker certificate is pinned by its SHA-1 fingerprint, so no CA chain is stored or validated. The record
+ * buffers are bounded to TLS_RECEIVE_BUFFER_SIZE and TLS_SEND_BUFFER_SIZE through the maximum fragment length
+ * extension, instead of the 16 kB a TLS record can have. A broker that ignores the extension fails the first
+ * handshake with a record that is too large; that is remembered in the TlsSessionCache, and the next handshake
+ * uses a full-size receive buffer.
+ *
+ * Nothing blocks: the TCP connection is asynchronous, and process() moves at most one received record through
+ * the engine while handshaking, so the scheduler runs between the steps of the handshake. The longest step is
+ * the one the engine cannot split, the key exchange of a full handshake. That is why the session is kept in a
+ * TlsSessionCache: a reconnect, also after a reset, resumes it with an abbreviated handshake without one. Full
+ * and resumed handshakes are counted and timed in getStats().
+ */
+
+#ifndef TLS_MQTT_TRANSPORT_H
+#define TLS_MQTT_TRANSPORT_H
+
+#include <algorithm>
+#include <memory>
+#include <ESPAsyncTCP.h>
+#include <bearssl/bearssl.h>
+#include <lwip/tcp.h>
+#include "StreamMqttTransport.h"
+#include "Hal.h"
+#include "../Constants.h"
+#include "../Log.h"
+#include "../TlsSessionCache.h"
+
+static_assert(sizeof(br_ssl_session_parameters) == sizeof(TlsSession),
+              "A TlsSession must have the layout of a BearSSL session");
+
+class TlsMqttTransport : public StreamMqttTransport {
+public:
+  /**
+   * Reason passed to the disconnect callback when the TLS handshake failed, e.g. on a fingerprint mismatch.
+   */
+  static constexpr int REASON_TLS = 101;
+
+  /**
+   * Counters and durations of the TLS handshakes since boot.
+   */
+  struct Stats {
+    uint32_t fullHandshakes = 0;
+    uint32_t resumedHandshakes = 0;
+    uint32_t failedHandshakes = 0;
+
+    /**
+     * The duration of the last full and the last resumed handshake in milliseconds, TCP connect included.
+     */
+    uint32_t lastFullTime = 0;
+    uint32_t lastResumedTime = 0;
+
+    /**
+     * The longest time one step of a handshake kept the main loop busy, in microseconds.
+     */
+    uint32_t longestStep = 0;
+  };
+
+  /**
+   * Create a new transport and feed the connection events to the record buffer.
+   */
+  TlsMqttTransport() : StreamMqttTransport(MQTT_MAX_PACKET_SIZE, TLS_POLL_INTERVAL) {
+    fingerprintValid = parseFingerprint(MQTT_TLS_FINGERPRINT, certificate.fingerprint);
+    if (!fingerprintValid) LOG_ERROR("[TLS] MQTT_TLS_FINGERPRINT is not a valid SHA-1 fingerprint.");
+
+    tcp.onConnect([this](void *argument, AsyncClient *connection) {
+      (void)argument;
+      (void)connection;
+      tcpConnected = true;
+      hal::wake();
+    });
+
+    tcp.onData([this](void *argument, AsyncClient *connection, void *data, size_t length) {
+      (void)argument;
+      // The window is only opened again once the engine took the bytes, so they always fit
+      connection->ackLater();
+      if (length > sizeof(received) - receivedLength) {
+        tcpClosed = true;
+        return;
+      }
+      memcpy(received + receivedLength, data, length);
+      receivedLength += length;
+      hal::wake();
+    });
+
+    tcp.onDisconnect([this](void *argument, AsyncClient *connection) {
+      (void)argument;
+      (void)connection;
+      tcpClosed = true;
+      hal::wake();
+    });
+
+    tcp.onError([this](void *argument, AsyncClient *connection, int8_t error) {
+      (void)argument;
+      (void)connection;
+      (void)error;
+      tcpClosed = true;
+      hal::wake();
+    });
+  }
+
+  void setServer(const char *host, uint16_t port) override {
+    StreamMqttTransport::setServer(host, port);
+    sessionCache.begin(host, port);
+  }
+
+  const Stats &getStats() const {
+    return stats;
+  }
+
+protected:
+  void openStream() override {
+    if (!fingerprintValid) {
+      fail(REASON_TLS);
+      return;
+    }
+    setUpEngine();
+
+    // The engine writes the parameters of the new or resumed session back into the ones it was given
+    resuming = sessionCache.get(cached);
+    if (resuming) {
+      br_ssl_engine_set_session_parameters(&client.eng, reinterpret_cast<const br_ssl_session_parameters *>(&cached));
+    }
+    if (!br_ssl_client_reset(&client, getHost(), resuming ? 1 : 0)) {
+      failHandshake("reset");
+      return;
+    }
+
+    tcpConnected = false;
+    tcpClosed = false;
+    receivedLength = 0;
+    startedAt = hal::millis();
+    if (!tcp.connect(getHost(), getPort())) fail(REASON_CLOSED);
+  }
+
+  int pollStream() override {
+    if (hal::millis() - startedAt >= TLS_HANDSHAKE_TIMEOUT) {
+      failHandshake("timeout");
+      return -1;
+    }
+    if (!tcpConnected) {
+      if (!tcpClosed) return 0;
+      fail(REASON_CLOSED);
+      return -1;
+    }
+    if (!pump(true)) return -1;
+
+    unsigned state = br_ssl_engine_current_state(&client.eng);
+    if ((state & (BR_SSL_SENDAPP | BR_SSL_RECVAPP)) == 0) {
+      if (!tcpClosed || receivedLength != 0) return 0;
+      failHandshake("connection closed");
+      return -1;
+    }
+    finishHandshake();
+    return 1;
+  }
+
+  long readStream(char *buffer, size_t size) override {
+    if (!pump(false)) return -1;
+    size_t length = 0;
+    unsigned char *data = br_ssl_engine_recvapp_buf(&client.eng, &length);
+    if (data == nullptr) {
+      if (!tcpClosed || receivedLength != 0) return 0;
+      fail(REASON_CLOSED);
+      return -1;
+    }
+    if (length > size) length = size;
+    memcpy(buffer, data, length);
+    br_ssl_engine_recvapp_ack(&client.eng, length);
+    return (long)length;
+  }
+
+  long writeStream(const char *data, size_t size) override {
+    if (!pump(false)) return -1;
+    size_t length = 0;
+    unsigned char *buffer = br_ssl_engine_sendapp_buf(&client.eng, &length);
+    if (buffer == nullptr) return 0;
+    if (length > size) length = size;
+    memcpy(buffer, data, length);
+    br_ssl_engine_sendapp_ack(&client.eng, length);
+    br_ssl_engine_flush(&client.eng, 0);
+    return pump(false) ? (long)length : -1;
+  }
+
+  void closeStream() override {
+    tcp.close(true);
+    tcpConnected = false;
+    receivedLength = 0;
+  }
+
+private:
+  /**
+   * Pins the certificate of the broker by the SHA-1 of its first certificate, and hands its key to the engine.
+   */
+  struct PinnedCertificate {
+    const br_x509_class *vtable;
+    br_sha1_context sha1;
+    br_x509_decoder_context decoder;
+    uint8_t fingerprint[20];
+    uint8_t certificates;
+    bool matched;
+  };
+
+  /**
+   * The suites a broker can pick: forward secret, with the ciphers BearSSL has fast constant-time code for.
+   */
+  static constexpr uint16_t SUITES[] = {
+    BR_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256, BR_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    BR_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256, BR_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+    BR_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384, BR_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+  };
+
+  /**
+   * Room for the records of the engine: the payload and the header, MAC and padding around it.
+   */
+  static constexpr size_t INPUT_OVERHEAD = BR_SSL_BUFSIZE_INPUT - 16384;
+  static constexpr size_t OUTPUT_OVERHEAD = BR_SSL_BUFSIZE_OUTPUT - 16384;
+
+  AsyncClient tcp;
+  br_ssl_client_context client;
+  PinnedCertificate certificate = {};
+  bool fingerprintValid = false;
+
+  unsigned char input[TLS_RECEIVE_BUFFER_SIZE + INPUT_OVERHEAD];
+  unsigned char output[TLS_SEND_BUFFER_SIZE + OUTPUT_OVERHEAD];
+
+  /**
+   * The receive buffer for a broker without the maximum fragment length extension, only allocated for one.
+   */
+  std::unique_ptr<unsigned char[]> largeInput;
+
+  /**
+   * Bytes received by the network stack and not taken by the engine yet, at most one TCP window.
+   */
+  unsigned char received[TCP_WND];
+  volatile size_t receivedLength = 0;
+  volatile bool tcpConnected = false;
+  volatile bool tcpClosed = false;
+
+  TlsSessionCache sessionCache;
+  TlsSession cached = {};
+  bool resuming = false;
+  uint32_t startedAt = 0;
+  Stats stats;
+
+  static void startChain(const br_x509_class **context, const char *serverName) {
+    (void)serverName;
+    PinnedCertificate *pinned = reinterpret_cast<PinnedCertificate *>(context);
+    pinned->certificates = 0;
+    pinned->matched = false;
+  }
+
+  static void startCertificate(const br_x509_class **context, uint32_t length) {
+    (void)length;
+    PinnedCertificate *pinned = reinterpret_cast<PinnedCertificate *>(context);
+    if (pinned->certificates != 0) return;
+    br_sha1_init(&pinned->sha1);
+    br_x509_decoder_init(&pinned->decoder, nullptr, nullptr);
+  }
+
+  static void appendCertificate(const br_x509_class **context, const unsigned char *data, size_t length) {
+    PinnedCertificate *pinned = reinterpret_cast<PinnedCertificate *>(context);
+    if (pinned->certificates != 0) return;
+    br_sha1_update(&pinned->sha1, data, length);
+    br_x509_decoder_push(&pinned->decoder, data, length);
+  }
+
+  static void endCertificate(const br_x509_class **context) {
+    PinnedCertificate *pinned = reinterpret_cast<PinnedCertificate *>(context);
+    if (pinned->certificates++ != 0) return;
+    uint8_t digest[br_sha1_SIZE];
+    br_sha1_out(&pinned->sha1, digest);
+    pinned->matched = memcmp(digest, pinned->fingerprint, sizeof(digest)) == 0;
+  }
+
+  static unsigned endChain(const br_x509_class **context) {
+    PinnedCertificate *pinned = reinterpret_cast<PinnedCertificate *>(context);
+    if (!pinned->matched) return BR_ERR_X509_NOT_TRUSTED;
+    int error = br_x509_decoder_last_error(&pinned->decoder);
+    return error != 0 ? (unsigned)error : 0;
+  }
+
+  static const br_x509_pkey *getKey(const br_x509_class *const *context, unsigned *usages) {
+    PinnedCertificate *pinned = reinterpret_cast<PinnedCertificate *>(const_cast<const br_x509_class **>(context));
+    if (usages != nullptr) *usages = BR_KEYTYPE_KEYX | BR_KEYTYPE_SIGN;
+    return br_x509_decoder_get_pkey(&pinned->decoder);
+  }
+
+  static constexpr br_x509_class PINNED_CERTIFICATE_CLASS = {
+    sizeof(PinnedCertificate), startChain, startCertificate, appendCertificate, endCertificate, endChain, getKey,
+  };
+
+  /**
+   * @return false if the text is not 20 bytes in hex, with or without colons
+   */
+  static bool parseFingerprint(const char *text, uint8_t (&fingerprint)[20]) {
+    size_t length = 0;
+    for (const char *c = text; *c != '\0'; c++) {
+      if (*c == ':') continue;
+      int digit = *c >= '0' && *c <= '9' ? *c - '0' : (*c | 0x20) >= 'a' && (*c | 0x20) <= 'f' ? (*c | 0x20) - 'a' + 10 : -1;
+      if (digit < 0 || length == 2 * sizeof(fingerprint)) return false;
+      fingerprint[length / 2] = (uint8_t)(fingerprint[length / 2] << 4 | digit);
+      length++;
+    }
+    return length == 2 * sizeof(fingerprint);
+  }
+
+  /**
+   * Set up the engine for a new connection: TLS 1.2, the suites, the pinned certificate and the buffers.
+   */
+  void setUpEngine() {
+    br_ssl_client_zero(&client);
+    br_ssl_engine_set_versions(&client.eng, BR_TLS12, BR_TLS12);
+    br_ssl_engine_set_suites(&client.eng, SUITES, sizeof(SUITES) / sizeof(SUITES[0]));
+    br_ssl_engine_set_hash(&client.eng, br_sha256_ID, &br_sha256_vtable);
+    br_ssl_engine_set_hash(&client.eng, br_sha384_ID, &br_sha384_vtable);
+    br_ssl_engine_set_prf_sha256(&client.eng, &br_tls12_sha256_prf);
+    br_ssl_engine_set_prf_sha384(&client.eng, &br_tls12_sha384_prf);
+    br_ssl_engine_set_default_ecdsa(&client.eng);
+    br_ssl_engine_set_default_rsavrfy(&client.eng);
+    br_ssl_engine_set_default_aes_gcm(&client.eng);
+    br_ssl_engine_set_default_chapol(&client.eng);
+
+    certificate.vtable = &PINNED_CERTIFICATE_CLASS;
+    br_ssl_engine_set_x509(&client.eng, &certificate.vtable);
+
+    // A smaller receive buffer makes the client ask for the maximum fragment length extension
+    if (sessionCache.hasUnboundedRecords()) {
+      if (!largeInput) largeInput.reset(new unsigned char[BR_SSL_BUFSIZE_INPUT]);
+      br_ssl_engine_set_buffers_bidi(&client.eng, largeInput.get(), BR_SSL_BUFSIZE_INPUT, output, sizeof(output));
+    } else {
+      br_ssl_engine_set_buffers_bidi(&client.eng, input, sizeof(input), output, sizeof(output));
+    }
+  }
+
+  /**
+   * Move records between the engine and the TCP connection. While handshaking, at most one received record
+   * goes through the engine per call, so a step of the handshake is all that runs before the main loop again.
+   *
+   * @param handshaking Whether to stop after one received record
+   * @return false if the engine failed and fail() was called
+   */
+  bool pump(bool handshaking) {
+    for (;;) {
+      unsigned state = br_ssl_engine_current_state(&client.eng);
+      if ((state & BR_SSL_CLOSED) != 0) {
+        int error = br_ssl_engine_last_error(&client.eng);
+        char reason[24];
+        snprintf(reason, sizeof(reason), "error %d", error);
+        if (isOpening()) {
+          failHandshake(reason);
+        } else {
+          if (error != BR_ERR_OK) LOG_WARN("[TLS] Connection failed: %s", reason);
+          fail(error == BR_ERR_OK ? REASON_CLOSED : REASON_TLS);
+        }
+        return false;
+      }
+
+      bool progressed = false;
+      if ((state & BR_SSL_SENDREC) != 0 && tcp.canSend()) {
+        size_t length = 0;
+        unsigned char *record = br_ssl_engine_sendrec_buf(&client.eng, &length);
+        size_t sent = tcp.add(reinterpret_cast<const char *>(record), std::min(length, tcp.space()));
+        if (sent > 0) {
+          tcp.send();
+          br_ssl_engine_sendrec_ack(&client.eng, sent);
+          progressed = true;
+        }
+      }
+      if ((state & BR_SSL_RECVREC) != 0 && receivedLength != 0) {
+        size_t length = 0;
+        unsigned char *record = br_ssl_engine_recvrec_buf(&client.eng, &length);
+        size_t taken = std::min(length, (size_t)receivedLength);
+        memcpy(record, received, taken);
+        receivedLength -= taken;
+        memmove(received, received + taken, receivedLength);
+        tcp.ack(taken);
+
+        // The engine runs the cryptography of the handshake as it takes the records
+        uint32_t start = hal::micros();
+        br_ssl_engine_recvrec_ack(&client.eng, taken);
+        uint32_t duration = hal::micros() - start;
+        if (handshaking && duration > stats.longestStep) stats.longestStep = duration;
+        if (handshaking) return true;
+        progressed = true;
+      }
+      if (!progressed) return true;
+    }
+  }
+
+  /**
+   * Count the handshake and cache its session.
+   */
+  void finishHandshake() {
+    uint32_t duration = hal::millis() - startedAt;
+    TlsSession current;
+    br_ssl_engine_get_session_parameters(&client.eng, reinterpret_cast<br_ssl_session_parameters *>(&current));
+    if (resuming && current.sameId(cached)) {
+      stats.resumedHandshakes++;
+      stats.lastResumedTime = duration;
+      LOG_INFO("[TLS] Session resumed in %lu ms", (unsigned long)duration);
+    } else {
+      stats.fullHandshakes++;
+      stats.lastFullTime = duration;
+      LOG_INFO("[TLS] Full handshake in %lu ms, longest step %lu us", (unsigned long)duration,
+               (unsigned long)stats.longestStep);
+    }
+    sessionCache.put(current);
+  }
+
+  void failHandshake(const char *reason) {
+    LOG_WARN("[TLS] Handshake failed: %s", reason);
+    stats.failedHandshakes++;
+    // A broker that ignored the maximum fragment length extension sent a record larger than the buffer
+    if (br_ssl_engine_last_error(&client.eng) == BR_ERR_TOO_LARGE) {
+      LOG_WARN("[TLS] The broker does not bound its records, using a 16 kB receive buffer.");
+      sessionCache.setUnboundedRecords(true);
+    }
+    sessionCache.clear();
+    fail(REASON_TLS);
+  }
+};
+
+#endif  // TLS_MQTT_TRANSPORT_H
@@ -0,0 +1,169 @@
+/**
+ * Wi-Fi network link of the ESP8266, provisioned through WiFiManager.
+ *
+ * Provisioning never blocks: begin() only starts joining the saved network or opens the config portal,
+ * and process() drives both from the main loop, so the alarm keeps working while the network is set up.
+ */
+
+#ifndef WIFI_LINK_H
+#define WIFI_LINK_H
+
+#include <WiFiManager.h>
+#include "NetworkLink.h"
+#include "Hal.h"
+#include "../Constants.h"
+#include "../Log.h"
+
+class WifiLink : public NetworkLink {
+public:
+  /**
+   * Start connecting to Wi-Fi. If the ESP was set up before it will join the saved network.
+   * If not, or if joining takes longer than WIFI_JOIN_TIMEOUT, it will create an access point with the name
+   * and password defined in the constants. This access point must be used to set up the connection with a
+   * Wi-Fi network. To set up this connection go to gateway IP (192.168.4.1) while connected to this access point.
+   */
+  void begin() override {
+    wifiConnectHandler = WiFi.onStationModeGotIP([this](const WiFiEventStationModeGotIP &event) {
+      (void)event;
+      if (state != State::CONNECTED) {
+        LOG_INFO("Connected to Wi-Fi.");
+      }
+      state = State::CONNECTED;
+      if (upCallback) upCallback();
+    });
+
+    wifiDisconnectHandler = WiFi.onStationModeDisconnected([this](const WiFiEventStationModeDisconnected &event) {
+      (void)event;
+      if (state == State::CONNECTED) {
+        // A drop after a successful connection is recovered by the connection supervisor, not the portal
+        state = State::RECONNECTING;
+        stateSince = hal::millis();
+      }
+      if (downCallback) downCallback();
+    });
+
+    // Initialize the Wi-Fi connection
+    LOG_INFO("Initializing Wi-Fi connection");
+    if (WIFI_IDLE_LIGHT_SLEEP) {
+      // Let the modem sleep between beacons while the main loop idles
+      WiFi.setSleepMode(WIFI_LIGHT_SLEEP);
+    }
+    wifiManager.setConfigPortalBlocking(false);
+    wifiManager.setConfigPortalTimeout(WIFI_PORTAL_TIMEOUT_SECONDS);
+
+    if (wifiManager.getWiFiIsSaved()) {
+      joinSavedNetwork();
+    } else {
+      startPortal();
+    }
+  }
+
+  /**
+   * Drive the join and the config portal. Must be called from the main loop.
+   */
+  void process() override {
+    switch (state) {
+      case State::JOINING:
+        // Fall back to the config portal if the saved network cannot be joined
+        if (hal::millis() - stateSince >= WIFI_JOIN_TIMEOUT) {
+          LOG_WARN("Could not join the saved Wi-Fi network.");
+          startPortal();
+        }
+        break;
+
+      case State::PORTAL:
+        wifiManager.process();
+        // When the portal times out without new credentials, fall back to the saved network
+        if (!wifiManager.getConfigPortalActive() && state == State::PORTAL) {
+          LOG_INFO("Wi-Fi config portal closed.");
+          joinSavedNetwork();
+        }
+        break;
+
+      case State::RECONNECTING:
+        break;
+
+      case State::CONNECTED:
+        // The saved network came back while the portal was open
+        if (wifiManager.getConfigPortalActive()) {
+          wifiManager.stopConfigPortal();
+        }
+        break;
+    }
+  }
+
+  bool isConnected() const override {
+    return WiFi.isConnected();
+  }
+
+  bool isConnecting() const override {
+    return state == State::JOINING || state == State::PORTAL;
+  }
+
+  void reconnect() override {
+    WiFi.reconnect();
+  }
+
+  void restart() override {
+    EspClass::restart();
+  }
+
+private:
+  enum class State {
+    /** Joining the saved network. */
+    JOINING,
+    /** The config portal is open; the saved network is still tried in the background. */
+    PORTAL,
+    /** The connection was lost and is being recovered through reconnect(). */
+    RECONNECTING,
+    /** Connected and holding an IP address. */
+    CONNECTED
+  };
+
+  /**
+   * Wi-Fi manager that runs the config portal.
+   */
+  WiFiManager wifiManager;
+
+  /**
+   * Wi-Fi event handler to handle a successful connection.
+   */
+  WiFiEventHandler wifiConnectHandler;
+
+  /**
+   * Wi-Fi event handler to handle a disconnection.
+   */
+  WiFiEventHandler wifiDisconnectHandler;
+
+  /**
+   * The current provisioning state.
+   */
+  State state = State::JOINING;
+
+  /**
+   * The time the current state was entered.
+   */
+  uint32_t stateSince = 0;
+
+  /**
+   * Start joining the network with the saved credentials without waiting for the result.
+   */
+  void joinSavedNetwork() {
+    state = State::JOINING;
+    stateSince = hal::millis();
+    WiFi.mode(WIFI_STA);
+    WiFi.begin();
+  }
+
+  /**
+   * Open the config portal without blocking.
+   */
+  void startPortal() {
+    LOG_INFO("Starting Wi-Fi config portal.");
+    state = State::PORTAL;
+    stateSince = hal::millis();
+    wifiManager.startConfigPortal(WIFI_SSID, WIFI_PASSWORD);
+  }
+};
+
+#endif  // WIFI_LINK_H
@@ -0,0 +1,229 @@
+/**
+ * Makes firmware deltas on the host, in the format of DeltaPatch.h.
+ *
+ * The image is matched against the base like bsdiff does, but with a hash index instead of a suffix array, which
+ * is plenty for images of a few hundred KB: an exact match of MATCH_SEED bytes anchors a region, which is then
+ * extended as long as it keeps matching more bytes than it misses. Such a region becomes add bytes, the new bytes
+ * between the regions become copy bytes. The patch stream is then compressed with LZSS.
+ */
+
+#ifndef DELTA_ENCODER_H
+#define DELTA_ENCODER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "../DeltaPatch.h"
+
+class DeltaEncoder {
+public:
+  /**
+   * The sizes of the parts of the last delta.
+   */
+  struct Stats {
+    size_t instructions = 0;
+    size_t addBytes = 0;
+    size_t copyBytes = 0;
+    size_t patchSize = 0;
+    size_t deltaSize = 0;
+  };
+
+  /**
+   * Make a delta that turns the base image into the new image.
+   */
+  std::vector<uint8_t> encode(const std::vector<uint8_t> &base, const std::vector<uint8_t> &image) {
+    stats = {};
+    std::vector<uint8_t> patch(DELTA_MAGIC, DELTA_MAGIC + sizeof(DELTA_MAGIC));
+    writeLittleEndian(patch, (uint32_t)base.size());
+    writeLittleEndian(patch, (uint32_t)image.size());
+    index(base);
+
+    // The position in the image, and the base position the base cursor of the patcher is at
+    size_t cursor = 0;
+    size_t aligned = 0;
+    while (cursor < image.size()) {
+      size_t add = extend(base, image, aligned, cursor);
+      size_t copyStart = cursor + add;
+      size_t next = copyStart;
+      size_t nextBase = 0;
+      while (next < image.size() && !findSeed(base, image, next, aligned + (next - cursor), nextBase)) next++;
+      size_t copy = next - copyStart;
+
+      // The seek moves the base cursor from the end of the add bytes to the start of the next region
+      int64_t seek = next < image.size() ? (int64_t)nextBase - (int64_t)(aligned + add) : 0;
+      writeVarint(patch, (uint32_t)add);
+      writeVarint(patch, (uint32_t)copy);
+      writeVarint(patch, (uint32_t)(int32_t)seek << 1 ^ (uint32_t)((int32_t)seek >> 31));
+      for (size_t i = 0; i < add; i++) patch.push_back((uint8_t)(image[cursor + i] - base[aligned + i]));
+      patch.insert(patch.end(), image.begin() + copyStart, image.begin() + next);
+
+      stats.instructions++;
+      stats.addBytes += add;
+      stats.copyBytes += copy;
+      aligned = (size_t)((int64_t)(aligned + add) + seek);
+      cursor = next;
+    }
+    stats.patchSize = patch.size();
+
+    std::vector<uint8_t> delta = compress(patch);
+    stats.deltaSize = delta.size();
+    return delta;
+  }
+
+  const Stats &getStats() const {
+    return stats;
+  }
+
+  /**
+   * Compress a patch stream with LZSS, greedy, with hash chains over the window.
+   */
+  static std::vector<uint8_t> compress(const std::vector<uint8_t> &input) {
+    std::vector<uint8_t> output;
+    std::vector<int32_t> head(1 << 16, -1);
+    std::vector<int32_t> previous(input.size(), -1);
+    auto hash = [&input](size_t position) {
+      return (uint16_t)((input[position] << 8 ^ input[position + 1] << 4 ^ input[position + 2]) * 2654435761U >> 16);
+    };
+    auto insert = [&](size_t position) {
+      if (position + DELTA_MIN_MATCH > input.size()) return;
+      uint16_t key = hash(position);
+      previous[position] = head[key];
+      head[key] = (int32_t)position;
+    };
+
+    size_t flagsAt = 0;
+    uint8_t items = 8;
+    size_t position = 0;
+    while (position < input.size()) {
+      if (items == 8) {
+        flagsAt = output.size();
+        output.push_back(0);
+        items = 0;
+      }
+
+      size_t bestLength = 0;
+      size_t bestDistance = 0;
+      if (position + DELTA_MIN_MATCH <= input.size()) {
+        size_t limit = std::min<size_t>(DELTA_MAX_MATCH, input.size() - position);
+        int chain = 0;
+        for (int32_t candidate = head[hash(position)]; candidate >= 0 && chain < MAX_CHAIN;
+             candidate = previous[candidate], chain++) {
+          size_t distance = position - (size_t)candidate;
+          if (distance > DELTA_WINDOW_SIZE) break;
+          size_t length = 0;
+          while (length < limit && input[candidate + length] == input[position + length]) length++;
+          if (length > bestLength) {
+            bestLength = length;
+            bestDistance = distance;
+            if (length == limit) break;
+          }
+        }
+      }
+
+      if (bestLength >= DELTA_MIN_MATCH) {
+        size_t lengthBits = std::min<size_t>(bestLength - DELTA_MIN_MATCH, DELTA_LENGTH_MASK);
+        uint16_t reference = (uint16_t)((bestDistance - 1) << (16 - DELTA_WINDOW_BITS) | lengthBits);
+        output.push_back((uint8_t)(reference >> 8));
+        output.push_back((uint8_t)reference);
+        if (lengthBits == DELTA_LENGTH_MASK) output.push_back((uint8_t)(bestLength - DELTA_MIN_MATCH - DELTA_LENGTH_MASK));
+        for (size_t i = 0; i < bestLength; i++) insert(position + i);
+        position += bestLength;
+      } else {
+        output[flagsAt] |= (uint8_t)(1 << items);
+        output.push_back(input[position]);
+        insert(position);
+        position++;
+      }
+      items++;
+    }
+    return output;
+  }
+
+private:
+  /**
+   * The length of the exact match that anchors a region.
+   */
+  static constexpr size_t MATCH_SEED = 8;
+
+  /**
+   * The bytes after the last match a region may be extended by without finding a better end.
+   */
+  static constexpr size_t EXTEND_SLACK = 64;
+
+  static constexpr int MAX_CHAIN = 64;
+  static constexpr uint8_t INDEX_BITS = 20;
+
+  Stats stats;
+
+  /**
+   * The last base position with each hash of MATCH_SEED bytes, or -1.
+   */
+  std::vector<int32_t> seeds;
+
+  static uint32_t seedHash(const uint8_t *bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return (uint32_t)((value * 0x9E3779B97F4A7C15ULL) >> (64 - INDEX_BITS));
+  }
+
+  void index(const std::vector<uint8_t> &base) {
+    seeds.assign((size_t)1 << INDEX_BITS, -1);
+    for (size_t i = 0; i + MATCH_SEED <= base.size(); i++) seeds[seedHash(&base[i])] = (int32_t)i;
+  }
+
+  /**
+   * Find where a region of the image starts: at the current alignment if it matches there, else anywhere in the base.
+   *
+   * @param position The position in the image
+   * @param alignedBase The base position that continues the current alignment
+   * @param found Receives the base position of the region
+   * @return true if a region starts at the position
+   */
+  bool findSeed(const std::vector<uint8_t> &base, const std::vector<uint8_t> &image, size_t position,
+                size_t alignedBase, size_t &found) const {
+    if (position + MATCH_SEED > image.size()) return false;
+    if (alignedBase + MATCH_SEED <= base.size() && memcmp(&base[alignedBase], &image[position], MATCH_SEED) == 0) {
+      found = alignedBase;
+      return true;
+    }
+    int32_t candidate = seeds[seedHash(&image[position])];
+    if (candidate < 0 || memcmp(&base[candidate], &image[position], MATCH_SEED) != 0) return false;
+    found = (size_t)candidate;
+    return true;
+  }
+
+  /**
+   * Extend a region like bsdiff: to the length where the matches exceed the misses by the most.
+   *
+   * @return The length of the region, 0 if it does not start with a match
+   */
+  static size_t extend(const std::vector<uint8_t> &base, const std::vector<uint8_t> &image, size_t basePosition,
+                       size_t position) {
+    size_t best = 0;
+    int64_t score = 0;
+    int64_t bestScore = 0;
+    for (size_t i = 0; basePosition + i < base.size() && position + i < image.size() && i - best <= EXTEND_SLACK; i++) {
+      score += base[basePosition + i] == image[position + i] ? 1 : -1;
+      if (score > bestScore) {
+        bestScore = score;
+        best = i + 1;
+      }
+    }
+    return best;
+  }
+
+  static void writeLittleEndian(std::vector<uint8_t> &output, uint32_t value) {
+    for (uint8_t i = 0; i < 4; i++) output.push_back((uint8_t)(value >> (8 * i)));
+  }
+
+  static void writeVarint(std::vector<uint8_t> &output, uint32_t value) {
+    while (value >= 0x80) {
+      output.push_back((uint8_t)(value | 0x80));
+      value >>= 7;
+    }
+    output.push_back((uint8_t)value);
+  }
+};
+
+#endif  // DELTA_ENCODER_H
@@ -0,0 +1,601 @@
+/**
+ * Host implementation of the hardware abstraction layer for the native build.
+ *
+ * Pins are kept in memory, the clock only moves when the simulation advances it and
+ * Ticker callbacks fire when the simulated clock passes their deadline.
+ * This lets the alarm and internet managers run on Linux without a board.
+ */
+
+#ifndef HOST_HAL_H
+#define HOST_HAL_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdarg>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <string>
+
+#define HIGH          0x1
+#define LOW           0x0
+#define INPUT         0x00
+#define OUTPUT        0x01
+#define INPUT_PULLUP  0x02
+
+// Code that runs in interrupt context on the device needs no special placement on the host
+#define IRAM_ATTR
+
+// Strings stay in RAM on the host, so the flash variants are the normal ones
+#define PSTR(s)       (s)
+#define vsnprintf_P   vsnprintf
+
+// Pin numbers of the Wemos D1 mini, so Constants.h can be used unchanged
+#define D0            16
+#define D5            14
+#define D6            12
+#define LED_BUILTIN   2
+
+/**
+ * Minimal stand-in for the Arduino Serial object that writes to stdout.
+ * Output can be muted to keep benchmarks from measuring the terminal.
+ */
+class HostSerial {
+public:
+  bool muted = false;
+
+  void begin(unsigned long baud) {
+    (void)baud;
+  }
+
+  size_t print(const char *value) {
+    return muted ? 0 : std::fputs(value, stdout);
+  }
+
+  size_t print(char value) {
+    return muted ? 0 : std::fputc(value, stdout);
+  }
+
+  size_t print(int value) {
+    return printf("%d", value);
+  }
+
+  size_t print(unsigned int value) {
+    return printf("%u", value);
+  }
+
+  size_t print(long value) {
+    return printf("%ld", value);
+  }
+
+  size_t print(unsigned long value) {
+    return printf("%lu", value);
+  }
+
+  size_t write(const uint8_t *data, size_t length) {
+    return muted ? 0 : std::fwrite(data, 1, length, stdout);
+  }
+
+  /**
+   * stdout never makes the simulation wait, so it takes any amount.
+   */
+  int availableForWrite() {
+    return 4096;
+  }
+
+  size_t println() {
+    return print('\n');
+  }
+
+  template<typename T>
+  size_t println(T value) {
+    size_t written = print(value);
+    return written + println();
+  }
+
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+    if (muted) return 0;
+    va_list args;
+    va_start(args, format);
+    int written = std::vprintf(format, args);
+    va_end(args);
+    return written < 0 ? 0 : written;
+  }
+};
+
+inline HostSerial Serial;
+
+namespace hal {
+namespace sim {
+  /**
+   * Number of simulated pins.
+   */
+  constexpr uint8_t PIN_COUNT = 32;
+
+  /**
+   * Current simulated time in milliseconds. 32 bits wide like on the device, so it wraps the same way.
+   */
+  inline uint32_t clockMs = 0;
+
+  /**
+   * Current level of each simulated pin.
+   */
+  inline uint8_t pinLevels[PIN_COUNT] = {};
+
+  /**
+   * Current mode of each simulated pin.
+   */
+  inline uint8_t pinModes[PIN_COUNT] = {};
+
+  /**
+   * Number of writes to each pin, to measure how often the managers touch the hardware.
+   */
+  inline uint32_t pinWrites[PIN_COUNT] = {};
+
+  /**
+   * Optional observer that is called on every pin level change, e.g. to record a claxon timeline.
+   */
+  inline std::function<void(uint8_t pin, uint8_t level, uint32_t timeMs)> onPinChange;
+
+  /**
+   * Size of the simulated RTC user memory, like the 512 bytes of the ESP8266.
+   */
+  constexpr size_t RTC_MEMORY_SIZE = 512;
+
+  /**
+   * Simulated RTC user memory. Keeps its content across a simulated reset.
+   */
+  inline uint8_t rtcMemory[RTC_MEMORY_SIZE] = {};
+
+  /**
+   * State of the pseudo random generator, fixed so simulation runs are reproducible.
+   */
+  inline uint32_t randomState = 0x2545F491;
+
+  /**
+   * Interrupt handler of each pin, called when the level changes.
+   */
+  inline void (*pinInterrupts[PIN_COUNT])() = {};
+
+  /**
+   * Set the level of an input pin from the outside world, e.g. a simulated button press.
+   * Calls the interrupt handler of the pin if the level changes.
+   *
+   * @param pin The pin to drive
+   * @param level HIGH or LOW
+   */
+  inline void drivePin(uint8_t pin, uint8_t level) {
+    if (pin >= PIN_COUNT || pinLevels[pin] == level) return;
+    pinLevels[pin] = level;
+    if (pinInterrupts[pin]) pinInterrupts[pin]();
+  }
+
+  /**
+   * The heap of the simulated device, see hal::freeHeap() and hal::largestFreeBlock().
+   */
+  inline uint32_t freeHeap = 40 * 1024;
+  inline uint32_t largestFreeBlock = 32 * 1024;
+
+  /**
+   * The chip ID of the simulated device.
+   */
+  inline uint32_t chipId = 0x00C0FFEE;
+
+  /**
+   * The wall clock time at simulated time 0 in milliseconds since the Unix epoch, and whether the simulated
+   * device has synchronized its wall clock.
+   */
+  inline uint64_t epochAtBoot = 1760000000000ULL;
+  inline bool wallClockSynced = true;
+
+  /**
+   * Contents of the simulated flash files by path. They survive a simulated reset.
+   */
+  inline std::map<std::string, std::vector<uint8_t>> flashFiles;
+
+  /**
+   * The amount of writes to the simulated flash files, and the bytes written by them.
+   */
+  inline uint32_t flashWrites = 0;
+  inline uint32_t flashBytesWritten = 0;
+
+  /**
+   * The running firmware image, the image in the spare slot and whether that one has been committed.
+   * A restart boots a committed image like the boot loader does.
+   */
+  inline std::vector<uint8_t> firmware;
+  inline std::vector<uint8_t> firmwareSlot;
+  inline uint32_t firmwareSlotSize = 0;
+  inline bool firmwareCommitted = false;
+
+  /**
+   * The command the boot loader finds in the first 128 bytes of RTC memory after a commit, like eboot.
+   * A restart only boots the committed image while that command is intact.
+   */
+  constexpr size_t BOOT_COMMAND_SIZE = 128;
+  inline uint8_t bootCommand[BOOT_COMMAND_SIZE] = {};
+
+  /**
+   * The space for the spare slot, like the free sketch space of a 4 MB flash with 1 MB for LittleFS.
+   */
+  inline uint32_t firmwareSlotCapacity = 1000 * 1024;
+
+  /**
+   * The amount of simulated restarts.
+   */
+  inline uint32_t restarts = 0;
+}  // namespace sim
+
+  inline void attachPinInterrupt(uint8_t pin, void (*callback)()) {
+    if (pin < sim::PIN_COUNT) sim::pinInterrupts[pin] = callback;
+  }
+
+  inline void setPinMode(uint8_t pin, uint8_t mode) {
+    if (pin < sim::PIN_COUNT) sim::pinModes[pin] = mode;
+  }
+
+  inline void writePin(uint8_t pin, uint8_t level) {
+    if (pin >= sim::PIN_COUNT) return;
+    sim::pinWrites[pin]++;
+    if (sim::pinLevels[pin] != level) {
+      sim::pinLevels[pin] = level;
+      if (sim::onPinChange) sim::onPinChange(pin, level, sim::clockMs);
+    }
+  }
+
+  inline int readPin(uint8_t pin) {
+    return pin < sim::PIN_COUNT ? sim::pinLevels[pin] : LOW;
+  }
+
+  inline uint32_t millis() {
+    return sim::clockMs;
+  }
+
+  inline uint32_t micros() {
+    return sim::clockMs * 1000U;
+  }
+
+  inline uint32_t chipId() {
+    return sim::chipId;
+  }
+
+  inline size_t serialWritable() {
+    return (size_t)Serial.availableForWrite();
+  }
+
+  inline void serialWrite(const char *data, size_t length) {
+    Serial.write((const uint8_t *)data, length);
+  }
+
+  inline void beginWallClock(uint16_t intervalSeconds) {
+    (void)intervalSeconds;
+  }
+
+  inline void updateWallClock() {}
+
+  inline uint64_t epochMillis() {
+    return sim::wallClockSynced ? sim::epochAtBoot + sim::clockMs : 0;
+  }
+
+  inline uint32_t freeHeap() {
+    return sim::freeHeap;
+  }
+
+  inline uint32_t largestFreeBlock() {
+    return sim::largestFreeBlock;
+  }
+
+  inline uint8_t heapFragmentation() {
+    return sim::freeHeap == 0 ? 0 : (uint8_t)(100 - sim::largestFreeBlock * 100 / sim::freeHeap);
+  }
+
+  inline uint32_t random(uint32_t max) {
+    // xorshift32
+    sim::randomState ^= sim::randomState << 13;
+    sim::randomState ^= sim::randomState >> 17;
+    sim::randomState ^= sim::randomState << 5;
+    return max == 0 ? 0 : sim::randomState % max;
+  }
+
+  inline bool rtcRead(uint32_t offset, void *data, size_t size) {
+    if (offset * 4 + size > sim::RTC_MEMORY_SIZE || size % 4 != 0) return false;
+    std::memcpy(data, sim::rtcMemory + offset * 4, size);
+    return true;
+  }
+
+  inline bool rtcWrite(uint32_t offset, const void *data, size_t size) {
+    if (offset * 4 + size > sim::RTC_MEMORY_SIZE || size % 4 != 0) return false;
+    std::memcpy(sim::rtcMemory + offset * 4, data, size);
+    return true;
+  }
+
+  /**
+   * Simulated fixed-size flash file, kept in sim::flashFiles.
+   */
+  class FlashFile {
+  public:
+    bool open(const char *path, size_t size) {
+      contents = &sim::flashFiles[path];
+      if (contents->size() != size) contents->assign(size, 0);
+      return true;
+    }
+
+    bool read(size_t offset, void *data, size_t size) {
+      if (contents == nullptr || offset + size > contents->size()) return false;
+      std::memcpy(data, contents->data() + offset, size);
+      return true;
+    }
+
+    bool write(size_t offset, const void *data, size_t size) {
+      if (contents == nullptr || offset + size > contents->size()) return false;
+      std::memcpy(contents->data() + offset, data, size);
+      sim::flashWrites++;
+      sim::flashBytesWritten += size;
+      return true;
+    }
+
+  private:
+    std::vector<uint8_t> *contents = nullptr;
+  };
+
+  inline uint32_t firmwareSize() {
+    return (uint32_t)sim::firmware.size();
+  }
+
+  inline bool readFirmware(uint32_t offset, void *data, size_t size) {
+    if ((size_t)offset + size > sim::firmware.size()) return false;
+    std::memcpy(data, sim::firmware.data() + offset, size);
+    return true;
+  }
+
+  /**
+   * Simulated spare firmware slot, kept in sim::firmwareSlot.
+   */
+  class FirmwareSlot {
+  public:
+    bool begin(uint32_t size) {
+      sim::firmwareSlot.clear();
+      sim::firmwareCommitted = false;
+      sim::firmwareSlotSize = size;
+      return size > 0 && size <= sim::firmwareSlotCapacity;
+    }
+
+    bool write(const uint8_t *data, size_t size) {
+      if (sim::firmwareSlot.size() + size > sim::firmwareSlotSize) return false;
+      sim::firmwareSlot.insert(sim::firmwareSlot.end(), data, data + size);
+      return true;
+    }
+
+    bool commit() {
+      sim::firmwareCommitted = sim::firmwareSlot.size() == sim::firmwareSlotSize;
+      if (sim::firmwareCommitted) {
+        for (size_t i = 0; i < sim::BOOT_COMMAND_SIZE; i++) sim::bootCommand[i] = (uint8_t)(0xEB ^ i);
+        memcpy(sim::rtcMemory, sim::bootCommand, sim::BOOT_COMMAND_SIZE);
+      }
+      return sim::firmwareCommitted;
+    }
+
+    void abort() {
+      if (!sim::firmwareCommitted) sim::firmwareSlot.clear();
+    }
+  };
+
+  /**
+   * Count the restart and boot a committed image, unless its boot command was overwritten.
+   * The simulation itself keeps running.
+   */
+  inline void restart() {
+    sim::restarts++;
+    bool commandIntact = memcmp(sim::rtcMemory, sim::bootCommand, sim::BOOT_COMMAND_SIZE) == 0;
+    if (sim::firmwareCommitted && commandIntact) sim::firmware.swap(sim::firmwareSlot);
+    if (sim::firmwareCommitted) {
+      sim::firmwareSlot.clear();
+      sim::firmwareCommitted = false;
+    }
+  }
+}  // namespace hal
+
+/**
+ * Simulated version of the ESP8266 Ticker, fired by hal::sim::advance().
+ */
+class Ticker {
+public:
+  using callback_function_t = std::function<void()>;
+
+  Ticker() = default;
+
+  Ticker(const Ticker &) = delete;
+
+  Ticker &operator=(const Ticker &) = delete;
+
+  ~Ticker() {
+    detach();
+  }
+
+  void once(float seconds, callback_function_t callback) {
+    schedule(static_cast<uint32_t>(seconds * 1000), false, std::move(callback));
+  }
+
+  void once_ms(uint32_t milliseconds, callback_function_t callback) {
+    schedule(milliseconds, false, std::move(callback));
+  }
+
+  void attach(float seconds, callback_function_t callback) {
+    schedule(static_cast<uint32_t>(seconds * 1000), true, std::move(callback));
+  }
+
+  void attach_ms(uint32_t milliseconds, callback_function_t callback) {
+    schedule(milliseconds, true, std::move(callback));
+  }
+
+  void detach() {
+    auto &all = registry();
+    all.erase(std::remove(all.begin(), all.end(), this), all.end());
+    callback = nullptr;
+  }
+
+  bool active() const {
+    return callback != nullptr;
+  }
+
+  /**
+   * @return All armed tickers.
+   */
+  static std::vector<Ticker *> &registry() {
+    static std::vector<Ticker *> tickers;
+    return tickers;
+  }
+
+  /**
+   * The time the ticker fires next.
+   */
+  uint32_t deadline = 0;
+
+  /**
+   * Fire the ticker and re-arm it if it is periodic.
+   */
+  void fire() {
+    callback_function_t current = callback;
+    if (repeat) {
+      deadline += period;
+    } else {
+      detach();
+    }
+    if (current) current();
+  }
+
+private:
+  callback_function_t callback;
+  uint32_t period = 0;
+  bool repeat = false;
+
+  void schedule(uint32_t milliseconds, bool periodic, callback_function_t function) {
+    detach();
+    period = milliseconds == 0 ? 1 : milliseconds;
+    repeat = periodic;
+    deadline = hal::sim::clockMs + period;
+    callback = std::move(function);
+    registry().push_back(this);
+  }
+};
+
+namespace hal {
+namespace sim {
+  /**
+   * Advance the simulated clock, firing every Ticker whose deadline passes on the way.
+   * Deadlines are compared with wraparound-safe arithmetic, like the device does.
+   *
+   * @param milliseconds The amount of time to advance
+   */
+  inline void advance(uint32_t milliseconds) {
+    uint32_t target = clockMs + milliseconds;
+    while (true) {
+      Ticker *next = nullptr;
+      for (Ticker *ticker : Ticker::registry()) {
+        if ((int32_t)(target - ticker->deadline) >= 0 &&
+            (next == nullptr || (int32_t)(next->deadline - ticker->deadline) > 0)) {
+          next = ticker;
+        }
+      }
+      if (next == nullptr) break;
+      clockMs = next->deadline;
+      next->fire();
+    }
+    clockMs = target;
+  }
+}  // namespace sim
+}  // namespace hal
+
+namespace hal {
+namespace sim {
+  /**
+   * Simulated one-shot hardware timer.
+   */
+  inline Ticker hardwareTimer;
+
+  /**
+   * Callback of the simulated hardware timer.
+   */
+  inline void (*hardwareTimerCallback)() = nullptr;
+}  // namespace sim
+
+  inline void attachTimer(void (*callback)()) {
+    sim::hardwareTimerCallback = callback;
+  }
+
+  inline void armTimer(uint32_t milliseconds) {
+    sim::hardwareTimer.once_ms(milliseconds, []() {
+      if (sim::hardwareTimerCallback) sim::hardwareTimerCallback();
+    });
+  }
+
+  inline void disarmTimer() {
+    sim::hardwareTimer.detach();
+  }
+
+  /**
+   * On the host the cycle counter counts wall-clock nanoseconds, so task run times are real measurements.
+   */
+  constexpr uint32_t CYCLES_PER_MICROSECOND = 1000;
+
+  inline uint32_t cycleCount() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  inline volatile bool wakeRequested = false;
+
+  inline void disableInterrupts() {}
+
+  inline void enableInterrupts() {}
+
+namespace sim {
+  /**
+   * Called for every simulated millisecond spent idle, e.g. to let the in-memory broker deliver messages.
+   */
+  inline std::function<void()> onIdle;
+
+  /**
+   * Total simulated milliseconds spent idle.
+   */
+  inline uint32_t idleMs = 0;
+}  // namespace sim
+
+  inline void wake() {
+    wakeRequested = true;
+  }
+
+  /**
+   * Idle by advancing the simulated clock one millisecond at a time, until the timeout passes or wake() is called.
+   * Without an sim::onIdle observer the clock jumps from one Ticker deadline to the next instead, so long
+   * simulations run at thousands of times real speed.
+   */
+  inline void idle(uint32_t milliseconds) {
+    if (!sim::onIdle) {
+      uint32_t end = sim::clockMs + milliseconds;
+      while (!wakeRequested && (int32_t)(end - sim::clockMs) > 0) {
+        uint32_t step = end - sim::clockMs;
+        for (Ticker *ticker : Ticker::registry()) {
+          int32_t untilDeadline = (int32_t)(ticker->deadline - sim::clockMs);
+          if (untilDeadline > 0 && (uint32_t)untilDeadline < step) step = (uint32_t)untilDeadline;
+        }
+        sim::advance(step);
+        sim::idleMs += step;
+      }
+      wakeRequested = false;
+      return;
+    }
+
+    for (uint32_t elapsed = 0; elapsed < milliseconds && !wakeRequested; elapsed++) {
+      sim::advance(1);
+      sim::idleMs++;
+      sim::onIdle();
+    }
+    wakeRequested = false;
+  }
+}  // namespace hal
+
+#endif  // HOST_HAL_H
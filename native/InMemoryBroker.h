@@ -0,0 +1,447 @@
+/**
+ * In-memory MQTT broker and matching transport for the native build.
+ *
+ * Messages are queued and delivered by process() once the simulated clock reaches their delivery time,
+ * so the broker latency and the chunking of large messages can be controlled by the simulation. The broker keeps
+ * retained messages, persistent sessions with their queued messages, and publishes the will of a client whose
+ * connection is lost.
+ */
+
+#ifndef IN_MEMORY_BROKER_H
+#define IN_MEMORY_BROKER_H
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "../hal/Hal.h"
+#include "../hal/MqttTransport.h"
+
+class InMemoryMqttTransport;
+
+class InMemoryBroker {
+public:
+  /**
+   * Simulated one-way latency between a client and the broker in milliseconds.
+   */
+  uint32_t latencyMs = 0;
+
+  /**
+   * Maximum size of a chunk handed to a message callback. 0 delivers every message in one chunk.
+   */
+  size_t maxChunkSize = 0;
+
+  /**
+   * Whether the broker accepts connections. Taking it offline drops every connected client.
+   */
+  bool online = true;
+
+  /**
+   * Number of messages published to the broker.
+   */
+  uint32_t published = 0;
+
+  /**
+   * Number of messages delivered to subscribers.
+   */
+  uint32_t delivered = 0;
+
+  /**
+   * Number of messages queued for persistent sessions while their client was offline.
+   */
+  uint32_t queued = 0;
+
+  /**
+   * Check whether a topic matches a subscription filter with the MQTT + and # wildcards.
+   *
+   * @param filter The subscription filter
+   * @param topic The topic of the message
+   * @return true if the topic matches the filter
+   */
+  static bool matches(const char *filter, const char *topic) {
+    while (*filter != '\0') {
+      if (*filter == '#') return true;
+      // A multi-level wildcard also matches the parent level
+      if (filter[0] == '/' && filter[1] == '#' && *topic == '\0') return true;
+      if (*filter == '+') {
+        while (*topic != '\0' && *topic != '/') topic++;
+        filter++;
+        continue;
+      }
+      if (*filter != *topic) return false;
+      filter++;
+      topic++;
+    }
+    return *topic == '\0';
+  }
+
+  /**
+   * Take the broker offline or bring it back, simulating an outage. Taking it offline drops every connected
+   * client without publishing their wills. The sessions are persisted and survive the outage.
+   */
+  void setOnline(bool up);
+
+  /**
+   * Attach a client that connected, taking over the session of its client ID unless it asked for a clean one.
+   * The messages queued for the session are delivered right after the CONNACK.
+   *
+   * @return Whether a session was present
+   */
+  bool attach(InMemoryMqttTransport *client);
+
+  /**
+   * Detach a client. A persistent session keeps its subscriptions, and the QoS 1 and 2 messages that were
+   * still on their way to the client are queued again.
+   *
+   * @param client The client
+   * @param lost Whether the connection was lost rather than closed with a disconnect, which publishes the will
+   */
+  void detach(InMemoryMqttTransport *client, bool lost);
+
+  /**
+   * Add a subscription of a client and deliver the retained messages that match it.
+   */
+  void subscribe(InMemoryMqttTransport *client, const char *filter, uint8_t qos) {
+    Session *session = find(client);
+    if (session == nullptr) return;
+    auto existing = std::find_if(session->subscriptions.begin(), session->subscriptions.end(),
+                                 [filter](const Subscription &subscription) { return subscription.filter == filter; });
+    if (existing != session->subscriptions.end()) {
+      existing->qos = qos;
+    } else {
+      session->subscriptions.push_back({filter, qos});
+    }
+
+    for (const auto &message : retainedMessages) {
+      if (matches(filter, message.first.c_str())) {
+        pending.push_back({hal::millis() + 2 * latencyMs, client, std::min(message.second.qos, qos),
+                           message.first, message.second.payload});
+      }
+    }
+  }
+
+  /**
+   * Publish a message to the subscribed clients. A retained message is kept for later subscribers,
+   * an empty retained message removes it.
+   */
+  void publish(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length) {
+    published++;
+    if (retain && length == 0) {
+      retainedMessages.erase(topic);
+    } else if (retain) {
+      retainedMessages[topic] = {std::string(payload, length), qos};
+    }
+
+    // Every session gets the message once, even if several of its subscriptions match
+    for (Session &session : sessions) {
+      int granted = -1;
+      for (const Subscription &subscription : session.subscriptions) {
+        if (matches(subscription.filter.c_str(), topic)) granted = std::max(granted, (int)subscription.qos);
+      }
+      if (granted < 0) continue;
+
+      uint8_t deliveryQos = std::min(qos, (uint8_t)granted);
+      if (session.client != nullptr) {
+        pending.push_back({hal::millis() + 2 * latencyMs, session.client, deliveryQos, topic,
+                           std::string(payload, length)});
+      } else if (deliveryQos > 0) {
+        session.queue.push_back({topic, std::string(payload, length), deliveryQos});
+        queued++;
+      }
+    }
+  }
+
+  /**
+   * @return The retained message of a topic, nullptr if there is none
+   */
+  const std::string *retained(const char *topic) const {
+    auto message = retainedMessages.find(topic);
+    return message == retainedMessages.end() ? nullptr : &message->second.payload;
+  }
+
+  /**
+   * Queue a callback to run at the simulated time the broker would answer, e.g. a CONNACK.
+   */
+  void schedule(std::function<void()> callback) {
+    pendingEvents.push_back({hal::millis() + 2 * latencyMs, std::move(callback)});
+  }
+
+  /**
+   * Deliver all messages and events that are due at the current simulated time.
+   */
+  void process();
+
+private:
+  struct Subscription {
+    std::string filter;
+    uint8_t qos;
+  };
+
+  struct Message {
+    std::string topic;
+    std::string payload;
+    uint8_t qos;
+  };
+
+  struct RetainedMessage {
+    std::string payload;
+    uint8_t qos;
+  };
+
+  /**
+   * The state the broker keeps per client ID. A clean session ends with its connection.
+   */
+  struct Session {
+    std::string clientId;
+    bool clean;
+
+    /**
+     * The connected client, nullptr while a persistent session is offline.
+     */
+    InMemoryMqttTransport *client;
+
+    std::vector<Subscription> subscriptions;
+
+    /**
+     * The QoS 1 and 2 messages that arrived while the client was offline.
+     */
+    std::vector<Message> queue;
+  };
+
+  struct Delivery {
+    uint32_t deliverAt;
+    InMemoryMqttTransport *client;
+    uint8_t qos;
+    std::string topic;
+    std::string payload;
+  };
+
+  struct Event {
+    uint32_t runAt;
+    std::function<void()> callback;
+  };
+
+  std::vector<Session> sessions;
+  std::map<std::string, RetainedMessage> retainedMessages;
+  std::deque<Delivery> pending;
+  std::deque<Event> pendingEvents;
+
+  Session *find(InMemoryMqttTransport *client) {
+    for (Session &session : sessions) {
+      if (session.client == client) return &session;
+    }
+    return nullptr;
+  }
+};
+
+class InMemoryMqttTransport : public MqttTransport {
+public:
+  /**
+   * The Last Will of the client, none while the topic is empty.
+   */
+  struct Will {
+    std::string topic;
+    std::string payload;
+    uint8_t qos = 0;
+    bool retain = false;
+  };
+
+  explicit InMemoryMqttTransport(InMemoryBroker *broker) : broker(broker) {}
+
+  ~InMemoryMqttTransport() override {
+    broker->detach(this, false);
+  }
+
+  void setServer(const char *host, uint16_t port) override {
+    (void)host;
+    (void)port;
+  }
+
+  void setCredentials(const char *user, const char *password) override {
+    (void)user;
+    (void)password;
+  }
+
+  void setClientId(const char *clientId) override {
+    this->clientId = clientId;
+  }
+
+  void setCleanSession(bool cleanSession) override {
+    this->cleanSession = cleanSession;
+  }
+
+  void setWill(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length) override {
+    will = {topic, std::string(payload, length), qos, retain};
+  }
+
+  void connect() override {
+    broker->schedule([this]() {
+      if (isConnected) return;
+      if (!broker->online) {
+        // Connection refused
+        if (disconnectCallback) disconnectCallback(0);
+        return;
+      }
+      isConnected = true;
+      bool sessionPresent = broker->attach(this);
+      if (connectCallback) connectCallback(sessionPresent);
+    });
+  }
+
+  void disconnect() override {
+    close(false);
+  }
+
+  /**
+   * Lose the connection without a disconnect, like a dropped TCP connection. The broker publishes the will.
+   */
+  void drop() {
+    close(true);
+  }
+
+  bool connected() const override {
+    return isConnected;
+  }
+
+  uint16_t subscribe(const char *topic, uint8_t qos) override {
+    if (!isConnected) return 0;
+    broker->subscribe(this, topic, qos);
+    uint16_t packetId = nextPacketId();
+    broker->schedule([this, packetId, qos]() {
+      if (subscribeCallback) subscribeCallback(packetId, qos);
+    });
+    return packetId;
+  }
+
+  uint16_t publish(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length) override {
+    if (!isConnected) return 0;
+    broker->publish(topic, qos, retain, payload, length);
+    if (qos == 0) return 1;
+
+    // The broker acknowledges after a round trip
+    uint16_t packetId = nextPacketId();
+    broker->schedule([this, packetId]() {
+      if (isConnected && publishCallback) publishCallback(packetId);
+    });
+    return packetId;
+  }
+
+  /**
+   * Hand a message chunk to the registered message callback.
+   */
+  void deliver(const char *topic, const char *payload, size_t len, size_t index, size_t total) {
+    if (messageCallback) messageCallback(topic, payload, len, index, total);
+  }
+
+  std::string clientId;
+  bool cleanSession = true;
+  Will will;
+
+private:
+  InMemoryBroker *broker;
+  bool isConnected = false;
+  uint16_t packetId = 0;
+
+  uint16_t nextPacketId() {
+    packetId = packetId == UINT16_MAX ? 1 : packetId + 1;
+    return packetId;
+  }
+
+  void close(bool lost) {
+    if (!isConnected) return;
+    isConnected = false;
+    broker->detach(this, lost);
+    if (disconnectCallback) disconnectCallback(0);
+  }
+};
+
+inline void InMemoryBroker::setOnline(bool up) {
+  online = up;
+  if (up) return;
+  std::vector<InMemoryMqttTransport *> connected;
+  for (const Session &session : sessions) {
+    if (session.client != nullptr) connected.push_back(session.client);
+  }
+  for (InMemoryMqttTransport *client : connected) {
+    client->drop();
+  }
+}
+
+inline bool InMemoryBroker::attach(InMemoryMqttTransport *client) {
+  // A client without an ID always gets a clean session of its own
+  auto session = client->clientId.empty() ? sessions.end()
+                                          : std::find_if(sessions.begin(), sessions.end(), [client](const Session &session) {
+                                              return session.clientId == client->clientId;
+                                            });
+  bool present = session != sessions.end() && !client->cleanSession;
+  if (session != sessions.end() && !present) {
+    sessions.erase(session);
+    session = sessions.end();
+  }
+  if (session == sessions.end()) {
+    sessions.push_back({client->clientId, client->cleanSession, client, {}, {}});
+    return false;
+  }
+
+  session->client = client;
+  session->clean = false;
+  for (Message &message : session->queue) {
+    pending.push_back({hal::millis(), client, message.qos, std::move(message.topic), std::move(message.payload)});
+  }
+  session->queue.clear();
+  return true;
+}
+
+inline void InMemoryBroker::detach(InMemoryMqttTransport *client, bool lost) {
+  Session *session = find(client);
+  if (session == nullptr) return;
+
+  if (session->clean) {
+    sessions.erase(sessions.begin() + (session - sessions.data()));
+  } else {
+    session->client = nullptr;
+    for (auto delivery = pending.begin(); delivery != pending.end();) {
+      if (delivery->client != client) {
+        ++delivery;
+        continue;
+      }
+      if (delivery->qos > 0) session->queue.push_back({delivery->topic, delivery->payload, delivery->qos});
+      delivery = pending.erase(delivery);
+    }
+  }
+
+  const InMemoryMqttTransport::Will &will = client->will;
+  if (lost && online && !will.topic.empty()) {
+    publish(will.topic.c_str(), will.qos, will.retain, will.payload.data(), will.payload.size());
+  }
+}
+
+inline void InMemoryBroker::process() {
+  uint32_t now = hal::millis();
+
+  while (!pendingEvents.empty() && (int32_t)(now - pendingEvents.front().runAt) >= 0) {
+    Event event = std::move(pendingEvents.front());
+    pendingEvents.pop_front();
+    event.callback();
+  }
+
+  while (!pending.empty() && (int32_t)(now - pending.front().deliverAt) >= 0) {
+    Delivery delivery = std::move(pending.front());
+    pending.pop_front();
+    if (find(delivery.client) == nullptr) continue;
+
+    size_t total = delivery.payload.size();
+    size_t chunkSize = maxChunkSize == 0 || maxChunkSize > total ? total : maxChunkSize;
+    size_t index = 0;
+    do {
+      size_t len = std::min(chunkSize, total - index);
+      delivery.client->deliver(delivery.topic.c_str(), delivery.payload.data() + index, len, index, total);
+      index += len;
+    } while (index < total);
+    delivered++;
+  }
+}
+
+#endif  // IN_MEMORY_BROKER_H
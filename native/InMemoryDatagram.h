@@ -0,0 +1,42 @@
+/**
+ * UDP listener for the native build, to which the simulation delivers datagrams directly.
+ */
+
+#ifndef IN_MEMORY_DATAGRAM_H
+#define IN_MEMORY_DATAGRAM_H
+
+#include "../hal/DatagramTransport.h"
+
+class InMemoryDatagramTransport : public DatagramTransport {
+public:
+  bool listen(uint16_t port, const char *group) override {
+    (void)port;
+    (void)group;
+    listening = true;
+    return true;
+  }
+
+  void close() override {
+    listening = false;
+  }
+
+  /**
+   * Deliver a datagram, as if a sensor on the LAN sent it. Lost while the device is not listening.
+   *
+   * @return true if the device was listening
+   */
+  bool deliver(const uint8_t *data, size_t length) {
+    if (!listening || !packetCallback) return false;
+    packetCallback(data, length);
+    return true;
+  }
+
+  bool isListening() const {
+    return listening;
+  }
+
+private:
+  bool listening = false;
+};
+
+#endif  // IN_MEMORY_DATAGRAM_H
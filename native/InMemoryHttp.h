@@ -0,0 +1,131 @@
+/**
+ * HTTP client for the native build, served from files in memory at a simulated bandwidth.
+ *
+ * The server side formats real responses, with Content-Range for ranged requests, so the response parser of
+ * HttpTransport runs like on the device. The connection can be dropped part way to simulate a Wi-Fi that fails.
+ */
+
+#ifndef IN_MEMORY_HTTP_H
+#define IN_MEMORY_HTTP_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "HostHal.h"
+#include "../hal/HttpTransport.h"
+
+class InMemoryHttpTransport : public HttpTransport {
+public:
+  /**
+   * The files the server has, by path.
+   */
+  std::map<std::string, std::vector<uint8_t>> files;
+
+  /**
+   * The bandwidth to the server in bytes per millisecond, the one-way latency and the size of a TCP segment.
+   */
+  uint32_t bytesPerMs = 16;
+  uint32_t latencyMs = 5;
+  size_t segmentSize = 1460;
+
+  /**
+   * Drop the connection once this many bytes have been sent in total, 0 for never. Cleared when it happens.
+   */
+  uint32_t dropAt = 0;
+
+  /**
+   * Whether the server can be reached.
+   */
+  bool available = true;
+
+  /**
+   * The requests served and the bytes sent over the wire, headers included.
+   */
+  uint32_t requests = 0;
+  uint32_t bytesSent = 0;
+
+  bool get(const char *host, uint16_t port, const char *path, uint32_t offset) override {
+    (void)port;
+    if (active || !available) return false;
+    char request[192];
+    if (startRequest(request, sizeof(request), host, path, offset) == 0) return false;
+
+    requests++;
+    char head[160];
+    int headLength;
+    auto file = files.find(path);
+    if (file == files.end() || offset > file->second.size()) {
+      headLength = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                            file == files.end() ? "404 Not Found" : "416 Range Not Satisfiable");
+      response.assign(head, head + headLength);
+    } else {
+      size_t size = file->second.size();
+      if (offset == 0) {
+        headLength = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                              size);
+      } else {
+        headLength = snprintf(head, sizeof(head),
+                              "HTTP/1.1 206 Partial Content\r\nContent-Length: %zu\r\nContent-Range: bytes %lu-%zu/%zu\r\n"
+                              "Connection: close\r\n\r\n", size - offset, (unsigned long)offset, size - 1, size);
+      }
+      response.assign(head, head + headLength);
+      response.insert(response.end(), file->second.begin() + offset, file->second.end());
+    }
+
+    // The connection and the request take a round trip each
+    active = true;
+    position = 0;
+    budget = 0;
+    sendAt = hal::millis() + 4 * latencyMs;
+    return true;
+  }
+
+  void abort() override {
+    active = false;
+    closed();
+  }
+
+  /**
+   * Send what the bandwidth allows. Call every simulated millisecond, like InMemoryBroker::process().
+   */
+  void process() {
+    if (!active || (int32_t)(hal::millis() - sendAt) < 0) return;
+    budget += bytesPerMs;
+    while (active && position < response.size()) {
+      size_t segment = std::min(segmentSize, response.size() - position);
+      if (dropAt != 0 && bytesSent + segment >= dropAt) segment = dropAt > bytesSent ? dropAt - bytesSent : 0;
+      if (segment > budget) return;
+      budget -= segment;
+      bytesSent += segment;
+      size_t start = position;
+      position += segment;
+      // Like the device, close the connection once the response is complete or refused
+      if (!receive(response.data() + start, segment)) {
+        active = false;
+        return;
+      }
+      if (dropAt != 0 && bytesSent >= dropAt) {
+        dropAt = 0;
+        abort();
+        return;
+      }
+    }
+    if (active) {
+      active = false;
+      closed();
+    }
+  }
+
+  bool isActive() const {
+    return active;
+  }
+
+private:
+  std::vector<uint8_t> response;
+  bool active = false;
+  size_t position = 0;
+  size_t budget = 0;
+  uint32_t sendAt = 0;
+};
+
+#endif  // IN_MEMORY_HTTP_H
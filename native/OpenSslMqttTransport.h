@@ -0,0 +1,328 @@
+/**
+ * MQTT transport over TLS on a POSIX socket, with OpenSSL, for host tools that talk to a broker with TLS.
+ *
+ * Does what the device does with BearSSL (hal/TlsMqttTransport.h), so the handshakes can be measured on the
+ * host: TLS 1.2 without session tickets or the extended master secret, which BearSSL lacks, the broker
+ * certificate pinned by its SHA-1 fingerprint, the maximum fragment length extension, and the session resumed
+ * by its ID from a TlsSessionCache, in the simulated RTC memory of the host.
+ *
+ * Link with -lssl -lcrypto.
+ */
+
+#ifndef OPEN_SSL_MQTT_TRANSPORT_H
+#define OPEN_SSL_MQTT_TRANSPORT_H
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <string>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "HostHal.h"
+#include "PosixMqttTransport.h"
+#include "../TlsSessionCache.h"
+
+class OpenSslMqttTransport : public PosixMqttTransport {
+public:
+  /**
+   * Reason passed to the disconnect callback when the TLS handshake or a record failed.
+   */
+  static constexpr int REASON_TLS = 101;
+
+  /**
+   * The last handshake: how long it took on the wall clock and on the CPU, the bytes on the wire and whether the
+   * session was resumed. The times are in microseconds, from the TCP connection to the finished handshake.
+   */
+  struct Handshake {
+    bool resumed = false;
+    uint64_t wallMicros = 0;
+    uint64_t cpuMicros = 0;
+
+    /**
+     * The CPU time of the longest step, one call that handled what had arrived: what the device spends in one
+     * run of its network task, see hal/TlsMqttTransport.h.
+     */
+    uint64_t longestStepMicros = 0;
+
+    uint64_t bytesSent = 0;
+    uint64_t bytesReceived = 0;
+
+    /**
+     * The largest record the broker agreed to send, 16384 without the maximum fragment length extension.
+     */
+    uint32_t recordLimit = 0;
+  };
+
+  /**
+   * @param fingerprint The SHA-1 fingerprint of the broker certificate in hex, with or without colons
+   * @param recordSize The record size to negotiate: 512, 1024, 2048 or 4096, or 0 for the default of 16 kB
+   */
+  OpenSslMqttTransport(const char *fingerprint, uint16_t recordSize) : recordSize(recordSize) {
+    parseFingerprint(fingerprint);
+    context = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_options(context, SSL_OP_NO_TICKET | SSL_OP_NO_EXTENDED_MASTER_SECRET);
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                  SSL_MODE_RELEASE_BUFFERS);
+    if (recordSize != 0) SSL_CTX_set_max_send_fragment(context, recordSize);
+    // The certificate is checked against the fingerprint instead of a CA
+    SSL_CTX_set_verify(context, SSL_VERIFY_NONE, nullptr);
+  }
+
+  ~OpenSslMqttTransport() override {
+    freeSsl();
+    SSL_CTX_free(context);
+  }
+
+  void setServer(const char *host, uint16_t port) override {
+    PosixMqttTransport::setServer(host, port);
+    sessionCache.begin(host, port);
+  }
+
+  /**
+   * Switch resuming sessions on or off, to measure full handshakes.
+   */
+  void setResumption(bool resumption) {
+    this->resumption = resumption;
+  }
+
+  bool isFingerprintValid() const {
+    return fingerprintValid;
+  }
+
+  const Handshake &getLastHandshake() const {
+    return handshake;
+  }
+
+  /**
+   * @return The fingerprint of the certificate the broker presented in the last full handshake
+   */
+  const std::string &getPeerFingerprint() const {
+    return peerFingerprint;
+  }
+
+  bool wantsWrite() const override {
+    if (ssl != nullptr && handshaking) return wantWrite;
+    return PosixMqttTransport::wantsWrite();
+  }
+
+protected:
+  void openStream() override {
+    if (!fingerprintValid) {
+      fail(REASON_TLS);
+      return;
+    }
+    PosixMqttTransport::openStream();
+  }
+
+  int pollStream() override {
+    if (ssl == nullptr) {
+      int opened = PosixMqttTransport::pollStream();
+      if (opened <= 0) return opened;
+      startHandshake();
+    }
+
+    uint64_t cpuStart = cpuMicros();
+    int result = SSL_connect(ssl);
+    uint64_t step = cpuMicros() - cpuStart;
+    handshake.cpuMicros += step;
+    if (step > handshake.longestStepMicros) handshake.longestStepMicros = step;
+    if (result != 1) {
+      int error = SSL_get_error(ssl, result);
+      wantWrite = error == SSL_ERROR_WANT_WRITE;
+      if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) return 0;
+      reportError("Handshake failed");
+      sessionCache.clear();
+      fail(REASON_TLS);
+      return -1;
+    }
+    return finishHandshake() ? 1 : -1;
+  }
+
+  long readStream(char *buffer, size_t size) override {
+    int received = SSL_read(ssl, buffer, (int)size);
+    if (received > 0) return received;
+    int error = SSL_get_error(ssl, received);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) return 0;
+    if (error != SSL_ERROR_ZERO_RETURN) reportError("Reading failed");
+    fail(error == SSL_ERROR_ZERO_RETURN ? REASON_CLOSED : REASON_TLS);
+    return -1;
+  }
+
+  long writeStream(const char *data, size_t size) override {
+    int sent = SSL_write(ssl, data, (int)size);
+    if (sent > 0) return sent;
+    int error = SSL_get_error(ssl, sent);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) return 0;
+    reportError("Writing failed");
+    fail(REASON_TLS);
+    return -1;
+  }
+
+  void closeStream() override {
+    if (ssl != nullptr && !handshaking) SSL_shutdown(ssl);
+    freeSsl();
+    PosixMqttTransport::closeStream();
+  }
+
+private:
+  SSL_CTX *context;
+  SSL *ssl = nullptr;
+  TlsSessionCache sessionCache;
+  Handshake handshake;
+  const uint16_t recordSize;
+  bool resumption = true;
+
+  uint8_t fingerprint[20] = {};
+  bool fingerprintValid = false;
+  std::string peerFingerprint;
+
+  /**
+   * Whether a handshake is running, and whether it waits for the socket to be writable.
+   */
+  bool handshaking = false;
+  bool wantWrite = false;
+
+  std::chrono::steady_clock::time_point handshakeStart;
+
+  static uint64_t cpuMicros() {
+    timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return (uint64_t)time.tv_sec * 1000000 + (uint64_t)time.tv_nsec / 1000;
+  }
+
+  void parseFingerprint(const char *text) {
+    size_t length = 0;
+    for (const char *c = text; *c != '\0'; c++) {
+      if (*c == ':') continue;
+      int digit = *c >= '0' && *c <= '9' ? *c - '0' : (*c | 0x20) >= 'a' && (*c | 0x20) <= 'f' ? (*c | 0x20) - 'a' + 10 : -1;
+      if (digit < 0 || length == 2 * sizeof(fingerprint)) return;
+      fingerprint[length / 2] = (uint8_t)(fingerprint[length / 2] << 4 | digit);
+      length++;
+    }
+    fingerprintValid = length == 2 * sizeof(fingerprint);
+  }
+
+  void startHandshake() {
+    ssl = SSL_new(context);
+    SSL_set_fd(ssl, fd());
+    SSL_set_tlsext_host_name(ssl, getHost());
+    if (recordSize != 0) SSL_set_tlsext_max_fragment_length(ssl, fragmentLengthCode(recordSize));
+
+    TlsSession cached;
+    if (resumption && sessionCache.get(cached)) {
+      SSL_SESSION *session = toOpenSsl(cached);
+      if (session != nullptr) SSL_set_session(ssl, session);
+      SSL_SESSION_free(session);
+    }
+
+    handshake = Handshake();
+    handshakeStart = std::chrono::steady_clock::now();
+    handshaking = true;
+    wantWrite = false;
+  }
+
+  /**
+   * Check the certificate of a full handshake against the fingerprint, and cache the session.
+   */
+  bool finishHandshake() {
+    handshaking = false;
+    handshake.wallMicros = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::steady_clock::now() - handshakeStart).count();
+    handshake.bytesSent = BIO_number_written(SSL_get_wbio(ssl));
+    handshake.bytesReceived = BIO_number_read(SSL_get_rbio(ssl));
+    handshake.resumed = SSL_session_reused(ssl) == 1;
+    SSL_SESSION *session = SSL_get_session(ssl);
+    uint8_t mode = SSL_SESSION_get_max_fragment_length(session);
+    handshake.recordLimit = mode >= TLSEXT_max_fragment_length_512 && mode <= TLSEXT_max_fragment_length_4096
+                                ? 256U << mode : 16384;
+
+    // A resumed session has no certificate, it was pinned in the full handshake that made it
+    if (!handshake.resumed) {
+      X509 *certificate = SSL_get1_peer_certificate(ssl);
+      uint8_t digest[EVP_MAX_MD_SIZE];
+      unsigned int digestLength = 0;
+      bool pinned = certificate != nullptr && X509_digest(certificate, EVP_sha1(), digest, &digestLength) == 1 &&
+                    digestLength == sizeof(fingerprint) && memcmp(digest, fingerprint, sizeof(fingerprint)) == 0;
+      peerFingerprint.clear();
+      for (unsigned int i = 0; i < digestLength; i++) {
+        char hex[4];
+        snprintf(hex, sizeof(hex), i == 0 ? "%02X" : ":%02X", digest[i]);
+        peerFingerprint += hex;
+      }
+      X509_free(certificate);
+      if (!pinned) {
+        std::fprintf(stderr, "TLS: the broker certificate %s does not match the fingerprint\n", peerFingerprint.c_str());
+        sessionCache.clear();
+        fail(REASON_TLS);
+        return false;
+      }
+    }
+
+    TlsSession current;
+    if (fromOpenSsl(session, current)) {
+      sessionCache.put(current);
+    } else {
+      sessionCache.clear();
+    }
+    return true;
+  }
+
+  static uint8_t fragmentLengthCode(uint16_t size) {
+    switch (size) {
+      case 512: return TLSEXT_max_fragment_length_512;
+      case 1024: return TLSEXT_max_fragment_length_1024;
+      case 2048: return TLSEXT_max_fragment_length_2048;
+      default: return TLSEXT_max_fragment_length_4096;
+    }
+  }
+
+  static bool fromOpenSsl(SSL_SESSION *session, TlsSession &result) {
+    result = {};
+    unsigned int idLength = 0;
+    const unsigned char *id = SSL_SESSION_get_id(session, &idLength);
+    if (idLength == 0 || idLength > sizeof(result.sessionId)) return false;
+    memcpy(result.sessionId, id, idLength);
+    result.sessionIdLength = (uint8_t)idLength;
+    result.version = (uint16_t)SSL_SESSION_get_protocol_version(session);
+    result.cipherSuite = (uint16_t)SSL_CIPHER_get_protocol_id(SSL_SESSION_get0_cipher(session));
+    return SSL_SESSION_get_master_key(session, result.masterSecret, sizeof(result.masterSecret)) ==
+           sizeof(result.masterSecret);
+  }
+
+  SSL_SESSION *toOpenSsl(const TlsSession &cached) const {
+    const unsigned char suite[2] = {(unsigned char)(cached.cipherSuite >> 8), (unsigned char)cached.cipherSuite};
+    const SSL_CIPHER *cipher = SSL_CIPHER_find(ssl, suite);
+    if (cipher == nullptr) return nullptr;
+    SSL_SESSION *session = SSL_SESSION_new();
+    if (SSL_SESSION_set1_id(session, cached.sessionId, cached.sessionIdLength) != 1 ||
+        SSL_SESSION_set1_master_key(session, cached.masterSecret, sizeof(cached.masterSecret)) != 1 ||
+        SSL_SESSION_set_protocol_version(session, cached.version) != 1 || SSL_SESSION_set_cipher(session, cipher) != 1) {
+      SSL_SESSION_free(session);
+      return nullptr;
+    }
+    SSL_SESSION_set_time(session, (long)time(nullptr));
+    SSL_SESSION_set_timeout(session, 24 * 60 * 60);
+    return session;
+  }
+
+  void reportError(const char *what) {
+    char error[160] = "closed";
+    unsigned long code = ERR_get_error();
+    if (code != 0) ERR_error_string_n(code, error, sizeof(error));
+    ERR_clear_error();
+    std::fprintf(stderr, "TLS: %s: %s\n", what, error);
+  }
+
+  void freeSsl() {
+    if (ssl != nullptr) SSL_free(ssl);
+    ssl = nullptr;
+    handshaking = false;
+  }
+};
+
+#endif  // OPEN_SSL_MQTT_TRANSPORT_H
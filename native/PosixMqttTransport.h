@@ -0,0 +1,149 @@
+/**
+ * MQTT 3.1.1 transport over a non-blocking POSIX socket, for host tools that talk to a real broker.
+ *
+ * The protocol is implemented by StreamMqttTransport, this only moves the bytes. Nothing blocks: the owner
+ * polls fd() and calls process(), which reads, runs the callbacks and writes what was queued.
+ */
+
+#ifndef POSIX_MQTT_TRANSPORT_H
+#define POSIX_MQTT_TRANSPORT_H
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../hal/StreamMqttTransport.h"
+
+class PosixMqttTransport : public StreamMqttTransport {
+public:
+  /**
+   * A socket error passes errno as a negative number to the disconnect callback.
+   * Packets with a larger remaining length than MAX_PACKET_SIZE are treated as a protocol error. The inbox and
+   * the outbox take that much each, per client of the fleet simulation.
+   */
+  static constexpr size_t MAX_PACKET_SIZE = 16 * 1024;
+
+  PosixMqttTransport() : StreamMqttTransport(MAX_PACKET_SIZE, 10) {}
+
+  ~PosixMqttTransport() override {
+    closeSocket();
+  }
+
+  void setServer(const char *host, uint16_t port) override {
+    StreamMqttTransport::setServer(host, port);
+    resolved = false;
+  }
+
+  /**
+   * @return The socket to poll, -1 while disconnected
+   */
+  int fd() const {
+    return socketFd;
+  }
+
+  /**
+   * @return The events to poll for: POLLOUT while connecting or while data waits to be sent
+   */
+  virtual bool wantsWrite() const {
+    return isOpening() || hasOutput();
+  }
+
+protected:
+  void openStream() override {
+    if (!resolved && !resolve()) {
+      fail(-EHOSTUNREACH);
+      return;
+    }
+
+    socketFd = ::socket(address.ss_family, SOCK_STREAM, 0);
+    if (socketFd < 0) {
+      fail(-errno);
+      return;
+    }
+    fcntl(socketFd, F_SETFL, fcntl(socketFd, F_GETFL, 0) | O_NONBLOCK);
+    int noDelay = 1;
+    setsockopt(socketFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    if (::connect(socketFd, reinterpret_cast<sockaddr *>(&address), addressLength) != 0 && errno != EINPROGRESS) {
+      fail(-errno);
+    }
+  }
+
+  int pollStream() override {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(socketFd, SOL_SOCKET, SO_ERROR, &error, &length) != 0) error = errno;
+    if (error == EINPROGRESS || error == EALREADY) return 0;
+    if (error != 0) {
+      fail(-error);
+      return -1;
+    }
+    // A socket that is still connecting has no peer yet
+    sockaddr_storage peer;
+    socklen_t peerLength = sizeof(peer);
+    return getpeername(socketFd, reinterpret_cast<sockaddr *>(&peer), &peerLength) == 0 ? 1 : 0;
+  }
+
+  long readStream(char *buffer, size_t size) override {
+    for (;;) {
+      ssize_t received = ::recv(socketFd, buffer, size, 0);
+      if (received > 0) return (long)received;
+      if (received == 0) {
+        fail(REASON_CLOSED);
+        return -1;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      if (errno != EINTR) {
+        fail(-errno);
+        return -1;
+      }
+    }
+  }
+
+  long writeStream(const char *data, size_t size) override {
+    ssize_t sent = ::send(socketFd, data, size, MSG_NOSIGNAL);
+    if (sent >= 0) return (long)sent;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    fail(-errno);
+    return -1;
+  }
+
+  void closeStream() override {
+    closeSocket();
+  }
+
+private:
+  int socketFd = -1;
+
+  bool resolved = false;
+  sockaddr_storage address = {};
+  socklen_t addressLength = 0;
+
+  bool resolve() {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result = nullptr;
+    std::string service = std::to_string(getPort());
+    if (getaddrinfo(getHost(), service.c_str(), &hints, &result) != 0 || result == nullptr) return false;
+    memcpy(&address, result->ai_addr, result->ai_addrlen);
+    addressLength = (socklen_t)result->ai_addrlen;
+    freeaddrinfo(result);
+    resolved = true;
+    return true;
+  }
+
+  void closeSocket() {
+    if (socketFd >= 0) ::close(socketFd);
+    socketFd = -1;
+  }
+};
+
+#endif  // POSIX_MQTT_TRANSPORT_H
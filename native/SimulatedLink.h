@@ -0,0 +1,64 @@
+/**
+ * Network link for the native build that can be brought up and down by the simulation.
+ */
+
+#ifndef SIMULATED_LINK_H
+#define SIMULATED_LINK_H
+
+#include "../hal/NetworkLink.h"
+
+class SimulatedLink : public NetworkLink {
+public:
+  void begin() override {
+    setConnected(true);
+  }
+
+  bool isConnected() const override {
+    return connected;
+  }
+
+  bool isConnecting() const override {
+    return false;
+  }
+
+  void reconnect() override {
+    reconnects++;
+    if (available) setConnected(true);
+  }
+
+  void restart() override {
+    restarts++;
+  }
+
+  /**
+   * Whether the access point can be reached. While false, reconnect() does not bring the link back.
+   */
+  bool available = true;
+
+  /**
+   * Number of reassociation attempts.
+   */
+  unsigned reconnects = 0;
+
+  /**
+   * Bring the link up or down and notify the listeners of the change.
+   *
+   * @param up Whether the link should be up
+   */
+  void setConnected(bool up) {
+    if (up == connected) return;
+    connected = up;
+    if (up && upCallback) upCallback();
+    if (!up && downCallback) downCallback();
+  }
+
+  /**
+   * Number of times the device asked to be restarted.
+   */
+  unsigned restarts = 0;
+
+private:
+  bool connected = false;
+};
+
+#endif  // SIMULATED_LINK_H
@@ -0,0 +1,682 @@
+/**
+ * Native entry point for the alarm project.
+ *
+ * Runs the alarm and internet managers on the host against a simulated clock and an in-memory broker,
+ * scheduled the same way as on the device. A simulated backend sends alarm commands and the run reports
+ * the command-to-status and command-to-claxon latencies in simulated time, the recovery from outages,
+ * the time from a reconnect to a consistent state and the measured run time of every scheduler task.
+ * A firmware update is run as full image and as delta over a connection that drops, to compare the bytes and
+ * the time they take.
+ */
+
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "../hal/Hal.h"
+#include "../Constants.h"
+#include "../AlarmStateManager.h"
+#include "../InternetManager.h"
+#include "../Scheduler.h"
+#include "../ButtonInput.h"
+#include "InMemoryBroker.h"
+#include "SimulatedLink.h"
+#include "InMemoryDatagram.h"
+#include "InMemoryHttp.h"
+#include "DeltaEncoder.h"
+#include "../Sha256.h"
+
+namespace {
+  InMemoryBroker broker;
+  SimulatedLink networkLink;
+  InMemoryMqttTransport deviceClient(&broker);
+  InMemoryMqttTransport backendClient(&broker);
+
+  AlarmStateManager alarmStateManager;
+  InMemoryDatagramTransport localTransport;
+  InMemoryHttpTransport updateServer;
+  InternetManager internetManager(&alarmStateManager, &networkLink, &deviceClient, &localTransport, &updateServer);
+  Scheduler<SCHEDULER_CAPACITY> scheduler;
+  ButtonInput buttonInput;
+
+  /**
+   * The task that checks the alarm state, woken whenever the alarm state changes.
+   */
+  uint8_t alarmTask;
+
+  /**
+   * The task that decodes button presses, woken by the button interrupt.
+   */
+  uint8_t buttonTask;
+
+  /**
+   * Wake the button task from the button interrupt.
+   */
+  void IRAM_ATTR onButtonEdge() {
+    scheduler.wakeFromInterrupt(buttonTask);
+  }
+
+  /**
+   * Simulated time the last command was sent by the backend.
+   */
+  uint32_t commandSentAt = 0;
+
+  /**
+   * Simulated time the first claxon edge after the last command was seen, 0 if not yet.
+   */
+  uint32_t claxonOnAt = 0;
+
+  /**
+   * Simulated time the status answer to the last command was received, 0 if not yet.
+   */
+  uint32_t statusReceivedAt = 0;
+
+  /**
+   * The amount of JSON status messages the backend received.
+   */
+  uint32_t statusMessages = 0;
+
+  /**
+   * The last JSON status and the amount of journal batches the backend received.
+   */
+  std::string lastStatus;
+  uint32_t journalBatches = 0;
+
+  /**
+   * The last metrics message and the last pong the backend received.
+   */
+  std::string lastMetrics;
+  std::string lastPong;
+
+  /**
+   * The last availability of the device the backend received: online, or offline from its Last Will.
+   */
+  std::string lastAvailability;
+
+  /**
+   * The last status of a firmware update the backend received.
+   */
+  std::string lastOtaStatus;
+
+  /**
+   * The status topic in the format of the last command.
+   */
+  std::string statusTopic;
+
+  /**
+   * Simulated time the run started.
+   */
+  uint32_t startedAt = 0;
+
+  void setup() {
+    alarmStateManager.initialize();
+    internetManager.initialize();
+
+    scheduler.add("network", [](uint32_t now) {
+      (void)now;
+      return internetManager.process();
+    });
+
+    buttonTask = scheduler.add("button", [](uint32_t now) {
+      return buttonInput.process(now);
+    });
+
+    alarmTask = scheduler.add("alarm", [](uint32_t now) {
+      (void)now;
+      return alarmStateManager.checkTriggerAlarm();
+    });
+
+    alarmStateManager.onStateChange([]() {
+      scheduler.wake(alarmTask);
+    });
+
+    // A short press silences the claxon, a long press clears all alarms
+    buttonInput.onPress([]() {
+      alarmStateManager.silenceClaxon();
+    });
+    buttonInput.onLongPress([]() {
+      internetManager.clearAlarms();
+    });
+    buttonInput.initialize(onButtonEdge);
+  }
+
+  void loop() {
+    scheduler.runOnce();
+  }
+
+  /**
+   * Run the main loop for the given amount of simulated time. The clock moves while the scheduler idles.
+   */
+  void run(uint32_t milliseconds) {
+    uint32_t end = hal::millis() + milliseconds;
+    while ((int32_t)(end - hal::millis()) > 0) {
+      loop();
+    }
+  }
+
+  /**
+   * @return A topic in a namespace of the device
+   */
+  std::string deviceTopic(const char *suffix, TopicRouter::Scope scope = TopicRouter::SCOPE_DEVICE) {
+    return std::string(internetManager.getTopics().prefix(scope)) + suffix;
+  }
+
+  /**
+   * Send an alarm/set command and wait for the status in the same format.
+   */
+  void sendCommand(const std::string &topic, const char *payload, size_t length) {
+    commandSentAt = hal::millis();
+    claxonOnAt = 0;
+    statusReceivedAt = 0;
+    bool cbor = topic.size() > strlen(TOPIC_SUFFIX_CBOR) &&
+                topic.compare(topic.size() - strlen(TOPIC_SUFFIX_CBOR), std::string::npos, TOPIC_SUFFIX_CBOR) == 0;
+    statusTopic = deviceTopic(cbor ? TOPIC_ALARM_STATUS_CBOR : TOPIC_ALARM_STATUS);
+    backendClient.publish(topic.c_str(), 2, false, payload, length);
+  }
+
+  void sendCommand(const char *payload, TopicRouter::Scope scope = TopicRouter::SCOPE_DEVICE) {
+    sendCommand(deviceTopic(TOPIC_ALARM_SET, scope), payload, strlen(payload));
+  }
+
+  /**
+   * Subscribe the backend to the status topics of all devices.
+   */
+  void subscribeBackend() {
+    backendClient.subscribe(TOPIC_ALARM "/+/" TOPIC_ALARM_STATUS, 2);
+    backendClient.subscribe(TOPIC_ALARM "/+/" TOPIC_ALARM_STATUS_CBOR, 2);
+    backendClient.subscribe(TOPIC_ALARM "/+/" TOPIC_ALARM_JOURNAL, 1);
+    backendClient.subscribe(TOPIC_ALARM "/+/" TOPIC_METRICS, 0);
+    backendClient.subscribe(TOPIC_ALARM "/+/" TOPIC_PONG, 0);
+    backendClient.subscribe(TOPIC_ALARM "/+/" TOPIC_AVAILABILITY, 1);
+    backendClient.subscribe(TOPIC_ALARM "/+/" TOPIC_OTA_STATUS, 1);
+  }
+
+  /**
+   * Make a firmware image like a build: code with a skewed instruction mix and aligned constants.
+   */
+  std::vector<uint8_t> makeImage(size_t size, uint32_t seed) {
+    std::vector<uint8_t> image(size);
+    for (size_t i = 0; i < size; i++) {
+      seed = seed * 1103515245 + 12345;
+      uint8_t value = (uint8_t)(seed >> 16);
+      image[i] = i % 4 == 3 ? (uint8_t)(i >> 12) : (uint8_t)(value & (value & 0x80 ? 0x0F : 0x3F));
+    }
+    return image;
+  }
+
+  /**
+   * Make the next version of an image: a new function, a changed one, and the addresses after them moved.
+   */
+  std::vector<uint8_t> nextVersion(const std::vector<uint8_t> &base) {
+    std::vector<uint8_t> image(base.begin(), base.begin() + 120 * 1024);
+    std::vector<uint8_t> added = makeImage(3 * 1024, 7);
+    image.insert(image.end(), added.begin(), added.end());
+    image.insert(image.end(), base.begin() + 120 * 1024, base.end());
+    for (size_t i = 200 * 1024; i < 201 * 1024; i++) image[i] ^= 0x5A;
+    for (size_t i = 123 * 1024 + 3; i < image.size(); i += 4 * 1024) image[i] += 3;
+    return image;
+  }
+
+  /**
+   * Run a firmware update from the command and report the bytes it took and the time to the verified image.
+   */
+  void runUpdate(const char *name, const std::string &command, const std::vector<uint8_t> &image) {
+    uint32_t bytesBefore = updateServer.bytesSent;
+    uint32_t restartsBefore = hal::sim::restarts;
+    OtaUpdater::Stats before = internetManager.getOtaUpdater().getStats();
+    backendClient.publish(deviceTopic(TOPIC_OTA).c_str(), 1, false, command.c_str(), command.size());
+    for (uint32_t waited = 0; hal::sim::restarts == restartsBefore && waited < 5 * 60 * 1000; waited += 100) {
+      if (internetManager.getOtaUpdater().getState() == OtaUpdater::State::FAILED) break;
+      run(100);
+    }
+    run(100);
+    const OtaUpdater::Stats &stats = internetManager.getOtaUpdater().getStats();
+    // On the host a cycle is a nanosecond
+    std::printf("%-10s bytes: %6u  update time: %6u ms  requests: %u  resumes: %u  patch: %5" PRIu64
+                " us  restarted: %s  image ok: %s\n", name, updateServer.bytesSent - bytesBefore, stats.lastDuration,
+                stats.requests - before.requests, stats.resumes - before.resumes, stats.lastPatchCycles / 1000,
+                hal::sim::restarts != restartsBefore ? "yes" : "no", hal::sim::firmware == image ? "yes" : "no");
+  }
+
+  /**
+   * Run until the device is back online after an outage, and report how long that took.
+   */
+  void reportRecovery(const char *name, uint32_t attemptsBefore) {
+    const ConnectionSupervisor &supervisor = internetManager.getConnectionSupervisor();
+    for (uint32_t waited = 0; !supervisor.isOnline() && waited < 10 * 60 * 1000; waited += 100) {
+      run(100);
+    }
+    std::printf("%-10s online: %s  reconnect time: %6u ms  attempts: %u  restarts: %u\n", name,
+                supervisor.isOnline() ? "yes" : "no", supervisor.getLastReconnectTime(),
+                supervisor.getReconnectAttempts() - attemptsBefore, networkLink.restarts);
+  }
+
+  void reportLatency(const char *name, bool claxonExpected) {
+    std::printf("%-10s command->status: %4u ms  command->claxon: ", name, statusReceivedAt - commandSentAt);
+    if (claxonExpected && claxonOnAt != 0) {
+      std::printf("%4u ms\n", claxonOnAt - commandSentAt);
+    } else {
+      std::printf("   - \n");
+    }
+  }
+
+  void reportScheduler() {
+    uint32_t elapsed = hal::millis() - startedAt;
+    std::printf("scheduler  iterations: %u (%.1f per s)  idle: %.1f%%\n", scheduler.getIterations(),
+                scheduler.getIterations() * 1000.0 / elapsed, hal::sim::idleMs * 100.0 / elapsed);
+    for (uint8_t id = 0; id < scheduler.getTaskCount(); id++) {
+      const auto &stats = scheduler.getStats(id);
+      // On the host a cycle is a nanosecond
+      std::printf("  %-8s runs: %7u  mean: %6" PRIu64 " ns  max: %7u ns\n", stats.name, stats.runs,
+                  stats.runs == 0 ? 0 : stats.totalCycles / stats.runs, stats.maxCycles);
+    }
+  }
+}  // namespace
+
+int main(int argc, char **argv) {
+  // Optional one-way broker latency in milliseconds and maximum chunk size of delivered messages
+  if (argc > 1) broker.latencyMs = (uint32_t)std::strtoul(argv[1], nullptr, 10);
+  if (argc > 2) broker.maxChunkSize = (size_t)std::strtoul(argv[2], nullptr, 10);
+  Serial.muted = true;
+
+  hal::sim::onPinChange = [](uint8_t pin, uint8_t level, uint32_t timeMs) {
+    if (pin == ALARM_CLAXON_PIN && level == HIGH && claxonOnAt == 0) claxonOnAt = timeMs;
+  };
+  hal::sim::onIdle = []() {
+    broker.process();
+    updateServer.process();
+  };
+
+  backendClient.onMessage([](const char *topic, const char *payload, size_t len, size_t index, size_t total) {
+    (void)total;
+    if (deviceTopic(TOPIC_ALARM_STATUS) == topic) {
+      if (index == 0) {
+        statusMessages++;
+        lastStatus.clear();
+      }
+      lastStatus.append(payload, len);
+    }
+    if (index == 0 && deviceTopic(TOPIC_ALARM_JOURNAL) == topic) journalBatches++;
+    if (deviceTopic(TOPIC_PONG) == topic) lastPong.assign(payload, len);
+    if (deviceTopic(TOPIC_AVAILABILITY) == topic) lastAvailability.assign(payload, len);
+    if (deviceTopic(TOPIC_OTA_STATUS) == topic) lastOtaStatus.assign(payload, len);
+    if (deviceTopic(TOPIC_METRICS) == topic) {
+      if (index == 0) lastMetrics.clear();
+      lastMetrics.append(payload, len);
+    }
+    if (index == 0 && statusTopic == topic && statusReceivedAt == 0) {
+      statusReceivedAt = hal::millis();
+    }
+  });
+
+  startedAt = hal::millis();
+  setup();
+  backendClient.connect();
+  run(100);
+  subscribeBackend();
+  run(100);
+
+  run(10000);
+
+  sendCommand("{\"" KEY_AIRFLOW_ALARM_ON "\": true}");
+  run(DELAY_30_SECONDS);
+  reportLatency("on", true);
+
+  sendCommand("{\"" KEY_AIRFLOW_ALARM_ON "\": false}");
+  run(1000);
+  reportLatency("off", false);
+
+  // The same commands in CBOR: {2: true} and {2: false}, key 2 is the airflow alarm
+  const char cborOn[] = {'\xA1', '\x02', '\xF5'};
+  const char cborOff[] = {'\xA1', '\x02', '\xF4'};
+  sendCommand(deviceTopic(TOPIC_ALARM_SET_CBOR), cborOn, sizeof(cborOn));
+  run(DELAY_30_SECONDS);
+  reportLatency("cbor on", true);
+
+  sendCommand(deviceTopic(TOPIC_ALARM_SET_CBOR), cborOff, sizeof(cborOff));
+  run(1000);
+  reportLatency("cbor off", false);
+
+  // Traced command and ping: the status and the pong echo the sequence number and the stage times
+  char traced[MQTT_MAX_PAYLOAD_SIZE];
+  snprintf(traced, sizeof(traced), "{\"" KEY_TEST_ALARM_ON "\":true,\"" KEY_SEQ "\":42,\"" KEY_ORIGIN "\":%llu}",
+           (unsigned long long)hal::epochMillis());
+  sendCommand(traced);
+  run(1000);
+  std::printf("%-10s status: %s\n", "trace", lastStatus.c_str());
+  snprintf(traced, sizeof(traced), "{\"" KEY_SEQ "\":43}");
+  backendClient.publish(deviceTopic(TOPIC_PING).c_str(), 0, false, traced, strlen(traced));
+  run(100);
+  std::printf("%-10s pong: %s\n", "", lastPong.c_str());
+  sendCommand("{\"" KEY_TEST_ALARM_ON "\":false}");
+  run(1000);
+
+  // Burst: the backend retries a command five times and then flips the test alarm in quick succession
+  InternetManager::CommandStats statsBefore = internetManager.getCommandStats();
+  uint32_t messagesBefore = statusMessages;
+  for (int i = 0; i < 5; i++) {
+    sendCommand("{\"" KEY_AIRFLOW_ALARM_ON "\": true}");
+  }
+  for (int i = 0; i < 6; i++) {
+    sendCommand(i % 2 == 0 ? "{\"" KEY_TEST_ALARM_ON "\": true}" : "{\"" KEY_TEST_ALARM_ON "\": false}");
+  }
+  run(2000);
+  const InternetManager::CommandStats &stats = internetManager.getCommandStats();
+  std::printf("%-10s commands: %u  coalesced: %u  unchanged: %u  status sent: %u  suppressed: %u  alarms: %s\n",
+              "burst", stats.commands - statsBefore.commands, stats.coalesced - statsBefore.coalesced,
+              stats.unchanged - statsBefore.unchanged, statusMessages - messagesBefore,
+              stats.statusSuppressed - statsBefore.statusSuppressed,
+              alarmStateManager.getActiveAlarms() == AIRFLOW_ALARM ? "airflow" : "wrong");
+  sendCommand("{\"" KEY_AIRFLOW_ALARM_ON "\": false}");
+  run(1000);
+
+  // Addressing: a command to another device is ignored, commands to the group and to all devices are applied
+  const char testOn[] = "{\"" KEY_TEST_ALARM_ON "\": true}";
+  backendClient.publish(TOPIC_ALARM "/0badf00d/" TOPIC_ALARM_SET, 2, false, testOn, strlen(testOn));
+  run(1000);
+  bool otherIgnored = !alarmStateManager.isAlarmOn();
+  sendCommand(testOn, TopicRouter::SCOPE_GROUP);
+  run(1000);
+  bool groupApplied = alarmStateManager.isAlarmOn(TEST_ALARM);
+  sendCommand("{\"" KEY_TEST_ALARM_ON "\": false}", TopicRouter::SCOPE_ALL);
+  run(1000);
+  bool allApplied = !alarmStateManager.isAlarmOn();
+
+  // A status request to all devices is answered after a random delay
+  commandSentAt = hal::millis();
+  statusReceivedAt = 0;
+  statusTopic = deviceTopic(TOPIC_ALARM_STATUS);
+  backendClient.publish(deviceTopic(TOPIC_ALARM_STATUS_GET, TopicRouter::SCOPE_ALL).c_str(), 1, false, "", 0);
+  run(BROADCAST_ANSWER_JITTER + 100);
+  std::printf("%-10s other device: %s  group: %s  all: %s  broadcast status after: %u ms\n", "addressing",
+              otherIgnored ? "ignored" : "applied", groupApplied ? "applied" : "ignored",
+              allApplied ? "applied" : "ignored", statusReceivedAt - commandSentAt);
+
+  // Wi-Fi blip: the access point is gone for 5 seconds
+  uint32_t attemptsBefore = internetManager.getConnectionSupervisor().getReconnectAttempts();
+  networkLink.available = false;
+  networkLink.setConnected(false);
+  deviceClient.drop();
+  run(5000);
+  networkLink.available = true;
+  reportRecovery("wifi blip", attemptsBefore);
+
+  // Broker outage of 30 seconds, during which a long press clears the test alarm
+  sendCommand("{\"" KEY_TEST_ALARM_ON "\": true}");
+  run(1000);
+  attemptsBefore = internetManager.getConnectionSupervisor().getReconnectAttempts();
+  uint32_t flashWritesBefore = hal::sim::flashWrites;
+  broker.setOnline(false);
+  run(2000);
+  hal::sim::drivePin(ALARM_BUTTON_PIN, HIGH);
+  run(BUTTON_LONG_PRESS + 500);
+  hal::sim::drivePin(ALARM_BUTTON_PIN, LOW);
+  run(30000 - 2000 - BUTTON_LONG_PRESS - 500);
+  broker.setOnline(true);
+  backendClient.connect();
+  run(100);
+  subscribeBackend();
+  reportRecovery("broker", attemptsBefore);
+  run(JOURNAL_WRITE_DELAY + 1000);
+  const OutboundJournal::Stats &journalStats = internetManager.getJournal().getStats();
+  std::printf("%-10s appended: %u  delivered: %u  batches: %u  flash writes: %u  status: %s\n", "journal",
+              journalStats.appended, journalStats.delivered, journalBatches,
+              hal::sim::flashWrites - flashWritesBefore, lastStatus.c_str());
+
+  // Local commands while the broker is down: a sensor on the LAN sets and clears the airflow alarm over UDP.
+  // A replayed datagram, a tampered one and the copy the sensor also sends over MQTT are refused.
+  constexpr uint32_t SENSOR_ID = 0x5E7502;
+  const uint8_t airflowOn[] = {0xA1, 0x02, cbor::TRUE};
+  const uint8_t airflowOff[] = {0xA1, 0x02, cbor::FALSE};
+  uint8_t datagram[LOCAL_COMMAND_MAX_SIZE];
+  InternetManager::CommandStats localBefore = internetManager.getCommandStats();
+  attemptsBefore = internetManager.getConnectionSupervisor().getReconnectAttempts();
+  broker.setOnline(false);
+  run(2000);
+  size_t datagramLength = LocalCommand::encode(datagram, sizeof(datagram), SENSOR_ID, 0, 1, airflowOn, sizeof(airflowOn));
+  commandSentAt = hal::millis();
+  claxonOnAt = 0;
+  localTransport.deliver(datagram, datagramLength);
+  while (claxonOnAt == 0 && hal::millis() - commandSentAt < 1000) {
+    loop();
+  }
+  uint32_t localLatency = claxonOnAt - commandSentAt;
+  localTransport.deliver(datagram, datagramLength);
+  datagram[LocalCommand::HEADER_SIZE] ^= 1;
+  localTransport.deliver(datagram, datagramLength);
+  run(1000);
+  broker.setOnline(true);
+  backendClient.connect();
+  run(100);
+  subscribeBackend();
+  reportRecovery("local", attemptsBefore);
+  sendCommand("{\"" KEY_AIRFLOW_ALARM_ON "\":true,\"" KEY_SOURCE "\":6190338,\"" KEY_SEQ "\":1}");
+  run(1000);
+  datagramLength = LocalCommand::encode(datagram, sizeof(datagram), SENSOR_ID, 0, 2, airflowOff, sizeof(airflowOff));
+  localTransport.deliver(datagram, datagramLength);
+  run(1000);
+  const InternetManager::CommandStats &localStats = internetManager.getCommandStats();
+  std::printf("%-10s command->claxon: %4u ms  authentic: %u  rejected: %u  duplicates: %u  alarm on: %s\n", "",
+              localLatency, localStats.localCommands - localBefore.localCommands,
+              localStats.localRejected - localBefore.localRejected, localStats.duplicates - localBefore.duplicates,
+              alarmStateManager.isAlarmOn() ? "yes" : "no");
+
+  // Resync: while the device is offline the backend sends a command, which the persistent session queues, and
+  // retains the same state as desired state. After reconnecting the device applies the queued command, refuses
+  // the desired state as its duplicate, and the retained status matches again.
+  InternetManager::CommandStats resyncBefore = internetManager.getCommandStats();
+  uint32_t queuedBefore = broker.queued;
+  networkLink.available = false;
+  networkLink.setConnected(false);
+  deviceClient.drop();
+  run(100);
+  std::string availabilityOffline = lastAvailability;
+  const char desired[] = "{\"" KEY_TEST_ALARM_ON "\":true,\"" KEY_AIRFLOW_ALARM_ON "\":false,\"" KEY_AIR_PRESSURE_ALARM_ON
+                         "\":false,\"" KEY_SOURCE "\":1,\"" KEY_SEQ "\":7}";
+  backendClient.publish(deviceTopic(TOPIC_ALARM_SET).c_str(), 2, false, desired, strlen(desired));
+  backendClient.publish(deviceTopic(TOPIC_ALARM_DESIRED).c_str(), 1, true, desired, strlen(desired));
+  run(5000);
+  networkLink.available = true;
+  uint32_t linkUpAt = hal::millis();
+  uint32_t connectedAt = 0;
+  uint32_t appliedAt = 0;
+  auto statusRetained = []() {
+    // The retained status may carry the trace of the command after the alarm keys
+    const std::string *retained = broker.retained(deviceTopic(TOPIC_ALARM_STATUS).c_str());
+    std::string expected(statusPayload(TEST_ALARM), statusPayloadLength(TEST_ALARM) - 1);
+    return retained != nullptr && retained->compare(0, expected.size(), expected) == 0;
+  };
+  while (!(appliedAt != 0 && statusRetained()) && hal::millis() - linkUpAt < 60000) {
+    loop();
+    if (connectedAt == 0 && deviceClient.connected()) connectedAt = hal::millis();
+    if (appliedAt == 0 && alarmStateManager.getActiveAlarms() == TEST_ALARM) appliedAt = hal::millis();
+  }
+  uint32_t consistentAt = hal::millis();
+  run(1000);
+  const InternetManager::CommandStats &resyncStats = internetManager.getCommandStats();
+  std::printf("%-10s link->connack: %5u ms  connack->applied: %4u ms  connack->status: %4u ms  queued: %u  desired: %u"
+              "  duplicates: %u  availability: %s -> %s\n", "resync", connectedAt - linkUpAt, appliedAt - connectedAt,
+              consistentAt - connectedAt, broker.queued - queuedBefore, resyncStats.desired - resyncBefore.desired,
+              resyncStats.duplicates - resyncBefore.duplicates, availabilityOffline.c_str(), lastAvailability.c_str());
+  sendCommand("{\"" KEY_TEST_ALARM_ON "\":false}");
+  run(1000);
+
+  // Telemetry: a sensor of the group publishes the airflow every second, the fan stalls and runs again. The
+  // device detects the stall itself at the first low reading and clears the alarm once the airflow is back.
+  std::string airflowTopic = deviceTopic(TOPIC_TELEMETRY_AIRFLOW, TopicRouter::SCOPE_GROUP);
+  const char *readings[] = {"301.5", "298.0", "302.2", "299.7", "41.3", "38.9", "40.0", "39.5", "40.8", "39.1",
+                            "295.4", "300.6", "299.2", "301.0", "298.8", "302.4"};
+  uint32_t raisedBefore = internetManager.getTelemetry().getStats().raised;
+  uint32_t stallAt = 0;
+  bool alarmDuringStall = false;
+  claxonOnAt = 0;
+  for (const char *reading : readings) {
+    if (stallAt == 0 && strcmp(reading, "41.3") == 0) stallAt = hal::millis();
+    backendClient.publish(airflowTopic.c_str(), 0, false, reading, strlen(reading));
+    run(1000);
+    if (strcmp(reading, "39.1") == 0) alarmDuringStall = alarmStateManager.getActiveAlarms() == AIRFLOW_ALARM;
+  }
+  bool alarmOnAfter = alarmStateManager.isAlarmOn();
+  uint32_t stallLatency = claxonOnAt - stallAt;
+  uint32_t stallSamples = internetManager.getTelemetry().getStats().samples;
+  uint32_t stallRaised = internetManager.getTelemetry().getStats().raised - raisedBefore;
+
+  // The backend raises the airflow alarm as well during a second stall, so it stays on after the airflow is back
+  sendCommand("{\"" KEY_AIRFLOW_ALARM_ON "\":true}");
+  for (const char *reading : readings) {
+    backendClient.publish(airflowTopic.c_str(), 0, false, reading, strlen(reading));
+    run(1000);
+  }
+  bool backendKept = alarmStateManager.getActiveAlarms() == AIRFLOW_ALARM;
+  sendCommand("{\"" KEY_AIRFLOW_ALARM_ON "\":false}");
+  run(1000);
+  std::printf("%-10s reading->claxon: %4u ms  readings: %u  raised: %u  during stall: %s  alarm on after: %s"
+              "  backend kept: %s\n", "telemetry", stallLatency, stallSamples, stallRaised,
+              alarmDuringStall ? "yes" : "no", alarmOnAfter ? "yes" : "no", backendKept ? "yes" : "no");
+
+  // Escalation: the backend retains new policies for the group. The device stores them once, also when they
+  // arrive again, and refuses a table whose loop stage does not exist.
+  // {"version": 3, 2: [1, [5000, 255, 0], [0, 1, 2], [20000, 0, 0]]}, and the same with loop stage 3
+  std::string escalationTopic = deviceTopic(TOPIC_ESCALATION, TopicRouter::SCOPE_GROUP);
+  char escalation[] = "\xA2\x67version\x03\x02\x84\x01\x83\x19\x13\x88\x18\xFF\x00\x83\x00\x01\x02\x83\x19\x4E\x20\x00\x00";
+  InternetManager::CommandStats escalationBefore = internetManager.getCommandStats();
+  uint32_t escalationWritesBefore = hal::sim::flashWrites;
+  backendClient.publish(escalationTopic.c_str(), 1, true, escalation, sizeof(escalation) - 1);
+  run(100);
+  backendClient.publish(escalationTopic.c_str(), 1, true, escalation, sizeof(escalation) - 1);
+  run(100);
+  escalation[12] = 0x03;
+  backendClient.publish(escalationTopic.c_str(), 1, false, escalation, sizeof(escalation) - 1);
+  run(100);
+  const InternetManager::CommandStats &escalationStats = internetManager.getCommandStats();
+  std::printf("%-10s version: %u  taken over: %u  refused: %u  flash writes: %u  airflow stages: %u\n", "escalation",
+              alarmStateManager.getEscalation().version, escalationStats.escalations - escalationBefore.escalations,
+              escalationStats.escalationsRejected - escalationBefore.escalationsRejected,
+              hal::sim::flashWrites - escalationWritesBefore,
+              alarmStateManager.getEscalation().policies[alarm_types::lowestBit(AIRFLOW_ALARM)].stageCount);
+
+  // Firmware update: the same new image once in full and once as delta against the running image, at 16 kB/s.
+  // The connection drops half way through the delta, the download continues from there.
+  std::vector<uint8_t> baseImage = makeImage(400 * 1024, 1);
+  std::vector<uint8_t> newImage = nextVersion(baseImage);
+  DeltaEncoder encoder;
+  updateServer.files["/alarm-next.bin"] = newImage;
+  updateServer.files["/alarm-next.msd"] = encoder.encode(baseImage, newImage);
+  uint8_t hash[SHA256_SIZE];
+  Sha256 sha;
+  sha.update(newImage.data(), newImage.size());
+  sha.finish(hash);
+  std::string hashHex;
+  for (uint8_t byte : hash) {
+    char hex[3];
+    snprintf(hex, sizeof(hex), "%02x", byte);
+    hashHex += hex;
+  }
+  std::string server = "{\"" KEY_SERVER "\":\"http://192.168.1.10:8080\",";
+  std::string full = "\"" KEY_FULL "\":\"/alarm-next.bin\",\"" KEY_FULL_SIZE "\":" + std::to_string(newImage.size()) +
+                     ",\"" KEY_SHA256 "\":\"" + hashHex + "\"}";
+  std::string delta = "\"" KEY_DELTA "\":\"/alarm-next.msd\",\"" KEY_DELTA_SIZE "\":" +
+                      std::to_string(updateServer.files["/alarm-next.msd"].size()) + ",";
+  hal::sim::firmware = baseImage;
+  runUpdate("ota full", server + full, newImage);
+  hal::sim::firmware = baseImage;
+  updateServer.dropAt = updateServer.bytesSent + (uint32_t)updateServer.files["/alarm-next.msd"].size() / 2;
+  runUpdate("ota delta", server + delta + full, newImage);
+  std::printf("%-10s delta: %zu of %zu bytes  status: %s\n", "", updateServer.files["/alarm-next.msd"].size(),
+              newImage.size(), lastOtaStatus.c_str());
+
+  // Button: a bouncing short press silences the claxon, a long press clears the alarm
+  sendCommand("{\"" KEY_TEST_ALARM_ON "\": true}");
+  run(200);
+  uint32_t pressedAt = hal::millis();
+  hal::sim::drivePin(ALARM_BUTTON_PIN, HIGH);
+  hal::sim::drivePin(ALARM_BUTTON_PIN, LOW);
+  hal::sim::drivePin(ALARM_BUTTON_PIN, HIGH);
+  while (hal::readPin(ALARM_CLAXON_PIN) == HIGH && hal::millis() - pressedAt < 1000) {
+    loop();
+  }
+  uint32_t silencedAfter = hal::millis() - pressedAt;
+  run(200);
+  hal::sim::drivePin(ALARM_BUTTON_PIN, LOW);
+  uint32_t claxonWrites = hal::sim::pinWrites[ALARM_CLAXON_PIN];
+  run(5000);
+  bool staysSilent = hal::sim::pinWrites[ALARM_CLAXON_PIN] == claxonWrites;
+  hal::sim::drivePin(ALARM_BUTTON_PIN, HIGH);
+  run(BUTTON_LONG_PRESS + 500);
+  hal::sim::drivePin(ALARM_BUTTON_PIN, LOW);
+  run(100);
+  std::printf("%-10s silenced after: %u ms  stays silent: %s  presses: %u  long: %u  alarm on: %s\n", "button",
+              silencedAfter, staysSilent ? "yes" : "no", buttonInput.getPresses(), buttonInput.getLongPresses(),
+              alarmStateManager.isAlarmOn() ? "yes" : "no");
+
+  // Reset while alarming: a fresh alarm state manager must resume from RTC memory
+  sendCommand("{\"" KEY_AIR_PRESSURE_ALARM_ON "\": true}");
+  run(3000);
+  reportScheduler();
+  std::printf("metrics    %s\n", lastMetrics.empty() ? "-" : lastMetrics.c_str());
+
+  hal::writePin(ALARM_LIGHT_PIN, LOW);
+  hal::writePin(ALARM_CLAXON_PIN, LOW);
+  AlarmStateManager rebooted;
+  uint32_t resetAt = hal::millis();
+  claxonOnAt = 0;
+  rebooted.initialize();
+  while (hal::readPin(ALARM_LIGHT_PIN) == LOW && hal::millis() - resetAt < 1000) {
+    rebooted.checkTriggerAlarm();
+    hal::sim::advance(1);
+  }
+  std::printf("%-10s light after: %4u ms  claxon after: ", "reset", hal::millis() - resetAt);
+  if (claxonOnAt != 0) {
+    std::printf("%4u ms\n", claxonOnAt - resetAt);
+  } else {
+    std::printf("   - \n");
+  }
+
+  // Reset while a rule holds the airflow alarm: the restarted device keeps it as detected, not as a command, so
+  // it clears once the airflow is back
+  sendCommand("{\"" KEY_AIR_PRESSURE_ALARM_ON "\": false}");
+  run(1000);
+  for (const char *reading : {"300.4", "299.1", "41.3", "38.9"}) {
+    backendClient.publish(airflowTopic.c_str(), 0, false, reading, strlen(reading));
+    run(1000);
+  }
+  deviceClient.drop();
+  networkLink.setConnected(false);
+  hal::writePin(ALARM_LIGHT_PIN, LOW);
+  hal::writePin(ALARM_CLAXON_PIN, LOW);
+  AlarmStateManager restartedAlarms;
+  std::unique_ptr<InternetManager> restarted(new InternetManager(&restartedAlarms, &networkLink, &deviceClient));
+  restartedAlarms.initialize();
+  restarted->initialize();
+  auto runRestarted = [&](uint32_t milliseconds) {
+    uint32_t end = hal::millis() + milliseconds;
+    while ((int32_t)(end - hal::millis()) > 0) {
+      uint32_t untilNext = std::min(restarted->process(), restartedAlarms.checkTriggerAlarm());
+      hal::idle(std::min(untilNext, end - hal::millis()));
+    }
+  };
+  runRestarted(1000);
+  AlarmMask restoredAlarms = restartedAlarms.getActiveAlarms();
+  uint32_t recoveredAt = hal::millis();
+  uint32_t lightOffAt = 0;
+  for (int i = 0; i < 15 && lightOffAt == 0; i++) {
+    backendClient.publish(airflowTopic.c_str(), 0, false, "301.2", 5);
+    runRestarted(1000);
+    if (hal::readPin(ALARM_LIGHT_PIN) == LOW) lightOffAt = hal::millis();
+  }
+  std::printf("%-10s restored: %s  remote: %s  light off after: ", "restart",
+              restoredAlarms == AIRFLOW_ALARM ? "airflow" : "wrong",
+              restartedAlarms.getRemoteAlarms() == 0 ? "none" : "wrong");
+  if (lightOffAt != 0) {
+    std::printf("%5u ms\n", lightOffAt - recoveredAt);
+  } else {
+    std::printf("    - \n");
+  }
+
+  std::printf("pin writes  light: %u  claxon: %u\n", hal::sim::pinWrites[ALARM_LIGHT_PIN],
+              hal::sim::pinWrites[ALARM_CLAXON_PIN]);
+  std::printf("broker      published: %u  delivered: %u\n", broker.published, broker.delivered);
+  return 0;
+}